@@ -0,0 +1,44 @@
+#!/bin/sh
+# Aggregate throughput of "ddsnap delta listen" as the number of concurrent
+# replication sessions grows, over loopback with file-backed volumes.
+#
+# usage: deltalisten.sh [max sessions] [volume size in MB]
+#
+# Expects ddsnap and deltabench (make deltabench) from the ddsnap build
+# directory in $DDSNAP_DIR, default ../../ddsnap.
+
+sessions=${1:-8}
+size=${2:-64}
+port=${PORT:-4329}
+bindir=${DDSNAP_DIR:-$(dirname $0)/../../ddsnap}
+dir=$(mktemp -d /tmp/deltalisten.XXXXXX) || exit 1
+
+abort()
+{
+	echo "failed" $1
+	[ -n "$listener" ] && kill $listener
+	rm -rf $dir
+	exit 1
+}
+
+i=0
+while [ $i -lt $sessions ]
+do
+	dd if=/dev/zero of=$dir/vol$i bs=1M count=$size 2>/dev/null || abort "creating volume $i"
+	i=`expr $i + 1`
+done
+
+$bindir/ddsnap delta listen --foreground --sessions $sessions -o $dir/progress.%s \
+	$dir 127.0.0.1:$port >$dir/listen.log 2>&1 &
+listener=$!
+sleep 1
+
+n=1
+while [ $n -le $sessions ]
+do
+	$bindir/deltabench 127.0.0.1:$port $n $size vol || abort "$n sessions"
+	n=`expr $n \* 2`
+done
+
+kill $listener
+rm -rf $dir
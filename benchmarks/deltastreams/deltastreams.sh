@@ -0,0 +1,46 @@
+#!/bin/sh
+# Throughput of one replication transfer split over parallel streams, over
+# loopback with injected latency, to a file-backed volume.
+#
+# usage: deltastreams.sh [max streams] [volume size in MB] [round trip ms]
+#
+# deltabench relays each connection with the given round trip time and a
+# TCP-like window, so no root or netem is needed.  Expects ddsnap and
+# deltabench (make deltabench) from the ddsnap build directory in
+# $DDSNAP_DIR, default ../../ddsnap.
+
+streams=${1:-8}
+size=${2:-256}
+rtt=${3:-50}
+port=${PORT:-4329}
+bindir=${DDSNAP_DIR:-$(dirname $0)/../../ddsnap}
+dir=$(mktemp -d /tmp/deltastreams.XXXXXX) || exit 1
+
+abort()
+{
+	echo "failed" $1
+	[ -n "$listener" ] && kill $listener
+	rm -rf $dir
+	exit 1
+}
+
+dd if=/dev/zero of=$dir/vol bs=1M count=$size 2>/dev/null || abort "creating volume"
+
+$bindir/ddsnap delta listen --foreground --sessions $streams -o $dir/progress \
+	$dir/vol 127.0.0.1:$port >$dir/listen.log 2>&1 &
+listener=$!
+sleep 1
+
+for delay in 0 $rtt
+do
+	echo "${delay}ms round trip"
+	n=1
+	while [ $n -le $streams ]
+	do
+		$bindir/deltabench -s -d $delay 127.0.0.1:$port $n $size || abort "$n streams"
+		n=`expr $n \* 2`
+	done
+done
+
+kill $listener
+rm -rf $dir
@@ -43,7 +43,8 @@ unsigned buffer_count;
 LIST_HEAD(free_buffers);
 unsigned journaled_count;
 LIST_HEAD(journaled_buffers); /* bufferes that have been written to journal but not yet to snapstore */
-static unsigned max_buffers = 10000;
+unsigned max_buffers = 10000;
+struct buffer_stats buffer_stats;
 static unsigned max_evict = 1000; /* free 10 percent of the buffers */
 
 void show_buffer(struct buffer *buffer)
@@ -192,6 +193,91 @@ int write_buffer(struct buffer *buffer)
 	return err;
 }
 
+/*
+ * Write back up to max buffers from the dirty or journaled list in ascending
+ * sector order, carrying on from the sector where the previous writeback
+ * stopped and wrapping at the end of the disk, so that a series of partial
+ * writebacks sweeps across the disk like an elevator instead of seeking to
+ * and fro.  Buffers at adjacent sectors go out together in one write of up
+ * to WRITEBACK_RUN buffers.  Returns the number of buffers written, or an
+ * error, leaving the buffers not written on their list.
+ */
+#define WRITEBACK_RUN 256
+
+static sector_t writeback_sector;
+
+static int compare_sector(void const *a, void const *b)
+{
+	struct buffer *x = *(struct buffer **)a, *y = *(struct buffer **)b;
+
+	if (x->sector != y->sector)
+		return x->sector < y->sector ? -1 : 1;
+	return x->fd < y->fd ? -1 : x->fd > y->fd;
+}
+
+static int contiguous(struct buffer *prev, struct buffer *next)
+{
+	return next->fd == prev->fd && next->size == prev->size &&
+		next->sector == prev->sector + (prev->size >> SECTOR_BITS);
+}
+
+int writeback_buffers(struct list_head *head, unsigned max)
+{
+	unsigned count = 0, start = 0, done = 0, i, j;
+	unsigned char *data = NULL;
+	struct list_head *list;
+	int err = 0;
+
+	list_for_each(list, head)
+		count++;
+	if (!count)
+		return 0;
+	struct buffer **vec = malloc(count * sizeof(*vec));
+	if (!vec)
+		return -ENOMEM;
+	list_for_each(list, head)
+		vec[start++] = list_entry(list, struct buffer, dirty_list);
+	qsort(vec, count, sizeof(*vec), compare_sector);
+	for (start = 0; start < count && vec[start]->sector < writeback_sector; start++)
+		;
+	if (max > count)
+		max = count;
+
+#define sorted(i) vec[(start + (i)) % count]
+	for (i = 0; i < max; i = j) {
+		struct buffer *buffer = sorted(i);
+		unsigned size = buffer->size;
+
+		for (j = i + 1; j < max && j - i < WRITEBACK_RUN; j++)
+			if (!contiguous(sorted(j - 1), sorted(j)))
+				break;
+		buftrace(warn("write back %u buffers at %Lx", j - i, buffer->sector););
+		if (j - i == 1)
+			err = write_buffer_to(buffer, buffer->sector);
+		else {
+			/* aligned for devices opened with O_DIRECT */
+			if (!data && posix_memalign((void **)&data, SECTOR_SIZE, WRITEBACK_RUN * size)) {
+				data = NULL;
+				err = -ENOMEM;
+				break;
+			}
+			for (unsigned k = i; k < j; k++)
+				memcpy(data + (k - i) * size, sorted(k)->data, size);
+			err = diskwrite(buffer->fd, data, (j - i) * size, buffer->sector << SECTOR_BITS);
+		}
+		if (err)
+			break;
+		writeback_sector = sorted(j - 1)->sector + 1;
+		for (unsigned k = i; k < j; k++)
+			set_buffer_uptodate(sorted(k));
+		done += j - i;
+	}
+#undef sorted
+	free(data);
+	free(vec);
+	return err ? err : done;
+}
+
 int read_buffer(struct buffer *buffer)
 {
 	buftrace(warn("read buffer %Lx", buffer->sector););
@@ -276,6 +362,7 @@ struct buffer *new_buffer(sector_t sector, unsigned size)
 			remove_buffer_lru(buffer_evict);
 			remove_buffer_hash(buffer_evict);
 			add_buffer_free(buffer_evict);
+			buffer_stats.evictions++;
 			if (++count == max_evict)
 				break;
 		}
@@ -323,6 +410,18 @@ int count_buffer(void)
 	return count;
 }
 
+/*
+ * Take another use of a buffer already in hand, as a hit in getblk does,
+ * without looking it up again.
+ */
+struct buffer *bget(struct buffer *buffer)
+{
+	buffer->count++;
+	list_del(&buffer->list);
+	list_add_tail(&buffer->list, &lru_buffers);
+	return buffer;
+}
+
 struct buffer *getblk(unsigned fd, sector_t sector, unsigned size)
 {
 	struct buffer **bucket = buffer_table + buffer_hash(sector), *buffer;
@@ -330,11 +429,10 @@ struct buffer *getblk(unsigned fd, sector_t sector, unsigned size)
 	for (buffer = *bucket; buffer; buffer = buffer->hashlist)
 		if (buffer->sector == sector) {
 			buftrace(warn("Found buffer for %Lx", sector););
-			buffer->count++;
-			list_del(&buffer->list);
-			list_add_tail(&buffer->list, &lru_buffers);
-			return buffer;
+			buffer_stats.hits++;
+			return bget(buffer);
 		}
+	buffer_stats.misses++;
 	if (!(buffer = new_buffer(sector, size)))
 		return NULL;
 	buffer->fd = fd;
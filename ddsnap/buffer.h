@@ -32,6 +32,10 @@ struct list_head dirty_buffers;
 extern unsigned dirty_buffer_count;
 struct list_head journaled_buffers;
 extern unsigned journaled_count;
+extern unsigned max_buffers;
+
+struct buffer_stats { unsigned long long hits, misses, evictions; };
+extern struct buffer_stats buffer_stats; /* getblk lookups found and not, buffers evicted for new ones */
 
 void show_dirty_buffers(void);
 void set_buffer_dirty(struct buffer *buffer);
@@ -41,9 +45,11 @@ void brelse(struct buffer *buffer);
 void brelse_dirty(struct buffer *buffer);
 int write_buffer_to(struct buffer *buffer, offset_t pos);
 int write_buffer(struct buffer *buffer);
+int writeback_buffers(struct list_head *head, unsigned max);
 int read_buffer(struct buffer *buffer);
 unsigned buffer_hash(sector_t sector);
 struct buffer *new_buffer(sector_t sector, unsigned size);
+struct buffer *bget(struct buffer *buffer);
 struct buffer *getblk(unsigned fd, sector_t sector, unsigned size);
 struct buffer *bread(unsigned fd, sector_t sector, unsigned size);
 void evict_buffer(struct buffer *buffer);
@@ -0,0 +1,8 @@
+/*
+ * This file is generated automatically by the Makefile.
+ */
+
+#define VERSION_STRING "unknown"
+#define BUILD_DATE "Sat Oct 17 00:37:43 UTC 2026"
+#define BUILD_USER "root"
+#define BUILD_HOST "vm"
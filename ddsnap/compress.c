@@ -0,0 +1,190 @@
+#include <errno.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#include "compress.h"
+
+static char const *codec_names[MAX_CODECS] = { "none", "zlib", "zstd", "lz4" };
+
+int codec_lookup(char const *name)
+{
+	unsigned codec;
+
+	if (!strcmp(name, "gzip"))
+		return CODEC_ZLIB;
+	for (codec = 0; codec < MAX_CODECS; codec++)
+		if (!strcmp(name, codec_names[codec]))
+			return codec;
+	return -1;
+}
+
+char const *codec_name(unsigned codec)
+{
+	return codec < MAX_CODECS ? codec_names[codec] : "unknown";
+}
+
+int codec_available(unsigned codec)
+{
+	switch (codec) {
+	case CODEC_NONE:
+	case CODEC_ZLIB:
+		return 1;
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return 1;
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		return 1;
+#endif
+	}
+	return 0;
+}
+
+/*
+ * Parse a comma separated list of codec names into a codec mask.  Returns
+ * zero if any name is unknown or the codec was not built in.
+ */
+unsigned codec_parse_list(char const *list)
+{
+	char name[16];
+	unsigned mask = 0;
+
+	while (*list) {
+		int len = strcspn(list, ","), codec;
+
+		if (len >= sizeof(name))
+			return 0;
+		memcpy(name, list, len);
+		name[len] = 0;
+		if ((codec = codec_lookup(name)) < 0 || !codec_available(codec))
+			return 0;
+		mask |= CODEC_MASK(codec);
+		list += len + !!list[len];
+	}
+	return mask;
+}
+
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *zstd_cctx;
+static ZSTD_DCtx *zstd_dctx;
+
+static int zstd_compress(int level, unsigned flags, void *out, unsigned long *out_size, void const *in, unsigned long in_size)
+{
+	if (!zstd_cctx && !(zstd_cctx = ZSTD_createCCtx()))
+		return -ENOMEM;
+	if (level > ZSTD_maxCLevel())
+		level = ZSTD_maxCLevel();
+	ZSTD_CCtx_reset(zstd_cctx, ZSTD_reset_session_and_parameters);
+	ZSTD_CCtx_setParameter(zstd_cctx, ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(zstd_cctx, ZSTD_c_enableLongDistanceMatching, !!(flags & CODEC_LONG));
+
+	size_t size = ZSTD_compress2(zstd_cctx, out, *out_size, in, in_size);
+	if (ZSTD_isError(size))
+		return ZSTD_getErrorCode(size) == ZSTD_error_dstSize_tooSmall ? -ENOSPC : -EINVAL;
+	*out_size = size;
+	return 0;
+}
+
+static int zstd_uncompress(void *out, unsigned long *out_size, void const *in, unsigned long in_size)
+{
+	if (!zstd_dctx && !(zstd_dctx = ZSTD_createDCtx()))
+		return -ENOMEM;
+
+	size_t size = ZSTD_decompressDCtx(zstd_dctx, out, *out_size, in, in_size);
+	if (ZSTD_isError(size))
+		return ZSTD_getErrorCode(size) == ZSTD_error_dstSize_tooSmall ? -ENOSPC : -EINVAL;
+	*out_size = size;
+	return 0;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int lz4_compress(int level, void *out, unsigned long *out_size, void const *in, unsigned long in_size)
+{
+	int size;
+
+	/* levels above one select the high compression variant */
+	if (level > 1)
+		size = LZ4_compress_HC(in, out, in_size, *out_size, level > LZ4HC_CLEVEL_MAX ? LZ4HC_CLEVEL_MAX : level);
+	else
+		size = LZ4_compress_default(in, out, in_size, *out_size);
+	if (size <= 0)
+		return -ENOSPC;
+	*out_size = size;
+	return 0;
+}
+
+static int lz4_uncompress(void *out, unsigned long *out_size, void const *in, unsigned long in_size)
+{
+	int size = LZ4_decompress_safe(in, out, in_size, *out_size);
+
+	if (size < 0)
+		return -EINVAL;
+	*out_size = size;
+	return 0;
+}
+#endif
+
+/*
+ * Compress in_size bytes into a buffer of *out_size bytes.  Returns -ENOSPC
+ * if the result would not fit, which callers treat as incompressible data.
+ */
+int codec_compress(unsigned codec, int level, unsigned flags, void *out, unsigned long *out_size, void const *in, unsigned long in_size)
+{
+	switch (codec) {
+	case CODEC_ZLIB:
+		if (level > Z_BEST_COMPRESSION)
+			level = Z_BEST_COMPRESSION;
+		switch (compress2(out, out_size, in, in_size, level)) {
+		case Z_OK:
+			return 0;
+		case Z_MEM_ERROR:
+			return -ENOMEM;
+		case Z_BUF_ERROR:
+			return -ENOSPC;
+		}
+		return -EINVAL;
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return zstd_compress(level, flags, out, out_size, in, in_size);
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		return lz4_compress(level, out, out_size, in, in_size);
+#endif
+	}
+	return -EINVAL;
+}
+
+int codec_uncompress(unsigned codec, void *out, unsigned long *out_size, void const *in, unsigned long in_size)
+{
+	switch (codec) {
+	case CODEC_ZLIB:
+		switch (uncompress(out, out_size, in, in_size)) {
+		case Z_OK:
+			return 0;
+		case Z_MEM_ERROR:
+			return -ENOMEM;
+		case Z_BUF_ERROR:
+			return -ENOSPC;
+		}
+		return -EINVAL;
+#ifdef HAVE_ZSTD
+	case CODEC_ZSTD:
+		return zstd_uncompress(out, out_size, in, in_size);
+#endif
+#ifdef HAVE_LZ4
+	case CODEC_LZ4:
+		return lz4_uncompress(out, out_size, in, in_size);
+#endif
+	}
+	return -EINVAL;
+}
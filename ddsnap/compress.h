@@ -0,0 +1,26 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+/*
+ * Compression codecs for delta extents.  None and zlib go out as the gzip_on
+ * flag of the delta extent header, newer codecs by number after it.
+ */
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+#define CODEC_ZSTD 2
+#define CODEC_LZ4  3
+#define MAX_CODECS 4
+
+#define CODEC_MASK(codec) (1 << (codec))
+
+/* codec flags */
+#define CODEC_LONG 1 /* zstd long range matching */
+
+int codec_lookup(char const *name);
+char const *codec_name(unsigned codec);
+int codec_available(unsigned codec);
+unsigned codec_parse_list(char const *list);
+int codec_compress(unsigned codec, int level, unsigned flags, void *out, unsigned long *out_size, void const *in, unsigned long in_size);
+int codec_uncompress(unsigned codec, void *out, unsigned long *out_size, void const *in, unsigned long in_size);
+
+#endif
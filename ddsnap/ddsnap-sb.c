@@ -19,7 +19,7 @@
 #include "dm-ddsnap.h"
 
 // FIXME: the following micros are copied from ddsnapd.c, move them to a header file
-#define MAX_SNAPSHOTS 64
+#define SB_SNAPSHOTS 64	/* snapshots with a place in the superblock */
 #define SB_SECTOR 8		/* Sector where superblock lives.     */
 #define SB_SECTORS 8		/* Size of ddsnap super block in sectors */
 
@@ -50,7 +50,7 @@ struct disksuper_04 {		/* the subfix is the data of latest incompatible sb forma
 		u8 bit;		// internal snapshot number, not derived from tag
 		s8 prio;	// 0=normal, 127=highest, -128=lowest
 		char reserved[4];	/* adds up to 16 */
-	} snaplist[MAX_SNAPSHOTS];	// entries are contiguous, in creation order
+	} snaplist[SB_SNAPSHOTS];	// entries are contiguous, in creation order
 	u32 snapshots;
 	u32 etree_levels;
 	s32 journal_base;	/* Sector offset of start of journal. */
@@ -76,7 +76,7 @@ struct disksuper_06 {
 	sector_t orgoffset, orgsectors;
 	u64 flags;
 	u64 deleting;
-	struct snapshot_06 snaplist[MAX_SNAPSHOTS];	// entries are contiguous, in creation order
+	struct snapshot_06 snaplist[SB_SNAPSHOTS];	// entries are contiguous, in creation order
 	u32 snapshots;
 	u32 etree_levels;
 	s32 journal_base;	/* Sector offset of start of journal. */
@@ -84,6 +84,7 @@ struct disksuper_06 {
 	s32 journal_size;	/* Size of the journal in chunks.     */
 	u32 sequence;		/* Latest commit block sequence num.  */
 	struct allocspace_img metadata, snapdata;
+	u64 delete_resume;
 };
 
 static int sb_print(int metadev)
@@ -103,6 +104,8 @@ static int sb_print(int metadev)
 		printf("\n");
 	}
 	printf("snapshots %d\n", sb.snapshots);
+	if (sb.deleting)
+		printf("deleting %016llx from chunk %llu\n", (unsigned long long)sb.deleting, (unsigned long long)sb.delete_resume);
 	return 0;
 }
 
@@ -126,6 +129,7 @@ static int upgrade_04(int metadev, char *magic)
 	}
 	memcpy(&sb.snapshots, &oldsb.snapshots,
 	       ((char *)&oldsb + sizeof(struct disksuper_04) - (char *)&oldsb.snapshots));
+	sb.delete_resume = 0;
 
 	if ((err = diskwrite(metadev, &sb, sizeof(struct disksuper_06), SB_SECTORS << SECTOR_BITS)) < 0) {
 		warn("Unable to write superblock: %s", strerror(errno));
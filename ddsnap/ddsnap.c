@@ -13,17 +13,19 @@
 #include <time.h>
 #include <sys/time.h>
 #include <ctype.h>
-#include <zlib.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <linux/fs.h> // for BLKGETSIZE
 #include <poll.h>
 #include <sys/prctl.h>
 #include "dm-ddsnap.h"
 #include "buffer.h"
+#include "compress.h"
 #include "daemonize.h"
 #include "ddsnap.h"
 #include "ddsnap.agent.h"
@@ -146,8 +148,12 @@ static int discard(int fd, int len)
 #define CHANGELIST_MAGIC_ID "rln"
 #define DELTA_MAGIC_ID "jc"
 #define MAGIC_NUM 0xbead0023
+#define CODEC_MAGIC_NUM 0xbead0024
 
 #define DEFAULT_REPLICATION_PORT 4321
+#define DEFAULT_DELTA_SESSIONS 4
+#define MAX_DELTA_STREAMS 64
+#define MAX_VOLUME_NAME 256
 #define TRUE 1
 #define FALSE 0
 
@@ -158,6 +164,13 @@ static int discard(int fd, int len)
 #define DEF_GZIP_COMP 0
 #define MAX_GZIP_COMP 9
 
+struct comp_opts
+{
+	unsigned codecs; /* mask of codecs to try, smallest result wins */
+	int level;
+	unsigned flags;
+};
+
 #define MAX_MEM_BITS 20
 #define MAX_MEM_SIZE (1 << MAX_MEM_BITS)
 #define DEFAULT_CHUNK_SIZE_BITS 12
@@ -180,6 +193,18 @@ struct delta_header
 	u32 tgt_snap;
 } PACKED;
 
+/*
+ * Follows the delta header in SEND_DELTA_STREAM, ahead of the volume name.
+ * The streams of one transfer cover disjoint byte ranges of the target.
+ */
+struct delta_stream
+{
+	u32 stream;
+	u32 streams;
+	u64 start_addr;
+	u64 end_addr; /* ~0ULL for the end of the volume */
+} PACKED;
+
 struct delta_extent_header
 {
 	u32 magic_num;
@@ -192,6 +217,77 @@ struct delta_extent_header
 	u64 ext2_chksum;
 } PACKED;
 
+/*
+ * An extent compressed with a codec newer than zlib has CODEC_MAGIC_NUM in
+ * its header, which is followed by the codec number, so older receivers
+ * reject it rather than write out the compressed bytes.  None and zlib
+ * still go as MAGIC_NUM with gzip_on.
+ */
+#define LEGACY_CODECS (CODEC_MASK(CODEC_NONE) | CODEC_MASK(CODEC_ZLIB))
+
+/*
+ * Optionally follows the volume name, which is then sent even if empty.
+ * Older listeners stop at the end of the name and never see it.
+ */
+struct delta_options
+{
+	u32 flags;
+	u64 check_addr; /* last extent acknowledged before the transfer broke */
+	u64 check_size;
+	u64 check_sum;
+} PACKED;
+
+#define DELTA_ACKS (1 << 0) /* acknowledge durable progress with SEND_DELTA_ACK */
+#define DELTA_CHECK (1 << 1) /* resuming, the check extent must be on the target */
+#define DELTA_CODECS (1 << 2) /* list the codecs downstream can decode in SEND_DELTA_PROCEED */
+
+/* Body of SEND_DELTA_PROCEED if DELTA_CODECS was asked for, otherwise empty */
+struct delta_proceed
+{
+	u32 codecs; /* mask of codecs downstream can decode */
+} PACKED;
+
+/* Sent back on the delta connection once the extents so far are on disk */
+struct delta_ack
+{
+	u64 chunks; /* chunks of this request applied, always at an extent boundary */
+	u64 extent_addr; /* last extent applied */
+	u64 extent_size;
+	u64 checksum;
+} PACKED;
+
+#define CHECKPOINT_MAGIC_ID "ckp"
+
+/*
+ * A checkpoint file is this header and a slot per stream.  The changelist
+ * being sent is saved beside it, in <checkpoint>.changelist.
+ */
+struct checkpoint_header
+{
+	char magic[MAGIC_SIZE];
+	u32 src_snap;
+	u32 tgt_snap;
+	u32 streams;
+	u32 chunksize_bits;
+	u64 count;
+};
+
+struct checkpoint_slot
+{
+	u64 next_chunk; /* everything before this is acknowledged */
+	u64 extent_addr; /* the last acknowledged extent, for the downstream to check */
+	u64 extent_size;
+	u64 checksum;
+};
+
+struct checkpoint
+{
+	int fd;
+	unsigned stream;
+	u64 start; /* first chunk of this request, acknowledgements count from here */
+	struct checkpoint_slot slot;
+};
+
 static u64 checksum(const unsigned char *data, u32 data_length)
 {
 	u64 result = 0;
@@ -487,16 +583,200 @@ static int write_changelist(int change_fd, struct change_list const *cl)
 	return 0;
 }
 
-static u64 chunks_in_extent(struct change_list *cl, u64 pos, u32 chunk_size)
+static char *checkpoint_name(char const *checkpoint_file, char const *suffix)
 {
-	u64 start_chunkaddr, cur_chunkaddr, num_of_chunks = 1;
-	start_chunkaddr = cl->chunks[pos];
-	cur_chunkaddr = cl->chunks[pos+1];
+	char *name;
 
-	while (cur_chunkaddr == start_chunkaddr + num_of_chunks && (num_of_chunks < (MAX_MEM_SIZE / chunk_size))) {
-		num_of_chunks++;
-		cur_chunkaddr = cl->chunks[pos + num_of_chunks];
+	if ((name = malloc(strlen(checkpoint_file) + strlen(suffix) + 1)))
+		sprintf(name, "%s%s", checkpoint_file, suffix);
+	return name;
+}
+
+/*
+ * Pick up a transfer that broke: the changelist it was sending and how far
+ * each stream of it was acknowledged, so neither the snapshot tree walk nor
+ * the acknowledged extents are repeated.  Returns zero if there is no usable
+ * checkpoint for these snapshots, and the caller starts a new one.
+ */
+static int checkpoint_load(char const *checkpoint_file, u32 src_snap, u32 tgt_snap, struct change_list **clp, struct checkpoint_slot *slots, int *streams)
+{
+	struct checkpoint_header ckh;
+	struct change_list *cl = NULL;
+	struct cl_header clh;
+	char *clname = NULL;
+	int fd, clfd = -1, err = 0, i;
+	u64 marker;
+
+	if ((fd = open(checkpoint_file, O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		warn("unable to open checkpoint %s: %s", checkpoint_file, strerror(errno));
+		return -errno;
+	}
+	if (fdread(fd, &ckh, sizeof(ckh)) < 0 || strncmp(ckh.magic, CHECKPOINT_MAGIC_ID, MAGIC_SIZE)
+			|| !ckh.streams || ckh.streams > MAX_DELTA_STREAMS || fdread(fd, slots, ckh.streams * sizeof(*slots)) < 0) {
+		warn("ignoring damaged checkpoint %s", checkpoint_file);
+		goto out;
+	}
+	if (ckh.src_snap != src_snap || ckh.tgt_snap != tgt_snap) {
+		warn("ignoring checkpoint %s of delta from %i to %i", checkpoint_file, ckh.src_snap, ckh.tgt_snap);
+		goto out;
+	}
+	for (i = 0; i < ckh.streams; i++)
+		if (slots[i].next_chunk > ckh.count) {
+			warn("ignoring damaged checkpoint %s", checkpoint_file);
+			goto out;
+		}
+
+	if (!(cl = malloc(sizeof(struct change_list)))) {
+		err = -ENOMEM;
+		goto out;
+	}
+	*cl = (struct change_list){ .count = ckh.count, .length = ckh.count, .chunksize_bits = ckh.chunksize_bits, .src_snap = src_snap, .tgt_snap = tgt_snap };
+
+	/* a full volume transfer has no changelist, nor does an empty one */
+	if (src_snap != -1 && ckh.count) {
+		if (!(clname = checkpoint_name(checkpoint_file, ".changelist")) || !(cl->chunks = malloc(ckh.count * sizeof(cl->chunks[0])))) {
+			err = -ENOMEM;
+			goto out;
+		}
+		if ((clfd = open(clname, O_RDONLY)) < 0 || fdread(clfd, &clh, sizeof(clh)) < 0
+				|| strncmp(clh.magic, CHANGELIST_MAGIC_ID, MAGIC_SIZE) || clh.src_snap != src_snap || clh.tgt_snap != tgt_snap
+				|| fdread(clfd, cl->chunks, ckh.count * sizeof(cl->chunks[0])) < 0
+				|| fdread(clfd, &marker, sizeof(marker)) < 0 || marker != -1) {
+			warn("ignoring checkpoint %s, its changelist %s is missing or incomplete", checkpoint_file, clname);
+			goto out;
+		}
+	}
+
+	*streams = ckh.streams;
+	*clp = cl;
+	cl = NULL;
+	err = 1;
+out:
+	if (cl)
+		free_change_list(cl);
+	if (clfd >= 0)
+		close(clfd);
+	if (clname)
+		free(clname);
+	close(fd);
+	return err;
+}
+
+/*
+ * Save the changelist, then the checkpoint itself with a rename, so a
+ * checkpoint never refers to a partly written changelist.
+ */
+static int checkpoint_create(char const *checkpoint_file, struct change_list const *cl, int streams, struct checkpoint_slot const *slots)
+{
+	struct checkpoint_header ckh = { .src_snap = cl->src_snap, .tgt_snap = cl->tgt_snap, .streams = streams,
+		.chunksize_bits = cl->chunksize_bits, .count = cl->count };
+	char *clname = checkpoint_name(checkpoint_file, ".changelist"), *tmpname = checkpoint_name(checkpoint_file, ".tmp");
+	int fd = -1, err = -ENOMEM;
+
+	strncpy(ckh.magic, CHECKPOINT_MAGIC_ID, sizeof(ckh.magic));
+	if (!clname || !tmpname)
+		goto out;
+	unlink(checkpoint_file);
+
+	err = -EIO;
+	if (cl->chunks) {
+		if ((fd = open(clname, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR)) < 0) {
+			warn("unable to create checkpoint changelist %s: %s", clname, strerror(errno));
+			goto out;
+		}
+		if (write_changelist(fd, cl) < 0 || fsync(fd) < 0) {
+			warn("unable to save checkpoint changelist %s", clname);
+			goto out;
+		}
+		close(fd);
+	}
+	if ((fd = open(tmpname, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR)) < 0) {
+		warn("unable to create checkpoint %s: %s", tmpname, strerror(errno));
+		goto out;
+	}
+	if (fdwrite(fd, &ckh, sizeof(ckh)) < 0 || fdwrite(fd, slots, streams * sizeof(*slots)) < 0 || fsync(fd) < 0
+			|| rename(tmpname, checkpoint_file) < 0) {
+		warn("unable to save checkpoint %s: %s", checkpoint_file, strerror(errno));
+		goto out;
+	}
+	err = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	if (clname)
+		free(clname);
+	if (tmpname)
+		free(tmpname);
+	return err;
+}
+
+static void checkpoint_remove(char const *checkpoint_file)
+{
+	char *clname = checkpoint_name(checkpoint_file, ".changelist");
+
+	unlink(checkpoint_file);
+	if (clname) {
+		unlink(clname);
+		free(clname);
+	}
+}
+
+/*
+ * The downstream has everything up to and including the acknowledged extent
+ * on disk, so record that a restart may skip it.  The transfer goes on even
+ * if the checkpoint cannot be updated, a restart just sends more.
+ */
+static int checkpoint_ack(struct checkpoint *ckp, int sock, unsigned length)
+{
+	struct checkpoint_slot slot;
+	struct delta_ack ack;
+	int err;
+
+	if (length != sizeof(ack)) {
+		warn("acknowledgement of %u bytes from downstream, expected %zu", length, sizeof(ack));
+		return -EPIPE;
+	}
+	if ((err = readpipe(sock, &ack, sizeof(ack))) < 0)
+		return err;
+	slot = (struct checkpoint_slot){ ckp->start + ack.chunks, ack.extent_addr, ack.extent_size, ack.checksum };
+	ckp->slot = slot;
+	if (pwrite(ckp->fd, &slot, sizeof(slot), sizeof(struct checkpoint_header) + ckp->stream * sizeof(slot)) < 0
+			|| fdatasync(ckp->fd) < 0)
+		warn("unable to update checkpoint: %s", strerror(errno));
+	return 0;
+}
+
+/* take in any acknowledgements that came back while we were sending */
+static int checkpoint_poll(struct checkpoint *ckp, int sock)
+{
+	struct pollfd pollfd = { .fd = sock, .events = POLLIN };
+	struct head head;
+	int err;
+
+	while (poll(&pollfd, 1, 0) > 0) {
+		if ((err = readpipe(sock, &head, sizeof(head))) < 0)
+			return err;
+		if (head.code != SEND_DELTA_ACK) {
+			if (head.code != SEND_DELTA_ERROR)
+				unknown_message(sock, &head);
+			else
+				error_message_handler(sock, "downstream server reason why send delta failed", head.length);
+			return -EPIPE;
+		}
+		if ((err = checkpoint_ack(ckp, sock, head.length)) < 0)
+			return err;
 	}
+	return 0;
+}
+
+static u64 chunks_in_extent(struct change_list *cl, u64 pos, u64 end, u32 chunk_size)
+{
+	u64 start_chunkaddr = cl->chunks[pos], num_of_chunks = 1;
+
+	while (pos + num_of_chunks < end && cl->chunks[pos + num_of_chunks] == start_chunkaddr + num_of_chunks && (num_of_chunks < (MAX_MEM_SIZE / chunk_size)))
+		num_of_chunks++;
 	return num_of_chunks;
 }
 
@@ -512,8 +792,9 @@ static int create_raw_delta(struct delta_extent_header *deh_ptr, const unsigned
 static int create_xdelta_delta(struct delta_extent_header *deh_ptr, unsigned char *input_buffer1, unsigned char *input_buffer2, unsigned char *output_buffer, u64 input_size, u64 *output_size)
 {
 	trace_off(printf("create xdelta delta\n"););
-	int err;
-	int ret = create_delta_chunk(input_buffer1, input_buffer2, output_buffer, input_size, (int *)output_size);
+	int err, delta_size = 0;
+	int ret = create_delta_chunk(input_buffer1, input_buffer2, output_buffer, input_size, &delta_size);
+	*output_size = delta_size;
 	deh_ptr->mode = XDELTA;
 	deh_ptr->extents_delta_length = *output_size;
 
@@ -561,58 +842,59 @@ gen_applytest_error:
 	return err;
 }
 
-static int gzip_on_delta(struct delta_extent_header *deh_ptr, unsigned char *input_buffer, unsigned char *output_buffer, u64 input_size, u64 *output_size, int level)
+/*
+ * Compress with each codec in the mask and keep the smallest result.  If no
+ * codec makes the delta smaller it is sent as is with CODEC_NONE.
+ */
+static int compress_delta(struct delta_extent_header *deh_ptr, u32 *codec_ptr, unsigned char *input_buffer, unsigned char *output_buffer, unsigned char *scratch, u64 input_size, u64 *output_size, struct comp_opts *comp)
 {
+	unsigned codec;
 	int err;
-	*output_size = input_size + 12 + (input_size >> 9);
-	int comp_ret = compress2(output_buffer, (unsigned long *) output_size, input_buffer, input_size, level);
-
-	if (comp_ret == Z_MEM_ERROR)
-		goto gen_compmem_error;
-	if (comp_ret == Z_BUF_ERROR)
-		goto gen_compbuf_error;
-	if (comp_ret == Z_STREAM_ERROR)
-		goto gen_compstream_error;
-
-	if (*output_size < input_size) {
-		deh_ptr->gzip_on = TRUE;
-		deh_ptr->extents_delta_length = *output_size;
-	} else {
-		deh_ptr->gzip_on = FALSE;
-		deh_ptr->extents_delta_length = input_size;
-		memcpy(output_buffer, input_buffer, input_size);
-		*output_size = input_size;
-	}
-	return 0;
 
-gen_compmem_error:
-	err = -ENOMEM;
-	warn("not enough buffer memory for compression of delta: %s", strerror(-err));
-	return err;
+	*codec_ptr = CODEC_NONE;
+	*output_size = input_size;
 
-gen_compbuf_error:
-	err = -ERANGE;
-	warn("not enough room in the output buffer for compression of delta: %s", strerror(-err));
-	return err;
+	for (codec = CODEC_ZLIB; codec < MAX_CODECS; codec++) {
+		if (!(comp->codecs & CODEC_MASK(codec)) || *output_size <= 1)
+			continue;
+		/* the first success lands in the output buffer, later ones have to beat it */
+		unsigned char *dest = *codec_ptr == CODEC_NONE ? output_buffer : scratch;
+		unsigned long size = *output_size - 1;
 
-gen_compstream_error:
-	err = -ERANGE;
-	warn("invalid compression parameter level=%d delta_size=%Lu in delta: %s", level, input_size, strerror(-err));
-	return err;
+		if ((err = codec_compress(codec, comp->level, comp->flags, dest, &size, input_buffer, input_size)) == -ENOSPC)
+			continue;
+		if (err < 0) {
+			warn("%s compression failed for level=%d delta_size=%Lu: %s", codec_name(codec), comp->level, input_size, strerror(-err));
+			return err;
+		}
+		if (dest == scratch)
+			memcpy(output_buffer, scratch, size);
+		*codec_ptr = codec;
+		*output_size = size;
+	}
+
+	if (*codec_ptr == CODEC_NONE)
+		memcpy(output_buffer, input_buffer, input_size);
+	deh_ptr->extents_delta_length = *output_size;
+	return 0;
 }
 
-static struct status_reply *generate_status(int serv_fd, u32 snaptag)
+static struct status_reply *generate_status(int serv_fd, u32 snaptag, u32 flags, int *length)
 {
 	int err, size;
 	struct status_reply *reply;
 
-	if ((err = outbead(serv_fd, STATUS, struct status_request, snaptag))) {
+	/* only servers that know the flags get them */
+	if ((err = flags ?
+	     outbead(serv_fd, STATUS, struct status_options, snaptag, flags) :
+	     outbead(serv_fd, STATUS, struct status_request, snaptag))) {
 		warn("unable to send status request: %s", strerror(-err));
 		return NULL;
 	}
 
 	if ((size = expect(serv_fd, STATUS_OK)) == -1) {
-		errprint("get status");
+		if (!flags || (errno != EPIPE && errno != ECONNRESET))
+			errprint("get status");
 		return NULL;
 	}
 
@@ -635,6 +917,8 @@ static struct status_reply *generate_status(int serv_fd, u32 snaptag)
 		return NULL;
 	}
 
+	if (length)
+		*length = size;
 	return reply;
 }
 
@@ -675,9 +959,41 @@ static int generate_progress_file(const char *progress_file, char **tmpfilename)
 	return 0;
 }
 
-static int write_progress(const char *progress_file, const char *progress_tmpfile, u64 chunk_num, u64 chunk_count, u64 extent_addr, u32 tgt_snap)
+/*
+ * The streams of a parallel transfer share one progress file, a fixed width
+ * line per stream that each session rewrites in place, so resume can pick
+ * up every stream where it left off.
+ */
+#define PROGRESS_LINE 80
+
+static int write_stream_progress(const char *progress_file, struct delta_stream *stream, u64 chunk_num, u64 chunk_count, u64 extent_addr, u32 tgt_snap)
+{
+	char line[PROGRESS_LINE + 1];
+	int fd, len, err = 0;
+
+	if ((fd = open(progress_file, O_WRONLY | O_CREAT, 0666)) < 0) {
+		warn("unable to open progress file %s: %s", progress_file, strerror(errno));
+		return -1;
+	}
+	len = snprintf(line, sizeof(line), "%u %Lu/%Lu %Lu", tgt_snap, chunk_num, chunk_count, extent_addr);
+	memset(line + len, ' ', PROGRESS_LINE - len);
+	line[PROGRESS_LINE - 1] = '\n';
+	if (pwrite(fd, line, PROGRESS_LINE, (off_t)stream->stream * PROGRESS_LINE) != PROGRESS_LINE) {
+		warn("unable to write to progress file %s: %s", progress_file, strerror(errno));
+		err = -1;
+	} else if (ftruncate(fd, (off_t)stream->streams * PROGRESS_LINE) < 0) /* drop lines of an earlier, wider transfer */
+		warn("unable to truncate progress file %s: %s", progress_file, strerror(errno));
+	close(fd);
+	return err;
+}
+
+static int write_progress(const char *progress_file, const char *progress_tmpfile, struct delta_stream *stream, u64 chunk_num, u64 chunk_count, u64 extent_addr, u32 tgt_snap)
 {
 	FILE *progress_fs;
+
+	if (stream)
+		return write_stream_progress(progress_file, stream, chunk_num, chunk_count, extent_addr, tgt_snap);
+
 	if ((progress_fs = fopen(progress_tmpfile, "w")) == NULL) {
 		warn("unable to open progress temp file %s: %s", progress_tmpfile, strerror(errno));
 		return -1;
@@ -713,7 +1029,116 @@ static void usec_sleep(unsigned long sleep_usecs)
 		sleep_time.tv_nsec = left_time.tv_nsec;
 	}
 }
-static int generate_delta_extents(u32 mode, int level, struct change_list *cl, int deltafile, char const *devstem, u32 src_snap, u32 tgt_snap, char const *progress_file, u64 start_chunk, u32 rate_limit)
+/*
+ * Token bucket rate limiter for sending deltas.  Credit accrues at the rate
+ * up to one burst and each write spends it in pieces of RATELIMIT_CHUNK,
+ * sleeping off any deficit, so traffic is smooth within an extent and a
+ * stall earns no more than one burst of catch up.  Credit is kept in byte
+ * microseconds so low rates do not round away.  With a rate limit file the
+ * limit is reread on SIGHUP, or within a second of the file changing.
+ */
+#define RATELIMIT_CHUNK (16 << 10)
+#define RATELIMIT_BURST_USECS 100000 /* default burst is 100ms worth */
+
+struct ratelimit
+{
+	u32 limit, burst; /* as configured for the whole transfer, burst zero for the default */
+	unsigned shares; /* parallel streams splitting the limit */
+	u64 rate, depth; /* this stream's bytes per second and bucket depth */
+	long long credit; /* byte microseconds */
+	u64 last, checked;
+	char const *file;
+	struct timespec mtime;
+};
+
+static volatile sig_atomic_t ratelimit_reread;
+
+static void ratelimit_sighup(int sig)
+{
+	ratelimit_reread = 1;
+}
+
+static void ratelimit_set(struct ratelimit *rl, u32 limit, unsigned shares)
+{
+	rl->limit = limit;
+	rl->shares = shares;
+	rl->rate = ((u64)limit + shares - 1) / shares;
+	rl->depth = rl->burst ? ((u64)rl->burst + shares - 1) / shares : rl->rate * RATELIMIT_BURST_USECS / 1000000;
+	if (rl->depth < RATELIMIT_CHUNK)
+		rl->depth = RATELIMIT_CHUNK;
+}
+
+static void ratelimit_check(struct ratelimit *rl, u64 now)
+{
+	struct stat st;
+	char buf[32];
+	FILE *file;
+	u32 limit;
+
+	if (!rl->file || (!ratelimit_reread && now - rl->checked < 1000000))
+		return;
+	rl->checked = now;
+	if (stat(rl->file, &st) < 0)
+		return;
+	if (!ratelimit_reread && st.st_mtim.tv_sec == rl->mtime.tv_sec && st.st_mtim.tv_nsec == rl->mtime.tv_nsec)
+		return;
+	ratelimit_reread = 0;
+	rl->mtime = st.st_mtim;
+	if (!(file = fopen(rl->file, "r")) || fscanf(file, "%31s", buf) != 1 || (limit = strtobytes(buf)) == INPUT_ERROR)
+		warn("unable to read rate limit from %s", rl->file);
+	else if (limit != rl->limit) {
+		warn("rate limit changed from %u to %u bytes/s", rl->limit, limit);
+		ratelimit_set(rl, limit, rl->shares);
+	}
+	if (file)
+		fclose(file);
+}
+
+/* take bytes out of the bucket at the given time, return microseconds to wait */
+static u64 ratelimit_delay(struct ratelimit *rl, u64 now, u64 bytes)
+{
+	u64 elapsed = now - rl->last;
+
+	ratelimit_check(rl, now);
+	rl->last = now;
+	if (!rl->rate)
+		return 0;
+	if (elapsed > 10000000)
+		elapsed = 10000000;
+	rl->credit += elapsed * rl->rate;
+	if (rl->credit > (long long)(rl->depth * 1000000))
+		rl->credit = rl->depth * 1000000;
+	rl->credit -= bytes * 1000000;
+	return rl->credit < 0 ? -rl->credit / (long long)rl->rate : 0;
+}
+
+static void ratelimit_wait(struct ratelimit *rl, u64 bytes)
+{
+	u64 delay = ratelimit_delay(rl, usec_now(), bytes);
+
+	if (delay)
+		usec_sleep(delay);
+}
+
+static int ratelimit_write(struct ratelimit *rl, int fd, void const *data, size_t count)
+{
+	int err;
+
+	if (!rl)
+		return fdwrite(fd, data, count);
+	while (count) {
+		size_t len = count < RATELIMIT_CHUNK ? count : RATELIMIT_CHUNK;
+
+		ratelimit_wait(rl, len);
+		if ((err = fdwrite(fd, data, len)) < 0)
+			return err;
+		data += len;
+		count -= len;
+	}
+	return 0;
+}
+
+static int generate_delta_extents(u32 mode, struct comp_opts *comp, struct change_list *cl, int deltafile, char const *devstem, u32 src_snap, u32 tgt_snap, char const *progress_file, struct delta_stream *stream, u64 start_chunk, u64 end_chunk, struct ratelimit *rl, struct checkpoint *ckp)
 {
 	int fullvolume = (src_snap == -1);
 	char *dev1name = NULL, *dev2name = NULL, *progress_tmpfile = NULL;
@@ -722,8 +1147,9 @@ static int generate_delta_extents(u32 mode, int level, struct change_list *cl, i
 	unsigned char *dev1_extent   = malloc(MAX_MEM_SIZE);
 	unsigned char *dev2_extent   = malloc(MAX_MEM_SIZE);
 	unsigned char *extents_delta = malloc(MAX_MEM_SIZE);
-	unsigned char *gzip_delta    = malloc(MAX_MEM_SIZE + 12 + (MAX_MEM_SIZE >> 9));
-	unsigned char *dev2_gzip_extent = malloc(MAX_MEM_SIZE + 12 + (MAX_MEM_SIZE >> 9));
+	unsigned char *comp_delta    = malloc(MAX_MEM_SIZE);
+	unsigned char *dev2_comp_extent = malloc(MAX_MEM_SIZE);
+	unsigned char *comp_scratch  = malloc(MAX_MEM_SIZE);
 
 	if (!fullvolume && (!(dev1name = malloc_snapshot_name(devstem, src_snap)) || ((snapdev1 = open(dev1name, O_RDONLY)) < 0))) {
 		warn("unable to open source snapshot: %s", strerror(errno));
@@ -734,20 +1160,21 @@ static int generate_delta_extents(u32 mode, int level, struct change_list *cl, i
 		goto out;
 	}
 
-	if (!dev1_extent || !dev2_extent || !extents_delta || !gzip_delta || !dev2_gzip_extent) {
+	if (!dev1_extent || !dev2_extent || !extents_delta || !comp_delta || !dev2_comp_extent || !comp_scratch) {
 		warn("variable memory allocation failed: %s", strerror(-err));
 		goto out;
 	}
 
-	u64 dev2_gzip_size;
+	u64 dev2_comp_size;
 	struct delta_extent_header deh = { .magic_num = MAGIC_NUM };
+	u32 codec, codec2;
 	u64 extent_addr = bogus, chunk_num, num_of_chunks, source_volume_size = bogus, target_volume_size;
-	u64 extent_size, delta_size, gzip_size = MAX_MEM_SIZE, bytes_total = 0, bytes_sent = 0;
+	u64 extent_size, delta_size, comp_size = MAX_MEM_SIZE, bytes_total = 0, bytes_sent = 0;
 	u32 chunk_size = 1 << cl->chunksize_bits;
 	struct delta_extent_header deh2 = { .magic_num = MAGIC_NUM, .mode = RAW };
 
 	trace_off(printf("dev1name: %s, dev2name: %s\n", dev1name, dev2name););
-	trace_off(printf("level: %d, chunksize bits: %Lu, chunk_count: %Lu\n", level, (llu_t) cl->chunksize_bits, (llu_t) cl->count););
+	trace_off(printf("codecs: %x, level: %d, chunksize bits: %Lu, chunk_count: %Lu\n", comp->codecs, comp->level, (llu_t) cl->chunksize_bits, (llu_t) cl->count););
 	trace_off(printf("starting delta generation, mode %u, chunksize %u\n", mode, chunk_size););
 
 	if (!fullvolume && (source_volume_size = fdsize64(snapdev1)) == -1) {
@@ -763,17 +1190,14 @@ static int generate_delta_extents(u32 mode, int level, struct change_list *cl, i
 
 	u64 current_time, last_update = 0, start_time = usec_now();
 
-	for (chunk_num = start_chunk; chunk_num < cl->count;) {
+	for (chunk_num = start_chunk; chunk_num < end_chunk;) {
 		if (fullvolume) {
 			extent_size = chunk_size;
 			extent_addr = chunk_num * extent_size;
 			num_of_chunks = 1;
 		} else {
 			extent_addr = cl->chunks[chunk_num] << cl->chunksize_bits;
-			if (chunk_num == (cl->count - 1) )
-				num_of_chunks = 1;
-			else
-				num_of_chunks = chunks_in_extent(cl, chunk_num, chunk_size);
+			num_of_chunks = chunks_in_extent(cl, chunk_num, end_chunk, chunk_size);
 			extent_size = chunk_size * num_of_chunks;
 		}
 		if (extent_addr > target_volume_size - extent_size)
@@ -781,7 +1205,7 @@ static int generate_delta_extents(u32 mode, int level, struct change_list *cl, i
 		bytes_total += extent_size;
 
 		/* delta extent header set-up*/
-		deh.gzip_on = FALSE;
+		codec = CODEC_NONE;
 		deh.extent_addr = extent_addr;
 		deh.num_of_chunks = num_of_chunks;
 
@@ -809,50 +1233,52 @@ static int generate_delta_extents(u32 mode, int level, struct change_list *cl, i
 			/* copy RAW data of snap2 if it is fullvolume or if snap2 is larger than snap1 */
 			deh.extents_delta_length = extent_size;
 			deh.mode = RAW;
-			if ((err = gzip_on_delta(&deh, dev2_extent, gzip_delta, extent_size, &gzip_size, level)) < 0)
+			if ((err = compress_delta(&deh, &codec, dev2_extent, comp_delta, comp_scratch, extent_size, &comp_size, comp)) < 0)
 				goto error_source;
 		} else {
-			/* Three different modes, raw, xdelta, best (either gzipped raw or gzipped xdelta)
+			/* Three different modes, raw, xdelta, best (either compressed raw or compressed xdelta)
 			 * Always use raw when senind the first chunk we are resuming on */
 			if (mode == RAW)
 				err = create_raw_delta (&deh, dev2_extent, extents_delta, extent_size, &delta_size);
 			else // compute xdelta for XDELTA or BEST_COMP mode
 				err = create_xdelta_delta (&deh, dev1_extent, dev2_extent, extents_delta, extent_size, &delta_size);
-			if ((err < 0) || ((err = gzip_on_delta(&deh, extents_delta, gzip_delta, delta_size, &gzip_size, level)) < 0))
+			if ((err < 0) || ((err = compress_delta(&deh, &codec, extents_delta, comp_delta, comp_scratch, delta_size, &comp_size, comp)) < 0))
 				goto error_source;
 
 			if (mode == BEST_COMP) {
 				/* delta extent header set-up for dev2_extent */
-				deh2.gzip_on = FALSE;
+				codec2 = CODEC_NONE;
 				deh2.extents_delta_length = extent_size;
-				if ((err = gzip_on_delta(&deh2, dev2_extent, dev2_gzip_extent, extent_size, &dev2_gzip_size, level)) < 0)
+				if ((err = compress_delta(&deh2, &codec2, dev2_extent, dev2_comp_extent, comp_scratch, extent_size, &dev2_comp_size, comp)) < 0)
 					goto error_source;
-				if (dev2_gzip_size <= gzip_size) {
+				if (dev2_comp_size <= comp_size) {
 					deh.mode = deh2.mode;
-					deh.gzip_on = deh2.gzip_on;
+					codec = codec2;
 					deh.extents_delta_length = deh2.extents_delta_length;
-					memcpy(gzip_delta, dev2_gzip_extent, dev2_gzip_size);
+					memcpy(comp_delta, dev2_comp_extent, dev2_comp_size);
 				}
 			}
 		}
 
 		/* write the delta extent header and extents_delta to the delta file*/
-		if ((err = fdwrite(deltafile, &deh, sizeof(deh))) < 0) {
+		deh.magic_num = codec > CODEC_ZLIB ? CODEC_MAGIC_NUM : MAGIC_NUM;
+		deh.gzip_on = codec == CODEC_ZLIB;
+		if ((err = ratelimit_write(rl, deltafile, &deh, sizeof(deh))) < 0 ||
+		    (codec > CODEC_ZLIB && (err = ratelimit_write(rl, deltafile, &codec, sizeof(codec))) < 0)) {
 			warn("unable to write delta header ");
 			goto error_source;
 		}
-		if ((err = fdwrite(deltafile, gzip_delta, deh.extents_delta_length)) < 0) {
+		if ((err = ratelimit_write(rl, deltafile, comp_delta, deh.extents_delta_length)) < 0) {
 			warn("unable to write delta data ");
 			goto error_source;
 		}
-		bytes_sent += deh.extents_delta_length + sizeof(deh);
+		bytes_sent += deh.extents_delta_length + sizeof(deh) + (codec > CODEC_ZLIB ? sizeof(codec) : 0);
+		if (ckp && (err = checkpoint_poll(ckp, deltafile)) < 0)
+			goto error_source;
 
 		current_time = usec_now();
-		if (rate_limit && ((bytes_sent * 1000000 / rate_limit) > (current_time - start_time)))
-			usec_sleep(bytes_sent * 1000000 / rate_limit - (current_time - start_time));
-
 		if (progress_file && ((current_time - last_update) > 1000000)) {
-			if (write_progress(progress_file, progress_tmpfile, chunk_num, cl->count, extent_addr, tgt_snap) < 0)
+			if (write_progress(progress_file, progress_tmpfile, stream, chunk_num, end_chunk, extent_addr, tgt_snap) < 0)
 				goto out;
 			last_update = current_time;
 		}
@@ -861,14 +1287,14 @@ static int generate_delta_extents(u32 mode, int level, struct change_list *cl, i
 	}
 
 	/* Make sure everything in changelist was properly transmitted */
-	if (chunk_num != cl->count) {
+	if (chunk_num != end_chunk) {
 		warn("changelist was not fully transmitted");
 		err = -ERANGE;
 	} else {
 		current_time = usec_now();
 		u32 transrate = (current_time > start_time) ? (unsigned)(bytes_sent * 1000000 / (current_time - start_time)) : 0;
-		warn("Total chunks %Lu (%Lu bytes), wrote %Lu bytes in %i seconds, rate limit %u, transfer rate %u bytes/s", chunk_num, bytes_total, bytes_sent, (unsigned)((current_time - start_time) / 1000000), rate_limit, transrate);
-		err = progress_file ? write_progress(progress_file, progress_tmpfile, chunk_num, cl->count, extent_addr, tgt_snap) : 0;
+		warn("Total chunks %Lu (%Lu bytes), wrote %Lu bytes in %i seconds, rate limit %u, transfer rate %u bytes/s", chunk_num, bytes_total, bytes_sent, (unsigned)((current_time - start_time) / 1000000), rl ? rl->limit : 0, transrate);
+		err = progress_file ? write_progress(progress_file, progress_tmpfile, stream, chunk_num, end_chunk, extent_addr, tgt_snap) : 0;
 	}
 	goto out;
 error_source:
@@ -884,10 +1310,12 @@ out:
 		free(dev2_extent);
 	if (extents_delta)
 		free(extents_delta);
-	if (gzip_delta)
-		free(gzip_delta);
-	if (dev2_gzip_extent)
-		free(dev2_gzip_extent);
+	if (comp_delta)
+		free(comp_delta);
+	if (dev2_comp_extent)
+		free(dev2_comp_extent);
+	if (comp_scratch)
+		free(comp_scratch);
 	if (progress_tmpfile)
 		free(progress_tmpfile);
 	if (dev1name)
@@ -897,7 +1325,7 @@ out:
 	return err;
 }
 
-static int generate_delta(u32 mode, int level, struct change_list *cl, int deltafile, char const *devstem)
+static int generate_delta(u32 mode, struct comp_opts *comp, struct change_list *cl, int deltafile, char const *devstem)
 {
 	/* Delta header set-up */
 	struct delta_header dh;
@@ -914,10 +1342,10 @@ static int generate_delta(u32 mode, int level, struct change_list *cl, int delta
 	if ((err = fdwrite(deltafile, &dh, sizeof(dh))) < 0)
 		return err;
 
-	return generate_delta_extents(mode, level, cl, deltafile, devstem, dh.src_snap, dh.tgt_snap, NULL, 0, 0);
+	return generate_delta_extents(mode, comp, cl, deltafile, devstem, dh.src_snap, dh.tgt_snap, NULL, NULL, 0, cl->count, NULL, NULL);
 }
 
-static int ddsnap_generate_delta(u32 mode, int level, char const *changelistname, char const *deltaname, char const *devstem)
+static int ddsnap_generate_delta(u32 mode, struct comp_opts *comp, char const *changelistname, char const *deltaname, char const *devstem)
 {
 	int clfile = open(changelistname, O_RDONLY);
 	if (clfile < 0) {
@@ -942,7 +1370,7 @@ static int ddsnap_generate_delta(u32 mode, int level, char const *changelistname
 		return 1;
 	}
 
-	if (generate_delta(mode, level, cl, deltafile, devstem) < 0) {
+	if (generate_delta(mode, comp, cl, deltafile, devstem) < 0) {
 		warn("could not write delta file \"%s\"", deltaname);
 		close(deltafile);
 		free_change_list(cl);
@@ -1030,14 +1458,158 @@ static u64 get_snapshot_sectors(int serv_fd, u32 snaptag)
 	return reply.count;
 }
 
-static int ddsnap_replication_send(int serv_fd, u32 src_snap, u32 tgt_snap, char const *devstem, u32 mode, int level, int ds_fd, char const *progress_file, u64 start_addr, u32 ratelimit)
+static u64 chunk_addr(struct change_list *cl, u64 chunk)
 {
-	int fullvolume = (src_snap == -1), err = -ENOMEM;
-	u64 skip_chunks = 0;
+	return (cl->chunks ? cl->chunks[chunk] : chunk) << cl->chunksize_bits;
+}
+
+/* When resuming, find the first chunk of [chunk, end) at or after addr, TODO binary search */
+static u64 resume_chunk(struct change_list *cl, u64 chunk, u64 end, u64 addr)
+{
+	if (!cl->chunks) {
+		u64 first = (addr + (1 << cl->chunksize_bits) - 1) >> cl->chunksize_bits;
+		return first < chunk ? chunk : first > end ? end : first;
+	}
+	while (chunk < end && chunk_addr(cl, chunk) < addr)
+		chunk++;
+	return chunk;
+}
+
+/*
+ * Send chunks [start, end) of the changelist over one downstream connection.
+ * A stream of a parallel transfer says which stream it is and which byte
+ * range of the target it covers, ahead of the volume name.  With a
+ * checkpoint the downstream acknowledges what it has on disk as it goes,
+ * and on resume first checks it really has the last extent acknowledged.
+ * Codecs newer than zlib are only used if the downstream lists them when
+ * it says to proceed; an older downstream gets zlib instead.
+ */
+static int send_delta_stream(int ds_fd, struct change_list *cl, u64 start, u64 end, struct delta_stream *stream, char const *devstem, char const *volume, u32 mode, struct comp_opts *comp, char const *progress_file, struct ratelimit *rl, struct checkpoint *ckp)
+{
+	struct { struct head head; struct delta_header body; char tail[sizeof(struct delta_stream) + MAX_VOLUME_NAME + sizeof(struct delta_options)]; } PACKED request = {
+		.head = { SEND_DELTA, sizeof(struct delta_header) },
+		.body = { DELTA_MAGIC_ID, end - start, 1 << cl->chunksize_bits, cl->src_snap, cl->tgt_snap } };
+	struct delta_options options = { .flags = ckp ? DELTA_ACKS : 0 };
+	struct delta_proceed proceed = { .codecs = LEGACY_CODECS };
+	struct comp_opts allowed = *comp;
+	char *tail = request.tail;
+	int err;
+
+	if (comp->codecs & ~LEGACY_CODECS)
+		options.flags |= DELTA_CODECS;
+	if (stream) {
+		request.head.code = SEND_DELTA_STREAM;
+		memcpy(tail, stream, sizeof(*stream));
+		request.head.length += sizeof(*stream);
+		tail += sizeof(*stream);
+	}
+	if (volume || options.flags) {
+		strncpy(tail, volume ? volume : "", MAX_VOLUME_NAME - 1);
+		request.head.length += strlen(tail) + 1;
+		tail += strlen(tail) + 1;
+	}
+	if (ckp && ckp->slot.extent_size) {
+		options.flags |= DELTA_CHECK;
+		options.check_addr = ckp->slot.extent_addr;
+		options.check_size = ckp->slot.extent_size;
+		options.check_sum = ckp->slot.checksum;
+	}
+	if (options.flags) {
+		memcpy(tail, &options, sizeof(options));
+		request.head.length += sizeof(options);
+	}
+	if (ckp)
+		ckp->start = start;
+	if ((err = writepipe(ds_fd, &request, sizeof(request.head) + request.head.length))) {
+		warn("unable to send delta: %s", strerror(-err));
+		return err;
+	}
+
+	struct head head;
+	if ((err = readpipe(ds_fd, &head, sizeof(head))) < 0) {
+		warn("unable to read response from downstream: %s", strerror(-err));
+		return err;
+	}
+
+	if (head.code == SEND_DELTA_RESTART) {
+		error_message_handler(ds_fd, "downstream server rejected the checkpoint", head.length);
+		return -ESTALE;
+	}
+	if (head.code != SEND_DELTA_PROCEED) {
+		if (head.code != SEND_DELTA_ERROR)
+			unknown_message(ds_fd, &head);
+		else
+			error_message_handler(ds_fd, "downstream server reason why send delta failed", head.length);
+		return -EPIPE;
+	}
+	if (head.length && head.length != sizeof(proceed)) {
+		warn("downstream sent a proceed message of length %u", head.length);
+		return -EPIPE;
+	}
+	if (head.length && (err = readpipe(ds_fd, &proceed, sizeof(proceed))) < 0) {
+		warn("unable to read response from downstream: %s", strerror(-err));
+		return err;
+	}
+	/* fall back to zlib if downstream can decode none of the codecs asked for */
+	allowed.codecs &= proceed.codecs | CODEC_MASK(CODEC_NONE);
+	for (unsigned codec = 0; codec < MAX_CODECS; codec++)
+		if ((comp->codecs & ~allowed.codecs & CODEC_MASK(codec)) && (!stream || !stream->stream))
+			warn("downstream cannot decode %s, not using it", codec_name(codec));
+	if ((comp->codecs & ~CODEC_MASK(CODEC_NONE)) && !(allowed.codecs & ~CODEC_MASK(CODEC_NONE)))
+		allowed.codecs |= CODEC_MASK(CODEC_ZLIB);
+
+	/* stream delta */
+	if ((err = generate_delta_extents(mode, &allowed, cl, ds_fd, devstem, cl->src_snap, cl->tgt_snap, progress_file, stream, start, end, rl, ckp)) < 0) {
+		warn("could not send delta downstream for snapshots %i and %i", cl->src_snap, cl->tgt_snap);
+		return err;
+	}
+	for (;;) {
+		if ((err = readpipe(ds_fd, &head, sizeof(head))) < 0) {
+			warn("unable to read response from downstream: %s", strerror(-err));
+			return err;
+		}
+		if (head.code != SEND_DELTA_ACK || !ckp)
+			break;
+		if ((err = checkpoint_ack(ckp, ds_fd, head.length)) < 0)
+			return err;
+	}
+
+	if (head.code != SEND_DELTA_DONE) {
+		if (head.code != SEND_DELTA_ERROR)
+			unknown_message(ds_fd, &head);
+		else
+			error_message_handler(ds_fd, "downstream server reason why send delta failed", head.length);
+		return -EPIPE;
+	}
+	return 0;
+}
+
+/*
+ * With more than one stream the changelist is split into that many
+ * contiguous ranges, each sent over its own connection by a child process,
+ * while stream zero goes over the connection we were given.  One resume
+ * address applies to every stream, or there is one per stream.
+ *
+ * A checkpoint file, if given, replaces the resume addresses: while it
+ * exists for these snapshots the transfer restarts from it, with the same
+ * changelist and streams, and it is removed once the transfer completes.
+ */
+static int ddsnap_replication_send(int serv_fd, u32 src_snap, u32 tgt_snap, char const *devstem, char const *volume, u32 mode, struct comp_opts *comp, int ds_fd, char const *hostname, unsigned port, int streams, char const *progress_file, u64 *resume, int resumes, struct ratelimit *rl, char const *checkpoint_file)
+{
+	int fullvolume = (src_snap == -1), err = -ENOMEM, i, status, resumed = 0, stale = 0;
+	struct checkpoint_slot slots[MAX_DELTA_STREAMS] = { };
+	struct checkpoint ckp = { .fd = -1 }, *ckpp = NULL;
 	struct change_list *cl = NULL;
+	pid_t pid;
 
-	/* setup changelist */
-	if (fullvolume) {
+	/* setup changelist, a checkpointed transfer saved its own */
+	if (checkpoint_file && (resumed = checkpoint_load(checkpoint_file, src_snap, tgt_snap, &cl, slots, &streams)) < 0) {
+		err = resumed;
+		goto out;
+	}
+	if (resumed) {
+		warn("resuming delta from %i to %i over %i streams from checkpoint %s", src_snap, tgt_snap, streams, checkpoint_file);
+	} else if (fullvolume) {
 		if ((cl = malloc(sizeof(struct change_list))) == NULL) {
 			warn("unable to allocate change list");
 			goto out;
@@ -1045,7 +1617,7 @@ static int ddsnap_replication_send(int serv_fd, u32 src_snap, u32 tgt_snap, char
 
 		err = -EINVAL;
 		struct status_reply *reply;
-		if (!(reply = generate_status(serv_fd, ~((u32)0U)))) {
+		if (!(reply = generate_status(serv_fd, ~((u32)0U), 0, NULL))) {
 			warn("cannot generate status");
 			goto out;
 		}
@@ -1058,7 +1630,6 @@ static int ddsnap_replication_send(int serv_fd, u32 src_snap, u32 tgt_snap, char
 		cl->src_snap = src_snap;
 		cl->tgt_snap = tgt_snap;
 		cl->chunks = NULL;
-		skip_chunks = cl->count - ((vol_size_bytes - start_addr) >> cl->chunksize_bits);
 	} else {
 		trace_off(printf("requesting changelist from snapshot %Lu to %Lu\n", (llu_t) src_snap, (llu_t) tgt_snap););
 		if ((cl = stream_changelist(serv_fd, src_snap, tgt_snap)) == NULL) {
@@ -1066,60 +1637,95 @@ static int ddsnap_replication_send(int serv_fd, u32 src_snap, u32 tgt_snap, char
 			err = -EINVAL;
 			goto out;
 		}
-		/* If resuming, find the first chunk that starts after the start_addr, TODO binary search */
-		while (skip_chunks < cl->count && cl->chunks[skip_chunks] << cl->chunksize_bits < start_addr)
-			skip_chunks++;
 	}
 
-	/* request approval for delta send */
-	if ((err = outbead(ds_fd, SEND_DELTA, struct delta_header, DELTA_MAGIC_ID, cl->count - skip_chunks, 1 << cl->chunksize_bits, src_snap, tgt_snap))) {
-		warn("unable to send delta: %s", strerror(-err));
-		goto out;
-	}
+	/* where each stream starts */
+	for (i = 0; i < streams; i++) {
+		u64 first = cl->count * i / streams, end = cl->count * (i + 1) / streams;
 
-	struct head head;
-	if ((err = readpipe(ds_fd, &head, sizeof(head))) < 0) {
-		warn("unable to read response from downstream: %s", strerror(-err));
-		goto out;
+		if (!resumed)
+			slots[i] = (struct checkpoint_slot){ resume_chunk(cl, first, end, resume[resumes > 1 ? i : 0]) };
+		else if (slots[i].next_chunk < first || slots[i].next_chunk > end)
+			slots[i] = (struct checkpoint_slot){ first };
 	}
-
-	if (head.code != SEND_DELTA_PROCEED) {
-		if (head.code != SEND_DELTA_ERROR)
-			unknown_message(ds_fd, &head);
-		else
-			error_message_handler(ds_fd, "downstream server reason why send delta failed", head.length);
-		err = -EPIPE;
-		goto out;
+	if (checkpoint_file) {
+		if (!resumed && (err = checkpoint_create(checkpoint_file, cl, streams, slots)) < 0)
+			goto out;
+		if ((ckp.fd = open(checkpoint_file, O_WRONLY)) < 0) {
+			warn("unable to open checkpoint %s: %s", checkpoint_file, strerror(errno));
+			err = -errno;
+			goto out;
+		}
+		ckpp = &ckp;
 	}
 
 	warn("sending delta from %i to %i", src_snap, tgt_snap);
 
-	/* stream delta */
-	if ((err = generate_delta_extents(mode, level, cl, ds_fd, devstem, src_snap, tgt_snap, progress_file, skip_chunks, ratelimit)) < 0) {
-		warn("could not send delta downstream for snapshots %i and %i", src_snap, tgt_snap);
-		goto out;
-	}
-	if ((err = readpipe(ds_fd, &head, sizeof(head))) < 0) {
-		warn("unable to read response from downstream: %s", strerror(-err));
-		goto out;
+	if (streams <= 1) {
+		ckp.slot = slots[0];
+		err = send_delta_stream(ds_fd, cl, slots[0].next_chunk, cl->count, NULL, devstem, volume, mode, comp, progress_file, rl, ckpp);
+		stale = err == -ESTALE;
+		goto done;
 	}
 
-	if (head.code != SEND_DELTA_DONE) {
-		if (head.code != SEND_DELTA_ERROR)
-			unknown_message(ds_fd, &head);
-		else
-			error_message_handler(ds_fd, "downstream server reason why send delta failed", head.length);
-		err = -EPIPE;
-		goto out;
-	}
+	/* the rate limit is shared out among the streams */
+	ratelimit_set(rl, rl->limit, streams);
 	err = 0;
+	for (i = streams - 1; i >= 0; i--) {
+		u64 first = cl->count * i / streams, end = cl->count * (i + 1) / streams, start = slots[i].next_chunk;
+		struct delta_stream stream = { .stream = i, .streams = streams, .start_addr = chunk_addr(cl, first),
+			.end_addr = end < cl->count ? chunk_addr(cl, end) : ~0ULL };
+
+		if (start == end)
+			continue;
+		ckp.stream = i;
+		ckp.slot = slots[i];
+		if (i == 0) {
+			err = send_delta_stream(ds_fd, cl, start, end, &stream, devstem, volume, mode, comp, progress_file, rl, ckpp);
+			stale = err == -ESTALE;
+			break;
+		}
+		if ((pid = fork()) < 0) {
+			warn("unable to fork delta stream %i: %s", i, strerror(errno));
+			err = -errno;
+			continue;
+		}
+		if (pid == 0) {
+			int sock;
+
+			close(ds_fd);
+			if ((sock = open_socket(hostname, port)) < 0) {
+				warn("delta stream %i unable to connect to downstream server %s port %u: %s", i, hostname, port, strerror(-sock));
+				exit(1);
+			}
+			err = send_delta_stream(sock, cl, start, end, &stream, devstem, volume, mode, comp, progress_file, rl, ckpp);
+			exit(err == -ESTALE ? 2 : err < 0);
+		}
+	}
+	while ((pid = wait(&status)) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			warn("delta stream process %i failed", pid);
+			stale |= WIFEXITED(status) && WEXITSTATUS(status) == 2;
+			err = -EPIPE;
+		}
+done:
+	if (checkpoint_file && stale)
+		warn("downstream no longer matches checkpoint %s, removed it so the next attempt starts over", checkpoint_file);
+	if (checkpoint_file && (stale || !err))
+		checkpoint_remove(checkpoint_file);
 out:
+	if (ckp.fd >= 0)
+		close(ckp.fd);
 	if (cl)
 		free_change_list(cl);
 	return err;
 }
 
-static int apply_delta_extents(int deltafile, u32 chunk_size, u64 chunk_count, char const *dev1name, char const *dev2name, char const *progress_file, u32 tgt_snap)
+/*
+ * With acks, each time the extents so far are synced to the target, the
+ * last one is acknowledged back to the upstream on the delta connection.
+ */
+static int apply_delta_extents(int deltafile, u32 chunk_size, u64 chunk_count, char const *dev1name, char const *dev2name, char const *progress_file, struct delta_stream *stream, u32 tgt_snap, int acks)
 {
 	int fullvolume = !dev1name;
 	int snapdev1 = bogus, snapdev2;
@@ -1153,6 +1759,7 @@ static int apply_delta_extents(int deltafile, u32 chunk_size, u64 chunk_count, c
 	}
 
 	struct delta_extent_header deh;
+	u32 codec = CODEC_NONE;
 	u64 uncomp_size, extent_size, source_volume_size = bogus, target_volume_size;
 	u64 extent_addr = 0, chunk_num;
 	int current_time, last_update = 0;
@@ -1170,8 +1777,12 @@ static int apply_delta_extents(int deltafile, u32 chunk_size, u64 chunk_count, c
 		trace_off(printf("reading chunk "U64FMT" header\n", chunk_num););
 		if ((err = fdread(deltafile, &deh, sizeof(deh))) < 0)
 			goto apply_headerread_error;
-		if (deh.magic_num != MAGIC_NUM)
+		if (deh.magic_num == MAGIC_NUM)
+			codec = deh.gzip_on ? CODEC_ZLIB : CODEC_NONE;
+		else if (deh.magic_num != CODEC_MAGIC_NUM)
 			goto apply_magic_error;
+		else if ((err = fdread(deltafile, &codec, sizeof(codec))) < 0)
+			goto apply_headerread_error;
 
 		extent_addr = deh.extent_addr;
 		extent_size = deh.num_of_chunks * chunk_size;
@@ -1192,19 +1803,16 @@ static int apply_delta_extents(int deltafile, u32 chunk_size, u64 chunk_count, c
 			}
 		}
 
-		/* gzip compression was used on extent */
-		if (deh.gzip_on == TRUE) {
+		if (deh.extents_delta_length > MAX_MEM_SIZE)
+			goto apply_length_error;
+
+		/* extent was compressed */
+		if (codec != CODEC_NONE) {
 			if ((err = fdread(deltafile, comp_delta, deh.extents_delta_length)) < 0)
 				goto apply_deltaread_error;
-			trace_off(printf("data was compressed\n"););
-			/* zlib decompression */
-			int comp_ret = uncompress(delta_data, (unsigned long *) &uncomp_size, comp_delta, deh.extents_delta_length);
-			if (comp_ret == Z_MEM_ERROR)
-				goto apply_compmem_error;
-			if (comp_ret == Z_BUF_ERROR)
-				goto apply_compbuf_error;
-			if (comp_ret == Z_DATA_ERROR)
-				goto apply_compdata_error;
+			trace_off(printf("data was compressed with %s\n", codec_name(codec)););
+			if ((err = codec_uncompress(codec, delta_data, (unsigned long *) &uncomp_size, comp_delta, deh.extents_delta_length)) < 0)
+				goto apply_uncompress_error;
 		} else {
 			if ((err = fdread(deltafile, delta_data, deh.extents_delta_length)) < 0)
 				goto apply_deltaread_error;
@@ -1230,11 +1838,15 @@ static int apply_delta_extents(int deltafile, u32 chunk_size, u64 chunk_count, c
 		if ((err = diskwrite(snapdev2, updated, extent_size, extent_addr)) < 0)
 			goto apply_write_error;
 
-		if (progress_file && (((current_time = now()) - last_update) > 0)) {
+		if ((progress_file || acks) && (((current_time = now()) - last_update) > 0)) {
 			if (fsync(snapdev2))
 				goto out;
-			if (write_progress(progress_file, progress_tmpfile, chunk_num, chunk_count, extent_addr, tgt_snap) < 0)
+			if (progress_file && write_progress(progress_file, progress_tmpfile, stream, chunk_num, chunk_count, extent_addr, tgt_snap) < 0)
+				goto out;
+			if (acks && (err = outbead(deltafile, SEND_DELTA_ACK, struct delta_ack, chunk_num + deh.num_of_chunks, extent_addr, extent_size, deh.ext2_chksum)) < 0) {
+				warn("unable to acknowledge extent at offset "U64FMT": %s", extent_addr, strerror(-err));
 				goto out;
+			}
 			last_update = current_time;
 		}
 
@@ -1243,7 +1855,7 @@ static int apply_delta_extents(int deltafile, u32 chunk_size, u64 chunk_count, c
 	trace_on(warn("All extents applied to %s\n", dev2name););
 	if (fsync(snapdev2))
 		goto out;
-	err = progress_file ? write_progress(progress_file, progress_tmpfile, chunk_num, chunk_count, extent_addr, tgt_snap) : 0;
+	err = progress_file ? write_progress(progress_file, progress_tmpfile, stream, chunk_num, chunk_count, extent_addr, tgt_snap) : 0;
 	goto out;
 
 	/* error messages */
@@ -1264,16 +1876,13 @@ apply_devread_error:
 	warn("could not read "U64FMT" chunk extent at offset "U64FMT" from downstream snapshot device \"%s\": %s", deh.num_of_chunks, extent_addr, dev1name, strerror(-err));
 	goto out;
 
-apply_compmem_error:
-	warn("not enough buffer memory for decompression of delta for "U64FMT" chunk extent starting at offset "U64FMT, deh.num_of_chunks, extent_addr);
-	goto out;
-
-apply_compbuf_error:
-	warn("not enough room in the output buffer for decompression of delta for "U64FMT" chunk extent starting at offset "U64FMT, deh.num_of_chunks, extent_addr);
+apply_length_error:
+	err = -ERANGE;
+	warn("delta length "U64FMT" too large for "U64FMT" chunk extent starting at offset "U64FMT, deh.extents_delta_length, deh.num_of_chunks, extent_addr);
 	goto out;
 
-apply_compdata_error:
-	warn("compressed data corrupted in delta for "U64FMT" chunk extent starting at offset "U64FMT, deh.num_of_chunks, extent_addr);
+apply_uncompress_error:
+	warn("could not decompress %s delta for "U64FMT" chunk extent starting at offset "U64FMT": %s", codec_name(codec), deh.num_of_chunks, extent_addr, strerror(-err));
 	goto out;
 
 apply_chunk_error:
@@ -1344,7 +1953,7 @@ static int apply_delta(int deltafile, char const *devstem)
 		return -ENOMEM;
 	}
 
-	if ((err = apply_delta_extents(deltafile, dh.chunk_size, dh.chunk_num, dev1name, devstem, NULL, dh.tgt_snap)) < 0) {
+	if ((err = apply_delta_extents(deltafile, dh.chunk_size, dh.chunk_num, dev1name, devstem, NULL, NULL, dh.tgt_snap, 0)) < 0) {
 		if (dev1name)
 			free(dev1name);
 		return err;
@@ -1498,6 +2107,25 @@ static int delete_snapshot(int sock, u32 snaptag)
 	return 0;
 }
 
+static int delete_snapshots(int sock, u32 *snaptags, unsigned count)
+{
+	struct messagebuf request = { .head = { DELETE_SNAPSHOTS, sizeof(struct delete_snapshots) + count * sizeof(u32) } };
+	struct delete_snapshots *body = (void *)request.body;
+	int err;
+
+	body->count = count;
+	memcpy(body->snaps, snaptags, count * sizeof(u32));
+	if ((err = writepipe(sock, &request, sizeof(request.head) + request.head.length)) < 0) {
+		warn("unable to send delete snapshots message: %s", strerror(-err));
+		return 1;
+	}
+	if (get_reply(sock, "delete snapshots", DELETE_SNAPSHOT_OK, 0, NULL) != 0) {
+		errprint("delete snapshots");
+		return 1;
+	}
+	return 0;
+}
+
 static int create_snapshot(int sock, u32 snaptag)
 {
 	int err;
@@ -1549,171 +2177,370 @@ static int usecount(int sock, u32 snaptag, int32_t usecnt_dev)
 	return 0;
 }
 
-static int ddsnap_delta_server(int lsock, char const *devstem, const char *progress_file, char const *logfile, int getsigfd)
+/*
+ * Work out which device an upstream session writes to.  A listener started
+ * on a device only takes deltas for that device; one started on a directory
+ * serves every volume in it, and the upstream names the volume after the
+ * delta header.
+ */
+static char *delta_target(char const *devstem, int multivolume, char const *volume, char *err_msg)
 {
-	char const *origindev = devstem;
-        struct pollfd pollvec[1];
-	struct sigaction sigact = { .sa_handler = sighandler, .sa_flags = (SA_NOCLDSTOP | SA_NOCLDWAIT | SA_RESETHAND) };
-	/* FIXME: keep list of child pids if we want to support multiple children */
-	pid_t pid = -1;  /* delta server has a single child only now */
+	char *target;
 
-        pollvec[0] = (struct pollfd){ .fd = getsigfd, .events = POLLIN };
-	if (sigprocmask(0, NULL, &sigact.sa_mask))  /* get the current signal mask */
-		error("fail to set signal mask");
+	if (!multivolume)
+		return strdup(devstem);
 
-	for (;;) {
-		int csock;
+	if (!volume || !*volume || strchr(volume, '/') || !strcmp(volume, ".") || !strcmp(volume, "..")) {
+		snprintf(err_msg, MAX_ERRMSG_SIZE, "invalid target volume name \"%s\"", volume ? volume : "");
+		err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+		return NULL;
+	}
+	if (!(target = malloc(strlen(devstem) + strlen(volume) + 2))) {
+		snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to allocate device name");
+		err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+		return NULL;
+	}
+	sprintf(target, "%s/%s", devstem, volume);
+	return target;
+}
 
-		if ((poll(pollvec, 1, 0) < 0) && (errno != EINTR))
-			error("poll failed, %s", strerror(errno));
-                if (pollvec[0].revents) {
-                        u8 sig = 0;
-                        /* it's stupid but this read also gets interrupted, so... */
-                        do { } while (read(getsigfd, &sig, 1) == -1 && errno == EINTR);
-                        trace_on(warn("Caught signal %i", sig););
-                        switch (sig) {
-                                case SIGHUP:
-                                        fflush(stderr);
-                                        fflush(stdout);
-                                        re_open_logfile(logfile);
-                                        break;
-				case SIGTERM:
-				case SIGINT:
-					if (pid > 0)
-						kill(pid, SIGKILL);
-					exit(0);
-				case SIGCHLD:
-					pid = -1; /* delta server has a single child only now */
-					break;
-				default:
-					break;
-                        }
-                }
+/*
+ * Each session gets its own progress file: "%s" in the name is replaced by
+ * the target volume, otherwise a multivolume listener appends ".<volume>".
+ * With no volume the "%s" is left out, along with a separator next to it.
+ */
+static char *session_progress_file(char const *progress_file, char const *volume)
+{
+	char const *subst, *tail;
+	int size, head;
+	char *name;
 
-		if ((csock = accept_socket(lsock)) < 0) {
-			warn("unable to accept connection: %s", strerror(-csock));
-			continue;
+	if (!progress_file)
+		return NULL;
+	size = strlen(progress_file) + (volume ? strlen(volume) : 0) + 2;
+	if (!(name = malloc(size)))
+		return NULL;
+	if (!(subst = strstr(progress_file, "%s"))) {
+		snprintf(name, size, volume ? "%s.%s" : "%s", progress_file, volume);
+		return name;
+	}
+	head = subst - progress_file;
+	tail = subst + 2;
+	if (!volume) {
+		if (head && strchr(".-_", progress_file[head - 1]))
+			head--;
+		else if (*tail && strchr(".-_", *tail))
+			tail++;
+	}
+	snprintf(name, size, "%.*s%s%s", head, progress_file, volume ? volume : "", tail);
+	return name;
+}
+
+/*
+ * A resumed transfer names the last extent we acknowledged.  If the target
+ * does not hold it any more the target changed since, and the upstream has
+ * to start over rather than skip what it thinks we have.
+ */
+static int check_resume_extent(int fd, struct delta_options const *options)
+{
+	unsigned char *data;
+	int err;
+
+	if (!options->check_size || options->check_size > MAX_MEM_SIZE)
+		return -EINVAL;
+	if (!(data = malloc(options->check_size)))
+		return -ENOMEM;
+	if (!(err = diskread(fd, data, options->check_size, options->check_addr)) && checksum(data, options->check_size) != options->check_sum)
+		err = -ESTALE;
+	free(data);
+	return err;
+}
+
+/*
+ * Service one upstream connection, in a child of the delta server.  Only one
+ * session at a time may write a given part of a target, enforced with a
+ * write lock on the byte range it covers so it also holds across listeners:
+ * the whole device for a plain delta, its own range for one stream of a
+ * parallel transfer.
+ */
+static int delta_session(int csock, char const *devstem, int multivolume, char const *progress_file)
+{
+	struct messagebuf message;
+	struct delta_header body;
+	struct delta_stream stream, *streamp = NULL;
+	struct delta_options options = { };
+	struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	char *target = NULL, *src_snapdev = NULL, *session_progress = NULL;
+	unsigned offset = sizeof(body), reply = SEND_DELTA_ERROR;
+	int err, lockfd = -1;
+	char err_msg[MAX_ERRMSG_SIZE];
+	err_msg[0] = '\0';
+
+	if ((err = readpipe(csock, &message.head, sizeof(message.head))) < 0) {
+		snprintf(err_msg, MAX_ERRMSG_SIZE, "error reading upstream message header: %s", strerror(-err));
+		err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+		goto end_connection;
+	}
+	if (message.head.length > maxbody) {
+		snprintf(err_msg, MAX_ERRMSG_SIZE, "message body too long %u", message.head.length);
+		err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+		goto end_connection;
+	}
+	if ((err = readpipe(csock, &message.body, message.head.length)) < 0) {
+		snprintf(err_msg, MAX_ERRMSG_SIZE, "error reading upstream message body: %s", strerror(-err));
+		err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+		goto end_connection;
+	}
+
+	switch (message.head.code) {
+	case SEND_DELTA_STREAM:
+		offset += sizeof(stream);
+		/* fall through */
+	case SEND_DELTA:
+		if (message.head.length < offset) {
+			snprintf(err_msg, MAX_ERRMSG_SIZE, "incomplete SEND_DELTA request sent by client: length %u, size %u", message.head.length, offset);
+			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+			goto end_connection;
 		}
 
-		trace_on(fprintf(stderr, "got client connection\n"););
+		memcpy(&body, message.body, sizeof(body));
 
-		assert(pid == -1); /* delta server has a single child only now */
-		sigaction(SIGCHLD, &sigact, NULL); /* monitor child exits */
-		if ((pid = fork()) < 0) {
-			warn("unable to fork to service connection: %s", strerror(errno));
-			goto cleanup_client;
+		if (body.chunk_size == 0) {
+			snprintf(err_msg, MAX_ERRMSG_SIZE, "invalid chunk size %u in SEND_DELTA", body.chunk_size);
+			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+			goto end_connection;
 		}
 
-		if (pid != 0) {
-			/* parent -- wait for another connection */
-			goto cleanup_client;
+		if (message.head.code == SEND_DELTA_STREAM) {
+			memcpy(&stream, message.body + sizeof(body), sizeof(stream));
+			if (stream.streams > MAX_DELTA_STREAMS || stream.stream >= stream.streams || stream.end_addr <= stream.start_addr) {
+				snprintf(err_msg, MAX_ERRMSG_SIZE, "invalid delta stream %u of %u", stream.stream, stream.streams);
+				err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+				goto end_connection;
+			}
+			lock.l_start = stream.start_addr;
+			lock.l_len = stream.end_addr == ~0ULL ? 0 : stream.end_addr - stream.start_addr;
+			streamp = &stream;
 		}
 
-		trace_on(fprintf(stderr, "processing\n"););
+		/* newer upstreams follow the delta header with the target volume name, then options */
+		char *volume = NULL, *nul;
+		if (message.head.length > offset) {
+			volume = message.body + offset;
+			if (!(nul = memchr(volume, 0, message.head.length - offset)))
+				message.body[message.head.length - 1] = '\0';
+			else if (message.body + message.head.length - (nul + 1) >= sizeof(options))
+				memcpy(&options, nul + 1, sizeof(options));
+			if (!*volume)
+				volume = NULL;
+		}
 
-		/* child */
+		if (!(target = delta_target(devstem, multivolume, volume, err_msg)))
+			goto end_connection;
 
-		struct messagebuf message;
-		int err;
-		char err_msg[MAX_ERRMSG_SIZE];
-		err_msg[0] = '\0';
+		/*
+		 * A resume reads back its check extent through the locked
+		 * descriptor: closing any other one onto the target would drop
+		 * the lock, which belongs to the process, not the descriptor.
+		 */
+		if ((lockfd = open(target, options.flags & DELTA_CHECK ? O_RDWR : O_WRONLY)) < 0) {
+			snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to open target device \"%s\": %s", target, strerror(errno));
+			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+			goto end_connection;
+		}
+		if (fcntl(lockfd, F_SETLK, &lock) < 0) {
+			snprintf(err_msg, MAX_ERRMSG_SIZE, "replication to \"%s\" already in progress", target);
+			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+			goto end_connection;
+		}
 
-		if ((err = readpipe(csock, &message.head, sizeof(message.head))) < 0) {
-			snprintf(err_msg, MAX_ERRMSG_SIZE, "error reading upstream message header: %s", strerror(-err));
+		if ((body.src_snap != (u32)~0UL) && !(src_snapdev = malloc_snapshot_name(target, body.src_snap))) {
+			snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to allocate device name");
 			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
 			goto end_connection;
 		}
-		if (message.head.length > maxbody) {
-			snprintf(err_msg, MAX_ERRMSG_SIZE, "message body too long %u", message.head.length);
+
+		if (progress_file && !(session_progress = session_progress_file(progress_file, multivolume ? volume : NULL))) {
+			snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to allocate progress file name");
 			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
 			goto end_connection;
 		}
-		if ((err = readpipe(csock, &message.body, message.head.length)) < 0) {
-			snprintf(err_msg, MAX_ERRMSG_SIZE, "error reading upstream message body: %s", strerror(-err));
+
+		if ((options.flags & DELTA_CHECK) && (err = check_resume_extent(lockfd, &options)) < 0) {
+			if (err == -ESTALE) {
+				reply = SEND_DELTA_RESTART;
+				snprintf(err_msg, MAX_ERRMSG_SIZE, "extent at offset "U64FMT" of \"%s\" does not match the checkpoint", options.check_addr, target);
+			} else
+				snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to check extent at offset "U64FMT" of \"%s\": %s", options.check_addr, target, strerror(-err));
 			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
 			goto end_connection;
 		}
 
-		struct delta_header body;
+		/* FIXME: verify snapshot exists */
 
-		switch (message.head.code) {
-		case SEND_DELTA:
-			if (message.head.length < sizeof(body)) {
-				snprintf(err_msg, MAX_ERRMSG_SIZE, "incomplete SEND_DELTA request sent by client: length %u, size %zu", message.head.length, sizeof(body));
-				err_msg[MAX_ERRMSG_SIZE-1] = '\0';
-				goto end_connection;
-			}
+		/* FIXME: In the future we should also lookup the client's address in a
+		 * device permission table.
+		 */
 
-			memcpy(&body, message.body, sizeof(body));
+		if (options.flags & DELTA_CODECS) {
+			unsigned codec, codecs = 0;
+
+			for (codec = 0; codec < MAX_CODECS; codec++)
+				if (codec_available(codec))
+					codecs |= CODEC_MASK(codec);
+			err = outbead(csock, SEND_DELTA_PROCEED, struct delta_proceed, codecs);
+		} else
+			err = outbead(csock, SEND_DELTA_PROCEED, struct {});
+		if (err < 0) {
+			snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to send delta proceed message to server");
+			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+			goto end_connection;
+		}
 
-			if (body.chunk_size == 0) {
-				snprintf(err_msg, MAX_ERRMSG_SIZE, "invalid chunk size %u in SEND_DELTA", body.chunk_size);
-				err_msg[MAX_ERRMSG_SIZE-1] = '\0';
-				goto end_connection;
-			}
+		/* retrieve it */
 
-			char *src_snapdev = NULL;
-			if ((body.src_snap != (u32)~0UL) && !(src_snapdev = malloc_snapshot_name(devstem, body.src_snap))) {
-				snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to allocate device name");
-				err_msg[MAX_ERRMSG_SIZE-1] = '\0';
-				goto end_connection;
-			}
+		if (apply_delta_extents(csock, body.chunk_size,
+					body.chunk_num, src_snapdev, target, session_progress, streamp, body.tgt_snap, options.flags & DELTA_ACKS) < 0) {
+			snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to apply upstream delta to device \"%s\"", target);
+			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+			goto end_connection;
+		}
 
-			/* FIXME: verify snapshot exists */
+		/* success */
 
-			/* FIXME: In the future we should also lookup the client's address in a
-			 * device permission table and check for replicatiosn already in progress.
-			 */
+		if (outbead(csock, SEND_DELTA_DONE, struct {}) < 0) {
+			snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to send delta complete message to server");
+			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+			goto end_connection;
+		}
+		trace_on(fprintf(stderr, "applied streamed delta to \"%s\", closing connection\n", target););
+		err = 0;
+		goto out;
 
-			if (outbead(csock, SEND_DELTA_PROCEED, struct {}) < 0) {
-				snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to send delta proceed message to server");
-				err_msg[MAX_ERRMSG_SIZE-1] = '\0';
-				if (src_snapdev)
-					free(src_snapdev);
-				goto end_connection;
-			}
+	default:
+		snprintf(err_msg, MAX_ERRMSG_SIZE,
+				"unexpected message type sent to snapshot replication server %x", message.head.code);
+		err_msg[MAX_ERRMSG_SIZE-1] = '\0';
+		goto end_connection;
+	}
 
-			/* retrieve it */
+end_connection:
+	warn("closing connection on error: %s", err_msg);
+	if (outhead(csock, reply, strlen(err_msg)+1) < 0 ||
+			writepipe(csock, err_msg, strlen(err_msg)+1) < 0)
+		warn("unable to send delta error message to upstream server");
+	err = 1;
+out:
+	close(csock);
+	if (lockfd >= 0)
+		close(lockfd);
+	if (session_progress)
+		free(session_progress);
+	if (src_snapdev)
+		free(src_snapdev);
+	if (target)
+		free(target);
+	return err;
+}
 
-			if (apply_delta_extents(csock, body.chunk_size,
-						body.chunk_num, src_snapdev, origindev, progress_file, body.tgt_snap) < 0) {
-				snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to apply upstream delta to device \"%s\"", origindev);
-				err_msg[MAX_ERRMSG_SIZE-1] = '\0';
-				if (src_snapdev)
-					free(src_snapdev);
-				goto end_connection;
+static void reap_sessions(pid_t *sessions, int *count)
+{
+	int status, i;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (i = 0; i < *count; i++)
+			if (sessions[i] == pid) {
+				sessions[i] = sessions[--*count];
+				break;
 			}
+		trace_on(warn("session %i exited with status %i, %i still running", pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1, *count););
+	}
+}
 
-			if (src_snapdev)
-				free(src_snapdev);
+static int ddsnap_delta_server(int lsock, char const *devstem, const char *progress_file, char const *logfile, int getsigfd, int max_sessions)
+{
+	struct pollfd pollvec[2];
+	struct sigaction sigact = { .sa_handler = sighandler, .sa_flags = SA_NOCLDSTOP };
+	struct stat st;
+	pid_t *sessions;
+	int count = 0, i;
+
+	if (!(sessions = malloc(max_sessions * sizeof(*sessions))))
+		error("unable to allocate session table");
+	if (stat(devstem, &st) < 0)
+		error("unable to stat \"%s\": %s", devstem, strerror(errno));
+	int multivolume = S_ISDIR(st.st_mode);
+
+	pollvec[0] = (struct pollfd){ .fd = getsigfd, .events = POLLIN };
+	pollvec[1] = (struct pollfd){ .fd = lsock, .events = POLLIN };
+	if (sigprocmask(0, NULL, &sigact.sa_mask))  /* get the current signal mask */
+		error("fail to set signal mask");
+	sigaction(SIGCHLD, &sigact, NULL); /* monitor child exits */
 
-			/* success */
+	for (;;) {
+		int csock;
+		pid_t pid;
 
-			if (outbead(csock, SEND_DELTA_DONE, struct {}) < 0) {
-				snprintf(err_msg, MAX_ERRMSG_SIZE, "unable to send delta complete message to server");
-				err_msg[MAX_ERRMSG_SIZE-1] = '\0';
-				goto end_connection;
+		/* stop accepting while all sessions are busy, new ones wait in the listen backlog */
+		pollvec[1].revents = 0;
+		if (poll(pollvec, count < max_sessions ? 2 : 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			error("poll failed, %s", strerror(errno));
+		}
+
+		if (pollvec[0].revents) {
+			u8 sig = 0;
+			/* it's stupid but this read also gets interrupted, so... */
+			do { } while (read(getsigfd, &sig, 1) == -1 && errno == EINTR);
+			trace_on(warn("Caught signal %i", sig););
+			switch (sig) {
+			case SIGHUP:
+				fflush(stderr);
+				fflush(stdout);
+				re_open_logfile(logfile);
+				break;
+			case SIGTERM:
+			case SIGINT:
+				for (i = 0; i < count; i++)
+					kill(sessions[i], SIGKILL);
+				exit(0);
+			case SIGCHLD:
+				reap_sessions(sessions, &count);
+				break;
+			default:
+				break;
 			}
-			trace_on(fprintf(stderr, "applied streamed delta to \"%s\", closing connection\n", origindev););
-			close(csock);
-			exit(0);
+		}
+
+		if (!pollvec[1].revents)
+			continue;
+
+		if ((csock = accept_socket(lsock)) < 0) {
+			warn("unable to accept connection: %s", strerror(-csock));
+			continue;
+		}
 
-		default:
-			snprintf(err_msg, MAX_ERRMSG_SIZE,
-					"unexpected message type sent to snapshot replication server %x", message.head.code);
-			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
-			goto end_connection;
+		trace_on(fprintf(stderr, "got client connection, %i sessions running\n", count););
+
+		if ((pid = fork()) < 0) {
+			warn("unable to fork to service connection: %s", strerror(errno));
+			close(csock);
+			continue;
 		}
 
-	end_connection:
-		warn("closing connection on error: %s", err_msg);
-		if (outhead(csock, SEND_DELTA_ERROR, strlen(err_msg)+1) < 0 ||
-				writepipe(csock, err_msg, strlen(err_msg)+1) < 0)
-			warn("unable to send delta error message to upstream server");
-		close(csock);
-		exit(1);
+		if (pid == 0) {
+			close(lsock);
+			close(getsigfd);
+			signal(SIGCHLD, SIG_DFL);
+			signal(SIGHUP, SIG_IGN);
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			exit(delta_session(csock, devstem, multivolume, progress_file));
+		}
 
-	cleanup_client:
+		sessions[count++] = pid;
 		close(csock);
 	}
 
@@ -1756,11 +2583,22 @@ int commas(char *buf, int len, long long n)
 	return newlen;
 }
 
-static int ddsnap_get_status(int serv_fd, u32 snaptag, int verbose)
+static int ddsnap_get_status(char const *sockname, u32 snaptag, int verbose, u32 flags)
 {
-	struct status_reply *reply = generate_status(serv_fd, snaptag);
-	if (!reply)
+	int serv_fd = create_socket(sockname), length;
+	struct status_reply *reply = generate_status(serv_fd, snaptag, flags, &length);
+
+	/* a server older than the status flags hangs up on them, so ask again without */
+	if (!reply && flags && (errno == EPIPE || errno == ECONNRESET)) {
+		close(serv_fd);
+		serv_fd = create_socket(sockname);
+		flags = 0;
+		reply = generate_status(serv_fd, snaptag, flags, &length);
+	}
+	if (!reply) {
+		close(serv_fd);
 		return 1;
+	}
 	int separate = !!reply->store.total;
 	char number1[27], number2[27];
 	unsigned snapshots = reply->snapshots;
@@ -1850,6 +2688,7 @@ static int ddsnap_get_status(int serv_fd, u32 snaptag, int verbose)
 		if (!(column_totals = malloc(sizeof(u64) * snapshots))) {
 			warn("unable to allocate array for column totals");
 			free(reply);
+			close(serv_fd);
 			return 1;
 		}
 
@@ -1868,6 +2707,9 @@ static int ddsnap_get_status(int serv_fd, u32 snaptag, int verbose)
 
 			total_chunks += column_totals[col];
 		}
+		/* a summary has shared chunks in one column, counted once per snapshot */
+		if (flags & STATUS_SUMMARY)
+			total_chunks = ((struct status_summary *)((char *)reply + snapshot_details_calc_size(snapshots, snapshots)))->exceptions;
 
 		printf("%6s %45llu", "totals", total_chunks);
 		if (snapshots > 0)
@@ -1894,7 +2736,18 @@ static int ddsnap_get_status(int serv_fd, u32 snaptag, int verbose)
 		printf("Metadata usage: %s bytes\n", number1);
 	}
 
+	/* older servers do not send the tree fill, and none is counted before a full status */
+	size_t fill_at = snapshot_details_calc_size(snapshots, snapshots) + (flags & STATUS_SUMMARY ? sizeof(struct status_summary) : 0);
+	if (length >= fill_at + sizeof(struct status_tree)) {
+		struct status_tree *fill = (void *)((char *)reply + fill_at);
+		if (fill->leaves)
+			printf("Btree: %u levels, %llu leaves %.1f%% full, %llu nodes %.1f%% full\n", fill->levels,
+			       (llu_t)fill->leaves, 100.0 * fill->leaf_bytes / ((double)fill->leaves * fill->leaf_capacity),
+			       (llu_t)fill->nodes, 100.0 * fill->node_entries / ((double)fill->nodes * fill->node_capacity));
+	}
+
 	free(reply);
+	close(serv_fd);
 
 	return 0;
 }
@@ -1924,6 +2777,262 @@ static int ddsnap_resize_devices(int serv_fd, u64 orgsize, u64 snapsize, u64 met
 	return 0;
 }
 
+static int ddsnap_compact_tree(int serv_fd, u32 fill)
+{
+	int err;
+	if ((err = outbead(serv_fd, COMPACT_TREE, struct compact_tree, fill))) {
+		warn("unable to send compact request: %s", strerror(-err));
+		return -1;
+	}
+	struct compact_tree_ok reply;
+	if (get_reply(serv_fd, "compact", COMPACT_TREE_OK, sizeof(struct compact_tree_ok), &reply) != 0) {
+		errprint("compact btree");
+		return -1;
+	}
+	printf("btree compacted from %u levels and %Lu leaves to %u levels, %Lu leaves and %Lu index nodes\n",
+		reply.old_levels, (unsigned long long) reply.old_leaves, reply.levels,
+		(unsigned long long) reply.leaves, (unsigned long long) reply.nodes);
+	return 0;
+}
+
+/*
+ * Print the upper bound of the bucket the given fraction of a histogram's
+ * values fall in.  The last bucket takes everything above, without bound.
+ */
+static void stats_percentile(char const *label, struct stats_entry *entry, double fraction)
+{
+	unsigned long long seen = 0;
+	unsigned i;
+
+	for (i = 0; i < entry->buckets; i++)
+		if ((seen += entry->bucket[i]) >= fraction * entry->count)
+			break;
+	if (i >= STATS_BUCKETS - 1)
+		printf("  %s <inf", label);
+	else
+		printf("  %s <%Lu", label, 1ULL << i);
+}
+
+static int ddsnap_get_stats(int serv_fd, u32 flags, int machine)
+{
+	struct stats_reply *reply;
+	int err, size;
+
+	if ((err = outbead(serv_fd, STATS, struct stats_request, flags))) {
+		warn("unable to send stats request: %s", strerror(-err));
+		return -1;
+	}
+	if ((size = expect(serv_fd, STATS_OK)) == -1) {
+		errprint("get stats");
+		return -1;
+	}
+	if (size < sizeof(struct stats_reply)) {
+		warn("stats length mismatch: expected >=%zu, actual %u", sizeof(struct stats_reply), size);
+		return -1;
+	}
+	if (!(reply = malloc(size))) {
+		warn("unable to allocate %u bytes for reply buffer", size);
+		return -1;
+	}
+	if ((err = readpipe(serv_fd, reply, size)) < 0) {
+		warn("received incomplete stats message: %s", strerror(-err));
+		free(reply);
+		return -1;
+	}
+	if (size != sizeof(struct stats_reply) + reply->entries * sizeof(struct stats_entry)) {
+		warn("stats length mismatch: %u entries in %u bytes", reply->entries, size);
+		free(reply);
+		return -1;
+	}
+
+	time_t since = reply->since;
+	if (machine)
+		printf("since %Lu\n", (unsigned long long)reply->since);
+	else
+		printf("Counting since %s", ctime(&since));
+	for (unsigned i = 0; i < reply->entries; i++) {
+		struct stats_entry *entry = reply->entry + i;
+
+		entry->name[STATS_NAME - 1] = 0;
+		if (machine) {
+			if (!entry->buckets) {
+				printf("%s %Lu\n", entry->name, (unsigned long long)entry->count);
+				continue;
+			}
+			printf("%s.count %Lu\n", entry->name, (unsigned long long)entry->count);
+			printf("%s.sum %Lu\n", entry->name, (unsigned long long)entry->sum);
+			for (unsigned j = 0; j < entry->buckets && j < STATS_BUCKETS; j++)
+				if (entry->bucket[j] && j == STATS_BUCKETS - 1)
+					printf("%s.lt.inf %Lu\n", entry->name, (unsigned long long)entry->bucket[j]);
+				else if (entry->bucket[j])
+					printf("%s.lt.%Lu %Lu\n", entry->name, 1ULL << j, (unsigned long long)entry->bucket[j]);
+			continue;
+		}
+		if (!entry->buckets) {
+			printf("%-30s %12Lu\n", entry->name, (unsigned long long)entry->count);
+			continue;
+		}
+		if (entry->buckets > STATS_BUCKETS)
+			entry->buckets = STATS_BUCKETS;
+		printf("%-30s %12Lu", entry->name, (unsigned long long)entry->count);
+		if (entry->count) {
+			printf("  mean %.1f", (double)entry->sum / entry->count);
+			stats_percentile("p50", entry, 0.5);
+			stats_percentile("p90", entry, 0.9);
+			stats_percentile("p99", entry, 0.99);
+			stats_percentile("max", entry, 1);
+		}
+		printf("\n");
+	}
+	free(reply);
+	return 0;
+}
+
+static char const *const trace_kinds[TRACE_KINDS] = { "origin write", "snapshot write", "snapshot read" };
+static char const *const trace_phases[TRACE_PHASES] = { "probe", "alloc", "tree", "copy read", "copy write", "commit", "lock wait" };
+
+/* time in no phase: waiting on the socket, building replies and the like */
+static unsigned trace_other(struct trace_record *record)
+{
+	unsigned phased = 0;
+
+	for (unsigned j = 0; j < TRACE_PHASES; j++)
+		phased += record->phase[j];
+	return record->total > phased ? record->total - phased : 0;
+}
+
+/*
+ * Print a trace dump, each record if asked, then for each kind of request
+ * the mean and worst time in each phase and its share of the total.
+ */
+static int trace_decode(struct trace_dump_ok *dump, unsigned size, int list)
+{
+	if (size < sizeof(*dump) || dump->phases != TRACE_PHASES ||
+		size != sizeof(*dump) + dump->records * sizeof(struct trace_record)) {
+		warn("trace dump of %u bytes does not hold records of %u phases", size, TRACE_PHASES);
+		return -1;
+	}
+
+	struct trace_sum { unsigned long long count, chunks, total, phase[TRACE_PHASES + 1]; unsigned max, phase_max[TRACE_PHASES + 1]; } kinds[TRACE_KINDS] = { };
+	unsigned i, j;
+
+	if (list) {
+		printf("%-17s %-14s %8s %6s %8s", "start", "request", "id", "chunks", "total");
+		for (j = 0; j < TRACE_PHASES; j++)
+			printf(" %10s", trace_phases[j]);
+		printf(" %10s\n", "other");
+	}
+	for (i = 0; i < dump->records; i++) {
+		struct trace_record *record = dump->record + i;
+
+		if (record->kind >= TRACE_KINDS)
+			continue;
+		if (list) {
+			printf("%10Lu.%06Lu %-14s %8u %6u %8u", (unsigned long long)record->start / 1000000,
+				(unsigned long long)record->start % 1000000, trace_kinds[record->kind],
+				record->id, record->chunks, record->total);
+			for (j = 0; j < TRACE_PHASES; j++)
+				printf(" %10u", record->phase[j]);
+			printf(" %10u\n", trace_other(record));
+		}
+
+		struct trace_sum *kind = kinds + record->kind;
+		kind->count++;
+		kind->chunks += record->chunks;
+		kind->total += record->total;
+		if (record->total > kind->max)
+			kind->max = record->total;
+		for (j = 0; j <= TRACE_PHASES; j++) {
+			unsigned time = j < TRACE_PHASES ? record->phase[j] : trace_other(record);
+			kind->phase[j] += time;
+			if (time > kind->phase_max[j])
+				kind->phase_max[j] = time;
+		}
+	}
+	if (list)
+		printf("\n");
+
+	printf("%u requests traced\n", dump->records);
+	for (i = 0; i < TRACE_KINDS; i++) {
+		struct trace_sum *kind = kinds + i;
+
+		if (!kind->count)
+			continue;
+		printf("\n%s: %Lu requests, %Lu chunks\n", trace_kinds[i], kind->count, kind->chunks);
+		printf("  %-12s %10s %10s %7s\n", "phase", "mean us", "max us", "share");
+		for (j = 0; j <= TRACE_PHASES; j++)
+			printf("  %-12s %10.1f %10u %6.1f%%\n", j < TRACE_PHASES ? trace_phases[j] : "other",
+				(double)kind->phase[j] / kind->count, kind->phase_max[j],
+				kind->total ? 100.0 * kind->phase[j] / kind->total : 0);
+		printf("  %-12s %10.1f %10u\n", "total", (double)kind->total / kind->count, kind->max);
+	}
+	return 0;
+}
+
+/* Fetch the server's request trace and decode it, or save it for decode later */
+static int ddsnap_trace_dump(int serv_fd, u32 flags, char const *rawfile, int list)
+{
+	struct trace_dump_ok *reply;
+	int err, size, fd;
+
+	if ((err = outbead(serv_fd, TRACE_DUMP, struct trace_dump, flags))) {
+		warn("unable to send trace dump request: %s", strerror(-err));
+		return -1;
+	}
+	if ((size = expect(serv_fd, TRACE_DUMP_OK)) == -1) {
+		errprint("trace dump");
+		return -1;
+	}
+	if (!(reply = malloc(size))) {
+		warn("unable to allocate %u bytes for reply buffer", size);
+		return -1;
+	}
+	if ((err = readpipe(serv_fd, reply, size)) < 0) {
+		warn("received incomplete trace dump: %s", strerror(-err));
+		free(reply);
+		return -1;
+	}
+	if (!rawfile) {
+		err = trace_decode(reply, size, list);
+		free(reply);
+		return err;
+	}
+	if ((fd = open(rawfile, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR)) < 0) {
+		warn("unable to create %s: %s", rawfile, strerror(errno));
+		free(reply);
+		return -1;
+	}
+	if ((err = writepipe(fd, reply, size)) < 0)
+		warn("unable to write %s: %s", rawfile, strerror(-err));
+	close(fd);
+	free(reply);
+	return err < 0 ? -1 : 0;
+}
+
+static int ddsnap_trace_decode(char const *rawfile, int list)
+{
+	struct trace_dump_ok *dump;
+	struct stat stat;
+	int err, fd;
+
+	if ((fd = open(rawfile, O_RDONLY)) < 0 || fstat(fd, &stat) < 0) {
+		warn("unable to open %s: %s", rawfile, strerror(errno));
+		return -1;
+	}
+	if (!(dump = malloc(stat.st_size))) {
+		warn("unable to allocate %Lu bytes for trace dump", (unsigned long long)stat.st_size);
+		close(fd);
+		return -1;
+	}
+	if ((err = readpipe(fd, dump, stat.st_size)) < 0)
+		warn("unable to read %s: %s", rawfile, strerror(-err));
+	else
+		err = trace_decode(dump, stat.st_size, list);
+	close(fd);
+	free(dump);
+	return err;
+}
+
 static void mainUsage(void)
 {
 	printf("usage: ddsnap [-?|--help|--usage|--version] <subcommand>\n"
@@ -1938,6 +3047,9 @@ static void mainUsage(void)
 	       "	priority          Set the priority of a snapshot\n"
 	       "	usecount          Change the use count of a snapshot\n"
 	       "        status            Report snapshot usage statistics\n"
+	       "        compact           Rebuild the btree densely packed\n"
+	       "        stats             Report server counters and latencies\n"
+	       "        trace             Dump or decode the server's request trace\n"
 	       "	vol               \n"
                "        usage: ddsnap vol [-?|--help|--usage] <subcommand>\n"
                "\n"
@@ -1976,6 +3088,26 @@ static void cdUsage(poptContext optCon, int exitcode, char const *error, char co
 	exit(exitcode);
 }
 
+/*
+ * Pick the delta codecs: zlib unless a list is given, or every codec built
+ * in for best mode.  Level zero zlib only stores, so don't bother with it.
+ */
+static int setup_comp_opts(struct comp_opts *comp, char const *codec_str, int level, int best, int zstd_long)
+{
+	unsigned codec;
+
+	comp->level = level;
+	comp->flags = zstd_long ? CODEC_LONG : 0;
+	if (codec_str)
+		return (comp->codecs = codec_parse_list(codec_str)) ? 0 : -1;
+	comp->codecs = level ? CODEC_MASK(CODEC_ZLIB) : 0;
+	if (best)
+		for (codec = CODEC_ZLIB; codec < MAX_CODECS; codec++)
+			if (codec_available(codec))
+				comp->codecs |= CODEC_MASK(codec);
+	return 0;
+}
+
 #ifdef DDSNAP_MEM_MONITOR
 int mmon_interval = DDSNAP_MEM_MONITOR;
 #endif
@@ -1990,12 +3122,13 @@ int main(int argc, char *argv[])
 	};
 
 	char *js_str = NULL, *bs_str = NULL, *cs_str = NULL;
-	int yes = FALSE;
+	int yes = FALSE, snapshots = 0;
 	struct poptOption initOptions[] = {
 		{ "yes", 'y', POPT_ARG_NONE, &yes, 0, "Answer yes to all prompts", NULL},
 		{ "journalsize", 'j', POPT_ARG_STRING, &js_str, 0, "User specified journal size, i.e. 400k (default: 100 * chunk_size)", "size" },
 		{ "blocksize", 'b', POPT_ARG_STRING, &bs_str, 0, "Snapshot metadata block size (power of two, default = 4K)", "size" },
 		{ "chunksize", 'c', POPT_ARG_STRING, &cs_str, 0, "Snapshot store chunk size (power of two, default = 16K)", "size" },
+		{ "snapshots", 'n', POPT_ARG_INT, &snapshots, 0, "Most snapshots the store will hold (default = 64, at most 1023)", "count" },
 		POPT_TABLEEND
 	};
 
@@ -2003,9 +3136,9 @@ int main(int argc, char *argv[])
 	char const *logfile = NULL;
 	char const *pidfile = NULL;
 	char const *progress_file = NULL;
-	char const *resume = NULL;
+	char const *resume = NULL, *checkpoint_file = NULL;
 	char const *cachesize_str = NULL;
-	char const *ratelimit_str = NULL;
+	char const *ratelimit_str = NULL, *burst_str = NULL, *ratelimit_file = NULL;
 	struct poptOption serverOptions[] = {
 		{ "debug", 'D', POPT_ARG_NONE, &debug, 0, "turn on debugging checks", NULL }, // !!! should turn on debug logging too
 		{ "experimental", 'X', POPT_ARG_NONE, &experimental, 0, "use experimental optimizations", NULL },
@@ -2020,15 +3153,30 @@ int main(int argc, char *argv[])
 		POPT_TABLEEND
 	};
 
-	int xd = FALSE, raw = FALSE, best_comp = FALSE, gzip_level = DEF_GZIP_COMP;
+	int max_sessions = DEFAULT_DELTA_SESSIONS;
+	struct poptOption listenOptions[] = {
+		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &serverOptions, 0, NULL, NULL },
+		{ "sessions", 'n', POPT_ARG_INT, &max_sessions, 0, "Maximum number of concurrent replication sessions", "count" },
+		POPT_TABLEEND
+	};
+
+	int xd = FALSE, raw = FALSE, best_comp = FALSE, gzip_level = DEF_GZIP_COMP, zstd_long = FALSE, streams = 1;
+	char const *codec_str = NULL, *volume_name = NULL;
 	struct poptOption cdOptions[] = {
 		{ "xdelta", 'x', POPT_ARG_NONE, &xd, 0, "Delta file format: xdelta chunk", NULL },
 		{ "raw", 'r', POPT_ARG_NONE, &raw, 0, "Delta file format: raw chunk from later snapshot", NULL },
 		{ "best", 'b', POPT_ARG_NONE, &best_comp, 0, "Delta file format: best compression (slowest)", NULL},
-		{ "gzip", 'g', POPT_ARG_INT, &gzip_level, 0, "Compression via gzip", "compression_level"},
+		{ "gzip", 'g', POPT_ARG_INT, &gzip_level, 0, "Compression level (zlib unless --codec is given)", "compression_level"},
+		{ "codec", 'C', POPT_ARG_STRING, &codec_str, 0, "Compression codecs to try, smallest result wins (none, zlib, zstd, lz4)", "codec[,codec...]" },
+		{ "long", '\0', POPT_ARG_NONE, &zstd_long, 0, "Use zstd long range matching", NULL },
+		{ "name", 'n', POPT_ARG_STRING, &volume_name, 0, "Target volume name on a multivolume downstream listener", "volume" },
 		{ "progress", 'p', POPT_ARG_STRING, &progress_file, 0, "Output progress to specified file", NULL },
-		{ "resume", 's', POPT_ARG_STRING, &resume, 0, "Resume from specified address", NULL },
+		{ "resume", 's', POPT_ARG_STRING, &resume, 0, "Resume from specified address, or one address per stream", "addr[,addr...]" },
+		{ "checkpoint", 'k', POPT_ARG_STRING, &checkpoint_file, 0, "Keep a checkpoint of acknowledged progress in file, and resume from it", "file" },
+		{ "streams", 'S', POPT_ARG_INT, &streams, 0, "Number of parallel connections to send the delta over (default = 1)", "count" },
 		{ "ratelimit", 'l', POPT_ARG_STRING, &ratelimit_str, 0, "Rate limit to send delta to downstream (unit = bytes/s; default = 0, no limit)", "rate" },
+		{ "burst", 'B', POPT_ARG_STRING, &burst_str, 0, "Bytes that may be sent at once above the rate limit (default = 100ms worth)", "size" },
+		{ "ratelimit-file", 'L', POPT_ARG_STRING, &ratelimit_file, 0, "Read the rate limit from a file, again on SIGHUP or when it changes", "file" },
 		POPT_TABLEEND
 	};
 
@@ -2037,6 +3185,7 @@ int main(int argc, char *argv[])
 	int size = FALSE;
 	int state = FALSE;
 	int verb = FALSE;
+	int recompute = FALSE;
 	struct poptOption stOptions[] = {
 		{ "last", '\0', POPT_ARG_NONE, &last, 0, "List the newest snapshot", NULL},
 		{ "list", 'l', POPT_ARG_NONE, &list, 0, "List all active snapshots", NULL},
@@ -2044,6 +3193,7 @@ int main(int argc, char *argv[])
 		{ "state", 'S', POPT_ARG_NONE, &state, 0,
 			"Return the state of snapshot after exit. Output: 0: normal; 1: not exist; 2: squashed; 9: other error", NULL},
 		{ "verbose", 'v', POPT_ARG_NONE, &verb, 0, "Verbose sharing information", NULL},
+		{ "recompute", 'r', POPT_ARG_NONE, &recompute, 0, "Recount sharing information from the whole btree", NULL},
 		POPT_TABLEEND
 	};
 
@@ -2054,8 +3204,8 @@ int main(int argc, char *argv[])
 		  "Create delta\n\t Function: Create a delta file given a changelist and 2 snapshots\n\t Usage: delta create [OPTION...] <changelist> <deltafile> <devstem>\n", NULL },
 		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &noOptions, 0,
 		  "Apply delta\n\t Function: Apply a delta file to a volume\n\t Usage: delta apply <deltafile> <devstem>", NULL },
-		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &serverOptions, 0,
-		  "Listen\n\t Function: Listen for a delta arriving from upstream\n\t Usage: delta listen [OPTION...] <devstem> [<host>[:<port>]]", NULL },
+		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &listenOptions, 0,
+		  "Listen\n\t Function: Listen for deltas arriving from upstream, for one device or every volume in a directory\n\t Usage: delta listen [OPTION...] <devstem|directory> [<host>[:<port>]]", NULL },
 		POPT_TABLEEND
 	};
 
@@ -2067,6 +3217,29 @@ int main(int argc, char *argv[])
 		POPT_TABLEEND
 	};
 
+	int fill = 0, offline = FALSE;
+	struct poptOption compactOptions[] = {
+		{ "fill", 'f', POPT_ARG_INT, &fill, 0, "Percent of each btree block to fill (default = 100)", "percent" },
+		{ "offline", 'o', POPT_ARG_NONE, &offline, 0, "Compact a store whose server is not running, given its devices", NULL },
+		POPT_TABLEEND
+	};
+
+	int machine = FALSE, reset = FALSE;
+	struct poptOption statsOptions[] = {
+		{ "machine", 'm', POPT_ARG_NONE, &machine, 0, "Print one name and value per line, for scripts", NULL },
+		{ "reset", 'r', POPT_ARG_NONE, &reset, 0, "Start counting again once reported", NULL },
+		POPT_TABLEEND
+	};
+
+	char *rawfile = NULL;
+	int listing = FALSE, clear = FALSE;
+	struct poptOption traceOptions[] = {
+		{ "raw", 'r', POPT_ARG_STRING, &rawfile, 0, "Save the dump to a file to decode later", "file" },
+		{ "list", 'l', POPT_ARG_NONE, &listing, 0, "List each request before the breakdown", NULL },
+		{ "clear", 'c', POPT_ARG_NONE, &clear, 0, "Forget the requests once dumped", NULL },
+		POPT_TABLEEND
+	};
+
 	poptContext mainCon;
 	struct poptOption mainOptions[] = {
 		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &initOptions, 0,
@@ -2093,6 +3266,12 @@ int main(int argc, char *argv[])
 		  "Transmit\n\t Function: Stream delta of the given two snapshots to downstream\n\t Usage: transmit [OPTION...] <sockname> <host>[:<port>] [snapshot1] <snapshot2>", NULL},
 		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &resizeOptions, 0,
 		  "Resize\n\t Function: Change origin/snapshot/metadata device size\n\t Usage: resize [OPTION...] <sockname>", NULL },
+		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &compactOptions, 0,
+		  "Compact\n\t Function: Rebuild the btree densely packed and in key order\n\t Usage: compact [OPTION...] <sockname> | --offline <dev/snapshot> <dev/origin> [dev/meta]", NULL },
+		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &statsOptions, 0,
+		  "Server statistics\n\t Function: Report server counters and latency histograms\n\t Usage: stats [OPTION...] <sockname>", NULL },
+		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &traceOptions, 0,
+		  "Request trace\n\t Function: Break down the time of recent requests by phase\n\t Usage: trace [OPTION...] dump <sockname> | decode <file>", NULL },
 		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &noOptions, 0,
 		  "Revert to snapshot\n\t Function: Revert to a snapshot\n\t Usage: revert <sockname> <snapshot>", NULL },
 		{ "version", 'V', POPT_ARG_NONE, NULL, 0, "Show version", NULL },
@@ -2292,7 +3471,12 @@ int main(int argc, char *argv[])
 			}
 		}
 		trace_off(printf("js_bytes is %u, bs_bits is %u, and cs_bits is %u\n", js_bytes, bs_bits, cs_bits););
-		return init_snapstore(orgdev_, snapdev_, metadev_, bs_bits, cs_bits, js_bytes);
+		if (snapshots < 0 || snapshots >= MAX_SNAPSHOTS) {
+			poptPrintUsage(initCon, stderr, 0);
+			fprintf(stderr, "Invalid number of snapshots. Try 256\n");
+			exit(1);
+		}
+		return init_snapstore(orgdev_, snapdev_, metadev_, bs_bits, cs_bits, js_bytes, snapshots);
 	}
 	if (strcmp(command, "agent") == 0) {
 		char const *sockname;
@@ -2478,21 +3662,24 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 	if (strcmp(command, "delete") == 0) {
-		if (argc != 4) {
-			printf("Usage: %s delete <sockname> <snapshot>\n", argv[0]);
+		if (argc < 4 || argc - 3 > MAX_SNAPSHOTS) {
+			printf("Usage: %s delete <sockname> <snapshot> [<snapshot>...]\n", argv[0]);
 			return 1;
 		}
 
-		u32 snaptag;
+		u32 snaptags[MAX_SNAPSHOTS];
+		unsigned count = argc - 3, i;
 
-		if (parse_snaptag(argv[3], &snaptag) < 0) {
-			fprintf(stderr, "%s: invalid snapshot %s\n", argv[0], argv[3]);
-			return 1;
-		}
+		for (i = 0; i < count; i++)
+			if (parse_snaptag(argv[3 + i], &snaptags[i]) < 0) {
+				fprintf(stderr, "%s: invalid snapshot %s\n", argv[0], argv[3 + i]);
+				return 1;
+			}
 
 		int sock = create_socket(argv[2]);
 
-		int ret = delete_snapshot(sock, snaptag);
+		/* a single delete is still understood by older servers */
+		int ret = count == 1 ? delete_snapshot(sock, snaptags[0]) : delete_snapshots(sock, snaptags, count);
 		close(sock);
 		return ret;
 	}
@@ -2696,12 +3883,8 @@ int main(int argc, char *argv[])
 				snaptag = ~((u32)0U); /* meaning "all snapshots" */
 			}
 
-			int sock = create_socket(sockname);
-
-			int ret = ddsnap_get_status(sock, snaptag, verb);
-			close(sock);
-
-			return ret;
+			/* without the sharing table the server need not walk the btree */
+			return ddsnap_get_status(sockname, snaptag, verb, recompute ? STATUS_RECOMPUTE : verb ? 0 : STATUS_SUMMARY);
 		}
 	}
 	/* syntax for delta/volume replication: ddsnap transmit <socket> <host[:port]> [fromsnap] <tosnap> */
@@ -2738,14 +3921,40 @@ int main(int argc, char *argv[])
 		if (best_comp)
 			gzip_level = MAX_GZIP_COMP;
 
-		u64 start_addr = 0;
-		if (resume && (!sscanf(resume, "%Lu", &start_addr))) {
-			fprintf(stderr, "%s %s: Invalid resume position specified", argv[0], argv[1]);
+		struct comp_opts comp;
+		if (setup_comp_opts(&comp, codec_str, gzip_level, best_comp, zstd_long) < 0) {
+			fprintf(stderr, "%s %s: Unknown or unsupported codec in \"%s\"\n", argv[0], argv[1], codec_str);
 			poptPrintUsage(cdCon, stderr, 0);
 			poptFreeContext(cdCon);
 			return 1;
 		}
 
+		if (streams < 1 || streams > MAX_DELTA_STREAMS) {
+			fprintf(stderr, "%s %s: Number of streams must be between 1 and %i\n", argv[0], argv[1], MAX_DELTA_STREAMS);
+			poptPrintUsage(cdCon, stderr, 0);
+			poptFreeContext(cdCon);
+			return 1;
+		}
+
+		u64 start_addr[MAX_DELTA_STREAMS] = { 0 };
+		int resumes = 1;
+		if (resume) {
+			char const *next = resume;
+			char *end;
+
+			for (resumes = 0; resumes < MAX_DELTA_STREAMS; next = end + 1) {
+				start_addr[resumes++] = strtoull(next, &end, 10);
+				if (end == next || *end != ',')
+					break;
+			}
+			if (end == next || *end || (resumes != 1 && resumes != streams)) {
+				fprintf(stderr, "%s %s: Invalid resume position specified, give one address or one per stream\n", argv[0], argv[1]);
+				poptPrintUsage(cdCon, stderr, 0);
+				poptFreeContext(cdCon);
+				return 1;
+			}
+		}
+
 		u32 ratelimit = 0;
 		if (ratelimit_str && ((ratelimit = strtobytes(ratelimit_str)) == INPUT_ERROR)) {
 			fprintf(stderr, "Invalid rate limit input. Omit option, or use 0 for the default\n");
@@ -2753,6 +3962,17 @@ int main(int argc, char *argv[])
 			poptFreeContext(cdCon);
 			return 1;
 		}
+
+		struct ratelimit rl = { .file = ratelimit_file };
+		if (burst_str && ((rl.burst = strtobytes(burst_str)) == INPUT_ERROR)) {
+			fprintf(stderr, "Invalid burst size input. Omit option, or use 0 for the default\n");
+			poptPrintUsage(cdCon, stderr, 0);
+			poptFreeContext(cdCon);
+			return 1;
+		}
+		ratelimit_set(&rl, ratelimit, 1);
+		ratelimit_reread = 1;
+		ratelimit_check(&rl, usec_now());
 		trace_off(fprintf(stderr, "xd=%d raw=%d best_comp=%d mode=%u gzip_level=%d\n", xd, raw, best_comp, mode, gzip_level););
 
 		char const *sockname, *snaptag1str, *snaptag2str, *hoststr;
@@ -2786,7 +4006,6 @@ int main(int argc, char *argv[])
 			free(hostname);
 			return 1;
 		}
-		free(hostname);
 
 		u32 snaptag1, snaptag2;
 		/* the fromsnap is optional. in case a single snap is specified, set src_snap to -1
@@ -2810,6 +4029,11 @@ int main(int argc, char *argv[])
 		if (sigaction(SIGPIPE, &ign_sa, NULL) == -1)
 			warn("could not disable SIGPIPE: %s", strerror(errno));
 
+		struct sigaction hup_sa = { .sa_handler = ratelimit_sighup, .sa_flags = SA_RESTART };
+		sigemptyset(&hup_sa.sa_mask);
+		if (sigaction(SIGHUP, &hup_sa, NULL) == -1)
+			warn("could not set up SIGHUP for rate limit changes: %s", strerror(errno));
+
 		int ret;
 		char *volume = strrchr(sockname, '/');
 		if (!volume) {
@@ -2823,10 +4047,11 @@ int main(int argc, char *argv[])
 				ret = 1;
 			} else {
 				sprintf(devstem, "%s%s", DEVMAP_PATH, volume);
-				ret = ddsnap_replication_send(sock, snaptag1, snaptag2, devstem, mode, gzip_level, ds_fd, progress_file, start_addr, ratelimit);
+				ret = ddsnap_replication_send(sock, snaptag1, snaptag2, devstem, volume_name, mode, &comp, ds_fd, hostname, port, streams, progress_file, start_addr, resumes, &rl, checkpoint_file);
 				free(devstem);
 			}
 		}
+		free(hostname);
 		close(ds_fd);
 		close(sock);
 
@@ -2928,6 +4153,14 @@ int main(int argc, char *argv[])
 			if (best_comp)
 				gzip_level = MAX_GZIP_COMP;
 
+			struct comp_opts comp;
+			if (setup_comp_opts(&comp, codec_str, gzip_level, best_comp, zstd_long) < 0) {
+				fprintf(stderr, "%s %s: Unknown or unsupported codec in \"%s\"\n", argv[0], argv[1], codec_str);
+				poptPrintUsage(cdCon, stderr, 0);
+				poptFreeContext(cdCon);
+				return 1;
+			}
+
 			trace_off(fprintf(stderr, "xd=%d raw=%d best_comp=%d mode=%u gzip_level=%d\n", xd, raw, best_comp, mode, gzip_level););
 
 			char const *changelist, *deltafile, *devstem;
@@ -2945,7 +4178,7 @@ int main(int argc, char *argv[])
 			if (poptPeekArg(cdCon) != NULL)
 				cdUsage(cdCon, 1, "Too many arguments inputted", "\n");
 
-			int ret = ddsnap_generate_delta(mode, gzip_level, changelist, deltafile, devstem);
+			int ret = ddsnap_generate_delta(mode, &comp, changelist, deltafile, devstem);
 
 			poptFreeContext(cdCon);
 			return ret;
@@ -2962,13 +4195,13 @@ int main(int argc, char *argv[])
 			char const *hostspec;
 
 			struct poptOption options[] = {
-				{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &serverOptions, 0, NULL, NULL },
+				{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &listenOptions, 0, NULL, NULL },
 				POPT_AUTOHELP
 				POPT_TABLEEND
 			};
 
 			poptContext dsCon = poptGetContext(NULL, argc-2, (const char **)&(argv[2]), options, 0);
-			poptSetOtherOptionHelp(dsCon, "<devstem> <host>[:<port>]");
+			poptSetOtherOptionHelp(dsCon, "<devstem|directory> <host>[:<port>]");
 
 			char dsOpt = poptGetNextOpt(dsCon);
 
@@ -2988,6 +4221,13 @@ int main(int argc, char *argv[])
 
 			hostspec = poptGetArg(dsCon);
 
+			if (max_sessions < 1) {
+				fprintf(stderr, "%s %s: need at least one session\n", command, subcommand);
+				poptPrintUsage(dsCon, stderr, 0);
+				poptFreeContext(dsCon);
+				return 1;
+			}
+
 			if (poptPeekArg(dsCon) != NULL) {
 				fprintf(stderr, "%s %s: only one host may be specified\n", command, subcommand);
 				poptPrintUsage(dsCon, stderr, 0);
@@ -3034,7 +4274,9 @@ int main(int argc, char *argv[])
 			free(hostname);
 
 			int getsigfd;
-			if (!nobg) {
+			if (nobg)
+				setup_signals(&getsigfd);
+			else {
 				pid_t pid;
 
 				if (!logfile)
@@ -3050,7 +4292,7 @@ int main(int argc, char *argv[])
 			}
 
 			return ddsnap_delta_server(sock, devstem, progress_file,
-				logfile, getsigfd);
+				logfile, getsigfd, max_sessions);
 		}
 
 		fprintf(stderr, "%s %s: unrecognized delta subcommand: %s.\n", argv[0], command, subcommand);
@@ -3099,6 +4341,122 @@ int main(int argc, char *argv[])
 
 		return ret;
 	}
+	if (strcmp(command, "compact") == 0) {
+		struct poptOption options[] = {
+			{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &compactOptions, 0, NULL, NULL },
+			POPT_AUTOHELP
+			POPT_TABLEEND
+		};
+
+		poptContext cdCon = poptGetContext(NULL, argc-1, (const char **)&(argv[1]), options, 0);
+		poptSetOtherOptionHelp(cdCon, "<server_socket> | --offline <dev/snapshot> <dev/origin> [dev/meta]");
+
+		char cdOpt = poptGetNextOpt(cdCon);
+		if (cdOpt < -1) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], poptBadOption(cdCon, POPT_BADOPTION_NOALIAS), poptStrerror(cdOpt));
+			poptFreeContext(cdCon);
+			return 1;
+		}
+		if (fill < 0 || fill > 100)
+			cdUsage(cdCon, 1, argv[0], "Fill must be a percentage\n");
+
+		if (offline) {
+			char const *snapdev = poptGetArg(cdCon), *origdev = poptGetArg(cdCon), *metadev = poptGetArg(cdCon);
+			if (!snapdev || !origdev)
+				cdUsage(cdCon, 1, argv[0], "Must specify snapshot and origin devices to compact\n");
+			if (poptPeekArg(cdCon) != NULL)
+				cdUsage(cdCon, 1, argv[0], "Too many arguments to compact\n");
+
+			int orgdev_, snapdev_, metadev_;
+			if ((snapdev_ = open(snapdev, O_RDWR | O_DIRECT)) == -1)
+				error("Could not open snapshot store %s: %s", snapdev, strerror(errno));
+			if ((orgdev_ = open(origdev, O_RDONLY | O_DIRECT)) == -1)
+				error("Could not open origin volume %s: %s", origdev, strerror(errno));
+			metadev_ = snapdev_;
+			if (metadev && !is_same_device(snapdev, metadev) && (metadev_ = open(metadev, O_RDWR | O_DIRECT)) == -1)
+				error("Could not open meta volume %s: %s", metadev, strerror(errno));
+			poptFreeContext(cdCon);
+			return compact_snapstore(orgdev_, snapdev_, metadev_, fill) < 0;
+		}
+
+		const char *sockname = poptGetArg(cdCon);
+		if (sockname == NULL)
+			cdUsage(cdCon, 1, argv[0], "Must specify socket name to compact\n");
+		if (poptPeekArg(cdCon) != NULL)
+			cdUsage(cdCon, 1, argv[0], "Too many arguments to compact\n");
+
+		poptFreeContext(cdCon);
+
+		int sock = create_socket(sockname);
+
+		return ddsnap_compact_tree(sock, fill) < 0;
+	}
+	if (strcmp(command, "stats") == 0) {
+		struct poptOption options[] = {
+			{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &statsOptions, 0, NULL, NULL },
+			POPT_AUTOHELP
+			POPT_TABLEEND
+		};
+
+		poptContext cdCon = poptGetContext(NULL, argc-1, (const char **)&(argv[1]), options, 0);
+		poptSetOtherOptionHelp(cdCon, "<server_socket>");
+
+		char cdOpt = poptGetNextOpt(cdCon);
+		if (cdOpt < -1) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], poptBadOption(cdCon, POPT_BADOPTION_NOALIAS), poptStrerror(cdOpt));
+			poptFreeContext(cdCon);
+			return 1;
+		}
+
+		const char *sockname = poptGetArg(cdCon);
+		if (sockname == NULL)
+			cdUsage(cdCon, 1, argv[0], "Must specify socket name to stats\n");
+		if (poptPeekArg(cdCon) != NULL)
+			cdUsage(cdCon, 1, argv[0], "Too many arguments to stats\n");
+
+		poptFreeContext(cdCon);
+
+		int sock = create_socket(sockname);
+
+		return ddsnap_get_stats(sock, reset ? STATS_RESET : 0, machine) < 0;
+	}
+	if (strcmp(command, "trace") == 0) {
+		struct poptOption options[] = {
+			{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &traceOptions, 0, NULL, NULL },
+			POPT_AUTOHELP
+			POPT_TABLEEND
+		};
+
+		poptContext cdCon = poptGetContext(NULL, argc-1, (const char **)&(argv[1]), options, 0);
+		poptSetOtherOptionHelp(cdCon, "dump <server_socket> | decode <file>");
+
+		char cdOpt = poptGetNextOpt(cdCon);
+		if (cdOpt < -1) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], poptBadOption(cdCon, POPT_BADOPTION_NOALIAS), poptStrerror(cdOpt));
+			poptFreeContext(cdCon);
+			return 1;
+		}
+
+		const char *subcommand = poptGetArg(cdCon);
+		const char *name = poptGetArg(cdCon);
+		if (subcommand == NULL || (strcmp(subcommand, "dump") && strcmp(subcommand, "decode")))
+			cdUsage(cdCon, 1, argv[0], "Must specify dump or decode to trace\n");
+		if (name == NULL)
+			cdUsage(cdCon, 1, argv[0], strcmp(subcommand, "dump") ? "Must specify file to decode\n" : "Must specify socket name to dump\n");
+		if (poptPeekArg(cdCon) != NULL)
+			cdUsage(cdCon, 1, argv[0], "Too many arguments to trace\n");
+		if (strcmp(subcommand, "dump") && (rawfile || clear))
+			cdUsage(cdCon, 1, argv[0], "--raw and --clear are for dump\n");
+
+		poptFreeContext(cdCon);
+
+		if (strcmp(subcommand, "decode") == 0)
+			return ddsnap_trace_decode(name, listing) < 0;
+
+		int sock = create_socket(name);
+
+		return ddsnap_trace_dump(sock, clear ? TRACE_CLEAR : 0, rawfile, listing) < 0;
+	}
 	/* syntax for snapshot revert: ddsnap revert <socket> <snap> */
 	if (strcmp(command, "revert") == 0) {
 		u32 snaptag;
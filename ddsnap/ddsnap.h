@@ -63,8 +63,8 @@ struct server { struct server_head { u8 type; u8 length; } header; char *address
 #define HOST_NAME_MAX 256
 #endif
 
-#define MAX_SNAPSHOTS 64
-#define SNAPSHOT_SQUASHED MAX_SNAPSHOTS
+#define MAX_SNAPSHOTS 1024 /* in a store initialized with wide share masks, else 64 */
+#define SNAPSHOT_SQUASHED 64 /* the bit of a squashed snapshot, never given to a live one */
 
 struct change_list
 {
@@ -88,7 +88,9 @@ int sniff_snapstore(int metadev);
 
 int init_snapstore(
 	int orgdev, int snapdev, int metadev,
-	unsigned bs_bits, unsigned cs_bits, unsigned js_bytes);
+	unsigned bs_bits, unsigned cs_bits, unsigned js_bytes, unsigned snapshots);
+
+int compact_snapstore(int orgdev, int snapdev, int metadev, unsigned fill);
 
 int start_server(
 	int orgdev, int snapdev, int metadev, 
@@ -33,6 +33,8 @@
 #include <popt.h>
 #include <sys/prctl.h>
 #include <sys/sysinfo.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include "dm-ddsnap.h"
 #include "buffer.h"
 #include "daemonize.h"
@@ -50,14 +52,19 @@
 #define SB_SECTOR 8			/* Sector where superblock lives.     */
 #define SB_SECTORS 8			/* Size of ddsnap super block in sectors */
 #define SB_MAGIC { 't', 'e', 's', 't', 0xdd, 0x07, 0x06, 0x04 } /* date of latest incompatible sb format */
+#define SB_MAGIC_WIDE { 't', 'e', 's', 't', 0xdd, 0x26, 0x10, 0x17 } /* the same with wide share masks */
 /*
  * Snapshot store format revision history
  * !!! always update this for every incompatible change !!!
  *
  * 2007-04-05: SB magic added and enforced
  * 2007-06-04: SB journal commit block used fields replaced by free
+ * 2026-10-17: stores for more than 64 snapshots, with their own magic
  */
 
+#define SB_SNAPSHOTS 64 /* snapshots with a place in the superblock */
+#define MAX_SHARE_WORDS (MAX_SNAPSHOTS / 64)
+
 #define DDSNAPD_CLIENT_ERROR -1
 #define DDSNAPD_AGENT_ERROR -2
 #define DDSNAPD_CAUGHT_SIGNAL -3
@@ -69,7 +76,14 @@
 #define PR_SET_LESS_THROTTLE 23
 #define PR_SET_MEMALLOC	24
 #define MAX_NEW_METACHUNKS 10
-#define MAX_DEFERRED_ALLOCS 500
+#define MAX_LEAF_SPLITS 2 /* extra leaf splits to fit one exception */
+#define MAX_COMMIT_ALLOCS 16 /* deferred allocation ranges per transaction */
+#define MAX_BTREE_DIRTY	10 // max dirty buffers generated in a btree operation, depends on how bushy the btree is
+#define DELETE_STEP_LEAVES 16 /* btree leaves per step of a background delete */
+#define RECOUNT_STEP_LEAVES 64 /* btree leaves per step of a background space count */
+#define WRITEBACK_STEP_BLOCKS 256 /* journaled buffers written home per idle step */
+#define WRITEBACK_IDLE_MS 100 /* quiet time before journaled buffers are written home */
+#define AUTO_DELETE_VICTIMS 8 /* most snapshots released by one auto delete */
 
 #ifndef trace
 #define trace trace_off
@@ -92,8 +106,8 @@ BTree
 
 Allocation bitmaps
   + allocation statistics
-  - Per-snapshot free space as full-tree pass
-  - option to track specific snapshot(s) on the fly
+  + Per-snapshot free space as full-tree pass
+  + option to track specific snapshot(s) on the fly
   \ return stats to client (on demand? always?)
   * Bitmap block radix tree - resizing
   - allocation policy
@@ -137,7 +151,7 @@ Failover
   \ Mark superblock active/inactive
   + upload client locks on server restart
   + release snapshot read locks for dead client
-  - Examine entire tree to initialize statistics after unsaved halt
+  + Examine entire tree to initialize statistics after unsaved halt
 
 General
   \ Prevent multiple server starts on same snapshot store
@@ -162,27 +176,50 @@ Cluster integration
  * Snapshot btree
  */
 
+/*
+ * An index node maps the chunks of its range to the nodes or leaves below
+ * it, each child taking those from its key up to the next child's.  Since
+ * version 1 a node keeps the keys apart from the child sectors, the keys in
+ * the first half of the block and the sectors in the second, so a search
+ * reads keys alone, eight to a cache line.  The first child needs no key,
+ * and the count and version take its place.  A version 0 node holds each
+ * key beside its sector after the header; read_node() rearranges it.
+ */
+#define NODE_VERSION 1
+
 struct enode
 {
 	u32 count;
-	u32 unused;
-	struct index_entry
-	{
-		u64 key; // note: entries[0].key never accessed
-		sector_t sector; // node sector address goes here
-	} entries[];
+	u32 version;
 };
 
+/*
+ * A leaf maps logical chunks to lists of exceptions.  Since version 1 a map
+ * entry may stand for a run of consecutive logical chunks whose exceptions
+ * are consecutive too, each exception in its list giving the share mask and
+ * the exception of the first chunk in the run.  The run length less one is
+ * kept in the high bits of the offset, so a version 0 leaf, with all runs
+ * of one chunk, reads the same.
+ *
+ * The share masks of a store for more than 64 snapshots take share_words
+ * 64 bit words, zero in the leaves of any other.
+ */
+#define LEAF_VERSION 1
+#define LEAF_OFFSET_BITS 24
+#define LEAF_OFFSET_MASK ((1 << LEAF_OFFSET_BITS) - 1)
+#define MAX_LEAF_RUN (1 << (32 - LEAF_OFFSET_BITS))
+
 struct eleaf
 {
 	le_u16 magic;
 	le_u16 version;
 	le_u32 count;
 	le_u64 base_chunk; // !!! FIXME the code doesn't use the base_chunk properly
-	le_u64 using_mask;
+	le_u32 share_words;
+	le_u32 unused;
 	struct etree_map
 	{
-		le_u32 offset;
+		le_u32 offset; // and run length - 1 above LEAF_OFFSET_BITS
 		le_u32 rchunk;
 	}
 	map[];
@@ -193,23 +230,157 @@ static inline struct enode *buffer2node(struct buffer *buffer)
 	return (struct enode *)buffer->data;
 }
 
+/* the key of child i, for i from 1 */
+static inline u64 *node_keys(struct enode *node)
+{
+	return (u64 *)node;
+}
+
 static inline struct eleaf *buffer2leaf(struct buffer *buffer)
 {
 	return (struct eleaf *)buffer->data;
 }
 
+/*
+ * An exception is the share mask, one bit for each snapshot using it, then
+ * the chunk it was copied out to.  With wide share masks the fields are not
+ * where this says, see ex_share() and ex_chunk().
+ */
 struct exception
 {
 	le_u64 share;
 	le_u64 chunk;
 };
 
+static inline unsigned share_words(struct eleaf *leaf)
+{
+	return leaf->share_words ? leaf->share_words : 1;
+}
+
+static inline u64 *ex_share(struct exception *p)
+{
+	return &p->share;
+}
+
+static inline u64 *ex_chunk(struct exception *p, unsigned words)
+{
+	return (u64 *)p + words;
+}
+
+static inline struct exception *ex_next(struct exception *p, unsigned words)
+{
+	return (struct exception *)((u64 *)p + words + 1);
+}
+
+static inline unsigned ex_size(unsigned words)
+{
+	return (words + 1) * sizeof(u64);
+}
+
+/*
+ * Share masks
+ */
+
+struct sharemask { u64 word[MAX_SHARE_WORDS]; };
+
+static inline int mask_test(u64 const *mask, unsigned bit)
+{
+	return mask[bit >> 6] >> (bit & 63) & 1;
+}
+
+static inline void mask_set(u64 *mask, unsigned bit)
+{
+	mask[bit >> 6] |= 1ULL << (bit & 63);
+}
+
+static inline void mask_clear(u64 *mask, unsigned bit)
+{
+	mask[bit >> 6] &= ~(1ULL << (bit & 63));
+}
+
+static inline int mask_empty(u64 const *mask, unsigned words)
+{
+	for (unsigned i = 0; i < words; i++)
+		if (mask[i])
+			return 0;
+	return 1;
+}
+
+static inline int mask_equal(u64 const *a, u64 const *b, unsigned words)
+{
+	for (unsigned i = 0; i < words; i++)
+		if (a[i] != b[i])
+			return 0;
+	return 1;
+}
+
+static inline int mask_intersects(u64 const *a, u64 const *b, unsigned words)
+{
+	for (unsigned i = 0; i < words; i++)
+		if (a[i] & b[i])
+			return 1;
+	return 0;
+}
+
+/* all the bits of b set in a? */
+static inline int mask_covers(u64 const *a, u64 const *b, unsigned words)
+{
+	for (unsigned i = 0; i < words; i++)
+		if (b[i] & ~a[i])
+			return 0;
+	return 1;
+}
+
+static inline void mask_or(u64 *a, u64 const *b, unsigned words)
+{
+	for (unsigned i = 0; i < words; i++)
+		a[i] |= b[i];
+}
+
+static inline void mask_andnot(u64 *a, u64 const *b, unsigned words)
+{
+	for (unsigned i = 0; i < words; i++)
+		a[i] &= ~b[i];
+}
+
+static inline unsigned mask_weight(u64 const *mask, unsigned words)
+{
+	unsigned weight = 0;
+	for (unsigned i = 0; i < words; i++)
+		weight += __builtin_popcountll(mask[i]);
+	return weight;
+}
+
+static inline unsigned map_offset(struct etree_map *map)
+{
+	return map->offset & LEAF_OFFSET_MASK;
+}
+
+static inline unsigned map_run(struct etree_map *map)
+{
+	return (map->offset >> LEAF_OFFSET_BITS) + 1;
+}
+
+static inline void set_map_offset(struct etree_map *map, unsigned offset)
+{
+	map->offset = (map->offset & ~LEAF_OFFSET_MASK) | offset;
+}
+
+static inline void set_map_run(struct etree_map *map, unsigned run)
+{
+	map->offset = map_offset(map) | (run - 1) << LEAF_OFFSET_BITS;
+}
+
 static inline struct exception *emap(struct eleaf *leaf, unsigned i)
 {
-	return	(struct exception *)((char *) leaf + leaf->map[i].offset);
+	return	(struct exception *)((char *) leaf + map_offset(&leaf->map[i]));
 }
 
-enum sbflags { SB_BUSY = 2 };
+enum sbflags {
+	SB_BUSY = 2,
+	SB_COUNTED = 4, /* exceptions and space below are up to date */
+	SB_RESIZING = 8, /* a bitmap is being moved, see relocation below */
+};
 
 struct disksuper
 {
@@ -218,7 +389,7 @@ struct disksuper
 	sector_t etree_root;		/* The b-tree root node sector.       */
 	sector_t orgoffset, orgsectors;
 	u64 flags;
-	u64 deleting;
+	u64 deleting; /* bits of deleted snapshots still in the btree */
 	struct snapshot
 	{
 		u32 ctime; // upper 32 bits are in super create_time
@@ -226,8 +397,9 @@ struct disksuper
 		u16 usecount; // persistent use count on snapshot device
 		u8 bit;    // internal snapshot number, not derived from tag
 		s8 prio;   // 0=normal, 127=highest, -128=lowest
+		u8 bithigh; // above the eight bits of bit, with wide share masks
 		u64 sectors; // sectors of the snapshot
-	} snaplist[MAX_SNAPSHOTS]; // entries are contiguous, in creation order
+	} snaplist[SB_SNAPSHOTS]; // entries are contiguous, in creation order
 	u32 snapshots;
 	u32 etree_levels;
 	s32 journal_base;		/* Sector offset of start of journal. */
@@ -243,6 +415,30 @@ struct disksuper
 		u64      bitmap_blocks;	/* Num blocks in allocation bitmap.   */
 		u32      allocsize_bits; /* Bits of number of bytes in chunk. */
 	} metadata, snapdata;
+	chunk_t delete_resume; /* Where the delete walk picks up, only valid if deleting. */
+	u64 exceptions; /* exceptions in the btree */
+	struct snapspace
+	{
+		u64 unique; /* exceptions only this snapshot has, freed by deleting it */
+		u64 shared; /* exceptions shared with other snapshots */
+	} space[SB_SNAPSHOTS]; /* by snapshot bit */
+	struct relocation
+	{
+		u64 chunks; /* size the space grows to once moved, zero if not moving */
+		u64 base; /* sector of the bitmap in its new place */
+		u32 blocks; /* bitmap blocks in the new place */
+		u32 done; /* blocks moved or cleared there so far */
+	} relocation[2]; /* metadata, snapdata, only valid if SB_RESIZING */
+	u32 share_words; /* words of each share mask, zero for one */
+	u32 snaptable_blocks;
+	sector_t snaptable; /* with wide share masks, where the snapshot list, space and deleting go instead */
+	struct compaction
+	{
+		u64 base; /* first chunk of the rebuilt tree */
+		u64 chunks; /* chunks reserved for it, zero if not compacting */
+		sector_t old_root; /* tree it replaced, still to be freed, zero until swapped in */
+		u32 old_levels;
+	} compaction;
 };
 
 struct allocspace { // everything bogus here!!!
@@ -261,8 +457,9 @@ struct allocspace { // everything bogus here!!!
  * write request can be acknowledged.
  *
  * The deferred allocation optimization avoids updating bitmaps at the time
- * a block is allocated, by remembering up to one contiguous range of block
- * allocations per journal commit block.  Eventually, before the journal
+ * a block is allocated, by remembering up to MAX_COMMIT_ALLOCS contiguous
+ * ranges of block allocations per journal commit block, each within one
+ * bitmap block.  Eventually, before the journal
  * wraps (fuzzy definition alert!!!) all the deferred allocations are actually
  * written to the bitmaps and the bitmaps are updated in a single journal
  * transaction, called a "barrier".  This never requires more total writes and
@@ -278,12 +475,30 @@ struct allocspace { // everything bogus here!!!
  * not work well except for cyclic allocation, which is a bad idea in the long
  * run.  Just for now...)
  *
- * Note!!!  Does not work for separate data/metadata yet.  Need to think
- * about how to make that work.  Simply disable the optimization in the
- * separate case for now.
+ * With separate data and metadata stores each allocation space defers its
+ * own allocations, in its own bitmap, but a barrier flushes both.
  */
 
-struct alloc_range { u64 chunk; u32 barrier:1, count:31; u32 pad; };
+struct alloc_range { u64 chunk; u32 barrier:1, count:31; u32 more; /* in a commit block, commit_ranges at its end */ };
+
+/* Further deferred allocations stored at the end of a commit block */
+struct commit_range { u64 chunk; u32 count; u32 snapdata; };
+
+struct deferred {
+	struct alloc_range *range; // committed deferred allocations, sorted and disjoint
+	unsigned count, size, blocks; // ranges, room for ranges, bitmap blocks they touch
+	struct alloc_range pending[MAX_COMMIT_ALLOCS]; // allocations deferred in this transaction
+	unsigned pendings;
+};
+
+/*
+ * The path of the last probe, kept so the next, most often for a nearby
+ * chunk, can start below the root, see probe().  Each level has the node or
+ * leaf there, the range of chunks it maps and the next index entry taken.
+ */
+#define FINGER_LEVELS 16
+
+struct finger { struct buffer *buffer; sector_t sector; chunk_t start, limit; unsigned next; };
 
 struct superblock
 {
@@ -293,7 +508,12 @@ struct superblock
 	char bogopad[4096 - sizeof(struct disksuper) - 2*sizeof(struct allocspace) ];
 
 	/* Derived, not saved to disk */
-	u64 snapmask; // bitmask of all valid snapshots
+	struct sharemask snapmask; // bitmask of all valid snapshots
+	unsigned share_words; // in each share mask, one unless wide
+	struct snapshot *snaplist; // in the superblock, or the snapshot table if wide
+	struct snapspace *space; // likewise
+	u64 *deleting; // likewise
+	char *snaptable; // with wide share masks
 	unsigned runflags;
 	unsigned snapdev, metadev, orgdev;
 	unsigned snaplock_hash_bits;
@@ -301,15 +521,34 @@ struct superblock
 	unsigned copybuf_size;
 	char *copybuf;
 	chunk_t source_chunk, dest_exception;
-	unsigned copy_chunks, deferred_allocs;
+	unsigned copy_chunks;
+	unsigned journal_since_barrier; // journal blocks written since the last barrier commit
 	unsigned max_commit_blocks; // physical addresses that fit in a commit block
-	u16 usecount[MAX_SNAPSHOTS]; // transient usecount for connected devices
-	struct alloc_range deferred_alloc[MAX_DEFERRED_ALLOCS], defer;
+	u16 usecount[MAX_SNAPSHOTS]; // transient usecount for connected devices, by bit
+	struct deferred deferred[2]; // metadata, snapdata, see deferred()
+	u64 *sharing; // exceptions per snapshot bit and share count, once counted
+	struct status_tree fill; // btree fill, counted along with sharing
+	chunk_t recount_next; // space is counted below this chunk until SB_COUNTED
+	unsigned finger_levels; // btree levels when the finger was taken, zero if none
+	struct finger finger[FINGER_LEVELS + 1]; // last probe path, buffers not held
 };
 
 static int valid_sb(struct superblock *sb)
 {
-	return !memcmp(sb->image.magic, (char[])SB_MAGIC, sizeof(sb->image.magic));
+	return !memcmp(sb->image.magic, (char[])SB_MAGIC, sizeof(sb->image.magic)) ||
+		!memcmp(sb->image.magic, (char[])SB_MAGIC_WIDE, sizeof(sb->image.magic));
+}
+
+/* snapshots the store can hold, one bit is never used as it marks squashed ones */
+static inline unsigned max_snapshots(struct superblock *sb)
+{
+	return sb->share_words == 1 ? SB_SNAPSHOTS : 64 * sb->share_words - 1;
+}
+
+/* a wide store keeps its deleting mask, space by bit, then snapshot list in a table */
+static inline unsigned snaptable_bytes(unsigned share_words)
+{
+	return share_words * (sizeof(u64) + 64 * (sizeof(struct snapspace) + sizeof(struct snapshot)));
 }
 
 static inline int combined(struct superblock *sb)
@@ -337,6 +576,203 @@ static int deferring(struct superblock *sb)
 	return !!(sb->runflags & RUN_DEFER);
 }
 
+/*
+ * Count an exception with the given share mask in a sharing table, by the
+ * bits set and how many other snapshots share it.  The table has a row for
+ * each bit of the share mask with a column for each bit.
+ */
+static inline void count_sharing(u64 *table, u64 const *share, unsigned words, int n)
+{
+	unsigned others = mask_weight(share, words) - 1;
+
+	for (unsigned i = 0; i < words; i++)
+		for (u64 word = share[i]; word; word &= word - 1)
+			table[64 * words * (64 * i + __builtin_ctzll(word)) + others] += n;
+}
+
+/*
+ * Count an exception with the given share mask as unique to or shared by
+ * each snapshot in it.
+ */
+static inline void count_space(struct superblock *sb, u64 const *share, int n)
+{
+	unsigned words = sb->share_words, weight = mask_weight(share, words);
+
+	if (weight)
+		sb->image.exceptions += n;
+	for (unsigned i = 0; i < words; i++)
+		for (u64 word = share[i]; word; word &= word - 1) {
+			struct snapspace *space = &sb->space[64 * i + __builtin_ctzll(word)];
+			if (weight > 1)
+				space->shared += n;
+			else
+				space->unique += n;
+		}
+}
+
+/*
+ * Keep the space counts and sharing table up to date as the exceptions of a
+ * run of chunks change share mask, from none for new ones or to none for ones
+ * freed.  While the space is counted in the background only chunks the count
+ * has passed are kept up to date, the rest are counted when it gets there.
+ */
+static inline void update_sharing(struct superblock *sb, chunk_t chunk, unsigned run, u64 const *from, u64 const *to)
+{
+	unsigned counted = run;
+
+	if (!(sb->image.flags & SB_COUNTED))
+		counted = chunk >= sb->recount_next ? 0 : chunk + run <= sb->recount_next ? run : sb->recount_next - chunk;
+	if (counted) {
+		if (from)
+			count_space(sb, from, -counted);
+		if (to)
+			count_space(sb, to, counted);
+	}
+	if (!sb->sharing)
+		return;
+	if (from)
+		count_sharing(sb->sharing, from, sb->share_words, -run);
+	if (to)
+		count_sharing(sb->sharing, to, sb->share_words, run);
+}
+
+/*
+ * Server metrics, reported by STATS.  Each event costs a few adds, and a
+ * timed one two clock reads, next to the disk IO or socket message it
+ * stands for.
+ */
+
+#define CODE_NAME(code) [code - PROTOCOL_ERROR] = #code
+
+static char const *const code_names[] = {
+	CODE_NAME(PROTOCOL_ERROR), CODE_NAME(IDENTIFY), CODE_NAME(IDENTIFY_OK), CODE_NAME(IDENTIFY_ERROR),
+	CODE_NAME(QUERY_WRITE), CODE_NAME(ORIGIN_WRITE_OK), CODE_NAME(ORIGIN_WRITE_ERROR),
+	CODE_NAME(SNAPSHOT_WRITE_OK), CODE_NAME(SNAPSHOT_WRITE_ERROR), CODE_NAME(QUERY_SNAPSHOT_READ),
+	CODE_NAME(SNAPSHOT_READ_OK), CODE_NAME(SNAPSHOT_READ_ERROR), CODE_NAME(SNAPSHOT_READ_ORIGIN_OK),
+	CODE_NAME(SNAPSHOT_READ_ORIGIN_ERROR), CODE_NAME(FINISH_SNAPSHOT_READ), CODE_NAME(GENERIC_ERROR),
+	CODE_NAME(CREATE_SNAPSHOT), CODE_NAME(CREATE_SNAPSHOT_OK), CODE_NAME(DELETE_SNAPSHOT),
+	CODE_NAME(DELETE_SNAPSHOT_OK), CODE_NAME(DUMP_TREE_RANGE), CODE_NAME(INITIALIZE_SNAPSTORE),
+	CODE_NAME(NEED_SERVER), CODE_NAME(CONNECT_SERVER), CODE_NAME(CONNECT_SERVER_OK),
+	CODE_NAME(CONNECT_SERVER_ERROR), CODE_NAME(CONTROL_SOCKET), CODE_NAME(SERVER_READY),
+	CODE_NAME(START_SERVER), CODE_NAME(SHUTDOWN_SERVER), CODE_NAME(SET_IDENTITY), CODE_NAME(UPLOAD_LOCK),
+	CODE_NAME(FINISH_UPLOAD_LOCK), CODE_NAME(NEED_CLIENTS), CODE_NAME(UPLOAD_CLIENT_ID),
+	CODE_NAME(FINISH_UPLOAD_CLIENT_ID), CODE_NAME(REMOVE_CLIENT_IDS), CODE_NAME(LIST_SNAPSHOTS),
+	CODE_NAME(SNAPSHOT_LIST), CODE_NAME(PRIORITY), CODE_NAME(PRIORITY_OK), CODE_NAME(USECOUNT),
+	CODE_NAME(USECOUNT_OK), CODE_NAME(STREAM_CHANGELIST), CODE_NAME(STREAM_CHANGELIST_OK),
+	CODE_NAME(SEND_DELTA), CODE_NAME(SEND_DELTA_PROCEED), CODE_NAME(SEND_DELTA_DONE),
+	CODE_NAME(SEND_DELTA_ERROR), CODE_NAME(STATUS), CODE_NAME(STATUS_OK), CODE_NAME(REQUEST_SNAPSHOT_STATE),
+	CODE_NAME(SNAPSHOT_STATE), CODE_NAME(REQUEST_SNAPSHOT_SECTORS), CODE_NAME(SNAPSHOT_SECTORS),
+	CODE_NAME(RESIZE), CODE_NAME(SEND_DELTA_STREAM), CODE_NAME(SEND_DELTA_ACK), CODE_NAME(SEND_DELTA_RESTART),
+	CODE_NAME(DELETE_SNAPSHOTS), CODE_NAME(COMPACT_TREE), CODE_NAME(COMPACT_TREE_OK), CODE_NAME(STATS),
+	CODE_NAME(STATS_OK), CODE_NAME(TRACE_DUMP), CODE_NAME(TRACE_DUMP_OK),
+};
+
+#define CODES (sizeof(code_names) / sizeof(*code_names))
+
+struct histogram { u64 count, sum, bucket[STATS_BUCKETS]; };
+
+static struct metrics {
+	u64 since; // counting started, seconds since the epoch
+	u64 requests[CODES]; // messages received, by code
+	struct histogram origin_write, snapshot_write, snapshot_read; // microseconds per request
+	struct histogram copyout, copyout_bytes; // microseconds and bytes per copyout
+	struct histogram commit, commit_blocks; // microseconds and dirty blocks per journal commit
+	struct histogram alloc_scan; // bitmap bytes searched per chunk allocated
+	struct histogram lock_wait; // microseconds origin writes wait for snapshot reads
+} metrics;
+
+static inline u64 usecs(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static inline void histogram_add(struct histogram *histogram, u64 value)
+{
+	unsigned bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+	histogram->count++;
+	histogram->sum += value;
+	histogram->bucket[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+}
+
+/* microseconds since the start, none if the clock was set back */
+static inline void histogram_time(struct histogram *histogram, u64 start)
+{
+	u64 now = usecs();
+	histogram_add(histogram, now > start ? now - start : 0);
+}
+
+/*
+ * Request tracing, reported by TRACE_DUMP: the last TRACE_RECORDS data
+ * requests, each with the time it spent in each phase.  The server loop
+ * both fills the ring and answers for it, one message at a time, so it
+ * needs no locks, and a phase costs two clock reads and an add.  Phases
+ * outside a traced request, a commit from the background say, cost nothing.
+ * A phase inside another, a commit while allocating say, is only counted
+ * once, for the inner one.
+ */
+
+#define TRACE_RECORDS 4096
+
+static struct trace_record trace_ring[TRACE_RECORDS];
+static u64 trace_count; // records ever begun, record n is in trace_ring[n % TRACE_RECORDS]
+static u64 trace_cleared; // records before this are not reported
+static struct trace_record *tracing; // the request being handled, if traced
+static u64 trace_phased; // microseconds of the request counted in some phase
+
+static void trace_request(unsigned kind, struct rw_request *body)
+{
+	unsigned chunks = 0;
+
+	for (unsigned i = 0; i < body->count; i++)
+		chunks += body->ranges[i].chunks;
+	tracing = trace_ring + trace_count++ % TRACE_RECORDS;
+	trace_phased = 0;
+	*tracing = (struct trace_record){ .start = usecs(), .kind = kind, .id = body->id, .chunks = chunks };
+}
+
+/* done with the request, returns its record number */
+static u64 trace_finish(void)
+{
+	u64 now = usecs();
+
+	tracing->total = now > tracing->start ? now - tracing->start : 0;
+	tracing = NULL;
+	return trace_count - 1;
+}
+
+/* the clock less the time already in phases, so inner phases drop out */
+static inline u64 phase_start(void)
+{
+	return tracing ? usecs() - trace_phased : 0;
+}
+
+static inline void phase_end(unsigned phase, u64 start)
+{
+	if (tracing) {
+		u64 now = usecs() - trace_phased;
+		if (now > start) {
+			tracing->phase[phase] += now - start;
+			trace_phased += now - start;
+		}
+	}
+}
+
+/* a request finished but held for a lock, add the wait if the ring still has it */
+static void trace_wait(u64 record)
+{
+	if (trace_count - record > TRACE_RECORDS)
+		return;
+	struct trace_record *traced = trace_ring + record % TRACE_RECORDS;
+	u64 now = usecs(), end = traced->start + traced->total;
+	if (now > end) {
+		traced->phase[TRACE_LOCK] += now - end;
+		traced->total += now - end;
+	}
+}
+
 /*
  * Journalling
  */
@@ -373,6 +809,7 @@ static unsigned next_journal_block(struct superblock *sb)
 {
 	unsigned next = sb->image.journal_next;
 
+	sb->journal_since_barrier++;
 	if (++sb->image.journal_next == sb->image.journal_size)
 		sb->image.journal_next = 0;
 
@@ -400,25 +837,36 @@ static int is_commit_block(struct commit_block *block)
  * this little chink in the armor should be filled.
  */
 
-static u32 checksum_block(struct superblock *sb, u32 *data)
+static u32 checksum_words(u32 *data, unsigned words)
 {
-	int i, sum = 0;
-	for (i = 0; i < sb->metadata.asi->allocsize_bits >> 2; i++)
+	u32 sum = 0;
+	for (unsigned i = 0; i < words; i++)
 		sum += data[i];
 	return sum;
 }
 
-static struct buffer *jgetblk(struct superblock *sb, unsigned i)
+static u32 checksum_block(struct superblock *sb, u32 *data)
 {
-	return getblk(sb->metadev, journal_sector(sb, i), sb->metadata.allocsize);
+	return checksum_words(data, sb->metadata.allocsize >> 2);
 }
 
 /*
- * Read the journal block at the given offset.
+ * Older journals summed only the first few words of a commit block, by
+ * mistake taking allocsize_bits for the block size, and so left the sector
+ * list unchecked.  Accept those too so a journal left by a crashed older
+ * daemon still replays.
  */
-static struct buffer *jread(struct superblock *sb, unsigned i)
+static int commit_checksum_ok(struct superblock *sb, struct commit_block *commit)
 {
-	return bread(sb->metadev, journal_sector(sb, i), sb->metadata.allocsize);
+	void *block = commit; /* summed as words, so not through the packed type */
+
+	return !checksum_block(sb, block) ||
+		!checksum_words(block, sb->metadata.asi->allocsize_bits >> 2);
+}
+
+static struct buffer *jgetblk(struct superblock *sb, unsigned i)
+{
+	return getblk(sb->metadev, journal_sector(sb, i), sb->metadata.allocsize);
 }
 
 /* counting free space for debugging purpose */
@@ -427,6 +875,39 @@ static struct buffer *snapread(struct superblock const *sb, sector_t sector)
 	return bread(sb->metadev, sector, sb->metadata.allocsize);
 }
 
+/* the sector of child i, for i from 0 */
+static inline sector_t *node_sectors(struct superblock const *sb, struct enode *node)
+{
+	return (sector_t *)((char *)node + sb->metadata.allocsize / 2);
+}
+
+/*
+ * Read an index node, rearranging one from before version 1 in memory.  It
+ * goes back to disk in the new layout if it is changed.
+ */
+static struct buffer *read_node(struct superblock const *sb, sector_t sector)
+{
+	struct buffer *buffer = snapread(sb, sector);
+	struct enode *node;
+	u64 *pairs;
+
+	if (!buffer || (node = buffer2node(buffer))->version)
+		return buffer;
+	if (!(pairs = malloc(node->count * 2 * sizeof(u64)))) {
+		brelse(buffer);
+		return NULL;
+	}
+	memcpy(pairs, node_keys(node) + 1, node->count * 2 * sizeof(u64));
+	for (unsigned i = 0; i < node->count; i++) {
+		if (i)
+			node_keys(node)[i] = pairs[2 * i];
+		node_sectors(sb, node)[i] = pairs[2 * i + 1];
+	}
+	node->version = NODE_VERSION;
+	free(pairs);
+	return buffer;
+}
+
 static int bytebits(unsigned char c)
 {
 	unsigned count = 0;
@@ -450,24 +931,46 @@ static inline void clear_bitmap_bit(unsigned char *bitmap, unsigned bit)
 	bitmap[bit >> 3] &= ~(1 << (bit & 7));
 }
 
+static inline struct relocation *relocation(struct superblock *sb, struct allocspace *as)
+{
+	return &sb->image.relocation[as->asi == &sb->image.snapdata];
+}
+
+static inline int relocating(struct superblock *sb, struct allocspace *as)
+{
+	return (sb->image.flags & SB_RESIZING) && relocation(sb, as)->chunks;
+}
+
+/*
+ * Return the sector of the given allocation bitmap block, in the bitmap's
+ * new place if a resize has moved the block there already.
+ */
+static sector_t bitmap_sector(struct superblock *sb, struct allocspace *as, u64 block)
+{
+	sector_t base = as->asi->bitmap_base;
+
+	if (relocating(sb, as) && block < relocation(sb, as)->done)
+		base = relocation(sb, as)->base;
+	return base + (block << sb->metadata.chunk_sectors_bits);
+}
+
 /*
  * flag = 0: check if bits for chunks from start_chunk to end_chunk are all zero
  * flag = 1: set bits for chunks from start_chunk to end_chunk
  * flag = 2: clear bits for chunks from start_chunk to end_chunk
  */
-static int change_bits(struct superblock *sb, chunk_t start, chunk_t count, chunk_t base, int flag)
-// !!! do sector shift inside here
+static int change_bits(struct superblock *sb, struct allocspace *as, chunk_t start, chunk_t count, int flag)
 {
 	chunk_t chunk, limit = start + count;
 	unsigned bitmap_shift = sb->metadata.asi->allocsize_bits + 3;
 	u64 bitmap_mask = (1 << bitmap_shift ) - 1;
-	sector_t sector = (base >> SECTOR_BITS) + ((start >> bitmap_shift) << sb->metadata.chunk_sectors_bits);
-	trace(warn("start %Lu, count %Lu, base %Lu, flag %d, sector %Lu", start, count, base, flag, sector);)
-	for (chunk = start; chunk < limit; sector += chunk_sectors(&sb->metadata)) {
-		struct buffer *buffer = bread(sb->metadev, sector, sb->metadata.allocsize);
+	trace(warn("start %Lu, count %Lu, flag %d", start, count, flag);)
+	for (chunk = start; chunk < limit;) {
+		struct buffer *buffer = bread(sb->metadev, bitmap_sector(sb, as, chunk >> bitmap_shift), sb->metadata.allocsize);
 		do {
 			if (!flag && get_bitmap_bit(buffer->data, chunk & bitmap_mask)) {
 				warn("chunk %Lu is in use", chunk);
+				brelse(buffer);
 				return -1;
 			}
 			if (flag == 1)
@@ -483,9 +986,155 @@ static int change_bits(struct superblock *sb, chunk_t start, chunk_t count, chun
 	return 0;
 }
 
-void set_allocated(struct superblock *sb, chunk_t chunk, unsigned count)
+void set_allocated(struct superblock *sb, struct allocspace *as, chunk_t chunk, unsigned count)
+{
+	change_bits(sb, as, chunk, count, 1);
+}
+
+/*
+ * Committed deferred allocations are kept as a sorted array of disjoint
+ * ranges, merged where they meet, so the allocator can check a candidate
+ * chunk with a binary search, and the number of bitmap blocks that flushing
+ * them would dirty is known exactly, see barrier_room().  A combined store
+ * has one set, separate stores one for each allocation space.
+ */
+static struct deferred *deferred(struct superblock *sb, struct allocspace *as)
+{
+	return sb->deferred + (as->asi == &sb->image.snapdata);
+}
+
+static struct allocspace *deferred_space(struct superblock *sb, struct deferred *def)
+{
+	return def == sb->deferred ? &sb->metadata : &sb->snapdata;
+}
+
+/* Committed deferred ranges in both sets */
+static unsigned deferred_ranges(struct superblock *sb)
+{
+	return sb->deferred[0].count + sb->deferred[1].count;
+}
+
+/* Ranges deferred in the open transaction */
+static unsigned pending_ranges(struct superblock *sb)
+{
+	return sb->deferred[0].pendings + sb->deferred[1].pendings;
+}
+
+static int chunk_within(chunk_t chunk, chunk_t start, chunk_t count)
+{
+	return chunk - start < count; // chunk_t must be unsigned!
+}
+
+static u64 bitmap_block(struct superblock *sb, chunk_t chunk)
+{
+	return chunk >> (sb->metadata.asi->allocsize_bits + 3);
+}
+
+/* Index of the first deferred range that ends after the given chunk */
+static unsigned find_deferred(struct deferred *def, chunk_t chunk)
+{
+	unsigned lo = 0, hi = def->count;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		struct alloc_range *range = def->range + mid;
+		if (range->chunk + range->count <= chunk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int is_deferred_alloc(struct superblock *sb, struct allocspace *as, chunk_t chunk)
+{
+	struct deferred *def = deferred(sb, as);
+	unsigned i = find_deferred(def, chunk);
+
+	if (i < def->count && chunk_within(chunk, def->range[i].chunk, def->range[i].count))
+		return 1;
+	for (i = 0; i < def->pendings; i++)
+		if (chunk_within(chunk, def->pending[i].chunk, def->pending[i].count))
+			return 1;
+	return 0;
+}
+
+static int add_deferred(struct superblock *sb, struct deferred *def, chunk_t chunk, unsigned count)
+{
+	unsigned i = find_deferred(def, chunk), n = def->count;
+	struct alloc_range *range = def->range;
+	u64 first = bitmap_block(sb, chunk), last = bitmap_block(sb, chunk + count - 1);
+	int before = i && range[i - 1].chunk + range[i - 1].count == chunk;
+	int after = i < n && range[i].chunk == chunk + count;
+	int shared_before = i && bitmap_block(sb, range[i - 1].chunk + range[i - 1].count - 1) == first;
+	int shared_after = i < n && bitmap_block(sb, range[i].chunk) == last;
+
+	assert(count);
+	if (before && (u64)range[i - 1].count + count >= 1ULL << 31)
+		before = 0;
+	if (after && (u64)range[i].count + count + (before ? range[i - 1].count : 0) >= 1ULL << 31)
+		after = 0;
+	if (!before && !after && n == def->size) {
+		unsigned size = n ? 2 * n : 64;
+		if (!(range = realloc(range, size * sizeof(*range))))
+			return -ENOMEM;
+		def->range = range;
+		def->size = size;
+	}
+
+	/* count the bitmap blocks not already dirtied by a neighbour */
+	def->blocks += last - first + 1 - shared_before - shared_after + (shared_before && shared_after && first == last);
+	if (before) {
+		range[i - 1].count += count;
+		if (after) {
+			range[i - 1].count += range[i].count;
+			memmove(range + i, range + i + 1, (--n - i) * sizeof(*range));
+		}
+	} else if (after) {
+		range[i].chunk = chunk;
+		range[i].count += count;
+	} else {
+		memmove(range + i + 1, range + i, (n++ - i) * sizeof(*range));
+		range[i] = (struct alloc_range){ .chunk = chunk, .count = count };
+	}
+	def->count = n;
+	return 0;
+}
+
+/*
+ * Remember an allocation in the current transaction instead of setting its
+ * bitmap bit, extending the last range if the chunk follows it in the same
+ * bitmap block, else starting another range if there is room for it.
+ */
+static int defer_alloc(struct superblock *sb, struct allocspace *as, chunk_t chunk)
+{
+	struct deferred *def = deferred(sb, as);
+	struct alloc_range *range = def->pending + def->pendings - 1;
+
+	if (def->pendings && chunk == range->chunk + range->count && bitmap_block(sb, chunk) == bitmap_block(sb, range->chunk)) {
+		range->count++;
+		return 1;
+	}
+	if (def->pendings == MAX_COMMIT_ALLOCS)
+		return 0;
+	def->pending[def->pendings++] = (struct alloc_range){ .chunk = chunk, .count = 1 };
+	return 1;
+}
+
+/*
+ * Take back the allocation just deferred in this transaction, as when an
+ * exception cannot be added to the tree after all.
+ */
+static int undefer_alloc(struct superblock *sb, struct allocspace *as, chunk_t chunk)
 {
-	change_bits(sb, chunk, count, sb->image.metadata.bitmap_base << SECTOR_BITS, 1);
+	struct deferred *def = deferred(sb, as);
+	struct alloc_range *range = def->pending + def->pendings - 1;
+
+	if (!def->pendings || chunk != range->chunk + range->count - 1)
+		return 0;
+	if (!--range->count)
+		def->pendings--;
+	return 1;
 }
 
 /*
@@ -501,7 +1150,7 @@ static chunk_t count_zeros(struct superblock *sb, struct allocspace *alloc)
 		zeroes[i] = bytebits(~i);
 	chunk_t count = 0, block = 0, bytes = (alloc->asi->chunks + 7) >> 3;
 	while (bytes) {
-		struct buffer *buffer = snapread(sb, alloc->asi->bitmap_base + (block << sb->metadata.chunk_sectors_bits));
+		struct buffer *buffer = snapread(sb, bitmap_sector(sb, alloc, block));
 		if (!buffer)
 			return 0; // can't happen!
 		unsigned char *p = buffer->data;
@@ -518,9 +1167,12 @@ static chunk_t count_zeros(struct superblock *sb, struct allocspace *alloc)
 
 static chunk_t count_deferred(struct superblock *sb, struct allocspace *alloc)
 {
-	unsigned count = sb->defer.count;
-	for (int i = 0; i < sb->deferred_allocs; i++)
-		count += sb->deferred_alloc[i].count;
+	struct deferred *def = deferred(sb, alloc);
+	chunk_t count = 0;
+	for (int i = 0; i < def->pendings; i++)
+		count += def->pending[i].count;
+	for (int i = 0; i < def->count; i++)
+		count += def->range[i].count;
 	return count;
 }
 
@@ -545,44 +1197,101 @@ static void check_freespace(struct superblock *sb)
 	}
 }
 
-static void selfcheck_freespace(struct superblock *sb)
+static void selfcheck_freespace(struct superblock *sb)
+{
+	if ((sb->runflags & RUN_SELFCHECK))
+		check_freespace(sb);
+}
+
+/*
+ * Journaled buffers go home sorted by sector, in elevator order, with
+ * adjacent buffers merged into one write, see writeback_buffers().  Most are
+ * written while the server is idle, see writeback_step(), or as they pass a
+ * high watermark in commit_transaction(), leaving little for the barrier.
+ */
+static void write_journaled_buffers(unsigned max)
+{
+	int err = writeback_buffers(&journaled_buffers, max);
+	if (err < 0)
+		warn("unable to write journaled buffers home: %s", strerror(-err));
+}
+
+static void flush_journaled_buffers(void)
 {
-	if ((sb->runflags & RUN_SELFCHECK))
-		check_freespace(sb);
+	write_journaled_buffers(journaled_count);
 }
 
-static void flush_journaled_buffers(void)
+/*
+ * Journaled buffers hold their cache memory until written home, so do not
+ * let them take more than a quarter of the cache, or of the journal.
+ */
+static unsigned writeback_watermark(struct superblock *sb)
 {
-	while (!list_empty(&journaled_buffers)) {
-		struct list_head *entry = journaled_buffers.next;
-		struct buffer *buffer = list_entry(entry, struct buffer, dirty_list);
-		jtrace(warn("write data sector = %Lx", buffer->sector););
-		if (write_buffer_to(buffer, buffer->sector))
-			warn("unable to write commit block to journal");
-		set_buffer_uptodate(buffer);
-	}
-	assert(journaled_count == 0);
+	unsigned limit = sb->image.journal_size < max_buffers ? sb->image.journal_size : max_buffers;
+	return limit / 4;
 }
 
 static void flush_deferred_allocs(struct superblock *sb)
 {
-	for (int i = 0; i < sb->deferred_allocs; i++)
-		set_allocated(sb, sb->deferred_alloc[i].chunk, sb->deferred_alloc[i].count);
-	sb->deferred_allocs = 0;
+	for (struct deferred *def = sb->deferred; def < sb->deferred + 2; def++) {
+		struct allocspace *as = deferred_space(sb, def);
+		for (int i = 0; i < def->count; i++)
+			set_allocated(sb, as, def->range[i].chunk, def->range[i].count);
+		for (int i = 0; i < def->pendings; i++)
+			set_allocated(sb, as, def->pending[i].chunk, def->pending[i].count);
+		def->count = def->blocks = def->pendings = 0;
+	}
 }
 
 /*
- * Deferred allocations are written to the journal one (for now) per commit
- * block.  Do not commit so many deferred allocations that the barrier commit
- * required to flush them to bitmaps will overwrite the oldest deferred alloc
- * in the journal, otherwise deferred allocations will be forgotten and double
- * allocations will result, followed by severe corruption shortly after.
+ * Deferred allocations are written to the journal, up to MAX_COMMIT_ALLOCS
+ * ranges per commit block.  Do not commit so many deferred allocations that
+ * the barrier commit required to flush them to bitmaps will overwrite the
+ * oldest deferred alloc in the journal, otherwise deferred allocations will
+ * be forgotten and double allocations will result, followed by severe
+ * corruption shortly after.
  *
- * The limit chosen below is arbitrary and pessimistic.  Repeat: must use a
- * pessimal flush critereon otherwise corruption is possible following journal
- * replay.  Do eventually develop a tighter limit by tracking the number of
- * bitmap blocks that will actually be dirtied by the flush.
+ * So the room left for a barrier is tracked exactly: the barrier dirties
+ * the bitmap blocks of the committed ranges, which are counted as ranges
+ * are added, and at most one more for each range of the open transaction,
+ * in each allocation space.
+ * Together with the transaction's own dirty buffers and its commit block,
+ * these must fit both in a commit block and in the journal blocks not used
+ * since the last barrier.  Transactions are committed early while the room
+ * shrinks, see transaction_limit(), and the barrier is only taken when the
+ * transaction after this one would no longer fit.
  */
+static int barrier_room(struct superblock *sb)
+{
+	int bitmaps = sb->deferred[0].blocks + sb->deferred[1].blocks + (combined(sb) ? 1 : 2) * MAX_COMMIT_ALLOCS;
+	int journal = sb->image.journal_size - sb->journal_since_barrier - bitmaps - 1;
+	int commit = sb->max_commit_blocks - bitmaps;
+	return journal < commit ? journal : commit;
+}
+
+static int barrier_needed(struct superblock *sb)
+{
+	if (!deferring(sb) && !deferred_ranges(sb) && !journaled_count)
+		return 0;
+	return barrier_room(sb) < (int)dirty_buffer_count + 1 + MAX_BTREE_DIRTY;
+}
+
+/* Commit block entries for the dirty buffers of a transaction */
+static int transaction_limit(struct superblock *sb)
+{
+	int limit = sb->max_commit_blocks - 4 * MAX_COMMIT_ALLOCS, room;
+
+	if (sb->image.journal_size < limit)
+		limit = sb->image.journal_size;
+	if (deferring(sb) && (room = barrier_room(sb)) < limit)
+		limit = room;
+	return limit;
+}
+
+static struct commit_range *commit_ranges(struct superblock *sb, struct commit_block *commit)
+{
+	return (struct commit_range *)((char *)commit + sb->metadata.allocsize) - commit->alloc.more;
+}
 
 /*
  * For now there is only ever one open transaction in the journal, the newest
@@ -597,14 +1306,17 @@ static void flush_deferred_allocs(struct superblock *sb)
  */
 static void commit_transaction(struct superblock *sb, int barrier)
 {
-	if (list_empty(&dirty_buffers) && !sb->defer.count)
+	if (list_empty(&dirty_buffers) && !pending_ranges(sb))
 		return;
 
-	if (sb->deferred_allocs >= sb->image.journal_size / 2 || journaled_count >= sb->image.journal_size / 2) {
+	u64 start = usecs(), phased = phase_start();
+
+	if (barrier_needed(sb)) {
 		flush_journaled_buffers();
 		flush_deferred_allocs(sb);
 		barrier = 1;
-	}
+	} else if (journaled_count >= writeback_watermark(sb))
+		write_journaled_buffers(journaled_count - writeback_watermark(sb) / 2);
 
 //warn(">>> %i <<<", sb->image.sequence);
 	struct list_head *list;
@@ -647,22 +1359,45 @@ static void commit_transaction(struct superblock *sb, int barrier)
 	}
 
 	jtrace(warn("commit journal block [%u]", pos););
-	commit->checksum = 0;
-	commit->checksum = -checksum_block(sb, (void *)commit);
 	commit->snapfree = snapfree(sb);
 	commit->metafree = metafree(sb);
 
-	if (sb->defer.count) {
-		commit->alloc = (struct alloc_range){ .chunk = sb->defer.chunk, .count = sb->defer.count };
-		sb->deferred_alloc[sb->deferred_allocs++] = commit->alloc;
-		sb->defer.count = 0;
+	/*
+	 * The first deferred metadata range goes in the commit block header,
+	 * where a combined store has always kept it, the rest at the end.
+	 */
+	if (pending_ranges(sb)) {
+		struct deferred *meta = sb->deferred;
+		int header = !!meta->pendings;
+		if (header)
+			commit->alloc = (struct alloc_range){ .chunk = meta->pending[0].chunk, .count = meta->pending[0].count };
+		commit->alloc.more = pending_ranges(sb) - header;
+		assert(commit->entries + 2 * commit->alloc.more <= sb->max_commit_blocks);
+		struct commit_range *more = commit_ranges(sb, commit);
+		for (struct deferred *def = sb->deferred; def < sb->deferred + 2; def++) {
+			for (int i = 0; i < def->pendings; i++) {
+				struct alloc_range *range = def->pending + i;
+				if (def != meta || i)
+					*more++ = (struct commit_range){ .chunk = range->chunk, .count = range->count, .snapdata = def != meta };
+				if (add_deferred(sb, def, range->chunk, range->count)) {
+					warn("no memory for deferred allocations, setting bitmap");
+					set_allocated(sb, deferred_space(sb, def), range->chunk, range->count);
+				}
+			}
+			def->pendings = 0;
+		}
 	}
 
-	if (barrier)
+	if (barrier) {
 		commit->alloc.barrier = 1;
+		sb->journal_since_barrier = 0;
+	}
 
+	commit->checksum = 0;
+	commit->checksum = -checksum_block(sb, (void *)commit);
 	if (write_buffer_to(commit_buffer, journal_sector(sb, pos)))
 		jtrace(warn("unable to write checksum from commit block");); // what does this mean?
+	histogram_add(&metrics.commit_blocks, commit->entries);
 	brelse(commit_buffer);
 
 	/* Use deferred metadata writes if RUN_DEFER flag is set and this is not a barrier commit. */
@@ -676,19 +1411,13 @@ static void commit_transaction(struct superblock *sb, int barrier)
 			add_buffer_journaled(buffer);
 		}
 	} else {
-		/*
-	 	* Now write each dirty buffer to its proper location.
-	 	* TODO: this can be merged with the above flush_journaled_buffers() code.
-	 	*/
-		while (!list_empty(&dirty_buffers)) {
-			struct list_head *entry = dirty_buffers.next;
-			struct buffer *buffer = list_entry(entry, struct buffer, dirty_list);
-			jtrace(warn("write data sector = %Lx", buffer->sector););
-			assert(buffer_dirty(buffer));
-			if (write_buffer(buffer)) // deletes it from dirty (fixme: fragile)
-				jtrace(warn("unable to write commit block to journal"););
-		}
+		/* Now write each dirty buffer to its proper location, in sector order */
+		int err = writeback_buffers(&dirty_buffers, dirty_buffer_count);
+		if (err < 0)
+			warn("unable to write dirty buffers home: %s", strerror(-err));
 	}
+	histogram_time(&metrics.commit, start);
+	phase_end(TRACE_COMMIT, phased);
 	/* checking free chunks for debugging purpose only,, return before this to skip the checking */
 	selfcheck_freespace(sb);
 }
@@ -701,6 +1430,25 @@ static void commit_deferred_allocs(struct superblock *sb)
 	commit_transaction(sb, 1);
 }
 
+static int writeback_pending(struct superblock *sb)
+{
+	return journaled_count || deferred_ranges(sb);
+}
+
+/*
+ * Called when the server has been idle for a while: write a batch of
+ * journaled buffers home, and once they are all home, commit the deferred
+ * allocations with a barrier, which is cheap by then, so the journal is
+ * reclaimed before it fills.
+ */
+static void writeback_step(struct superblock *sb)
+{
+	if (journaled_count)
+		write_journaled_buffers(WRITEBACK_STEP_BLOCKS);
+	else if (deferred_ranges(sb))
+		commit_deferred_allocs(sb);
+}
+
 /* Journal Replay */
 
 #ifdef SHOW_HELPERS
@@ -712,7 +1460,7 @@ static void show_alloc_range(struct alloc_range *range, char *sep)
 static void _show_journal(struct superblock *sb)
 {
 	for (int i = 0; i < sb->image.journal_size; i++) {
-		struct buffer *buffer = jread(sb, i);
+		struct buffer *buffer = snapread(sb, journal_sector(sb, i));
 		struct commit_block *commit = buf2commit(buffer);
 
 		if (!is_commit_block(commit)) {
@@ -735,9 +1483,13 @@ static void _show_journal(struct superblock *sb)
 		evict_buffer(buffer); /* avoid data alias on next show */
 	}
 	printf("defered: (");
-	show_alloc_range(&sb->defer, ") ");
-	for (int i = 0; i < sb->deferred_allocs; i++)
-		show_alloc_range(sb->deferred_alloc + i, " ");
+	for (int j = 0; j < 2; j++)
+		for (int i = 0; i < sb->deferred[j].pendings; i++)
+			show_alloc_range(sb->deferred[j].pending + i, " ");
+	printf(") ");
+	for (int j = 0; j < 2; j++)
+		for (int i = 0; i < sb->deferred[j].count; i++)
+			show_alloc_range(sb->deferred[j].range + i, " ");
 	printf("\n");
 }
 
@@ -746,34 +1498,172 @@ static void _show_journal(struct superblock *sb)
 
 #define fieldtype(structname, fieldname) typeof(((struct structname *)NULL)->fieldname)
 
+/*
+ * Replay reads the whole journal into memory with large sequential reads
+ * instead of a block at a time through the buffer cache, checks the commit
+ * blocks on several threads, then writes each replayed block home once, the
+ * newest copy, in sector order.
+ */
+#define JOURNAL_READ_BYTES (1 << 20)
+#define MAX_REPLAY_THREADS 8
+
+static unsigned replay_threads; /* zero for one per processor online */
+
+struct journal_scan {
+	struct superblock *sb;
+	char *journal;
+	unsigned start, end;
+	int corrupt;		/* journal block with a bad checksum, or -1 */
+};
+
+static void *scan_journal(void *data)
+{
+	struct journal_scan *scan = data;
+	unsigned blocksize = scan->sb->metadata.allocsize;
+
+	for (unsigned i = scan->start; i < scan->end; i++) {
+		struct commit_block *commit = (void *)(scan->journal + (size_t)i * blocksize);
+		if (is_commit_block(commit) && !commit_checksum_ok(scan->sb, commit)) {
+			scan->corrupt = i;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Check the commit blocks in slices of the journal, one per thread.  The
+ * calling thread takes the first slice, and any slice a thread could not be
+ * started for.
+ */
+static int check_journal(struct superblock *sb, char *journal)
+{
+	unsigned jblocks = sb->image.journal_size, threads = replay_threads;
+	struct journal_scan scan[MAX_REPLAY_THREADS];
+	pthread_t thread[MAX_REPLAY_THREADS];
+	int started[MAX_REPLAY_THREADS] = { }, corrupt = -1;
+
+	if (!threads) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = online > 0 ? online : 1;
+	}
+	if (threads > MAX_REPLAY_THREADS)
+		threads = MAX_REPLAY_THREADS;
+	if (threads > jblocks)
+		threads = jblocks;
+
+	for (unsigned i = 0; i < threads; i++) {
+		scan[i] = (struct journal_scan){ .sb = sb, .journal = journal, .corrupt = -1,
+			.start = (u64)jblocks * i / threads, .end = (u64)jblocks * (i + 1) / threads };
+		if (i)
+			started[i] = !pthread_create(&thread[i], NULL, scan_journal, &scan[i]);
+	}
+	for (unsigned i = 0; i < threads; i++) {
+		if (started[i])
+			pthread_join(thread[i], NULL);
+		else
+			scan_journal(&scan[i]);
+		if (scan[i].corrupt != -1 && corrupt == -1)
+			corrupt = scan[i].corrupt;
+	}
+	return corrupt;
+}
+
+static int read_journal(struct superblock *sb, char *journal)
+{
+	size_t size = (size_t)sb->image.journal_size * sb->metadata.allocsize;
+	off_t base = (off_t)sb->image.journal_base << SECTOR_BITS;
+
+	for (size_t done = 0; done < size; done += JOURNAL_READ_BYTES) {
+		size_t count = size - done < JOURNAL_READ_BYTES ? size - done : JOURNAL_READ_BYTES;
+		if (diskread(sb->metadev, journal + done, count, base + done) < 0)
+			return -errno;
+	}
+	return 0;
+}
+
+struct replay_block {
+	sector_t sector;
+	unsigned pos;		/* journal block holding the data */
+	unsigned order;		/* later copies of a sector win */
+};
+
+static int compare_replay(const void *a, const void *b)
+{
+	struct replay_block const *x = a, *y = b;
+
+	if (x->sector != y->sector)
+		return x->sector < y->sector ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*
+ * Write the newest copy of each sector home, merging runs that are adjacent
+ * both in the journal and on disk into one write.  Returns the number of
+ * blocks written.
+ */
+static int replay_blocks(struct superblock *sb, char *journal, struct replay_block *replay, unsigned count)
+{
+	unsigned blocksize = sb->metadata.allocsize, sectors = chunk_sectors(&sb->metadata);
+	unsigned written = 0, i = 0, j, run;
+
+	qsort(replay, count, sizeof(*replay), compare_replay);
+	for (i = j = 0; i < count; i++)
+		if (i + 1 == count || replay[i + 1].sector != replay[i].sector)
+			replay[j++] = replay[i];
+	count = j;
+
+	for (i = 0; i < count; i += run, written += run) {
+		for (run = 1; i + run < count; run++)
+			if (replay[i + run].sector != replay[i].sector + run * sectors ||
+			    replay[i + run].pos != replay[i].pos + run)
+				break;
+		jtrace(warn("write journal [%u] data to %Lx, %u blocks", replay[i].pos, replay[i].sector, run););
+		if (diskwrite(sb->metadev, journal + (size_t)replay[i].pos * blocksize,
+			      (size_t)run * blocksize, (off_t)replay[i].sector << SECTOR_BITS) < 0)
+			return -errno;
+	}
+	return written;
+}
+
 static int replay_journal(struct superblock *sb)
 {
-	struct buffer *buffer;
-	int jblocks = sb->image.journal_size, commits = 0;;
+	unsigned jblocks = sb->image.journal_size, blocksize = sb->metadata.allocsize;
+	int commits = 0, blocks = 0, written, corrupt;
 	char const *why = "";
-
-	warn("Replaying journal");
+	struct timeval start, stop;
+	struct replay_block *replay = NULL;
+	char *journal;
 	fieldtype(commit_block, sequence) seq[jblocks];
 	unsigned pos[jblocks], newest = -1;
 
-	/* Scan the entire journal for commit blocks */
-	for (int i = 0; i < jblocks; i++) {
-		if (!(buffer = jread(sb, i))) {
-			why = "block read failed";
-			goto failed_buffer;
-		}
+	warn("Replaying journal");
+	gettimeofday(&start, NULL);
+	if (posix_memalign((void **)&journal, SECTOR_SIZE, (size_t)jblocks * blocksize)) {
+		journal = NULL;
+		why = "out of memory for journal";
+		goto failed;
+	}
+	if (read_journal(sb, journal) < 0) {
+		why = "journal read failed";
+		goto failed_free;
+	}
+	if ((corrupt = check_journal(sb, journal)) != -1) {
+		warn("bad checksum on commit block [%u]", corrupt);
+		why = "corrupt journal block";
+		goto failed_free;
+	}
 
-		struct commit_block *commit = buf2commit(buffer);
+#define journal_block(i) ((struct commit_block *)(journal + (size_t)(i) * blocksize))
+
+	/* Find the commit blocks */
+	for (int i = 0; i < jblocks; i++) {
+		struct commit_block *commit = journal_block(i);
 		if (is_commit_block(commit)) {
-			if (checksum_block(sb, (void *)commit)) {
-				why = "corrupt journal block";
-				goto failed_buffer;
-			}
 			seq[commits] = commit->sequence;
 			pos[commits] = i;
 			commits++;
 		}
-		brelse(buffer);
 	}
 
 	//for (int i = 0; i < commits; i++)
@@ -786,11 +1676,15 @@ static int replay_journal(struct superblock *sb)
 		if (next_recorded_seq != seq_plus_one) {
 			if (newest != -1) {
 				why = "unexpected gap in journal sequence";
-				goto failed;
+				goto failed_free;
 			}
 			newest = i;
 		}
 	}
+	if (newest == -1) {
+		why = "no commit blocks in journal";
+		goto failed_free;
+	}
 	jtrace(warn("found newest commit [%u]", pos[newest]););
 
 	/* Pick up any deferred allocs */
@@ -799,22 +1693,39 @@ static int replay_journal(struct superblock *sb)
 	do {
 		if (i == commits)
 			i = 0;
-		buffer = jread(sb, pos[i]);
-		commit = buf2commit(buffer);
+		commit = journal_block(pos[i]);
 		struct alloc_range alloc = commit->alloc;
+		struct commit_range *more = commit_ranges(sb, commit);
 		if (alloc.barrier) {
-			sb->deferred_allocs = 0;
+			for (int j = 0; j < 2; j++)
+				sb->deferred[j].count = sb->deferred[j].blocks = 0;
 			barrier = i;
 		}
-		if (alloc.count) {
-			jtrace(show_alloc_range(&alloc, " deferred\n");)
-			sb->deferred_alloc[sb->deferred_allocs++] = (struct alloc_range){
-				.chunk = alloc.chunk, .count = alloc.count };
+		if (alloc.more >= 2 * MAX_COMMIT_ALLOCS) {
+			why = "bad deferred allocation count";
+			goto failed_free;
+		}
+		for (int j = -1; j < (int)alloc.more; j++) {
+			struct commit_range range = j < 0 ? (struct commit_range){ .chunk = alloc.chunk, .count = alloc.count } : more[j];
+			if (!range.count)
+				continue;
+			if (range.snapdata > 1 || (range.snapdata && combined(sb))) {
+				why = "bad deferred allocation space";
+				goto failed_free;
+			}
+			jtrace(warn("deferred %u@%Lu in %s", range.count, (llu_t)range.chunk, range.snapdata ? "snapdata" : "metadata"););
+			if (add_deferred(sb, sb->deferred + range.snapdata, range.chunk, range.count)) {
+				why = "out of memory for deferred allocations";
+				goto failed_free;
+			}
 		}
-		brelse(buffer);
 	} while (i++ != newest);
 
-	/* write the journal blocks between the barrier and the newest commit to disk */
+	/* collect the journal blocks between the barrier and the newest commit */
+	if (!(replay = malloc(jblocks * sizeof(*replay)))) {
+		why = "out of memory for replay";
+		goto failed_free;
+	}
 	if (barrier == -1 || barrier == newest)
 		i = newest;
 	else
@@ -822,35 +1733,49 @@ static int replay_journal(struct superblock *sb)
 	do {
 		if (i == commits)
 			i = 0;
-		buffer = jread(sb, pos[i]);
-		commit = buf2commit(buffer);
+		commit = journal_block(pos[i]);
 		unsigned entries = commit->entries;
+		if (entries + 2 * commit->alloc.more > sb->max_commit_blocks || blocks + entries > jblocks) {
+			why = "bad commit block entry count";
+			goto failed_free;
+		}
 		for (int j = 0; j < entries; j++) {
-			unsigned replay = (pos[i] - entries + j + jblocks) % jblocks;
-			struct buffer *databuf = jread(sb, replay);
-			if (is_commit_block(buf2commit(databuf)))
-				error("data block [%u] marked as commit block", replay);
-			jtrace(warn("write journal [%u] data to %Lx", replay, commit->sector[i]););
-			warn("write journal [%u] data to %Lx", replay, commit->sector[i]);
-			write_buffer_to(databuf, commit->sector[i]);
-			brelse(databuf);
+			unsigned data = (pos[i] - entries + j + jblocks) % jblocks;
+			if (is_commit_block(journal_block(data))) {
+				warn("data block [%u] marked as commit block", data);
+				why = "commit block in transaction data";
+				goto failed_free;
+			}
+			replay[blocks] = (struct replay_block){ .sector = commit->sector[j], .pos = data, .order = blocks };
+			blocks++;
 		}
-		if (i != newest)
-			brelse(buffer);
 	} while (i++ != newest);
 
+	if ((written = replay_blocks(sb, journal, replay, blocks)) < 0) {
+		why = "replay write failed";
+		goto failed_free;
+	}
+
 	/* Recover durable state from newest commit */
+	commit = journal_block(pos[newest]);
 	sb->image.journal_next = (pos[newest] + 1 + jblocks) % jblocks;
 	sb->image.sequence = commit->sequence + 1;
+	sb->journal_since_barrier = barrier == -1 ? jblocks : (pos[newest] - pos[barrier] + jblocks) % jblocks;
 	sb->image.snapdata.freechunks = commit->snapfree;
 	sb->image.metadata.freechunks = commit->metafree;
-	brelse(buffer);
-
-	check_freespace(sb); // passes for a fsck (need more)
+#undef journal_block
+	free(replay);
+	free(journal);
+
+	gettimeofday(&stop, NULL);
+	warn("Replayed %i of %i journalled blocks from %i commits in %.3f seconds", written, blocks, commits,
+	     (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6);
+	selfcheck_freespace(sb); /* the free counts in the commit block are trusted */
 	return 0;
 
-failed_buffer:
-	brelse(buffer);
+failed_free:
+	free(replay);
+	free(journal);
 failed:
 	error("Journal recovery failed, %s", why);
 	return -1;
@@ -895,32 +1820,56 @@ failed:
  * btree leaf todo:
  *   - Check leaf, index structure
  *   - Mechanism for identifying which snapshots are in each leaf
- *   - binsearch for leaf, index lookup
  *   - enforce 32 bit address range within leaf
  */
 
 static unsigned leaf_freespace(struct eleaf *leaf);
 static unsigned leaf_payload(struct eleaf *leaf);
 
+/*
+ * Find the map entry whose run holds the target chunk, or failing that the
+ * first past it, where a map entry for the chunk would go.  The runs are in
+ * order and do not overlap, so their ends are too, and a binary search finds
+ * the first that ends past the target.
+ */
+static unsigned find_run(struct eleaf *leaf, u64 target)
+{
+	unsigned lo = 0, hi = leaf->count;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if ((u64)leaf->map[mid].rchunk + map_run(&leaf->map[mid]) > target)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static inline int run_holds(struct eleaf *leaf, unsigned i, u64 target)
+{
+	return i < leaf->count && leaf->map[i].rchunk <= target;
+}
+
 /*
  * origin_chunk_unique: an origin logical chunk is shared unless all snapshots
  * have exceptions.
  */
-static int origin_chunk_unique(struct eleaf *leaf, u64 chunk, u64 snapmask)
+static int origin_chunk_unique(struct eleaf *leaf, u64 chunk, u64 const *snapmask)
 {
-	u64 using = 0;
-	u64 i, target = chunk - leaf->base_chunk;
-	struct exception const *p;
+	unsigned words = share_words(leaf);
+	u64 using[words];
+	u64 target = chunk - leaf->base_chunk;
+	unsigned i = find_run(leaf, target);
+	struct exception *p;
 
-	for (i = 0; i < leaf->count; i++)
-		if (leaf->map[i].rchunk == target)
-			goto found;
-	return !snapmask;
-found:
-	for (p = emap(leaf, i); p < emap(leaf, i+1); p++)
-		using |= p->share;
+	if (!run_holds(leaf, i, target))
+		return mask_empty(snapmask, words);
+	memset(using, 0, sizeof(using));
+	for (p = emap(leaf, i); p < emap(leaf, i+1); p = ex_next(p, words))
+		mask_or(using, ex_share(p), words);
 
-	return !(~using & snapmask);
+	return mask_covers(using, snapmask, words);
 }
 
 /*
@@ -930,20 +1879,18 @@ found:
  */
 static int snapshot_chunk_unique(struct eleaf *leaf, u64 chunk, int snapbit, chunk_t *exception)
 {
-	u64 mask = 1LL << snapbit;
-	unsigned i, target = chunk - leaf->base_chunk;
-	struct exception const *p;
+	unsigned words = share_words(leaf);
+	u64 target = chunk - leaf->base_chunk;
+	unsigned i = find_run(leaf, target);
+	struct exception *p;
 
-	for (i = 0; i < leaf->count; i++)
-		if (leaf->map[i].rchunk == target)
-			goto found;
-	return 0;
-found:
-	for (p = emap(leaf, i); p < emap(leaf, i+1); p++)
+	if (!run_holds(leaf, i, target))
+		return 0;
+	for (p = emap(leaf, i); p < emap(leaf, i+1); p = ex_next(p, words))
 		/* shared if more than one bit set including this one */
-		if ((p->share & mask)) {
-			*exception = p->chunk;
-			return !(p->share & ~mask);
+		if (mask_test(ex_share(p), snapbit)) {
+			*exception = *ex_chunk(p, words) + (target - leaf->map[i].rchunk);
+			return mask_weight(ex_share(p), words) == 1;
 		}
 	return 0;
 }
@@ -955,6 +1902,7 @@ found:
  *      - move tail of map up
  *      - store new chunk address in map
  *  - otherwise
+ *      - split the chunk out of its run, if any
  *      - for origin:
  *          - or together all sharemaps, invert -> new map
  *      - for snapshot:
@@ -964,6 +1912,7 @@ found:
  *      - move head of exceptions down
  *      - store new exception/sharemap
  *      - adjust map head offsets
+ *  - join the chunk onto neighbouring runs it carries on
  *
  * If the new exception won't fit in the leaf, return an error so that
  * higher level code may split the leaf and try again.  This keeps the
@@ -991,48 +1940,147 @@ static unsigned leaf_payload(struct eleaf *leaf)
 	return lower + upper;
 }
 
+/*
+ * Split the run of map entry i in two at the given chunk of the run, giving
+ * the tail a new map entry and a copy of the exception list, each exception
+ * moved on by the length of the head.  Return an error if there isn't room
+ * for the copy.
+ */
+static int split_run(struct eleaf *leaf, unsigned i, unsigned at)
+{
+	struct exception *exceptions = emap(leaf, 0), *end = emap(leaf, i+1), *p, *q;
+	unsigned j, size = (char *)end - (char *)emap(leaf, i), run = map_run(&leaf->map[i]), words = share_words(leaf);
+
+	assert(at && at < run);
+	if (leaf_freespace(leaf) < size + sizeof(struct etree_map))
+		return -EFULL;
+	memmove((char *)exceptions - size, exceptions, (char *)end - (char *)exceptions);
+	memmove(&leaf->map[i+2], &leaf->map[i+1], (leaf->count - i) * sizeof(struct etree_map));
+	leaf->count++;
+	for (j = 0; j <= i; j++)
+		leaf->map[j].offset -= size;
+	leaf->map[i+1].offset = (char *)end - size - (char *)leaf;
+	leaf->map[i+1].rchunk = leaf->map[i].rchunk + at;
+	set_map_run(&leaf->map[i+1], run - at);
+	set_map_run(&leaf->map[i], at);
+	for (p = emap(leaf, i), q = emap(leaf, i+1); q < end; p = ex_next(p, words), q = ex_next(q, words)) {
+		memcpy(ex_share(q), ex_share(p), words * sizeof(u64));
+		*ex_chunk(q, words) = *ex_chunk(p, words) + at;
+	}
+	return 0;
+}
+
+/*
+ * Join the run of map entry i+1 onto that of map entry i if it carries on
+ * where that one ends, each exception in the same order with the same share
+ * mask and the next exception chunk.  Return true if joined.
+ */
+static int merge_runs(struct eleaf *leaf, unsigned i)
+{
+	struct exception *exceptions = emap(leaf, 0), *p, *q;
+	unsigned j, run, size, words = share_words(leaf);
+
+	if (i + 1 >= leaf->count)
+		return 0;
+	run = map_run(&leaf->map[i]);
+	size = (char *)emap(leaf, i+1) - (char *)emap(leaf, i);
+	if (leaf->map[i].rchunk + run != leaf->map[i+1].rchunk ||
+	    run + map_run(&leaf->map[i+1]) > MAX_LEAF_RUN ||
+	    (char *)emap(leaf, i+2) - (char *)emap(leaf, i+1) != size)
+		return 0;
+	for (p = emap(leaf, i), q = emap(leaf, i+1); p < emap(leaf, i+1); p = ex_next(p, words), q = ex_next(q, words))
+		if (!mask_equal(ex_share(p), ex_share(q), words) || *ex_chunk(p, words) + run != *ex_chunk(q, words))
+			return 0;
+	run += map_run(&leaf->map[i+1]);
+	memmove((char *)exceptions + size, exceptions, (char *)emap(leaf, i+1) - (char *)exceptions);
+	for (j = 0; j <= i; j++)
+		leaf->map[j].offset += size;
+	memmove(&leaf->map[i+1], &leaf->map[i+2], (leaf->count - i - 1) * sizeof(struct etree_map));
+	leaf->count--;
+	set_map_run(&leaf->map[i], run);
+	leaf->version = LEAF_VERSION;
+	return 1;
+}
+
+/*
+ * Would a chunk with just the given exception carry on the run of map
+ * entry i?
+ */
+static int extends_run(struct eleaf *leaf, unsigned i, u64 target, u64 exception, u64 const *share)
+{
+	unsigned run = map_run(&leaf->map[i]), words = share_words(leaf);
+	struct exception *p = emap(leaf, i);
+
+	return leaf->map[i].rchunk + run == target && run < MAX_LEAF_RUN && ex_next(p, words) == emap(leaf, i+1) &&
+		mask_equal(ex_share(p), share, words) && *ex_chunk(p, words) + run == exception;
+}
+
 /*
  * Add an "exception" to a b-tree leaf.
  *
  * Finds the chunk to which we're adding the exception.  If it doesn't exist
- * in the leaf, add it.  Compute the share mask and insert the exception at
- * the appropriate place.  Return an error if there isn't enough room for the
+ * in the leaf, add it, and if it is part of a run, split it out of the run.
+ * Compute the share mask and insert the exception at the appropriate place,
+ * then join the chunk back up with its neighbours where it now carries on
+ * one of their runs.  Return an error if there isn't enough room for the
  * new entry.
  */
-static int add_exception_to_leaf(struct eleaf *leaf, u64 chunk, u64 exception, int snapshot, u64 active)
+static int add_exception_to_leaf(struct superblock *sb, struct eleaf *leaf, u64 chunk, u64 exception, int snapshot, u64 const *active)
 {
-	unsigned target = chunk - leaf->base_chunk;
-	u64 mask = 1ULL << snapshot, sharemap;
-	struct exception *ins, *exceptions = emap(leaf, 0);
-	char *maptop = (char *)(&leaf->map[leaf->count + 1]); // include sentinel
-	unsigned i, j, free = (char *)exceptions - maptop;
-
-	trace(warn("chunk %Lx exception %Lx, snapshot = %i free space = %u", 
-		chunk, exception, snapshot, free););
+	unsigned target = chunk - leaf->base_chunk, words = share_words(leaf), size = ex_size(words);
+	u64 sharemap[words];
+	struct exception *ins, *exceptions;
+	char *maptop;
+	unsigned i, j, free;
+	int err;
 
 	/*
 	 * Find the chunk for which we're adding an exception entry.
 	 */
-	for (i = 0; i < leaf->count; i++) // !!! binsearch goes here
-		if (leaf->map[i].rchunk >= target)
-			break;
+	i = find_run(leaf, target);
+	if (run_holds(leaf, i, target) && map_run(&leaf->map[i]) > 1) {
+		unsigned at = target - leaf->map[i].rchunk;
+		if (at && (err = split_run(leaf, i++, at)))
+			return err;
+		if (map_run(&leaf->map[i]) > 1 && (err = split_run(leaf, i, 1)))
+			return err;
+	}
+	exceptions = emap(leaf, 0);
+	maptop = (char *)(&leaf->map[leaf->count + 1]); // include sentinel
+	free = (char *)exceptions - maptop;
+
+	trace(warn("chunk %Lx exception %Lx, snapshot = %i free space = %u", 
+		chunk, exception, snapshot, free););
 
 	/*
-	 * If we didn't find the chunk, insert a new one at map[i].
+	 * If we didn't find the chunk, insert a new one at map[i], unless
+	 * its only exception carries on the run before it.  Then just
+	 * lengthen that run, which needs no room at all.
 	 */
-	if (i == leaf->count || leaf->map[i].rchunk > target) {
-		if (free < sizeof(struct exception) + sizeof(struct etree_map))
+	if (!run_holds(leaf, i, target)) {
+		memset(sharemap, 0, sizeof(sharemap));
+		if (snapshot == -1)
+			mask_or(sharemap, active, words);
+		else
+			mask_set(sharemap, snapshot);
+		if (i && extends_run(leaf, i - 1, target, exception, sharemap)) {
+			set_map_run(&leaf->map[i-1], map_run(&leaf->map[i-1]) + 1);
+			leaf->version = LEAF_VERSION;
+			update_sharing(sb, chunk, 1, NULL, sharemap);
+			merge_runs(leaf, i - 1);
+			return 0;
+		}
+		if (free < size + sizeof(struct etree_map))
 			return -EFULL;
 		ins = emap(leaf, i);
 		memmove(&leaf->map[i+1], &leaf->map[i], maptop - (char *)&leaf->map[i]);
 		leaf->map[i].offset = (char *)ins - (char *)leaf;
 		leaf->map[i].rchunk = target;
 		leaf->count++;
-		sharemap = snapshot == -1? active: mask;
 		goto insert;
 	}
 
-	if (free < sizeof(struct exception))
+	if (free < size)
 		return -EFULL;
 	/*
 	 * Compute the share map from that of each existing exception entry
@@ -1048,17 +2096,22 @@ static int add_exception_to_leaf(struct eleaf *leaf, u64 chunk, u64 exception, i
 	 * becomes unshared).  We then set sharing for this snapshot in the
 	 * new exception entry.
 	 */
+	memset(sharemap, 0, sizeof(sharemap));
 	if (snapshot == -1) {
-		for (sharemap = 0, ins = emap(leaf, i); ins < emap(leaf, i+1); ins++)
-			sharemap |= ins->share;
-		sharemap = (~sharemap) & active;
+		for (ins = emap(leaf, i); ins < emap(leaf, i+1); ins = ex_next(ins, words))
+			mask_or(sharemap, ex_share(ins), words);
+		for (j = 0; j < words; j++)
+			sharemap[j] = ~sharemap[j] & active[j];
 	} else {
-		for (ins = emap(leaf, i); ins < emap(leaf, i+1); ins++)
-			if ((ins->share & mask)) {
-				ins->share &= ~mask;
+		for (ins = emap(leaf, i); ins < emap(leaf, i+1); ins = ex_next(ins, words))
+			if (mask_test(ex_share(ins), snapshot)) {
+				u64 share[words];
+				memcpy(share, ex_share(ins), sizeof(share));
+				mask_clear(ex_share(ins), snapshot);
+				update_sharing(sb, chunk, 1, share, ex_share(ins));
 				break;
 			}
-		sharemap = mask;
+		mask_set(sharemap, snapshot);
 	}
 	ins = emap(leaf, i);
 insert:
@@ -1068,98 +2121,165 @@ insert:
 	 * to make room for the new one, then insert the new entry in the
 	 * space freed.  Adjust the offsets for all earlier chunks.
 	 */
-	memmove(exceptions - 1, exceptions, (char *)ins - (char *)exceptions);
-	ins--;
-	ins->share = sharemap;
-	ins->chunk = exception;
+	memmove((char *)exceptions - size, exceptions, (char *)ins - (char *)exceptions);
+	ins = (struct exception *)((char *)ins - size);
+	memcpy(ex_share(ins), sharemap, sizeof(sharemap));
+	*ex_chunk(ins, words) = exception;
+	update_sharing(sb, chunk, 1, NULL, sharemap);
 
 	for (j = 0; j <= i; j++)
-		leaf->map[j].offset -= sizeof(struct exception);
+		leaf->map[j].offset -= size;
 
+	if (i && merge_runs(leaf, i - 1))
+		i--;
+	merge_runs(leaf, i);
 	return 0;
 }
 
 /*
- * Split a leaf.
- *
- * This routine splits a b-tree leaf at the middle chunk.  It copies that
- * and later map entries along with the associated lists of exceptions to
- * the new leaf.  It moves the remaining exception lists to the end of the
- * original block then adjusts the offsets for those map entries and the
- * counts for each leaf.  It returns the chunk at which the leaf was split
- * (which is now the first chunk in the new leaf).
+ * Bytes of a leaf taken by map entry i and its exception list.
  */
-static u64 split_leaf(struct eleaf *leaf, struct eleaf *leaf2)
+static unsigned entry_bytes(struct eleaf *leaf, unsigned i)
 {
-	unsigned i, nhead = (leaf->count + 1) / 2, ntail = leaf->count - nhead, tailsize;
-	/* Should split at middle of data instead of median exception */
-	u64 splitpoint = leaf->map[nhead].rchunk + leaf->base_chunk;
-	char *phead, *ptail;
+	return sizeof(struct etree_map) + (char *)emap(leaf, i+1) - (char *)emap(leaf, i);
+}
 
-	phead = (char *)emap(leaf, 0);
-	ptail = (char *)emap(leaf, nhead);
-	tailsize = (char *)emap(leaf, leaf->count) - ptail;
+/*
+ * Move the last n map entries of 'leaf,' along with their exception lists,
+ * to the front of 'leaf2,' which follows it.  Make room in 'leaf2' by moving
+ * its map entries up, copy the lists in below its own and point the moved
+ * entries at them, then move the remaining lists in 'leaf' to the end of the
+ * block.  The caller checks that 'leaf2' has room.
+ */
+static void move_tail(struct eleaf *leaf, struct eleaf *leaf2, unsigned n)
+{
+	unsigned i, nhead = leaf->count - n, end = map_offset(&leaf->map[leaf->count]);
+	char *phead = (char *)emap(leaf, 0), *ptail = (char *)emap(leaf, nhead);
+	unsigned tailsize = (char *)emap(leaf, leaf->count) - ptail;
+	unsigned dest = map_offset(&leaf2->map[0]) - tailsize, from = map_offset(&leaf->map[nhead]);
 
-	/* Copy upper half to new leaf */
-	memcpy(leaf2, leaf, offsetof(struct eleaf, map)); // header
-	memcpy(&leaf2->map[0], &leaf->map[nhead], (ntail + 1) * sizeof(struct etree_map)); // map
-	memcpy(ptail - (char *)leaf + (char *)leaf2, ptail, tailsize); // data
-	leaf2->count = ntail;
+	assert(leaf_freespace(leaf2) >= tailsize + n * sizeof(struct etree_map));
+	memmove(&leaf2->map[n], &leaf2->map[0], (leaf2->count + 1) * sizeof(struct etree_map));
+	memcpy(&leaf2->map[0], &leaf->map[nhead], n * sizeof(struct etree_map)); // map
+	for (i = 0; i < n; i++)
+		set_map_offset(&leaf2->map[i], map_offset(&leaf2->map[i]) - from + dest);
+	memcpy((char *)leaf2 + dest, ptail, tailsize); // data
+	leaf2->count += n;
+	if (leaf->version > leaf2->version)
+		leaf2->version = leaf->version;
 
-	/* Move lower half to top of block */
 	memmove(phead + tailsize, phead, ptail - phead);
-	leaf->count = nhead;
-	for (i = 0; i <= nhead; i++) // also adjust sentinel
+	for (i = 0; i < nhead; i++)
 		leaf->map[i].offset += tailsize;
-	leaf->map[nhead].rchunk = 0; // tidy up
+	leaf->map[nhead] = (struct etree_map){ .offset = end }; // new sentinel
+	leaf->count = nhead;
+}
 
-	return splitpoint;
+/*
+ * Move the first n map entries of 'leaf2,' along with their exception lists,
+ * to the end of 'leaf,' which it follows.  Move the exception lists in 'leaf'
+ * down to make room, copy in the map entries and lists, then drop the moved
+ * map entries from 'leaf2,' whose remaining lists stay where they are.  The
+ * caller checks that 'leaf' has room.
+ */
+static void move_head(struct eleaf *leaf, struct eleaf *leaf2, unsigned n)
+{
+	unsigned i, nhead = leaf->count, end = map_offset(&leaf->map[nhead]);
+	unsigned headsize = (char *)emap(leaf2, n) - (char *)emap(leaf2, 0);
+	unsigned from = map_offset(&leaf2->map[0]);
+	char *phead = (char *)emap(leaf, 0);
+
+	assert(leaf_freespace(leaf) >= headsize + n * sizeof(struct etree_map));
+	memmove(phead - headsize, phead, (char *)leaf + end - phead);
+	for (i = 0; i < nhead; i++)
+		leaf->map[i].offset -= headsize;
+	memcpy(&leaf->map[nhead], &leaf2->map[0], n * sizeof(struct etree_map)); // map
+	for (i = nhead; i < nhead + n; i++)
+		set_map_offset(&leaf->map[i], map_offset(&leaf->map[i]) - from + end - headsize);
+	memcpy((char *)leaf + end - headsize, (char *)leaf2 + from, headsize); // data
+	leaf->map[nhead + n] = (struct etree_map){ .offset = end }; // sentinel
+	leaf->count += n;
+	if (leaf2->version > leaf->version)
+		leaf->version = leaf2->version;
+
+	memmove(&leaf2->map[0], &leaf2->map[n], (leaf2->count - n + 1) * sizeof(struct etree_map));
+	leaf2->count -= n;
 }
 
 /*
- * Merge the contents of 'leaf2' into 'leaf.'  The leaves are contiguous and
- * 'leaf2' follows 'leaf.'  Move the exception lists in 'leaf' up to make room
- * for those of 'leaf2,' adjusting the offsets in the map entries, then copy
- * the map entries and exception lists straight from 'leaf2.'
+ * The number of leading map entries of a leaf that hold about the given
+ * bytes of its payload, counting an entry in if at least half of it fits.
  */
-static void merge_leaves(struct eleaf *leaf, struct eleaf *leaf2)
+static unsigned leaf_entries_within(struct eleaf *leaf, unsigned bytes)
 {
-	unsigned nhead = leaf->count, ntail = leaf2->count, i;
-	unsigned tailsize = (char *)emap(leaf2, ntail) - (char *)emap(leaf2, 0);
-	char *phead = (char *)emap(leaf, 0), *ptail = (char *)emap(leaf, nhead);
+	unsigned i, head = 0;
+
+	for (i = 0; i < leaf->count; i++) {
+		unsigned size = entry_bytes(leaf, i);
+		if (head + size / 2 > bytes)
+			break;
+		head += size;
+	}
+	return i;
+}
 
-	// move data down
-	memmove(phead - tailsize, phead, ptail - phead);
+/*
+ * Split a leaf.
+ *
+ * This routine moves the map entries of a b-tree leaf from the given one on,
+ * along with their lists of exceptions, to a new leaf.  It returns the chunk
+ * at which the leaf was split (which is now the first chunk in the new leaf).
+ */
+static u64 split_leaf(struct eleaf *leaf, struct eleaf *leaf2, unsigned nhead)
+{
+	u64 splitpoint = leaf->map[nhead].rchunk + leaf->base_chunk;
 
-	// adjust pointers
-	for (i = 0; i <= nhead; i++) // also adjust sentinel
-		leaf->map[i].offset -= tailsize;
+	move_tail(leaf, leaf2, leaf->count - nhead);
+	return splitpoint;
+}
 
-	// move data from leaf2 to top
-	memcpy(ptail - tailsize, (char *)emap(leaf2, 0), tailsize); // data
-	memcpy(&leaf->map[nhead], &leaf2->map[0], (ntail + 1) * sizeof(struct etree_map)); // map
-	leaf->count += ntail;
+/*
+ * Merge the contents of 'leaf2' into 'leaf.'  The leaves are contiguous and
+ * 'leaf2' follows 'leaf.'
+ */
+static void merge_leaves(struct eleaf *leaf, struct eleaf *leaf2)
+{
+	move_head(leaf, leaf2, leaf2->count);
 }
 
 /*
- * Copy the index entries in 'node2' into 'node.'
+ * Copy the children of 'node2' into 'node.'  The first child of 'node2' has
+ * no key there, so it takes 'key,' where the range of 'node2' starts.
  */
-static void merge_nodes(struct enode *node, struct enode *node2)
+static void merge_nodes(struct superblock *sb, struct enode *node, struct enode *node2, u64 key)
 {
-	memcpy(&node->entries[node->count], &node2->entries[0], node2->count * sizeof(struct index_entry));
+	unsigned count = node->count;
+
+	if (!node2->count)
+		return;
+	memcpy(node_sectors(sb, node) + count, node_sectors(sb, node2), node2->count * sizeof(sector_t));
+	node_keys(node)[count] = key;
+	memcpy(node_keys(node) + count + 1, node_keys(node2) + 1, (node2->count - 1) * sizeof(u64));
 	node->count += node2->count;
 }
 
-static void init_leaf(struct eleaf *leaf, int block_size)
+/* exceptions fill a leaf down from here, the end of the block unless BUSHY */
+static inline unsigned leaf_top(unsigned block_size)
+{
+#ifdef BUSHY
+	return 200;
+#endif
+	return block_size;
+}
+
+static void init_leaf(struct eleaf *leaf, int block_size, unsigned share_words)
 {
 	leaf->magic = 0x1eaf;
-	leaf->version = 0;
+	leaf->version = LEAF_VERSION;
 	leaf->base_chunk = 0;
 	leaf->count = 0;
-	leaf->map[0].offset = block_size;
-#ifdef BUSHY
-	leaf->map[0].offset = 200;
-#endif
+	leaf->share_words = share_words > 1 ? share_words : 0;
+	leaf->map[0].offset = leaf_top(block_size);
 }
 
 static void set_sb_dirty(struct superblock *sb)
@@ -1170,6 +2290,9 @@ static void set_sb_dirty(struct superblock *sb)
 static void save_sb(struct superblock *sb)
 {
 	if (sb->runflags & RUN_SB_DIRTY) {
+		if (sb->snaptable && sb->image.snaptable && diskwrite(sb->metadev, sb->snaptable,
+			sb->image.snaptable_blocks << sb->metadata.asi->allocsize_bits, sb->image.snaptable << SECTOR_BITS) < 0)
+			warn("Unable to write snapshot table to disk: %s", strerror(errno));
 		if (diskwrite(sb->metadev, &sb->image, 4096, SB_SECTOR << SECTOR_BITS) < 0)
 			warn("Unable to write superblock to disk: %s", strerror(errno));
 		sb->runflags &= ~RUN_SB_DIRTY;
@@ -1241,6 +2364,7 @@ static void init_bitmap_blocks(struct superblock *sb, unsigned bitmap_base, unsi
  *    4k ddsnap superblock
  *    bitmap blocks
  *    journal blocks
+ *    snapshot table blocks, with wide share masks
  *    btree and copied out blocks
  */
 
@@ -1252,7 +2376,9 @@ static int init_allocation(struct superblock *sb)
 	sb->metadata.asi->bitmap_base = meta_bitmap_base_chunk << sb->metadata.chunk_sectors_bits;
 	sb->metadata.asi->last_alloc = 0;
 
-	unsigned reserved = meta_bitmap_base_chunk + sb->metadata.asi->bitmap_blocks + sb->image.journal_size;
+	if (sb->snaptable)
+		sb->image.snaptable_blocks = DIVROUND(snaptable_bytes(sb->share_words), sb->metadata.allocsize);
+	unsigned reserved = meta_bitmap_base_chunk + sb->metadata.asi->bitmap_blocks + sb->image.journal_size + sb->image.snaptable_blocks;
 
 	/*
 	 * If we're using combined snapshot and metadata, we don't need to
@@ -1274,6 +2400,8 @@ static int init_allocation(struct superblock *sb)
 		+ ((sb->metadata.asi->bitmap_blocks +
 		    (!combined(sb) ? sb->snapdata.asi->bitmap_blocks : 0)) 
 		   << sb->metadata.chunk_sectors_bits);
+	if (sb->snaptable)
+		sb->image.snaptable = sb->image.journal_base + ((sector_t)sb->image.journal_size << sb->metadata.chunk_sectors_bits);
 	
 	if (!combined(sb))
 		warn("metadata store size: %Li chunks (%Li sectors)", 
@@ -1296,8 +2424,11 @@ static int free_chunk(struct superblock *sb, struct allocspace *as, chunk_t chun
 	u64 bitmap_block = chunk >> bitmap_shift;
 
 	trace(printf("free chunk %Lx\n", chunk););
-	struct buffer *buffer = snapread(sb, as->asi->bitmap_base + 
-			(bitmap_block << sb->metadata.chunk_sectors_bits));
+	if (undefer_alloc(sb, as, chunk)) {
+		as->asi->freechunks++;
+		return 1;
+	}
+	struct buffer *buffer = snapread(sb, bitmap_sector(sb, as, bitmap_block));
 	
 	if (!buffer) {
 		warn("unable to free chunk %Lu", (llu_t) chunk);
@@ -1331,35 +2462,24 @@ static void grab_chunk(struct superblock *sb, struct allocspace *as, chunk_t chu
 	unsigned bitmap_shift = sb->metadata.asi->allocsize_bits + 3, bitmap_mask = (1 << bitmap_shift ) - 1;
 	u64 bitmap_block = chunk >> bitmap_shift;
 
-	struct buffer *buffer = snapread(sb, as->asi->bitmap_base + (bitmap_block << sb->metadata.chunk_sectors_bits));
+	struct buffer *buffer = snapread(sb, bitmap_sector(sb, as, bitmap_block));
 	assert(!get_bitmap_bit(buffer->data, chunk & bitmap_mask));
 	set_bitmap_bit(buffer->data, chunk & bitmap_mask);
 	brelse_dirty(buffer);
 }
 #endif
 
-static int chunk_within(chunk_t chunk, chunk_t start, chunk_t count)
-{
-	return chunk - start < count; // chunk_t must be unsigned!
-}
-
-static int is_deferred_alloc(struct superblock *sb, chunk_t chunk)
+static void show_deferred_alloc(struct superblock *sb, struct allocspace *as)
 {
-	if (chunk_within(chunk, sb->defer.chunk, sb->defer.count))
-		return 1;
-	for (int i = 0; i < sb->deferred_allocs; i++)
-		if (chunk_within(chunk, sb->deferred_alloc[i].chunk, sb->deferred_alloc[i].count))
-			return 1;
-	return 0;
-}
-
-static void show_deferred_alloc(struct superblock *sb)
-{
-	unsigned count = sb->defer.count;
-	printf("deferred chunk %Li count %u\n", sb->defer.chunk, count);
-	for (int i = 0; i < sb->deferred_allocs; i++) {
-		count = sb->deferred_alloc[i].count;
-		printf("deferred chunk %Li count %u\n", sb->deferred_alloc[i].chunk, count);
+	struct deferred *def = deferred(sb, as);
+	unsigned count;
+	for (int i = 0; i < def->pendings; i++) {
+		count = def->pending[i].count;
+		printf("deferred chunk %Li count %u\n", def->pending[i].chunk, count);
+	}
+	for (int i = 0; i < def->count; i++) {
+		count = def->range[i].count;
+		printf("deferred chunk %Li count %u\n", def->range[i].chunk, count);
 	}
 }
 
@@ -1375,7 +2495,7 @@ static void show_deferred_alloc(struct superblock *sb)
  * beginning.  If it exhausts the range it's searching without finding a free
  * chunk, return failure.
  */
-static chunk_t alloc_chunk_from_range(struct superblock *sb, struct allocspace *as, chunk_t startchunk, chunk_t nchunks)
+static chunk_t alloc_chunk_from_range(struct superblock *sb, struct allocspace *as, chunk_t startchunk, chunk_t nchunks, u64 *scanned)
 {
 	/*
 	 * Set up a useful few bits of information here:
@@ -1397,12 +2517,13 @@ static chunk_t alloc_chunk_from_range(struct superblock *sb, struct allocspace *
 	u64 length = (nchunks + bit + 7) >> 3;
 
 	while (1) {
-		struct buffer *buffer = snapread(sb, as->asi->bitmap_base + (blocknum << sb->metadata.chunk_sectors_bits));
+		struct buffer *buffer = snapread(sb, bitmap_sector(sb, as, blocknum));
 		if (!buffer)
 			return -1;
 		unsigned char c, *p = buffer->data + offset;
 		unsigned tail = sb->metadata.allocsize - offset, n = tail > length? length: tail;
 		trace(printf("search %u bytes of bitmap %Lx from offset %u\n", n, blocknum, offset););
+		*scanned += n;
 		for (length -= n; n--; p++)
 			if ((c = *p) != 0xff) {
 				trace_off(printf("found byte at offset %u of bitmap %Lx = %hhx\n", p - buffer->data, blocknum, c););
@@ -1411,28 +2532,20 @@ static chunk_t alloc_chunk_from_range(struct superblock *sb, struct allocspace *
 					if (!(c & bit) ) {
 						chunk_t chunk = i + ((p - buffer->data) << 3) + (blocknum << bitmap_shift);
 
-						if (is_deferred_alloc(sb, chunk))
+						if (is_deferred_alloc(sb, as, chunk))
 							continue;
 
 						if (get_bitmap_bit(buffer->data, chunk & bitmap_mask)) {
 							warn("chunk %Li already in use", chunk);
-							show_deferred_alloc(sb);
+							show_deferred_alloc(sb, as);
 						}
 						assert(!get_bitmap_bit(buffer->data, chunk & bitmap_mask));
-						if (deferring(sb) && sb->deferred_allocs < MAX_DEFERRED_ALLOCS) {
-							if (!sb->defer.count) {
-								sb->defer.chunk = chunk;
-								sb->defer.count = 1;
-								goto success;
-							}
-							if (chunk == sb->defer.chunk + 1) {
-								sb->defer.count++;
-								goto success;
-							}
-						}
+						if (deferring(sb) && defer_alloc(sb, as, chunk))
+							goto success;
 						set_bitmap_bit(buffer->data, chunk & bitmap_mask);
 						set_buffer_dirty(buffer);
 success:
+						*scanned -= n; /* the bytes past this one */
 						brelse(buffer);
 						as->asi->freechunks--;
 						set_sb_dirty(sb); // !!! optimize this away
@@ -1456,7 +2569,7 @@ success:
  * btree entry lookup
  */
 
-struct etree_path { struct buffer *buffer; struct index_entry *pnext; };
+struct etree_path { struct buffer *buffer; unsigned next; };
 
 static inline struct enode *path_node(struct etree_path path[], int level)
 {
@@ -1473,37 +2586,107 @@ static void brelse_path(struct etree_path *path, unsigned levels)
 		brelse(path[i].buffer);
 }
 
+/*
+ * Find the child following the one whose subtree holds the chunk: the first
+ * after child 0, which has no key, with a key past the chunk, or the count.
+ * A node holds hundreds of children, so search their keys by halves, with a
+ * select rather than a branch on each comparison, which would be taken at
+ * random and mispredicted half the time.
+ */
+static unsigned find_child(struct enode *node, u64 chunk)
+{
+	u64 *keys = node_keys(node), *base = keys + 1;
+	unsigned len = node->count - 1;
+
+	while (len > 1) {
+		unsigned half = len / 2;
+		base = base[half - 1] <= chunk ? base + half : base;
+		len -= half;
+	}
+	return base - keys + (len && *base <= chunk);
+}
+
+/*
+ * Forget the last probe path, as any change to the index nodes must, or to
+ * the leaves they point at.
+ */
+static inline void forget_finger(struct superblock *sb)
+{
+	sb->finger_levels = 0;
+}
+
+/*
+ * The deepest level of the last probe path that maps the chunk, or zero to
+ * start from the root.  Its buffers are not held, so each down to that level
+ * must still hold its block: it may since have been evicted or reused.
+ */
+static unsigned finger_level(struct superblock *sb, u64 chunk)
+{
+	struct finger *finger = sb->finger;
+	unsigned level, i;
+
+	if (sb->finger_levels != sb->image.etree_levels)
+		return 0;
+	for (level = sb->finger_levels; level; level--)
+		if (finger[level].start <= chunk && chunk < finger[level].limit)
+			break;
+	for (i = 0; i <= level; i++)
+		if (finger[i].buffer->sector != finger[i].sector || finger[i].buffer->state == BUFFER_STATE_INVAL)
+			return 0;
+	return level;
+}
+
 /*
  * Find the b-tree leaf for the passed chunk.  Record the chain of enodes
  * leading from the root to that leaf in the passed etree_path.  Each element
  * of that path gets a buffer containing the enode at that level of the path
  * and a pointer to the next index entry in that enode.
+ *
+ * Chunks mostly come in runs, so the path is kept as a finger for the next
+ * probe, which takes what it can of it without looking the blocks up again
+ * and only searches below the deepest node or leaf that maps its chunk.
  */
 static struct buffer *probe(struct superblock *sb, u64 chunk, struct etree_path *path)
 {
-	unsigned i, levels = sb->image.etree_levels;
-	struct buffer *nodebuf = snapread(sb, sb->image.etree_root);
-	if (!nodebuf)
-		return NULL;
-	struct enode *node = buffer2node(nodebuf);
+	unsigned i, levels = sb->image.etree_levels, start = finger_level(sb, chunk);
+	int keep = levels <= FINGER_LEVELS;
+	struct finger *finger = sb->finger;
+	struct buffer *nodebuf;
 
-	for (i = 0; i < levels; i++) {
-		struct index_entry *pnext = node->entries, *top = pnext + node->count;
+	for (i = 0; i < start; i++)
+		path[i] = (struct etree_path){ bget(finger[i].buffer), finger[i].next };
+	forget_finger(sb);
+	if (start)
+		nodebuf = bget(finger[start].buffer);
+	else {
+		if (!(nodebuf = read_node(sb, sb->image.etree_root)))
+			return NULL;
+		finger[0] = (struct finger){ nodebuf, nodebuf->sector, 0, -1 };
+	}
 
-		while (++pnext < top)
-			if (pnext->key > chunk)
-				break;
+	for (i = start; i < levels; i++) {
+		struct enode *node = buffer2node(nodebuf);
+		unsigned next = find_child(node, chunk);
+		sector_t child = node_sectors(sb, node)[next - 1];
 
 		path[i].buffer = nodebuf;
-		path[i].pnext = pnext;
-		nodebuf = snapread(sb, (pnext - 1)->sector);
+		path[i].next = next;
+		nodebuf = i + 1 < levels ? read_node(sb, child) : snapread(sb, child);
 		if (!nodebuf) {
-			brelse_path(path, i);
+			brelse_path(path, i + 1);
 			return NULL;
 		}
-		node = (struct enode *)nodebuf->data;
+		if (keep) {
+			finger[i].next = next;
+			finger[i + 1] = (struct finger){ nodebuf, nodebuf->sector,
+				next == 1 ? finger[i].start : node_keys(node)[next - 1],
+				next == node->count ? finger[i].limit : node_keys(node)[next] };
+		}
 	}
+	if (keep)
+		sb->finger_levels = levels;
 	assert(((struct eleaf *)nodebuf->data)->magic == 0x1eaf);
+	assert(((struct eleaf *)nodebuf->data)->version <= LEAF_VERSION);
 	return nodebuf;
 }
 
@@ -1538,16 +2721,18 @@ static int traverse_tree_range(
 		 * middle of a non-leaf-level node and start from there.
 		 */
 		do {
+			sector_t sector = level < 0 ? sb->image.etree_root :
+				node_sectors(sb, node)[path[level].next++];
 			level++;
-			nodebuf = snapread(sb, level? path[level - 1].pnext++->sector: sb->image.etree_root);
+			nodebuf = read_node(sb, sector);
 			if (!nodebuf) {
 				warn("unable to read node at sector 0x%Lx at level %d of tree traversal",
-					level? path[level - 1].pnext++->sector: sb->image.etree_root, level);
+					sector, level);
 				return -EIO;
 			}
 			node = buffer2node(nodebuf);
 			path[level].buffer = nodebuf;
-			path[level].pnext = node->entries;
+			path[level].next = 0;
 			trace(printf("push to level %i, %i nodes\n", level, node->count););
 		} while (level < levels - 1);
 
@@ -1556,11 +2741,10 @@ static int traverse_tree_range(
 		 * Process the leaves in this node.  Call the passed function
 		 * for each.
 		 */
-		while (path[level].pnext < node->entries + node->count) {
-			leafbuf = snapread(sb, path[level].pnext++->sector);
-			if (!leafbuf) {
-				warn("unable to read leaf at sector 0x%Lx of tree traversal",
-					level? path[level - 1].pnext++->sector: sb->image.etree_root);
+		while (path[level].next < node->count) {
+			sector_t sector = node_sectors(sb, node)[path[level].next++];
+			if (!(leafbuf = snapread(sb, sector))) {
+				warn("unable to read leaf at sector 0x%Lx of tree traversal", sector);
 				return -EIO;
 			}
 start:
@@ -1580,8 +2764,8 @@ start:
 				return 0;
 			nodebuf = path[--level].buffer;
 			node = buffer2node(nodebuf);
-			trace(printf("pop to level %i, %i of %i nodes\n", level, path[level].pnext - node->entries, node->count););
-		} while (path[level].pnext == node->entries + node->count);
+			trace(printf("pop to level %i, %i of %i nodes\n", level, path[level].next, node->count););
+		} while (path[level].next == node->count);
 	}
 }
 
@@ -1589,14 +2773,28 @@ start:
  * btree debug dump
  */
 
+static void show_exception(struct exception *p, unsigned words)
+{
+	printf("%Lx/%08llx", *ex_chunk(p, words), ex_share(p)[words - 1]);
+	for (unsigned k = words - 1; k--;)
+		printf("%016llx", ex_share(p)[k]);
+}
+
 static void show_leaf_range(struct eleaf *leaf, chunk_t start, chunk_t finish)
 {
+	unsigned words = share_words(leaf);
+
 	for (int i = 0; i < leaf->count; i++) {
 		chunk_t addr = leaf->map[i].rchunk;
 		if (addr >= start && addr <= finish) {
-			printf("Addr %Lu: ", (unsigned long long) addr);
-			for (struct exception *p = emap(leaf, i); p < emap(leaf, i+1); p++)
-				printf("%Lx/%08llx, ", p->chunk, p->share);
+			printf("Addr %Lu", (unsigned long long) addr);
+			if (map_run(&leaf->map[i]) > 1)
+				printf("+%u", map_run(&leaf->map[i]));
+			printf(": ");
+			for (struct exception *p = emap(leaf, i); p < emap(leaf, i+1); p = ex_next(p, words)) {
+				show_exception(p, words);
+				printf(", ");
+			}
 			printf("\n");
 		}
 	}
@@ -1614,7 +2812,8 @@ static void show_subtree_range(struct superblock *sb, struct enode *node, chunk_
 	int i;
 
 	for (i = 0; i < node->count; i++) {
-		struct buffer *buffer = snapread(sb, node->entries[i].sector);
+		sector_t sector = node_sectors(sb, node)[i];
+		struct buffer *buffer = levels ? read_node(sb, sector) : snapread(sb, sector);
 		if (levels)
 			show_subtree_range(sb, buffer2node(buffer), start, finish, levels - 1, indent + 3);
 		else {
@@ -1626,7 +2825,7 @@ static void show_subtree_range(struct superblock *sb, struct enode *node, chunk_
 
 static void show_tree_range(struct superblock *sb, chunk_t start, chunk_t finish)
 {
-	struct buffer *buffer = snapread(sb, sb->image.etree_root);
+	struct buffer *buffer = read_node(sb, sb->image.etree_root);
 	if (!buffer)
 		return;
 	show_subtree_range(sb, buffer2node(buffer), start, finish, sb->image.etree_levels - 1, 0);
@@ -1640,25 +2839,28 @@ static void show_tree(struct superblock *sb)
 }
 #endif
 
-static void check_leaf(struct eleaf *leaf, u64 snapmask)
+static void check_leaf(struct eleaf *leaf, u64 const *snapmask)
 {
+	unsigned words = share_words(leaf);
 	struct exception *p;
 	int i;
 
 	for (i = 0; i < leaf->count; i++) {
-		trace(printf("%x=", leaf->map[i].rchunk););
+		trace(printf("%x+%u=", leaf->map[i].rchunk, map_run(&leaf->map[i])););
 		// printf("@%i ", leaf->map[i].offset);
-		for (p = emap(leaf, i); p < emap(leaf, i+1); p++) {
+		for (p = emap(leaf, i); p < emap(leaf, i+1); p = ex_next(p, words)) {
 			// !!! should also check for any zero sharemaps here
-			trace(printf("%Lx/%08llx%s", p->chunk, p->share, p+1 < emap(leaf, i+1)? ",": " "););
-			if (p->share & snapmask)
-				printf("nonzero bits %016Lx outside snapmask %016Lx\n", p->share, snapmask);
+			trace(show_exception(p, words); printf("%s", ex_next(p, words) < emap(leaf, i+1)? ",": " "););
+			if (mask_intersects(ex_share(p), snapmask, words)) {
+				printf("nonzero bits ");
+				show_exception(p, words);
+				printf(" outside snapmask %016Lx\n", snapmask[0]);
+			}
 		}
 	}
 	// printf("top@%i", leaf->map[i].offset);
 }
 
-#define MAX_BTREE_DIRTY	10 // max dirty buffers generated in a btree operation, depends on how bushy the btree is
 
 /*
  * Check if the number of dirty buffers meets or exceeds the size of the 
@@ -1668,7 +2870,7 @@ static void check_leaf(struct eleaf *leaf, u64 snapmask)
  */
 static void dirty_buffer_count_check(struct superblock *sb)
 {
-	if ((int)dirty_buffer_count >= (int)(sb->image.journal_size - MAX_BTREE_DIRTY)) {
+	if ((int)dirty_buffer_count >= transaction_limit(sb) - MAX_BTREE_DIRTY) {
 		if (dirty_buffer_count > sb->image.journal_size) {
 			warn("number of dirty buffers %d is too large for journal %u", dirty_buffer_count, sb->image.journal_size);
 			abort();
@@ -1680,8 +2882,8 @@ static void dirty_buffer_count_check(struct superblock *sb)
 /* FIXME: the structure is only used to pass info between two functions */
 struct delete_info
 {
-	u64 snapmask;
-	u64 any;
+	u64 const *snapmask;
+	int any;
 };
 
 /*
@@ -1699,7 +2901,7 @@ static void _delete_snapshots_from_leaf(struct superblock *sb, struct eleaf *lea
 	/* p points just past the last map[] entry in the leaf. */
 	struct exception *p = emap(leaf, leaf->count), *dest = p;
 	struct etree_map *pmap, *dmap;
-	unsigned i;
+	unsigned i, words = share_words(leaf), size = ex_size(words);
 
 	dinfo->any = 0;
 
@@ -1719,18 +2921,24 @@ static void _delete_snapshots_from_leaf(struct superblock *sb, struct eleaf *lea
 		 * False the first time through, since i is leaf->count and p
 		 * was set to emap(leaf, leaf->count) above.
 		 */
+		unsigned run = map_run(&leaf->map[i]);
 		while (p != emap(leaf, i)) {
-			u64 share = (--p)->share;
-			dinfo->any |= share & dinfo->snapmask;
+			u64 share[words];
+			p = (struct exception *)((char *)p - size);
+			memcpy(share, ex_share(p), sizeof(share));
+			dinfo->any |= mask_intersects(share, dinfo->snapmask, words);
 					/* Unshare with given snapshot(s).    */
-			p->share &= ~dinfo->snapmask;
-			if (p->share)	/* If still used, keep chunk.         */
-				*--dest = *p;
-			else
-				free_exception(sb, p->chunk);
+			mask_andnot(ex_share(p), dinfo->snapmask, words);
+			update_sharing(sb, leaf->base_chunk + leaf->map[i].rchunk, run, share, ex_share(p));
+			if (!mask_empty(ex_share(p), words)) {	/* If still used, keep chunk. */
+				dest = (struct exception *)((char *)dest - size);
+				memmove(dest, p, size);
+			} else
+				for (unsigned k = 0; k < run; k++)
+					free_exception(sb, *ex_chunk(p, words) + k);
 			dirty_buffer_count_check(sb);
 		}
-		leaf->map[i].offset = (char *)dest - (char *)leaf;
+		set_map_offset(&leaf->map[i], (char *)dest - (char *)leaf);
 	}
 	/* Remove empties from map */
 	/*
@@ -1741,19 +2949,27 @@ static void _delete_snapshots_from_leaf(struct superblock *sb, struct eleaf *lea
 	 */
 	dmap = pmap = &leaf->map[0];
 	for (i = 0; i < leaf->count; i++, pmap++)
-		if (pmap->offset != (pmap + 1)->offset)
+		if (map_offset(pmap) != map_offset(pmap + 1))
 			*dmap++ = *pmap;
 	/*
 	 * There is always a phantom map entry after the last, that has the
 	 * offset of the end of the leaf and, of course, no chunk number.
 	 */
-	dmap->offset = pmap->offset;
+	dmap->offset = map_offset(pmap);
 	dmap->rchunk = 0; // tidy up
 	leaf->count = dmap - &leaf->map[0];
+	/*
+	 * Chunks that differed only in exceptions of the deleted snapshots
+	 * may now join up into runs.
+	 */
+	if (dinfo->any)
+		for (i = 0; i < leaf->count;)
+			if (!merge_runs(leaf, i))
+				i++;
 	check_leaf(leaf, dinfo->snapmask);
 }
 
-static int delete_snapshots_from_leaf(struct superblock *sb, struct eleaf *leaf, u64 snapmask)
+static int delete_snapshots_from_leaf(struct superblock *sb, struct eleaf *leaf, u64 const *snapmask)
 {
 	struct delete_info dinfo;
 
@@ -1761,7 +2977,7 @@ static int delete_snapshots_from_leaf(struct superblock *sb, struct eleaf *leaf,
 
 	_delete_snapshots_from_leaf(sb, leaf, &dinfo);
 
-	return !!dinfo.any;
+	return dinfo.any;
 }
 
 /*
@@ -1782,51 +2998,63 @@ static int delete_snapshots_from_leaf(struct superblock *sb, struct eleaf *leaf,
  */
 
 /*
- * Return true if path[level].pnext points at the end of the list of index
- * entries.
+ * Return true if path[level].next is past the last child of the node.
  */
 static inline int finished_level(struct etree_path path[], int level)
 {
-	struct enode *node = path_node(path, level);
-	return path[level].pnext == node->entries + node->count;
+	return path[level].next == path_node(path, level)->count;
+}
+
+/*
+ * The key where the range of the node at the given level of the path starts:
+ * that of the child it is in the first node above it where it is not child 0.
+ * There must be one, the node is not the first in the tree.
+ */
+static u64 path_start(struct etree_path path[], int level)
+{
+	while (path[--level].next == 1)
+		assert(level);
+	return node_keys(path_node(path, level))[path[level].next - 1];
 }
 
 /*
- * Remove the index entry at path[level].pnext-1 by moving entries below it up
- * into its place.  If it wasn't the last entry in the node but it _was_ the
- * first entry (and we're not at the root), preserve the key by inserting it
- * into the index entry of the parent node that refers to this node.
+ * Remove the child before path[level].next by moving those after it down
+ * into its place.  If it wasn't the last child in the node but it _was_ the
+ * first (and we're not at the root), preserve the key by inserting it into
+ * the node above that refers to this node.
  */
-static void remove_index(struct etree_path path[], int level)
+static void remove_index(struct superblock *sb, struct etree_path path[], int level)
 {
 	struct enode *node = path_node(path, level);
-	chunk_t pivot = (path[level].pnext)->key; // !!! out of bounds for delete of last from full index
-	int count = node->count, i;
-
-	// stomps the node count (if 0th key holds count)
-	memmove(path[level].pnext - 1, path[level].pnext,
-		(char *)&node->entries[count] - (char *)path[level].pnext);
-	node->count = count - 1;
-	--(path[level].pnext);
+	unsigned count = node->count, child = path[level].next - 1, i;
+	u64 *keys = node_keys(node) + (child ? child : 1);
+	sector_t *sectors = node_sectors(sb, node) + child;
+	chunk_t pivot = path[level].next < count ? node_keys(node)[path[level].next] : 0;
+
+	memmove(sectors, sectors + 1, (count - child - 1) * sizeof(*sectors));
+	if (keys + 1 < node_keys(node) + count)
+		memmove(keys, keys + 1, (node_keys(node) + count - keys - 1) * sizeof(*keys));
+	node->count = --count;
+	path[level].next = child;
 	set_buffer_dirty(path[level].buffer);
 
 	// no pivot for last entry
-	if (path[level].pnext == node->entries + node->count)
+	if (child == count)
 		return;
 
 	// climb up to common parent and set pivot to deleted key
 	// what if index is now empty? (no deleted key)
 	// then some key above is going to be deleted and used to set pivot
-	if (path[level].pnext == node->entries && level) {
-		/* Keep going up the path if we're at the first index entry. */
-		for (i = level - 1; path[i].pnext - 1 == path_node(path, i)->entries; i--)
+	if (!child && level) {
+		/* Keep going up the path if we're at the first child. */
+		for (i = level - 1; path[i].next == 1; i--)
 			if (!i)		/* If we hit the root, we're done.    */
 				return;
 		/*
-		 * Found a node where we're not at the first entry.  Set the
-		 * key here to that of the deleted index entry.
+		 * Found a node where we're not at the first child.  Set the
+		 * key here to that of the deleted child.
 		 */
-		(path[i].pnext - 1)->key = pivot;
+		node_keys(path_node(path, i))[path[i].next - 1] = pivot;
 		set_buffer_dirty(path[i].buffer);
 	}
 }
@@ -1857,13 +3085,18 @@ static void brelse_free(struct superblock *sb, struct buffer *buffer)
  * directly below the root that only contain a single node), remove those
  * empty levels until either the second level is no longer empty or we only
  * have one level remaining.
+ *
+ * If max_leaves is not zero, stop before the leaf after that many, commit,
+ * and return 1 with the first chunk of that leaf in *next, to be passed back
+ * as resume.  The tree may change in between, it is probed again.  Nodes are
+ * only merged with neighbours seen in the same call.
  */
-static int delete_tree_range(struct superblock *sb, u64 snapmask, chunk_t resume)
+static int delete_tree_range(struct superblock *sb, u64 const *snapmask, chunk_t resume, unsigned max_leaves, chunk_t *next)
 {
 	int levels = sb->image.etree_levels, level = levels - 1;
 	struct etree_path path[levels], hold[levels];
 	struct buffer *leafbuf, *prevleaf = NULL;
-	unsigned i;
+	unsigned i, leaves = 1;
 
 	for (i = 0; i < levels; i++) // can be initializer if not dynamic array (change it?)
 		hold[i] = (struct etree_path){ };
@@ -1873,6 +3106,7 @@ static int delete_tree_range(struct superblock *sb, u64 snapmask, chunk_t resume
 	 */
 	if (!(leafbuf = probe(sb, resume, path)))
 		return -ENOMEM;
+	forget_finger(sb); /* leaves and nodes are merged below */
 
 	commit_transaction(sb, 0);
 	while (1) { /* in-order leaf walk */
@@ -1896,7 +3130,7 @@ static int delete_tree_range(struct superblock *sb, u64 snapmask, chunk_t resume
 			if (leaf_payload(this) <= leaf_freespace(prev)) {
 				trace_off(warn(">>> can merge leaf %p into leaf %p", leafbuf, prevleaf););
 				merge_leaves(prev, this);
-				remove_index(path, level);
+				remove_index(sb, path, level);
 				set_buffer_dirty(prevleaf);
 				brelse_free(sb, leafbuf);
 				dirty_buffer_count_check(sb);
@@ -1938,8 +3172,8 @@ keep_prev_leaf:
 					 */
 					if (this->count <= sb->metadata.alloc_per_node - prev->count) {
 						trace(warn(">>> can merge node %p into node %p", this, prev););
-						merge_nodes(prev, this);
-						remove_index(path, level - 1);
+						merge_nodes(sb, prev, this, path_start(path, level));
+						remove_index(sb, path, level - 1);
 						set_buffer_dirty(hold[level].buffer);
 						brelse_free(sb, path[level].buffer);
 						dirty_buffer_count_check(sb);
@@ -1982,14 +3216,14 @@ keep_prev_node:
 					brelse_path(hold, levels);
 					if (dirty_buffer_count)
 						commit_transaction(sb, 0);
-					sb->snapmask &= ~snapmask;
+					mask_andnot(sb->snapmask.word, snapmask, sb->share_words);
 					set_sb_dirty(sb);
 					save_sb(sb); /* we don't call save_state after a squash */
 					return 0;
 				}
 
 				level--;
-				trace_off(printf("pop to level %i, %i of %i nodes\n", level, path[level].pnext - path_node(path, level)->entries, path_node(path, level)->count););
+				trace_off(printf("pop to level %i, %i of %i nodes\n", level, path[level].next, path_node(path, level)->count););
 			} while (finished_level(path, level));
 			/*
 			 * Now rebuild the path from where we are (one entry
@@ -1997,28 +3231,47 @@ keep_prev_node:
 			 * been adjusted in operations above) down to the node
 			 * above the next leaf.
 			 */
+			if (max_leaves && leaves >= max_leaves)
+				goto stop;
 			do { /* push back down to leaf level */
-				struct buffer *nodebuf = snapread(sb, path[level++].pnext++->sector);
+				struct buffer *nodebuf = read_node(sb, node_sectors(sb, path_node(path, level))[path[level].next++]);
 				if (!nodebuf) {
-					brelse_path(path, level - 1); /* anything else needs to be freed? */
+					brelse_path(path, level); /* anything else needs to be freed? */
 					return -ENOMEM;
 				}
-				path[level].buffer = nodebuf;
-				path[level].pnext = buffer2node(nodebuf)->entries;
+				path[++level].buffer = nodebuf;
+				path[level].next = 0;
 				trace_off(printf("push to level %i, %i nodes\n", level, path_node(path, level)->count););
 			} while (level < levels - 1);
-		}
+		} else if (max_leaves && leaves >= max_leaves)
+			goto stop;
 
 		dirty_buffer_count_check(sb);
 		/*
 		 * Get the leaf indicated in the next index entry in the node
 		 * at this level.
 		 */
-		if (!(leafbuf = snapread(sb, path[level].pnext++->sector))) {
+		if (!(leafbuf = snapread(sb, node_sectors(sb, path_node(path, level))[path[level].next++]))) {
 			brelse_path(path, level);
 			return -ENOMEM;		
 		}
+		leaves++;
 	}
+stop:
+	/*
+	 * Every child but the first of a node has a key.  The next child is
+	 * only the first when the one before it was just merged away, and
+	 * then its range starts where the node's does.
+	 */
+	*next = path[level].next ? node_keys(path_node(path, level))[path[level].next] : path_start(path, level);
+	brelse(prevleaf);
+	brelse_path(path, level + 1);
+	for (i = 0; i < levels; i++)
+		if (hold[i].buffer)
+			brelse(hold[i].buffer);
+	if (dirty_buffer_count)
+		commit_transaction(sb, 0);
+	return 1;
 }
 
 /*
@@ -2027,7 +3280,7 @@ keep_prev_node:
  */
 static struct snapshot *find_snap(struct superblock *sb, u32 tag)
 {
-	struct snapshot *snapshot = sb->image.snaplist;
+	struct snapshot *snapshot = sb->snaplist;
 	struct snapshot *end = snapshot + sb->image.snapshots;
 
 	for (; snapshot < end; snapshot++)
@@ -2036,9 +3289,14 @@ static struct snapshot *find_snap(struct superblock *sb, u32 tag)
 	return NULL;
 }
 
+static inline unsigned snap_bit(const struct snapshot *snapshot)
+{
+	return snapshot->bit | snapshot->bithigh << 8;
+}
+
 static inline int is_squashed(const struct snapshot *snapshot)
 {
-	return snapshot->bit == SNAPSHOT_SQUASHED;
+	return snap_bit(snapshot) == SNAPSHOT_SQUASHED;
 }
 
 /* usecount() calculates and returns the usecount for a given snapshot.
@@ -2046,15 +3304,22 @@ static inline int is_squashed(const struct snapshot *snapshot)
  * (for devices using the snapshot). */
 static inline u16 usecount(struct superblock *sb, struct snapshot *snap)
 {
-	return (is_squashed(snap) ? 0 : sb->usecount[snap->bit]) + snap->usecount;
+	return (is_squashed(snap) ? 0 : sb->usecount[snap_bit(snap)]) + snap->usecount;
+}
+
+/* chunks that deleting the snapshot would free, zero if not counted */
+static chunk_t snapshot_frees(struct superblock *sb, struct snapshot *snap)
+{
+	return (sb->image.flags & SB_COUNTED) && !is_squashed(snap) ? sb->space[snap_bit(snap)].unique : 0;
 }
 
 /* find the oldest snapshot with 0 usecnt and lowest priority.
  * if no such snapshot exists, find the snapshot with lowest priority
+ * among equals, prefer the one whose delete frees the most space
  */
 static struct snapshot *find_victim(struct superblock *sb)
 {
-	struct snapshot *snaplist = sb->image.snaplist;
+	struct snapshot *snaplist = sb->snaplist;
 	u32 snapshots = sb->image.snapshots;
 
 	assert(snapshots);
@@ -2065,7 +3330,8 @@ static struct snapshot *find_victim(struct superblock *sb)
 			continue;
 		if (!is_squashed(best) && (usecount(sb, snap) && !usecount(sb, best)))
 			continue;
-		if (!is_squashed(best) && (!usecount(sb, snap) == !usecount(sb, best)) && (snap->prio >= best->prio))
+		if (!is_squashed(best) && (!usecount(sb, snap) == !usecount(sb, best)) && (snap->prio > best->prio ||
+		    (snap->prio == best->prio && snapshot_frees(sb, snap) <= snapshot_frees(sb, best))))
 			continue;
 		best = snap;
 	}
@@ -2073,27 +3339,119 @@ static struct snapshot *find_victim(struct superblock *sb)
 }
 
 /*
- * Delete the passed snapshot.
+ * Snapshots are removed from the btree in the background, a few leaves at a
+ * time between requests, so a big delete does not hold up client I/O.  The
+ * bits being deleted and where the walk is up to are kept in the superblock,
+ * so after a restart it carries on from there.  The bits are not given to
+ * new snapshots until the walk is done.
  */
-static int delete_snap(struct superblock *sb, struct snapshot *snap)
+static void delete_later(struct superblock *sb, u64 const *mask)
+{
+	trace_on(warn("delete snapshot mask %Lx in the background", mask[0]););
+	/* bits added to a walk under way need the whole tree, start it over */
+	mask_or(sb->deleting, mask, sb->share_words);
+	sb->image.delete_resume = 0;
+	mask_andnot(sb->snapmask.word, mask, sb->share_words);
+	set_sb_dirty(sb);
+	save_sb(sb);
+}
+
+static inline int deleting(struct superblock *sb)
+{
+	return !mask_empty(sb->deleting, sb->share_words);
+}
+
+/*
+ * Walk up to the given number of leaves of a background delete, or all that
+ * remain if zero.  Returns one while there is more to do.
+ */
+static int delete_step(struct superblock *sb, unsigned leaves)
 {
-	trace_on(warn("Delete snaptag %u (snapnum %i)", snap->tag, snap->bit););
-	u64 mask;
-	if (is_squashed(snap))
-		mask = 0;
+	chunk_t next = 0;
+	int more;
+
+	if (!deleting(sb))
+		return 0;
+	/* freed chunks must not be pending in a deferred allocation */
+	if (deferred_ranges(sb) || pending_ranges(sb))
+		commit_deferred_allocs(sb);
+	if ((more = delete_tree_range(sb, sb->deleting, sb->image.delete_resume, leaves, &next)) < 0) {
+		warn("unable to delete snapshot mask %Lx: %s", sb->deleting[0], strerror(-more));
+		return more;
+	}
+	if (more)
+		sb->image.delete_resume = next;
 	else {
-		mask = 1ULL << snap->bit;
-		sb->usecount[snap->bit] = 0; // reset transient usecount for this bit during auto-deletion
+		trace_on(warn("finished deleting snapshot mask %Lx", sb->deleting[0]););
+		memset(sb->deleting, 0, sb->share_words * sizeof(u64));
+		sb->image.delete_resume = 0;
+	}
+	set_sb_dirty(sb);
+	save_sb(sb);
+	return more;
+}
+
+/*
+ * Take the passed snapshot out of the snapshot list and return the bit to
+ * delete from the btree, -1 if it was squashed.
+ */
+static int drop_snap(struct superblock *sb, struct snapshot *snap)
+{
+	trace_on(warn("Delete snaptag %u (snapnum %i)", snap->tag, snap_bit(snap)););
+	int bit = -1;
+	if (!is_squashed(snap)) {
+		bit = snap_bit(snap);
+		sb->usecount[bit] = 0; // reset transient usecount for this bit during auto-deletion
 	}
 	/* Compress the snapshot entry out of the list. */
-	memmove(snap, snap + 1, (char *)(sb->image.snaplist + --sb->image.snapshots) - (char *)snap);
+	memmove(snap, snap + 1, (char *)(sb->snaplist + --sb->image.snapshots) - (char *)snap);
 	set_sb_dirty(sb);
-	if (!mask) {
+	if (bit < 0)
 		trace_on(warn("snapshot squashed, skipping tree delete"););
-		return 0;
+	return bit;
+}
+
+/*
+ * Delete the passed snapshot.
+ */
+static int delete_snap(struct superblock *sb, struct snapshot *snap)
+{
+	struct sharemask mask = { };
+	int bit = drop_snap(sb, snap);
+	if (bit >= 0) {
+		mask_set(mask.word, bit);
+		delete_later(sb, mask.word);
 	}
-	commit_deferred_allocs(sb);
-	return delete_tree_range(sb, mask, 0);
+	return 0;
+}
+
+/*
+ * Delete the snapshots with the passed tags in one walk of the btree.  None
+ * are deleted unless all of them can be.
+ */
+static int delete_snaps(struct superblock *sb, u32 const *tags, unsigned count, char **why)
+{
+	struct snapshot *snap;
+	struct sharemask mask = { };
+	unsigned i;
+	int bit, any = 0;
+
+	for (i = 0; i < count; i++) {
+		*why = "snapshot doesn't exist";
+		if (!(snap = find_snap(sb, tags[i])))
+			return -EINVAL;
+		*why = "snapshot has non-zero usecount";
+		if (usecount(sb, snap))
+			return -EINVAL;
+	}
+	for (i = 0; i < count; i++)
+		if ((snap = find_snap(sb, tags[i])) && (bit = drop_snap(sb, snap)) >= 0) { /* tags may repeat */
+			mask_set(mask.word, bit);
+			any = 1;
+		}
+	if (any)
+		delete_later(sb, mask.word);
+	return 0;
 }
 
 /*
@@ -2111,9 +3469,11 @@ static int delete_snap(struct superblock *sb, struct snapshot *snap)
 static chunk_t alloc_chunk(struct superblock *sb, struct allocspace *as)
 {
 	chunk_t last = as->asi->last_alloc, total = as->asi->chunks, found;
+	u64 scanned = 0;
 
-	if ((found = alloc_chunk_from_range(sb, as, last, total - last)) != -1 ||
-	    (found = alloc_chunk_from_range(sb, as, 0, last)) != -1) {
+	if ((found = alloc_chunk_from_range(sb, as, last, total - last, &scanned)) != -1 ||
+	    (found = alloc_chunk_from_range(sb, as, 0, last, &scanned)) != -1) {
+		histogram_add(&metrics.alloc_scan, scanned);
 		as->asi->last_alloc = found;
 		set_sb_dirty(sb);
 		return found;
@@ -2163,7 +3523,7 @@ static struct buffer *new_leaf(struct superblock *sb)
 	if (!buffer)
 		return NULL;
 	memset(buffer->data, 0, sb->metadata.allocsize);
-	init_leaf(buffer2leaf(buffer), sb->metadata.allocsize);
+	init_leaf(buffer2leaf(buffer), sb->metadata.allocsize, sb->share_words);
 	set_buffer_dirty(buffer);
 	return buffer;
 }
@@ -2180,6 +3540,7 @@ static struct buffer *new_node(struct superblock *sb)
 	memset(buffer->data, 0, sb->metadata.allocsize);
 	struct enode *node = buffer2node(buffer);
 	node->count = 0;
+	node->version = NODE_VERSION;
 	set_buffer_dirty(buffer);
 	return buffer;
 }
@@ -2192,21 +3553,22 @@ static struct buffer *new_node(struct superblock *sb)
 
 struct gen_changelist
 {
-	u64 mask1;
-	u64 mask2;
+	struct sharemask mask1;
+	struct sharemask mask2;
 	struct change_list *cl;
 };
 
 static void gen_changelist_leaf(struct superblock *sb, struct eleaf *leaf, void *data)
 {
-	u64 mask1 = ((struct gen_changelist *)data)->mask1;
-	u64 mask2 = ((struct gen_changelist *)data)->mask2;
+	u64 const *mask1 = ((struct gen_changelist *)data)->mask1.word;
+	u64 const *mask2 = ((struct gen_changelist *)data)->mask2.word;
 	struct change_list *cl = ((struct gen_changelist *)data)->cl;
-	struct exception const *p;
+	unsigned words = share_words(leaf);
+	struct exception *p;
 	u64 newchunk;
 	int i;
 	u32 snap = cl->tgt_snap;
-	struct snapshot const *snaplist = sb->image.snaplist;
+	struct snapshot const *snaplist = sb->snaplist;
 	u64 snap_sectors = 0;
 
 	for (i = 0; i < sb->image.snapshots; i++)
@@ -2217,15 +3579,17 @@ static void gen_changelist_leaf(struct superblock *sb, struct eleaf *leaf, void
 		return;
 	}
 	for (i = 0; i < leaf->count; i++)
-		for (p = emap(leaf, i); p < emap(leaf, i+1); p++) {
-			if ( ((p->share & mask2) == mask2) != ((p->share & mask1) == mask1) ) {
-				newchunk = leaf->base_chunk + leaf->map[i].rchunk;
-				/* check if the chunk is within the size of the target snapshot
-				 * to deal with origin device shrinking */
-				if ((newchunk << sb->snapdata.chunk_sectors_bits) >= snap_sectors)
-					continue;
-				if (append_change_list(cl, newchunk) < 0)
-					warn("unable to write chunk %Li to changelist", newchunk);
+		for (p = emap(leaf, i); p < emap(leaf, i+1); p = ex_next(p, words)) {
+			if (mask_covers(ex_share(p), mask2, words) != mask_covers(ex_share(p), mask1, words)) {
+				for (unsigned k = 0; k < map_run(&leaf->map[i]); k++) {
+					newchunk = leaf->base_chunk + leaf->map[i].rchunk + k;
+					/* check if the chunk is within the size of the target snapshot
+					 * to deal with origin device shrinking */
+					if ((newchunk << sb->snapdata.chunk_sectors_bits) >= snap_sectors)
+						break;
+					if (append_change_list(cl, newchunk) < 0)
+						warn("unable to write chunk %Li to changelist", newchunk);
+				}
 				break;
 			}
 		}
@@ -2238,9 +3602,9 @@ static void gen_changelist_leaf(struct superblock *sb, struct eleaf *leaf, void
 /*
  * BTree insertion is a little hairy, as expected.  We keep track of the
  * access path in a vector of etree_path elements, each of which holds
- * a node buffer and a pointer into the buffer data giving the address at
- * which the next buffer in the path was found, which is also where a new
- * node will be inserted if necessary.  If a leaf is split we may need to
+ * a node buffer and the index of the child after the one the next buffer
+ * in the path was found at, which is also where a new node will be
+ * inserted if necessary.  If a leaf is split we may need to
  * work all the way up from the bottom to the top of the path, splitting
  * index nodes as well.  If we split the top index node we need to add
  * a new tree level.  We have to keep track of which nodes were modified
@@ -2249,71 +3613,109 @@ static void gen_changelist_leaf(struct superblock *sb, struct eleaf *leaf, void
  *
  * Note that the first key of an index block is never accessed.  This is
  * because for a btree, there is always one more key than nodes in each
- * index node.  In other words, keys lie between node pointers.  We will
+ * index node.  In other words, keys lie between node pointers.  We
  * micro-optimize by placing the node count in the first key, which allows
  * a node to contain an esthetically pleasing binary number of pointers.
- * (Not done yet.)
  */
 /*
  * Insert a child into an enode.
  *
- * Move all entries from here to the end of the index entries down one entry,
- * thereby freeing the current entry.  Fill that with the information for our
- * new child.
+ * Move the children from here to the end of the node up one, with their
+ * keys, thereby freeing the current place.  Fill that with our new child.
+ * Only an empty node takes a child at 0, which needs no key.
  */
-static void insert_child(struct enode *node, struct index_entry *p, sector_t child, u64 childkey)
+static void insert_child(struct superblock *sb, struct enode *node, unsigned i, sector_t child, u64 childkey)
 {
-	memmove(p + 1, p, (char *)(&node->entries[0] + node->count) - (char *)p);
-	p->sector = child;
-	p->key = childkey;
+	sector_t *sectors = node_sectors(sb, node);
+	u64 *keys = node_keys(node);
+
+	assert(i || !node->count);
+	memmove(sectors + i + 1, sectors + i, (node->count - i) * sizeof(*sectors));
+	sectors[i] = child;
+	if (i) {
+		memmove(keys + i + 1, keys + i, (node->count - i) * sizeof(*keys));
+		keys[i] = childkey;
+	}
 	node->count++;
 }
 
 /*
- * Add an exception to the B-tree.
- *
- * This routine calls add_exception_to_leaf() to add the passed exception to
- * the leaf.  If that fails, we split the leaf and add the exception to the
- * appropriate leaf of the pair.  We then add the new leaf to the enode,
- * splitting it (and any parents) if necessary.  In the degenerate case, we
- * split enodes all the way up the etree path until we create a new root at
- * the top.
- *
- * Returns 0 on success and -errno on failure.
+ * The most bytes adding an exception for the target chunk can take in a
+ * leaf: splitting the chunk out of the middle of its run copies the run's
+ * entry twice.
  */
-static int add_exception_to_tree(struct superblock *sb, struct buffer *leafbuf, u64 target, u64 exception, int snapbit, struct etree_path path[], unsigned levels)
+static unsigned leaf_room_needed(struct eleaf *leaf, u64 target)
 {
-	/*
-	 * Try to add the exception to the leaf we already have in hand.  If
-	 * that works, we're done.
-	 */
-	if (!add_exception_to_leaf(buffer2leaf(leafbuf), target, exception, snapbit, sb->snapmask)) {
-		brelse_dirty(leafbuf);
-		return 0;
-	}
-	/*
-	 * There wasn't room to add a new exception to the leaf.  Split it.
-	 */
-	trace(warn("adding a new leaf to the tree"););
-	struct buffer *childbuf = new_leaf(sb);
-	if (!childbuf) 
-		return -ENOMEM; /* this is the right thing to do? */
-	
-	u64 childkey = split_leaf(buffer2leaf(leafbuf), buffer2leaf(childbuf));
-	sector_t childsector = childbuf->sector;
-	/*
-	 * Now add the exception to the appropriate leaf.  Childkey has the
-	 * first chunk in the new leaf we just created.
-	 */
-	if (add_exception_to_leaf(target < childkey ? buffer2leaf(leafbuf): buffer2leaf(childbuf), target, exception, snapbit, sb->snapmask)) {
-		warn("new leaf has no space");
-		return -ENOMEM;
+	unsigned i = find_run(leaf, target);
+
+	if (run_holds(leaf, i, target))
+		return 2 * entry_bytes(leaf, i) + ex_size(share_words(leaf));
+	return ex_size(share_words(leaf)) + sizeof(struct etree_map);
+}
+
+static unsigned largest_entry(struct eleaf *leaf)
+{
+	unsigned i, most = 0;
+
+	for (i = 0; i < leaf->count; i++)
+		if (entry_bytes(leaf, i) > most)
+			most = entry_bytes(leaf, i);
+	return most;
+}
+
+static inline unsigned leaf_capacity(struct superblock *sb)
+{
+	return leaf_top(sb->metadata.allocsize) - offsetof(struct eleaf, map) - sizeof(struct etree_map);
+}
+
+/*
+ * Even out the payload of two neighbouring leaves, leaving each at least
+ * one map entry.
+ */
+static void balance_leaves(struct eleaf *leaf, struct eleaf *leaf2)
+{
+	unsigned size = leaf_payload(leaf), size2 = leaf_payload(leaf2), half = (size + size2) / 2, n;
+
+	if (size > size2) {
+		n = leaf_entries_within(leaf, half);
+		if (n < leaf->count)
+			move_tail(leaf, leaf2, leaf->count - (n ? n : 1));
+	} else {
+		n = leaf_entries_within(leaf2, half - size);
+		if (n >= leaf2->count)
+			n = leaf2->count - 1;
+		if (n)
+			move_head(leaf, leaf2, n);
 	}
-	brelse_dirty(leafbuf);
-	brelse_dirty(childbuf);
+}
+
+/*
+ * Spread two neighbouring leaves, each with more than one map entry, over
+ * three, moving the tail of the first and the head of the last into the new
+ * leaf between them so each keeps about a third of the payload.
+ */
+static void spread_leaves(struct eleaf *leaf, struct eleaf *mid, struct eleaf *leaf2)
+{
+	unsigned size2 = leaf_payload(leaf2), third = (leaf_payload(leaf) + size2) / 3, n;
+
+	n = leaf_entries_within(leaf, third);
+	n = n < 1 ? 1 : n >= leaf->count ? leaf->count - 1 : n;
+	move_tail(leaf, mid, leaf->count - n);
+	n = leaf_entries_within(leaf2, size2 - third);
+	n = n < 1 ? 1 : n >= leaf2->count ? leaf2->count - 1 : n;
+	move_head(mid, leaf2, n);
+}
 
+/*
+ * Add a new leaf or node to the enode at the bottom of the path, splitting
+ * it (and any parents) if necessary.  In the degenerate case, we split
+ * enodes all the way up the etree path until we create a new root at the
+ * top.
+ */
+static int add_child_to_tree(struct superblock *sb, sector_t childsector, u64 childkey, struct etree_path path[], unsigned levels)
+{
 	while (levels--) {
-		struct index_entry *pnext = path[levels].pnext;
+		unsigned next = path[levels].next;
 		struct buffer *parentbuf = path[levels].buffer;
 		struct enode *parent = buffer2node(parentbuf);
 
@@ -2322,29 +3724,34 @@ static int add_exception_to_tree(struct superblock *sb, struct buffer *leafbuf,
 		 * done.
 		 */
 		if (parent->count < sb->metadata.alloc_per_node) {
-			insert_child(parent, pnext, childsector, childkey);
+			insert_child(sb, parent, next, childsector, childkey);
 			set_buffer_dirty(parentbuf);
 			return 0;
 		}
 		/*
-		 * Split the node.
+		 * Split the node, or for a child past its end, as when leaves
+		 * are added in ascending order, start a new node with just the
+		 * child and leave the full one as it is.
 		 */
-		unsigned half = parent->count / 2;
-		u64 newkey = parent->entries[half].key;
+		int append = next == parent->count;
+		unsigned half = append ? parent->count : parent->count / 2;
+		u64 newkey = append ? childkey : node_keys(parent)[half];
 		struct buffer *newbuf = new_node(sb); 
 		if (!newbuf) 
 			return -ENOMEM;
 		struct enode *newnode = buffer2node(newbuf);
 
 		newnode->count = parent->count - half;
-		memcpy(&newnode->entries[0], &parent->entries[half], newnode->count * sizeof(struct index_entry));
+		memcpy(node_sectors(sb, newnode), node_sectors(sb, parent) + half, newnode->count * sizeof(sector_t));
+		if (newnode->count > 1)
+			memcpy(node_keys(newnode) + 1, node_keys(parent) + half + 1, (newnode->count - 1) * sizeof(u64));
 		parent->count = half;
 		/*
 		 * If the path entry is in the new node, use that as the
 		 * parent.
 		 */
-		if (pnext > &parent->entries[half]) {
-			pnext = pnext - &parent->entries[half] + newnode->entries;
+		if (append || next > half) {
+			next -= half;
 			set_buffer_dirty(parentbuf);
 			parentbuf = newbuf;
 			parent = newnode;
@@ -2353,7 +3760,7 @@ static int add_exception_to_tree(struct superblock *sb, struct buffer *leafbuf,
 		 * Insert the child now that we have room in the parent, then
 		 * climb the path and insert the new child there.
 		 */
-		insert_child(parent, pnext, childsector, childkey);
+		insert_child(sb, parent, next, childsector, childkey);
 		set_buffer_dirty(parentbuf);
 		childkey = newkey;
 		childsector = newbuf->sector;
@@ -2373,9 +3780,9 @@ static int add_exception_to_tree(struct superblock *sb, struct buffer *leafbuf,
 	struct enode *newroot = buffer2node(newrootbuf);
 
 	newroot->count = 2;
-	newroot->entries[0].sector = sb->image.etree_root;
-	newroot->entries[1].key = childkey;
-	newroot->entries[1].sector = childsector;
+	node_sectors(sb, newroot)[0] = sb->image.etree_root;
+	node_keys(newroot)[1] = childkey;
+	node_sectors(sb, newroot)[1] = childsector;
 	sb->image.etree_root = newrootbuf->sector;
 	sb->image.etree_levels++;
 	set_sb_dirty(sb);
@@ -2383,6 +3790,167 @@ static int add_exception_to_tree(struct superblock *sb, struct buffer *leafbuf,
 	return 0;
 }
 
+/*
+ * Make room for an exception that does not fit in its leaf, in one of these
+ * ways, B*-tree style, so leaves stay fuller than the half a plain split
+ * leaves behind:
+ *
+ *  - A chunk past the end of the leaf is most likely the next of a run of
+ *    ascending writes, so it starts a new leaf on its own, leaving the full
+ *    one as it is.
+ *  - If a neighbouring leaf under the same parent has room, the two are
+ *    evened out and the exception added to the one the chunk falls in.
+ *  - If the neighbour is about full too, the pair is spread over three
+ *    leaves, each about two thirds full.
+ *  - Otherwise, or if plain is set, the leaf is split in two at the middle
+ *    of its payload.
+ *
+ * Returns 0 once the exception is added, -EAGAIN if the leaf it falls in
+ * still has no room for it, or -errno on failure.  The leaf buffer is
+ * released either way.
+ */
+static int make_leaf_room(struct superblock *sb, struct buffer *leafbuf, u64 target, u64 exception, int snapbit, struct etree_path path[], unsigned levels, int plain)
+{
+	struct eleaf *leaf = buffer2leaf(leafbuf), *where;
+	struct buffer *parentbuf = path[levels - 1].buffer, *childbuf, *siblingbuf;
+	struct enode *parent = buffer2node(parentbuf);
+	unsigned next = path[levels - 1].next, last = leaf->count - 1;
+	int err;
+	u64 childkey;
+
+	trace(warn("making room in a leaf"););
+	forget_finger(sb);
+	if (!plain && leaf->count && target < leaf->base_chunk + leaf->map[last].rchunk + map_run(&leaf->map[last]) &&
+	    (next < parent->count || next > 1)) {
+		/*
+		 * Take the neighbour to the right if there is one, else the
+		 * one to the left.  Bentry is the child index of the second
+		 * leaf of the pair, whose key changes as entries move.
+		 */
+		int right = next < parent->count;
+		unsigned bentry = right ? next : next - 1;
+		u64 *bkey = node_keys(parent) + bentry;
+		if (!(siblingbuf = snapread(sb, node_sectors(sb, parent)[right ? next : next - 2]))) {
+			brelse(leafbuf);
+			return -EIO;
+		}
+		struct buffer *abuf = right ? leafbuf : siblingbuf, *bbuf = right ? siblingbuf : leafbuf;
+		struct eleaf *a = buffer2leaf(abuf), *b = buffer2leaf(bbuf);
+		unsigned size = leaf_payload(a) + leaf_payload(b), most = largest_entry(a);
+		unsigned need = leaf_room_needed(leaf, target), room = leaf_capacity(sb);
+
+		if (largest_entry(b) > most)
+			most = largest_entry(b);
+		if (a->count + b->count > 1 && size / 2 + most + need <= room) {
+			balance_leaves(a, b);
+			*bkey = b->base_chunk + b->map[0].rchunk;
+			set_buffer_dirty(parentbuf);
+			where = target < *bkey ? a : b;
+			err = add_exception_to_leaf(sb, where, target, exception, snapbit, sb->snapmask.word) ? -EAGAIN : 0;
+			brelse_dirty(siblingbuf);
+			brelse_dirty(leafbuf);
+			return err;
+		}
+		if (a->count > 1 && b->count > 1 && size / 3 + most + need <= room) {
+			if (!(childbuf = new_leaf(sb))) {
+				brelse(siblingbuf);
+				brelse(leafbuf);
+				return -ENOMEM;
+			}
+			spread_leaves(a, buffer2leaf(childbuf), b);
+			childkey = buffer2leaf(childbuf)->base_chunk + buffer2leaf(childbuf)->map[0].rchunk;
+			*bkey = b->base_chunk + b->map[0].rchunk;
+			set_buffer_dirty(parentbuf);
+			where = target < childkey ? a : target < *bkey ? buffer2leaf(childbuf) : b;
+			brelse_dirty(siblingbuf);
+			path[levels - 1].next = bentry; /* the new leaf goes in before b */
+			goto add;
+		}
+		brelse(siblingbuf);
+	}
+	/*
+	 * Split the leaf, or start a new one for a chunk past its end.  A
+	 * leaf holding just the run the chunk falls in cannot be split.
+	 */
+	int past = !leaf->count || target >= leaf->base_chunk + leaf->map[last].rchunk + map_run(&leaf->map[last]);
+	if (!past && leaf->count == 1) {
+		warn("leaf for chunk %Lx has no space", target);
+		brelse(leafbuf);
+		return -ENOMEM;
+	}
+	trace(warn("adding a new leaf to the tree"););
+	if (!(childbuf = new_leaf(sb))) {
+		brelse(leafbuf);
+		return -ENOMEM;
+	}
+	if (past)
+		childkey = target;
+	else {
+		unsigned nhead = leaf_entries_within(leaf, leaf_payload(leaf) / 2);
+		nhead = nhead < 1 ? 1 : nhead >= leaf->count ? leaf->count - 1 : nhead;
+		childkey = split_leaf(leaf, buffer2leaf(childbuf), nhead);
+	}
+	where = target < childkey ? leaf : buffer2leaf(childbuf);
+add:
+	/*
+	 * Now add the exception to the appropriate leaf.  Childkey has the
+	 * first chunk in the new leaf we just created.  If the chunk's half
+	 * is still too full, the new leaf goes in anyway and the caller
+	 * tries again.
+	 */
+	err = add_exception_to_leaf(sb, where, target, exception, snapbit, sb->snapmask.word) ? -EAGAIN : 0;
+	sector_t childsector = childbuf->sector;
+	brelse_dirty(leafbuf);
+	brelse_dirty(childbuf);
+	int error = add_child_to_tree(sb, childsector, childkey, path, levels);
+	return error ? error : err;
+}
+
+/*
+ * Add an exception to the B-tree.
+ *
+ * This routine calls add_exception_to_leaf() to add the passed exception to
+ * the leaf.  If that fails, make_leaf_room() restructures the leaves around
+ * it.  Splitting a chunk out of a long shared run can take more room than one
+ * split frees in a small block, so the leaf is found again and split until
+ * the exception fits.
+ *
+ * Returns 0 on success and -errno on failure, releasing the leaf buffer
+ * either way.
+ */
+static int add_exception_to_tree(struct superblock *sb, struct buffer *leafbuf, u64 target, u64 exception, int snapbit, struct etree_path path[], unsigned levels)
+{
+	int err, tries = 0;
+
+	/*
+	 * Try to add the exception to the leaf we already have in hand.  If
+	 * that works, we're done.
+	 */
+	if (!add_exception_to_leaf(sb, buffer2leaf(leafbuf), target, exception, snapbit, sb->snapmask.word)) {
+		brelse_dirty(leafbuf);
+		return 0;
+	}
+	err = make_leaf_room(sb, leafbuf, target, exception, snapbit, path, levels, 0);
+	while (err == -EAGAIN) {
+		unsigned levels = sb->image.etree_levels;
+		struct etree_path path[levels];
+
+		if (++tries > MAX_LEAF_SPLITS) {
+			warn("no room for chunk %Lx after %i splits", target, MAX_LEAF_SPLITS);
+			return -ENOMEM;
+		}
+		if (!(leafbuf = probe(sb, target, path)))
+			return -EIO;
+		if (!add_exception_to_leaf(sb, buffer2leaf(leafbuf), target, exception, snapbit, sb->snapmask.word)) {
+			brelse_dirty(leafbuf);
+			err = 0;
+		} else
+			err = make_leaf_room(sb, leafbuf, target, exception, snapbit, path, levels, 1);
+		brelse_path(path, levels);
+	}
+	return err;
+}
+
 #define chunk_highbit ((sizeof(chunk_t) * 8) - 1)
 
 /*
@@ -2400,12 +3968,18 @@ static int finish_copyout(struct superblock *sb)
 		trace(printf("copy %u %schunks from %Lx to %Lx\n", sb->copy_chunks,
 			is_snap? "snapshot ": "origin ", source, sb->dest_exception););
 		assert(size <= sb->copybuf_size);
+		u64 start = usecs(), phased = phase_start();
 		if (diskread(is_snap? sb->snapdev: sb->orgdev, sb->copybuf, size,
 			source << sb->snapdata.asi->allocsize_bits) < 0)
 			trace(printf("copyout death on read\n"););
+		phase_end(TRACE_COPY_READ, phased);
+		phased = phase_start();
 		if (diskwrite(sb->snapdev, sb->copybuf, size,
 			sb->dest_exception << sb->snapdata.asi->allocsize_bits) < 0)
 			trace_on(printf("copyout death on write\n"););
+		phase_end(TRACE_COPY_WRITE, phased);
+		histogram_time(&metrics.copyout, start);
+		histogram_add(&metrics.copyout_bytes, size);
 		sb->copy_chunks = 0;
 	}
 	return 0;
@@ -2455,11 +4029,18 @@ static int copyout(struct superblock *sb, chunk_t chunk, chunk_t exception)
 /*
  * Select a victim snapshot and delete/squash it. Called when the snapshot 
  * store is full or when we reach the maximum number of snapshots.
+ *
+ * Unused snapshots of no higher priority that would be next in line go
+ * with it, up to AUTO_DELETE_VICTIMS, so that they cost one tree walk
+ * instead of one each.
  */
 static int auto_delete_snapshot(struct superblock *sb)
 {
 	struct snapshot *victim = find_victim(sb);
-	int err;
+	struct sharemask mask = { };
+	unsigned victims = 0;
+	int bit, any = 0;
+	s8 prio;
 	if (is_squashed(victim) || victim->prio == 127) {
 		/* All snapshots deleted, check for lost chunks */
 		if (sb->image.snapdata.freechunks < sb->image.snapdata.chunks ) {
@@ -2471,7 +4052,7 @@ static int auto_delete_snapshot(struct superblock *sb)
 			// !!! this is also used in initialization, make this a common function
 			unsigned meta_bitmap_base_chunk = (SB_SECTOR + 2*chunk_sectors(&sb->metadata) - 1) >> sb->metadata.chunk_sectors_bits;
 			unsigned reserved = meta_bitmap_base_chunk + sb->metadata.asi->bitmap_blocks + sb->image.journal_size
-				+ sb->metadata.asi->bitmap_blocks + 1
+				+ sb->image.snaptable_blocks + sb->metadata.asi->bitmap_blocks + 1
 				+ sb->snapdata.asi->bitmap_blocks;
 			if (sb->image.metadata.freechunks + reserved < sb->image.metadata.chunks) {
 				warn("%Li free metadata chunks after all snapshots deleted", sb->image.metadata.freechunks);
@@ -2482,23 +4063,47 @@ static int auto_delete_snapshot(struct superblock *sb)
 	}
 	warn("releasing snapshot %u", victim->tag);
 	if (usecount(sb, victim)) {
-		commit_deferred_allocs(sb);
-		err = delete_tree_range(sb, 1ULL << victim->bit, 0);
-		sb->usecount[victim->bit] = 0;
+		mask_set(mask.word, snap_bit(victim));
+		any = 1;
+		sb->usecount[snap_bit(victim)] = 0;
 		victim->bit = SNAPSHOT_SQUASHED;
-	} else
-		err = delete_snap(sb, victim);
-	return err;
+		victim->bithigh = 0;
+		set_sb_dirty(sb);
+	} else {
+		for (prio = victim->prio; ; ) {
+			if ((bit = drop_snap(sb, victim)) >= 0) {
+				mask_set(mask.word, bit);
+				any = 1;
+			}
+			if (++victims == AUTO_DELETE_VICTIMS || !sb->image.snapshots)
+				break;
+			victim = find_victim(sb);
+			if (is_squashed(victim) || usecount(sb, victim) || victim->prio > prio)
+				break;
+			warn("releasing snapshot %u with it", victim->tag);
+		}
+	}
+	if (any)
+		delete_later(sb, mask.word);
+	return 0;
 }
 
+/*
+ * Space comes back progressively: a background delete under way is pushed
+ * along only as far as needed, and another victim chosen only once it is done.
+ */
 static int ensure_free_chunks(struct superblock *sb, struct allocspace *as, int chunks)
 {
-	do {
-		if (as->asi->freechunks >= chunks)
-			return 0;
-		if (auto_delete_snapshot(sb))
+	while (as->asi->freechunks < chunks) {
+		if (deleting(sb)) {
+			if (delete_step(sb, DELETE_STEP_LEAVES) < 0)
+				goto fail_delete;
+			continue;
+		}
+		if (!sb->image.snapshots || auto_delete_snapshot(sb))
 			goto fail_delete;
-	} while (sb->image.snapshots);
+	}
+	return 0;
 
 fail_delete:
 	warn("snapshot delete failed");
@@ -2525,6 +4130,7 @@ static chunk_t make_unique(struct superblock *sb, chunk_t chunk, int snapbit)
 	chunk_t exception = 0;
 	int error;
 	trace(warn("chunk %Lx, snapbit %i", chunk, snapbit););
+	u64 start = phase_start();
 
 	/* first we check if we will have enough freespace */
 	if (combined(sb)) {
@@ -2536,6 +4142,7 @@ static chunk_t make_unique(struct superblock *sb, chunk_t chunk, int snapbit)
 		if (ensure_free_chunks(sb, &sb->snapdata, 1))
 			return -1;
 	}
+	phase_end(TRACE_ALLOC, start);
 
 	unsigned levels = sb->image.etree_levels;
 	struct etree_path path[levels + 1];
@@ -2543,6 +4150,7 @@ static chunk_t make_unique(struct superblock *sb, chunk_t chunk, int snapbit)
 	 * Find the proper leaf for this chunk.  The "path" gets the list of
 	 * B-tree nodes that lead to the returned leaf.
 	 */
+	start = phase_start();
 	struct buffer *leafbuf = probe(sb, chunk, path);
 	if (!leafbuf) 
 		return -1;
@@ -2552,23 +4160,29 @@ static chunk_t make_unique(struct superblock *sb, chunk_t chunk, int snapbit)
 	 * field, here, is a bitmask of all valid snapshots for the volume.
 	 */
 	if (snapbit == -1?
-		origin_chunk_unique(buffer2leaf(leafbuf), chunk, sb->snapmask):
+		origin_chunk_unique(buffer2leaf(leafbuf), chunk, sb->snapmask.word):
 		snapshot_chunk_unique(buffer2leaf(leafbuf), chunk, snapbit, &exception))
 	{
 		trace_off(warn("chunk %Lx already unique in snapnum %i", chunk, snapbit););
 		brelse(leafbuf);
+		phase_end(TRACE_PROBE, start);
 		goto out;
 	}
+	phase_end(TRACE_PROBE, start);
+	start = phase_start();
 	u64 newex = alloc_snapblock(sb);
 	if (newex == -1) {
 		// count_free
 		error("we should count free bits here and try to get the accounting right");
 	}; /* if this broke, then our ensure above is broken */
+	phase_end(TRACE_ALLOC, start);
 
 	copyout(sb, exception? (exception | (1ULL << chunk_highbit)): chunk, newex);
-	if ((error = add_exception_to_tree(sb, leafbuf, chunk, newex, snapbit, path, levels)) < 0) {
+	start = phase_start();
+	error = add_exception_to_tree(sb, leafbuf, chunk, newex, snapbit, path, levels);
+	phase_end(TRACE_TREE, start);
+	if (error < 0) {
 		free_exception(sb, newex);
-		brelse(leafbuf); /* !!! redundant? */
 		warn("unable to add exception to tree: %s", strerror(-error));
 		newex = -1;
 	}
@@ -2587,6 +4201,7 @@ static int test_unique(struct superblock *sb, chunk_t chunk, int snapbit, chunk_
 {
 	unsigned levels = sb->image.etree_levels;
 	struct etree_path path[levels + 1];
+	u64 start = phase_start();
 	struct buffer *leafbuf = probe(sb, chunk, path);
 	
 	if (!leafbuf)
@@ -2594,10 +4209,11 @@ static int test_unique(struct superblock *sb, chunk_t chunk, int snapbit, chunk_
 	
 	trace(warn("chunk %Lx, snapbit %i", chunk, snapbit););
 	int result = snapbit == -1?
-		origin_chunk_unique(buffer2leaf(leafbuf), chunk, sb->snapmask):
+		origin_chunk_unique(buffer2leaf(leafbuf), chunk, sb->snapmask.word):
 		snapshot_chunk_unique(buffer2leaf(leafbuf), chunk, snapbit, exception);
 	brelse(leafbuf);
 	brelse_path(path, levels);
+	phase_end(TRACE_PROBE, start);
 	return result;
 }
 
@@ -2606,14 +4222,14 @@ static int test_unique(struct superblock *sb, chunk_t chunk, int snapbit, chunk_
 /*
  * Calculate a bitmask from the list of existing snapshots.
  */
-static u64 calc_snapmask(struct superblock *sb)
+static struct sharemask calc_snapmask(struct superblock *sb)
 {
-	u64 mask = 0;
+	struct sharemask mask = { };
 	unsigned int i;
 
 	for (i = 0; i < sb->image.snapshots; i++)
-		if (!is_squashed(&sb->image.snaplist[i]))
-			mask |= 1ULL << sb->image.snaplist[i].bit;
+		if (!is_squashed(&sb->snaplist[i]))
+			mask_set(mask.word, snap_bit(&sb->snaplist[i]));
 
 	return mask;
 }
@@ -2622,16 +4238,16 @@ static u64 calc_snapmask(struct superblock *sb)
 static int tag_snapbit(struct superblock *sb, unsigned tag)
 {
 	struct snapshot *snapshot = find_snap(sb, tag);
-	return snapshot ? snapshot->bit : -1;
+	return snapshot ? snap_bit(snapshot) : -1;
 }
 
 static unsigned int snapbit_tag(struct superblock *sb, unsigned bit)
 {
 	unsigned int i, n = sb->image.snapshots;
-	struct snapshot const *snap = sb->image.snaplist;
+	struct snapshot const *snap = sb->snaplist;
 
 	for (i = 0; i < n; i++)
-		if (snap[i].bit == bit)
+		if (snap_bit(&snap[i]) == bit)
 			return snap[i].tag;
 
 	return (u32)~0UL;
@@ -2641,7 +4257,7 @@ static unsigned int snapbit_tag(struct superblock *sb, unsigned bit)
 /* find the oldest snapshot with 0 usecnt and lowest priority. */
 static struct snapshot *find_unused(struct superblock *sb)
 {
-	struct snapshot *snaplist = sb->image.snaplist;
+	struct snapshot *snaplist = sb->snaplist;
 	u32 snapshots = sb->image.snapshots;
 
 	assert(snapshots);
@@ -2663,12 +4279,12 @@ static int create_snapshot(struct superblock *sb, unsigned snaptag)
 	struct snapshot *snapshot;
 
 	/* check if we are out of snapshots */
-	if (snapshots >= MAX_SNAPSHOTS) {
+	if (snapshots >= max_snapshots(sb)) {
 		struct snapshot *victim = find_unused(sb);
 		if (!usecount(sb, victim))
 			delete_snap(sb, victim);
-		if ((snapshots = sb->image.snapshots) >= MAX_SNAPSHOTS) {
-			warn("the number of snapshots is beyond the %d limit", MAX_SNAPSHOTS);
+		if ((snapshots = sb->image.snapshots) >= max_snapshots(sb)) {
+			warn("the number of snapshots is beyond the %d limit", max_snapshots(sb));
 			return -EFULL;
 		}
 	}
@@ -2677,17 +4293,19 @@ static int create_snapshot(struct superblock *sb, unsigned snaptag)
 	if (find_snap(sb, snaptag))
 		return -EEXIST;
 
-	/* Find available snapshot bit */
-	for (i = 0; i < MAX_SNAPSHOTS; i++)
-		if (!(sb->snapmask & (1ULL << i)))
-			goto create;
+	/* Find available snapshot bit, if need be by finishing a delete */
+	do {
+		for (i = 0; i < 64 * sb->share_words; i++)
+			if (i != SNAPSHOT_SQUASHED && !mask_test(sb->snapmask.word, i) && !mask_test(sb->deleting, i))
+				goto create;
+	} while (deleting(sb) && delete_step(sb, 0) == 0);
 	return -EFULL;
 
 create:
 	trace_on(warn("Create snapshot tag = %u, bit = %i)", snaptag, i););
-	snapshot = sb->image.snaplist + sb->image.snapshots++;
-	*snapshot = (struct snapshot){ .tag = snaptag, .bit = i, .ctime = time(NULL), .sectors = sb->image.orgsectors };
-	sb->snapmask |= (1ULL << i);
+	snapshot = sb->snaplist + sb->image.snapshots++;
+	*snapshot = (struct snapshot){ .tag = snaptag, .bit = i, .bithigh = i >> 8, .ctime = time(NULL), .sectors = sb->image.orgsectors };
+	mask_set(sb->snapmask.word, i);
 	set_sb_dirty(sb);
 	return i;
 }
@@ -2699,9 +4317,9 @@ static void show_snapshots(struct superblock *sb)
 
 	printf("%u snapshots\n", snapshots);
 	for (i = 0; i < snapshots; i++) {
-		struct snapshot *snapshot = sb->image.snaplist + i;
+		struct snapshot *snapshot = sb->snaplist + i;
 		printf("snapshot %u tag %u prio %i created %x\n", 
-			snapshot->bit, 
+			snap_bit(snapshot), 
 			snapshot->tag, 
 			snapshot->prio, 
 			snapshot->ctime);
@@ -2809,6 +4427,8 @@ struct client
 
 struct pending
 {
+	u64 start; // microseconds, when the write started waiting
+	u64 traced; // its trace record
 	unsigned holdcount;
 	struct client *client;
 	struct messagebuf message;
@@ -2925,6 +4545,7 @@ static void waitfor_chunk(struct superblock *sb, chunk_t chunk, struct pending *
 			// arguably we should know the client and fill it in here
 			*pending = calloc(1, sizeof(struct pending));
 			(*pending)->holdcount = 1;
+			(*pending)->start = usecs();
 		}
 		trace(printf("new_snaplock_wait call\n"););
 		struct snaplock_wait *wait = new_snaplock_wait(sb);
@@ -2994,6 +4615,8 @@ static struct snaplock *release_lock(struct superblock *sb, struct snaplock *loc
 		assert(list->pending->holdcount);
 		if (list->pending != NULL && !--(list->pending->holdcount)) {
 			struct pending *pending = list->pending;
+			histogram_time(&metrics.lock_wait, pending->start);
+			trace_wait(pending->traced);
 			reply(pending->client->sock, &pending->message);
 			free(pending);
 		}
@@ -3117,7 +4740,7 @@ static void setup_sb(struct superblock *sb)
 	sb->snapdata.allocsize = 1 << cs_bits;
 	sb->metadata.chunk_sectors_bits = bs_bits - SECTOR_BITS;
 	sb->snapdata.chunk_sectors_bits = cs_bits - SECTOR_BITS;
-	sb->metadata.alloc_per_node = (sb->metadata.allocsize - offsetof(struct enode, entries)) / sizeof(struct index_entry);
+	sb->metadata.alloc_per_node = sb->metadata.allocsize / 2 / sizeof(sector_t);
 #ifdef BUSHY
 	sb->metadata.alloc_per_node = 10;
 #endif
@@ -3133,18 +4756,37 @@ static void setup_sb(struct superblock *sb)
 
 	sb->metadata.asi = &sb->image.metadata; // !!! so why even have sb->metadata??
 	sb->snapdata.asi = combined(sb) ? &(sb)->image.metadata : &(sb)->image.snapdata;
+
+	/*
+	 * Up to 64 snapshots fit in the superblock.  A store initialized for
+	 * more has wide share masks and keeps its snapshot list, space counts
+	 * and deleting mask in a table of its own instead.
+	 */
+	if ((sb->share_words = sb->image.share_words ? sb->image.share_words : 1) == 1) {
+		sb->snaplist = sb->image.snaplist;
+		sb->space = sb->image.space;
+		sb->deleting = &sb->image.deleting;
+		for (int i = 0; i < SB_SNAPSHOTS; i++)
+			sb->image.snaplist[i].bithigh = 0; /* was padding */
+		return;
+	}
+	unsigned table_bytes = DIVROUND(snaptable_bytes(sb->share_words), sb->metadata.allocsize) << bs_bits;
+	if ((err = posix_memalign((void **)&sb->snaptable, SECTOR_SIZE, table_bytes)))
+		error("unable to allocate snapshot table: %s", strerror(err));
+	memset(sb->snaptable, 0, table_bytes);
+	if (sb->image.snaptable && diskread(sb->metadev, sb->snaptable, table_bytes, sb->image.snaptable << SECTOR_BITS) < 0)
+		error("unable to read snapshot table: %s", strerror(errno));
+	sb->deleting = (u64 *)sb->snaptable;
+	sb->space = (struct snapspace *)(sb->deleting + sb->share_words);
+	sb->snaplist = (struct snapshot *)(sb->space + 64 * sb->share_words);
 }
 
 /*
  * Shrink snapshot store: clear bits for shrinked space and free unused bitmap chunks
  * Expand snapshot store:
  *   If we don't need more bitmap chunks, just update last bytes.
- *   Otherwise:
- *     Copy old bitmap blocks to the beginning of the added space
- *     Zero additional new bitmap blocks
- *     Set new bitmap base and bitmap blocks
- *     Clear bits for old bitmap chunks in new bitmap
- *     Reserve new bitmap chunks in new bitmap
+ *   Otherwise start moving the bitmap to the beginning of the added space,
+ *   see relocate_step(), and return one.
  */
 
 static int adjust_bitmap(struct superblock *sb, struct allocspace *as, u64 newchunks, u64 new_basechunk, u64 new_metachunks)
@@ -3154,23 +4796,20 @@ static int adjust_bitmap(struct superblock *sb, struct allocspace *as, u64 newch
 	unsigned newbitmaps = calc_bitmap_blocks(sb, newchunks);
 	chunk_t oldbase = as->asi->bitmap_base << SECTOR_BITS;
 	chunk_t newbase = new_basechunk << sb->metadata.asi->allocsize_bits;
-	unsigned blockshift = sb->metadata.asi->allocsize_bits;
 	unsigned blocksize = sb->metadata.allocsize;
 	chunk_t oldchunks_meta = oldbase >> sb->metadata.asi->allocsize_bits;
-	sector_t sector;
-	int i;
 
 	warn("oldchunks %Lu newchunks %Lu, oldbitmaps %u, newbitmaps %u", oldchunks, newchunks, oldbitmaps, newbitmaps);
 	/* snapshot shrinking */
 	if (newchunks <= oldchunks) {
 		/* check if any chunk to be freed is currently in use */
-		if (change_bits(sb, newchunks, oldchunks - newchunks, oldbase, 0)) {
+		if (change_bits(sb, as, newchunks, oldchunks - newchunks, 0)) {
 			warn("some chunks to be freed are still in use!!!");
 			return -1;
 		}
 		/* clear bits for unused bitmap chunks */
 		if (newbitmaps < oldbitmaps) {
-			change_bits(sb, oldchunks_meta + newbitmaps, oldbitmaps - newbitmaps, sb->image.metadata.bitmap_base << SECTOR_BITS, 2);
+			change_bits(sb, &sb->metadata, oldchunks_meta + newbitmaps, oldbitmaps - newbitmaps, 2);
 			as->asi->bitmap_blocks = newbitmaps;
 		}
 		return 0;
@@ -3180,8 +4819,7 @@ static int adjust_bitmap(struct superblock *sb, struct allocspace *as, u64 newch
 	if (oldbitmaps == newbitmaps) {
 		if ((oldchunks & 7) || (newchunks & 7)) {
 			/* clear the last byte of the old/new bitmap block */
-			sector_t sector = (oldbase >> SECTOR_BITS) + ((oldbitmaps - 1) << sb->metadata.chunk_sectors_bits);
-			struct buffer *buffer = bread(sb->metadev, sector, blocksize);
+			struct buffer *buffer = bread(sb->metadev, bitmap_sector(sb, as, oldbitmaps - 1), blocksize);
 			if ((oldchunks & 7))
 				buffer->data[(oldchunks >> 3) & (blocksize - 1)] &= ~(0xff << (oldchunks & 7));
 			if ((newchunks & 7))
@@ -3198,40 +4836,119 @@ static int adjust_bitmap(struct superblock *sb, struct allocspace *as, u64 newch
 		return -1;
 	}
 
-	/* copy old bitmap chunks to the newbase */
-	for (i = 0; i < oldbitmaps; i++) {
-		trace_off(warn("copy oldbitmap %d to sector %Lu", i, (newbase + (i << blockshift)) >> SECTOR_BITS););
-		diskread(sb->metadev, sb->copybuf, blocksize, oldbase + (i << blockshift));
-		diskwrite(sb->metadev, sb->copybuf, blocksize, newbase + (i << blockshift));
+	*relocation(sb, as) = (struct relocation){ .chunks = newchunks, .base = newbase >> SECTOR_BITS, .blocks = newbitmaps };
+	sb->image.flags |= SB_RESIZING;
+	/* already part of the metadata space if that grew without moving */
+	if (as != &sb->metadata && new_basechunk + newbitmaps <= sb->metadata.asi->chunks) {
+		change_bits(sb, &sb->metadata, new_basechunk, newbitmaps, 1);
+		sb->metadata.asi->freechunks -= newbitmaps;
 	}
+	set_sb_dirty(sb);
+	return 1;
+}
+
+/*
+ * A store grown past what its allocation bitmap covers needs a bigger bitmap,
+ * which goes in the space added to the metadata store.  Rather than hold up
+ * clients while the whole bitmap is copied, it is moved in the background, a
+ * batch of blocks at a time between requests, and the store only grows once
+ * it is done.  Blocks already moved are used in their new place meanwhile.
+ * How far the move has got is saved in the superblock after each batch, so
+ * it carries on from there after a restart.
+ */
+#define RELOCATE_STEP_BLOCKS 256 /* bitmap blocks moved per step of a resize */
+
+static void finish_relocation(struct superblock *sb, struct allocspace *as)
+{
+	struct relocation *move = relocation(sb, as), *snapmove = &sb->image.relocation[1];
+	unsigned oldbitmaps = as->asi->bitmap_blocks, blocksize = sb->metadata.allocsize;
+	chunk_t oldchunks = as->asi->chunks;
+	chunk_t oldbase = as->asi->bitmap_base >> sb->metadata.chunk_sectors_bits;
 
-	/* clear the partial bits for the last old bitmap byte */
+	/* allocation may go past the old end now */
 	if ((oldchunks & 7)) {
-		sector_t sector = (newbase >> SECTOR_BITS) + ((oldbitmaps - 1) << sb->metadata.chunk_sectors_bits);
-		struct buffer *buffer = bread(sb->metadev, sector, blocksize);
+		struct buffer *buffer = snapread(sb, bitmap_sector(sb, as, oldbitmaps - 1));
 		buffer->data[(oldchunks >> 3) & (blocksize - 1)] &= ~(0xff << (oldchunks & 7));
 		brelse_dirty(buffer);
 	}
+	as->asi->bitmap_base = move->base;
+	as->asi->bitmap_blocks = move->blocks;
+	as->asi->freechunks += move->chunks - oldchunks;
+	as->asi->chunks = move->chunks;
+	move->chunks = 0;
+
+	/* the old bitmap is free metadata space, the new one is not */
+	change_bits(sb, &sb->metadata, oldbase, oldbitmaps, 2);
+	sb->metadata.asi->freechunks += oldbitmaps;
+	if (as == &sb->metadata) {
+		change_bits(sb, &sb->metadata, move->base >> sb->metadata.chunk_sectors_bits, move->blocks, 1);
+		sb->metadata.asi->freechunks -= move->blocks;
+		if (snapmove->chunks) {
+			change_bits(sb, &sb->metadata, snapmove->base >> sb->metadata.chunk_sectors_bits, snapmove->blocks, 1);
+			sb->metadata.asi->freechunks -= snapmove->blocks;
+		}
+	}
+	if (!sb->image.relocation[0].chunks && !snapmove->chunks)
+		sb->image.flags &= ~SB_RESIZING;
+	/* the bitmap changes must be durable before the superblock says done */
+	commit_transaction(sb, 0);
+	warn("%s store grown to %Lu chunks", as == &sb->metadata ? "metadata" : "snapshot", as->asi->chunks);
+}
 
-	/* clear new bitmap chunks */
-	sector = (newbase >> SECTOR_BITS) + (oldbitmaps << sb->metadata.chunk_sectors_bits);
-	for (i = oldbitmaps; i < newbitmaps; i++, sector += chunk_sectors(&sb->metadata)) {
-		struct buffer *buffer = getblk(sb->metadev, sector, blocksize);
-		memset(buffer->data, 0, blocksize);
-		trace_off(warn("clear newbitmap %d, sector %Lu", i, sector););
-		/* Suppress overrun allocation in partial last byte */
-		if (i == newbitmaps - 1 && (newchunks & 7))
-			buffer->data[(newchunks >> 3) & (blocksize - 1)] |= 0xff << (newchunks & 7);
-		brelse_dirty(buffer);
+/*
+ * Move or clear the next batch of bitmap blocks, metadata first.  Returns
+ * one while there is more to do.
+ */
+static int relocate_step(struct superblock *sb)
+{
+	struct allocspace *as = relocating(sb, &sb->metadata) ? &sb->metadata : &sb->snapdata;
+	struct relocation *move = relocation(sb, as);
+	unsigned blocksize = sb->metadata.allocsize, oldbitmaps = as->asi->bitmap_blocks;
+	unsigned count = move->blocks - move->done, copy = 0;
+	unsigned char *data;
+	int err = 0;
+
+	if (!relocating(sb, as))
+		return 0;
+	if (count > RELOCATE_STEP_BLOCKS)
+		count = RELOCATE_STEP_BLOCKS;
+	if (posix_memalign((void **)&data, SECTOR_SIZE, (size_t)count * blocksize))
+		return -ENOMEM;
+	if (move->done < oldbitmaps) {
+		copy = oldbitmaps - move->done < count ? oldbitmaps - move->done : count;
+		/* copied from disk, so no bitmap block may be dirty or journaled */
+		commit_deferred_allocs(sb);
+		if (diskread(sb->metadev, data, (size_t)copy * blocksize, bitmap_sector(sb, as, move->done) << SECTOR_BITS) < 0) {
+			err = -errno;
+			goto out;
+		}
 	}
+	memset(data + (size_t)copy * blocksize, 0, (size_t)(count - copy) * blocksize);
+	/* Suppress overrun allocation in partial last byte */
+	if (move->done + count == move->blocks && count > copy && (move->chunks & 7))
+		data[(size_t)(count - 1) * blocksize + ((move->chunks >> 3) & (blocksize - 1))] |= 0xff << (move->chunks & 7);
+	if (diskwrite(sb->metadev, data, (size_t)count * blocksize,
+		      (move->base + ((sector_t)move->done << sb->metadata.chunk_sectors_bits)) << SECTOR_BITS) < 0) {
+		err = -errno;
+		goto out;
+	}
+	trace_off(warn("moved %u and cleared %u bitmap blocks from %u", copy, count - copy, move->done););
+	move->done += count;
+	if (move->done == move->blocks)
+		finish_relocation(sb, as);
+	set_sb_dirty(sb);
+	save_sb(sb);
+out:
+	free(data);
+	if (err < 0)
+		warn("unable to move allocation bitmap: %s", strerror(-err));
+	return err < 0 ? err : !!(sb->image.flags & SB_RESIZING);
+}
 
-	as->asi->bitmap_base = newbase >> SECTOR_BITS;
-	as->asi->bitmap_blocks = newbitmaps;
-
-	/* clear bits for old bitmap chunks and reserve new bitmap chunks at new bitmap base */
-	change_bits(sb, oldchunks_meta, oldbitmaps, sb->image.metadata.bitmap_base << SECTOR_BITS, 2);
-	change_bits(sb, new_basechunk, newbitmaps, sb->image.metadata.bitmap_base << SECTOR_BITS, 1);
-	return 0;
+/* chunks in the given space, or that it is growing to */
+static u64 space_chunks(struct superblock *sb, struct allocspace *as)
+{
+	return relocating(sb, as) ? relocation(sb, as)->chunks : as->asi->chunks;
 }
 
 static int change_device_sizes(struct superblock *sb, u64 orgsize, u64 snapsize, u64 metasize)
@@ -3239,25 +4956,29 @@ static int change_device_sizes(struct superblock *sb, u64 orgsize, u64 snapsize,
 	u64 metachunks, snapchunks, orgsectors;
 	u64 new_bitmap_basechunk = 0;
 	u64 new_metachunks = 0;
+	int moving = 0, resizing = !!(sb->image.flags & SB_RESIZING);
 
 	metachunks = metasize >> sb->image.metadata.allocsize_bits;
-	if (metachunks && sb->image.metadata.chunks != metachunks) {
+	if (!resizing && metachunks && sb->image.metadata.chunks != metachunks) {
 		u64 oldbitmaps = sb->image.metadata.bitmap_blocks;
 		warn("metadev size changes from %Lu to %Lu", sb->image.metadata.chunks, metachunks);
 		/* no need to do bitmap update during initialization (i.e., metadata.chunks ==0) */
 		if (sb->image.metadata.chunks) {
 			new_bitmap_basechunk = sb->image.metadata.chunks;
 			new_metachunks = metachunks - sb->image.metadata.chunks;
-			if (adjust_bitmap(sb, &sb->metadata, metachunks, new_bitmap_basechunk, new_metachunks) < 0)
+			if ((moving = adjust_bitmap(sb, &sb->metadata, metachunks, new_bitmap_basechunk, new_metachunks)) < 0)
 				return -1;
-			new_bitmap_basechunk += sb->metadata.asi->bitmap_blocks;
-			new_metachunks -= sb->metadata.asi->bitmap_blocks;
+			unsigned newbitmaps = moving ? sb->image.relocation[0].blocks : sb->metadata.asi->bitmap_blocks;
+			new_bitmap_basechunk += newbitmaps;
+			new_metachunks -= newbitmaps;
+		}
+		if (!moving) {
+			sb->image.metadata.freechunks += metachunks - sb->image.metadata.chunks + oldbitmaps - sb->image.metadata.bitmap_blocks;
+			sb->image.metadata.chunks = metachunks;
 		}
-		sb->image.metadata.freechunks += metachunks - sb->image.metadata.chunks + oldbitmaps - sb->image.metadata.bitmap_blocks;
-		sb->image.metadata.chunks = metachunks;
 	}
 
-	if (sb->metadev != sb->snapdev) {
+	if (!resizing && sb->metadev != sb->snapdev) {
 		snapchunks = snapsize >> sb->image.snapdata.allocsize_bits;
 	       	if (snapchunks && sb->image.snapdata.chunks != snapchunks) {
 			warn("snapdev size changes from %Lu to %Lu", sb->image.snapdata.chunks, snapchunks);
@@ -3266,14 +4987,18 @@ static int change_device_sizes(struct superblock *sb, u64 orgsize, u64 snapsize,
 			 * is also expanded. In that case, new_bitmap_basechunk and new_metachunks
 			 * have been properly updated above.
 			 */
+			moving = 0;
 			if (sb->image.snapdata.chunks) {
 				u64 oldbitmaps = sb->image.snapdata.bitmap_blocks;
-				if (adjust_bitmap(sb, &sb->snapdata, snapchunks, new_bitmap_basechunk, new_metachunks) < 0)
+				if ((moving = adjust_bitmap(sb, &sb->snapdata, snapchunks, new_bitmap_basechunk, new_metachunks)) < 0)
 					return -1;
-				sb->image.metadata.freechunks += oldbitmaps - sb->image.snapdata.bitmap_blocks;
+				if (!moving)
+					sb->image.metadata.freechunks += oldbitmaps - sb->image.snapdata.bitmap_blocks;
+			}
+			if (!moving) {
+				sb->image.snapdata.freechunks += snapchunks - sb->image.snapdata.chunks;
+				sb->image.snapdata.chunks = snapchunks;
 			}
-			sb->image.snapdata.freechunks += snapchunks - sb->image.snapdata.chunks;
-			sb->image.snapdata.chunks = snapchunks;
 		}
 	}
 
@@ -3325,6 +5050,302 @@ static void save_sb_check(struct superblock *sb)
 	save_sb(sb);
 }
 
+/*
+ * Tree compaction
+ *
+ * Splits and merges leave the btree with part full leaves and nodes strewn
+ * over the metadata store in the order they were allocated.  Compaction
+ * rebuilds the tree bottom up from its own leaves: the exceptions are packed
+ * into leaves filled to a given percentage, then the index nodes above them,
+ * all written to one run of free chunks in key order, root last, so a walk of
+ * the tree reads the store front to back and a probe touches fewer blocks.
+ *
+ * Nothing refers to the new tree until it is complete, so it is written
+ * directly and not journaled.  The superblock notes the run before it is
+ * reserved, then swaps in the new root and notes the old one, which is freed
+ * last.  A restart finding the note drops the new tree if it was never
+ * swapped in, or else finishes freeing the old one, see finish_compaction().
+ */
+struct compact {
+	unsigned limit; /* payload bytes to pack each leaf to */
+	u64 old_leaves, leaves; /* leaves of the old tree, and of the new one so far */
+	unsigned used; /* payload of the last leaf while counting */
+	chunk_t base; /* first chunk of the new tree */
+	struct buffer *buffer; /* leaf being packed */
+	struct eleaf *scratch; /* copy of the old leaf being taken apart */
+	u64 *keys; /* first chunk of each new leaf, then of each node */
+	int err;
+};
+
+/* count the leaves the packed tree will have, less the last */
+static void count_packed(struct superblock *sb, struct eleaf *leaf, void *data)
+{
+	struct compact *compact = data;
+
+	compact->old_leaves++;
+	for (unsigned i = 0; i < leaf->count; i++) {
+		unsigned size = entry_bytes(leaf, i);
+		if (compact->used && compact->used + size > compact->limit) {
+			compact->leaves++;
+			compact->used = 0;
+		}
+		compact->used += size;
+	}
+}
+
+static int start_packed_leaf(struct superblock *sb, struct compact *compact, u64 key)
+{
+	chunk_t chunk = compact->base + compact->leaves;
+
+	if (!(compact->buffer = getblk(sb->metadev, chunk << sb->metadata.chunk_sectors_bits, sb->metadata.allocsize)))
+		return -ENOMEM;
+	memset(compact->buffer->data, 0, sb->metadata.allocsize);
+	init_leaf(buffer2leaf(compact->buffer), sb->metadata.allocsize, sb->share_words);
+	compact->keys[compact->leaves++] = key;
+	return 0;
+}
+
+static int write_packed(struct buffer *buffer)
+{
+	int err = write_buffer(buffer);
+
+	if (err < 0)
+		warn("unable to write compacted btree block at sector 0x%Lx: %s", (llu_t)buffer->sector, strerror(-err));
+	brelse(buffer);
+	return err < 0 ? -EIO : 0;
+}
+
+/*
+ * Move the entries of an old leaf into new ones, counting an entry into a
+ * leaf just as count_packed() does.  The old leaf is copied first, as its
+ * buffer must not change.
+ */
+static void pack_leaf(struct superblock *sb, struct eleaf *leaf, void *data)
+{
+	struct compact *compact = data;
+	struct eleaf *scratch = compact->scratch;
+
+	if (compact->err)
+		return;
+	memcpy(scratch, leaf, sb->metadata.allocsize);
+	while (scratch->count) {
+		struct eleaf *packed = buffer2leaf(compact->buffer);
+		unsigned n = 0, used = leaf_payload(packed);
+
+		while (n < scratch->count && (!used || used + entry_bytes(scratch, n) <= compact->limit))
+			used += entry_bytes(scratch, n++);
+		if (n)
+			move_head(packed, scratch, n);
+		if (!scratch->count)
+			break;
+		struct buffer *full = compact->buffer;
+		compact->buffer = NULL;
+		if ((compact->err = write_packed(full)) ||
+		    (compact->err = start_packed_leaf(sb, compact, scratch->base_chunk + scratch->map[0].rchunk)))
+			return;
+	}
+}
+
+/*
+ * Find the first run of the given number of free chunks in an allocation
+ * space, or return -1 if there is none.
+ */
+static chunk_t find_free_run(struct superblock *sb, struct allocspace *as, chunk_t count)
+{
+	unsigned bitmap_shift = sb->metadata.asi->allocsize_bits + 3;
+	u64 bitmap_mask = (1 << bitmap_shift) - 1;
+	chunk_t chunk, start = 0;
+	struct buffer *buffer = NULL;
+
+	for (chunk = 0; chunk < as->asi->chunks && chunk - start < count; chunk++) {
+		if (!buffer || !(chunk & bitmap_mask)) {
+			if (buffer)
+				brelse(buffer);
+			if (!(buffer = snapread(sb, bitmap_sector(sb, as, chunk >> bitmap_shift))))
+				return -1;
+		}
+		if (get_bitmap_bit(buffer->data, chunk & bitmap_mask))
+			start = chunk + 1;
+	}
+	if (buffer)
+		brelse(buffer);
+	return chunk - start == count ? start : -1;
+}
+
+static int chunk_allocated(struct superblock *sb, struct allocspace *as, chunk_t chunk)
+{
+	unsigned bitmap_shift = sb->metadata.asi->allocsize_bits + 3;
+	struct buffer *buffer = snapread(sb, bitmap_sector(sb, as, chunk >> bitmap_shift));
+	int allocated = buffer && get_bitmap_bit(buffer->data, chunk & ((1 << bitmap_shift) - 1));
+
+	if (buffer)
+		brelse(buffer);
+	return allocated;
+}
+
+/* blocks a restart finds already freed are skipped */
+static void free_tree(struct superblock *sb, sector_t sector, unsigned level, unsigned levels)
+{
+	if (level < levels) {
+		struct buffer *nodebuf = read_node(sb, sector);
+		if (!nodebuf) {
+			warn("unable to read node at sector 0x%Lx, its subtree is lost", (llu_t)sector);
+			return;
+		}
+		struct enode *node = buffer2node(nodebuf);
+		for (unsigned i = 0; i < node->count; i++)
+			free_tree(sb, node_sectors(sb, node)[i], level + 1, levels);
+		brelse(nodebuf);
+	}
+	if (chunk_allocated(sb, &sb->metadata, sector >> sb->metadata.chunk_sectors_bits))
+		free_block(sb, sector);
+	dirty_buffer_count_check(sb);
+}
+
+/*
+ * Free the tree replaced by a compaction, or the run reserved for a new tree
+ * that was never swapped in.  The run is reserved in one transaction, so it
+ * is either all allocated or not at all.
+ */
+static void finish_compaction(struct superblock *sb)
+{
+	struct compaction *record = &sb->image.compaction;
+
+	if (!record->chunks)
+		return;
+	if (record->old_root) {
+		trace_off(warn("freeing the btree replaced by compaction"););
+		free_tree(sb, record->old_root, 0, record->old_levels);
+	} else {
+		warn("dropping unfinished compaction of the btree");
+		if (chunk_allocated(sb, &sb->metadata, record->base)) {
+			change_bits(sb, &sb->metadata, record->base, record->chunks, 2);
+			sb->metadata.asi->freechunks += record->chunks;
+		}
+	}
+	commit_transaction(sb, 0);
+	*record = (struct compaction){ };
+	set_sb_dirty(sb);
+	save_sb(sb);
+}
+
+/*
+ * Rebuild the btree with its leaves and nodes filled to the given percent,
+ * all of them if zero.  Clients wait meanwhile.
+ */
+static int compact_tree(struct superblock *sb, unsigned fill, struct compact_tree_ok *result)
+{
+	struct compaction *record = &sb->image.compaction;
+	unsigned bits = sb->metadata.chunk_sectors_bits, per, levels = 0, level;
+	struct compact compact = { };
+	u64 leaves, nodes = 0, count, i, j;
+	chunk_t base, child, next;
+	int err = 0;
+
+	if ((sb->image.flags & SB_RESIZING) || record->chunks)
+		return -EBUSY;
+	if (!fill || fill > 100)
+		fill = 100;
+	compact.limit = leaf_capacity(sb) * fill / 100;
+	per = sb->metadata.alloc_per_node * fill / 100;
+	if (per < 2)
+		per = 2;
+
+	if ((err = traverse_tree_range(sb, 0, -1, count_packed, &compact)) < 0)
+		return err;
+	leaves = compact.leaves + 1;
+	for (count = leaves; !levels || count > 1; levels++)
+		nodes += count = DIVROUND(count, per);
+
+	/* the bitmap is read from here on, so flush it and start clean */
+	commit_deferred_allocs(sb);
+	if ((base = find_free_run(sb, &sb->metadata, leaves + nodes)) == -1) {
+		warn("no run of %Lu free metadata chunks to compact the btree into", (llu_t)(leaves + nodes));
+		return -ENOSPC;
+	}
+	if (!(compact.keys = malloc(leaves * sizeof(*compact.keys))) || !(compact.scratch = malloc(sb->metadata.allocsize))) {
+		err = -ENOMEM;
+		goto out;
+	}
+	*record = (struct compaction){ .base = base, .chunks = leaves + nodes };
+	set_sb_dirty(sb);
+	save_sb(sb);
+	change_bits(sb, &sb->metadata, base, leaves + nodes, 1);
+	sb->metadata.asi->freechunks -= leaves + nodes;
+	commit_transaction(sb, 0);
+
+	compact.base = base;
+	compact.leaves = 0;
+	if ((err = start_packed_leaf(sb, &compact, 0)) < 0)
+		goto fail;
+	if ((err = traverse_tree_range(sb, 0, -1, pack_leaf, &compact)) < 0 || (err = compact.err))
+		goto fail;
+	struct buffer *last = compact.buffer;
+	compact.buffer = NULL;
+	if ((err = write_packed(last)))
+		goto fail;
+	assert(compact.leaves == leaves);
+
+	/* each level of index nodes follows the one below it */
+	for (level = 0, count = leaves, child = base, next = base + leaves; level < levels; level++) {
+		u64 parents = DIVROUND(count, per);
+
+		for (j = 0; j < parents; j++) {
+			u64 from = j * count / parents, to = (j + 1) * count / parents;
+			struct buffer *buffer = getblk(sb->metadev, (next + j) << bits, sb->metadata.allocsize);
+
+			if (!buffer) {
+				err = -ENOMEM;
+				goto fail;
+			}
+			memset(buffer->data, 0, sb->metadata.allocsize);
+			struct enode *node = buffer2node(buffer);
+			node->version = NODE_VERSION;
+			for (i = from; i < to; i++, node->count++) {
+				node_sectors(sb, node)[node->count] = (child + i) << bits;
+				if (node->count) /* the first child's key is in the node above */
+					node_keys(node)[node->count] = compact.keys[i];
+			}
+			compact.keys[j] = compact.keys[from];
+			if ((err = write_packed(buffer)))
+				goto fail;
+		}
+		child = next;
+		next += parents;
+		count = parents;
+	}
+
+	*result = (struct compact_tree_ok){
+		.old_levels = sb->image.etree_levels, .old_leaves = compact.old_leaves,
+		.levels = levels, .leaves = leaves, .nodes = nodes };
+	record->old_root = sb->image.etree_root;
+	record->old_levels = sb->image.etree_levels;
+	sb->image.etree_root = child << bits;
+	sb->image.etree_levels = levels;
+	forget_finger(sb);
+	set_sb_dirty(sb);
+	save_sb(sb);
+	finish_compaction(sb);
+	if (sb->fill.leaves) {
+		sb->fill.levels = levels;
+		sb->fill.nodes = nodes;
+		sb->fill.node_entries = leaves + nodes - 1;
+		sb->fill.leaves = leaves;
+	}
+	warn("btree compacted from %u levels and %Lu leaves to %u levels, %Lu leaves and %Lu nodes at chunk %Lu",
+		result->old_levels, (llu_t)result->old_leaves, levels, (llu_t)leaves, (llu_t)nodes, (llu_t)base);
+out:
+	free(compact.keys);
+	free(compact.scratch);
+	return err;
+fail:
+	if (compact.buffer)
+		brelse(compact.buffer);
+	warn("unable to compact the btree: %s", strerror(-err));
+	finish_compaction(sb);
+	goto out;
+}
+
 static int init_journal(struct superblock *sb)
  {
 	chunk_t metafree = sb->image.metadata.freechunks;
@@ -3343,11 +5364,30 @@ static int init_journal(struct superblock *sb)
 	return 0;
 }
 
-static int init_super(struct superblock *sb, u32 js_bytes, u32 bs_bits, u32 cs_bits)
+static int init_super(struct superblock *sb, u32 js_bytes, u32 bs_bits, u32 cs_bits, unsigned snapshots)
 {
 	int error;
 
+	if (bs_bits >= LEAF_OFFSET_BITS) {
+		warn("block size %u too large for btree leaves", 1 << bs_bits);
+		return -EINVAL;
+	}
 	sb->image = (struct disksuper){ .magic = SB_MAGIC };
+	if (snapshots > SB_SNAPSHOTS) {
+		/* one more bit than snapshots, the squashed one */
+		unsigned words = DIVROUND(snapshots + 1, 64);
+		if (words > MAX_SHARE_WORDS) {
+			warn("at most %u snapshots", MAX_SNAPSHOTS - 1);
+			return -EINVAL;
+		}
+		/* a chunk written between each snapshot has an exception for each, all in one leaf */
+		unsigned leaf_bytes = offsetof(struct eleaf, map[2]) + (64 * words - 1) * ex_size(words);
+		if (leaf_bytes > 1 << bs_bits) {
+			warn("a store for %u snapshots needs a block size of at least %u bytes", snapshots, leaf_bytes);
+			return -EINVAL;
+		}
+		sb->image = (struct disksuper){ .magic = SB_MAGIC_WIDE, .share_words = words };
+	}
 	sb->image.metadata.allocsize_bits = bs_bits;
 	sb->image.snapdata.allocsize_bits = cs_bits;
 
@@ -3358,6 +5398,7 @@ static int init_super(struct superblock *sb, u32 js_bytes, u32 bs_bits, u32 cs_b
 
 	setup_sb(sb);
 	sb->image.etree_levels = 1;
+	sb->image.flags |= SB_COUNTED; /* nothing to count yet */
 	sb->image.create_time = time(NULL);
 	sb->image.orgoffset  = 0; //!!! FIXME: shouldn't always assume offset starts at 0
 
@@ -3379,7 +5420,7 @@ static int init_super(struct superblock *sb, u32 js_bytes, u32 bs_bits, u32 cs_b
 	struct buffer *rootbuf = new_node(sb);
 	assert(leafbuf != NULL && rootbuf != NULL);
 	buffer2node(rootbuf)->count = 1;
-	buffer2node(rootbuf)->entries[0].sector = leafbuf->sector;
+	node_sectors(sb, buffer2node(rootbuf))[0] = leafbuf->sector;
 	sb->image.etree_root = rootbuf->sector;
 	brelse_dirty(rootbuf);
 	brelse_dirty(leafbuf);
@@ -3414,42 +5455,98 @@ next:
 #define check_client_locks(x, y) client_locks(x, y, 1)
 #define free_client_locks(x, y) client_locks(x, y, 0)
 
-/* A very simple-minded implementation.  You can do it in very
- * few operations with whole-register bit twiddling but I assume
- * that we can juse find a macro somewhere which works.
- *  AKA hamming weight, sideways add
+/*
+ * Walk a B-tree leaf, counting shared chunks per snapshot, and the leaf in
+ * the tree fill.
  */
-static unsigned int bit_count(u64 num)
+static void calc_sharing(struct superblock *sb, struct eleaf *leaf, void *data)
 {
-	unsigned count = 0;
-
-	for (; num; num >>= 1)
-		if (num & 1)
-			count++;
+	u64 *share_table = data;
+	unsigned words = share_words(leaf);
+	struct exception *p;
+	int i;
 
-	return count;
+	sb->fill.leaves++;
+	sb->fill.leaf_bytes += leaf_payload(leaf);
+	for (i = 0; i < leaf->count; i++)
+		for (p = emap(leaf, i); p < emap(leaf, i+1); p = ex_next(p, words)) {
+			assert(!mask_empty(ex_share(p), words)); // belongs in check leaf function
+			count_sharing(share_table, ex_share(p), words, map_run(&leaf->map[i]));
+		}
 }
 
 /*
- * Walk a B-tree leaf, counting shared chunks per snapshot.
+ * Count the unique and shared chunks per snapshot in a B-tree leaf, from the
+ * given chunk on.  The leaf may start before it if it was merged with one
+ * already counted.
  */
-static void calc_sharing(struct superblock *sb, struct eleaf *leaf, void *data)
+static void count_leaf_space(struct superblock *sb, struct eleaf *leaf, chunk_t from)
 {
-	uint64_t *share_table = data;
-	struct exception const *p;
-	unsigned bit;
-	unsigned int share_count;
+	unsigned words = share_words(leaf);
+	struct exception *p;
 	int i;
 
-	for (i = 0; i < leaf->count; i++)
-		for (p = emap(leaf, i); p < emap(leaf, i+1); p++) {
-			assert(p->share); // belongs in check leaf function
-			share_count = bit_count(p->share) - 1;
+	for (i = 0; i < leaf->count; i++) {
+		chunk_t chunk = leaf->base_chunk + leaf->map[i].rchunk, end = chunk + map_run(&leaf->map[i]);
+		if (end <= from)
+			continue;
+		for (p = emap(leaf, i); p < emap(leaf, i+1); p = ex_next(p, words))
+			count_space(sb, ex_share(p), end - (chunk < from ? from : chunk));
+	}
+}
+
+/*
+ * The space counts are kept up to date in the superblock and saved with it
+ * at shutdown, so a clean start trusts them.  A store that never had them,
+ * or one that was not shut down cleanly, has them counted again by a walk
+ * of the whole tree, a few leaves at a time between requests.
+ */
+static void start_recount(struct superblock *sb)
+{
+	warn("counting snapshot space in the background");
+	sb->image.flags &= ~SB_COUNTED;
+	sb->image.exceptions = 0;
+	memset(sb->space, 0, 64 * sb->share_words * sizeof(*sb->space));
+	sb->recount_next = 0;
+	set_sb_dirty(sb);
+}
+
+/*
+ * Count up to the given number of leaves, or all that remain if zero.
+ * Returns one while there is more to do.
+ */
+static int recount_step(struct superblock *sb, unsigned leaves)
+{
+	unsigned levels = sb->image.etree_levels;
+	struct etree_path path[levels];
+	struct buffer *leafbuf;
+	chunk_t next;
+	int level;
 
-			for (bit = 0; bit < MAX_SNAPSHOTS; bit++)
-				if (p->share & (1ULL << (u64)bit))
-					share_table[MAX_SNAPSHOTS * bit + share_count]++;
+	while (!(sb->image.flags & SB_COUNTED)) {
+		if (!(leafbuf = probe(sb, sb->recount_next, path))) {
+			warn("unable to count snapshot space");
+			return -EIO;
+		}
+		count_leaf_space(sb, buffer2leaf(leafbuf), sb->recount_next);
+		brelse(leafbuf);
+		/* the next leaf starts at the key of the next entry up the path */
+		for (next = 0, level = levels - 1; level >= 0; level--)
+			if (!finished_level(path, level)) {
+				next = node_keys(path_node(path, level))[path[level].next];
+				break;
+			}
+		brelse_path(path, levels);
+		if (!(sb->recount_next = next)) {
+			trace_on(warn("finished counting snapshot space, %Lu exceptions", (llu_t)sb->image.exceptions););
+			sb->image.flags |= SB_COUNTED;
+			set_sb_dirty(sb);
+			save_sb(sb);
 		}
+		if (leaves && !--leaves)
+			break;
+	}
+	return !(sb->image.flags & SB_COUNTED);
 }
 
 /* It is more expensive than we'd like to find the struct snapshot, FIXME */
@@ -3469,18 +5566,102 @@ void outerror(int sock, int err, char *text)
 		warn("unable to send error %u", GENERIC_ERROR);
 }
 
-void get_status(struct superblock *sb, unsigned sock)
+/*
+ * Work out the space counts from the sharing table, for a summary asked for
+ * while they are still being counted in the background.  Each exception is
+ * in the row of every snapshot sharing it, in the column one less than the
+ * number of those.
+ */
+static u64 sharing_space(struct superblock *sb, struct snapspace *space)
 {
-	struct snapshot const *snaplist = sb->image.snaplist;
+	unsigned bits = 64 * sb->share_words;
+	u64 *sharing = sb->sharing, exceptions = 0;
 
-	unsigned snapshots = sb->image.snapshots;
-	size_t reply_len = snapshot_details_calc_size(snapshots, snapshots);
-	struct status_reply *reply = calloc(reply_len, 1); // !!! error check?
+	for (int col = 0; col < bits; col++) {
+		u64 total = 0;
+		for (int bit = 0; bit < bits; bit++)
+			total += sharing[bits * bit + col];
+		exceptions += total / (col + 1);
+	}
+	for (int bit = 0; bit < bits; bit++) {
+		u64 *row = sharing + bits * bit;
+		space[bit] = (struct snapspace){ .unique = row[0] };
+		for (int col = 1; col < bits; col++)
+			space[bit].shared += row[col];
+	}
+	return exceptions;
+}
+
+/*
+ * Count the index nodes below the given one in the tree fill.  Leaves are
+ * counted by calc_sharing() as the tree is walked for the sharing table.
+ */
+static int count_nodes(struct superblock *sb, sector_t sector, unsigned level)
+{
+	struct buffer *nodebuf = read_node(sb, sector);
+	int err = 0;
 
-	uint64_t share_array[MAX_SNAPSHOTS * MAX_SNAPSHOTS];
-	memset(share_array, 0, sizeof(share_array));
+	if (!nodebuf) {
+		warn("unable to read node at sector 0x%Lx", (llu_t)sector);
+		return -EIO;
+	}
+	struct enode *node = buffer2node(nodebuf);
+	sb->fill.nodes++;
+	sb->fill.node_entries += node->count;
+	if (level + 1 < sb->image.etree_levels)
+		for (unsigned i = 0; i < node->count && !err; i++)
+			err = count_nodes(sb, node_sectors(sb, node)[i], level + 1);
+	brelse(nodebuf);
+	return err;
+}
+
+/*
+ * The sharing table is counted with a walk of the whole tree the first time
+ * status is asked for, or when asked to recount, then kept up to date as
+ * exceptions are added and deleted.  A summary needs only the space counts
+ * and never walks the tree, unless they are not counted yet: each snapshot
+ * gets its unique and shared chunks in the first two columns, and the number
+ * of exceptions follows the rows.  The tree fill counted with the last walk
+ * follows either.
+ */
+void get_status(struct superblock *sb, unsigned sock, u32 flags)
+{
+	struct snapshot const *snaplist = sb->snaplist;
 
-	traverse_tree_range(sb, 0, -1, calc_sharing, share_array);
+	unsigned snapshots = sb->image.snapshots;
+	int summary = (flags & STATUS_SUMMARY) && !(flags & STATUS_RECOMPUTE);
+	size_t details_len = snapshot_details_calc_size(snapshots, snapshots);
+	size_t fill_at = details_len + (summary ? sizeof(struct status_summary) : 0);
+	size_t reply_len = fill_at + sizeof(struct status_tree);
+	struct status_reply *reply = calloc(reply_len, 1); // !!! error check?
+	int recompute = !!(flags & STATUS_RECOMPUTE);
+	unsigned bits = 64 * sb->share_words;
+	struct snapspace *space = sb->space, *partial = NULL;
+	u64 exceptions = sb->image.exceptions;
+
+	if ((!summary || !(sb->image.flags & SB_COUNTED)) && !sb->sharing) {
+		if (!(sb->sharing = malloc(bits * bits * sizeof(u64))))
+			error("unable to allocate sharing table");
+		recompute = 1;
+	}
+	if (recompute) {
+		memset(sb->sharing, 0, bits * bits * sizeof(u64));
+		sb->fill = (struct status_tree){
+			.levels = sb->image.etree_levels,
+			.node_capacity = sb->metadata.alloc_per_node,
+			.leaf_capacity = leaf_capacity(sb) };
+		traverse_tree_range(sb, 0, -1, calc_sharing, sb->sharing);
+		count_nodes(sb, sb->image.etree_root, 0);
+	}
+	memcpy((char *)reply + fill_at, &sb->fill, sizeof(struct status_tree));
+	if (summary) {
+		if (!(sb->image.flags & SB_COUNTED)) {
+			if (!(space = partial = malloc(bits * sizeof(*partial))))
+				error("unable to allocate space counts");
+			exceptions = sharing_space(sb, partial);
+		}
+		((struct status_summary *)((char *)reply + details_len))->exceptions = exceptions;
+	}
 	reply->ctime = sb->image.create_time;
 	reply->meta.chunksize_bits = sb->image.metadata.allocsize_bits;
 	reply->meta.total = sb->image.metadata.chunks;
@@ -3503,17 +5684,103 @@ void get_status(struct superblock *sb, unsigned sock)
 			details->sharing[0] = -1;
 			continue;
 		}
+		if (summary) {
+			details->sharing[0] = space[snap_bit(&snaplist[row])].unique;
+			if (snapshots > 1)
+				details->sharing[1] = space[snap_bit(&snaplist[row])].shared;
+			continue;
+		}
 		for (int col = 0; col < snapshots; ++col)
-			details->sharing[col] = share_array[MAX_SNAPSHOTS * snaplist[row].bit + col];
+			details->sharing[col] = sb->sharing[bits * snap_bit(&snaplist[row]) + col];
 	}
 
 	if (outhead(sock, STATUS_OK, reply_len) < 0 || writepipe(sock, reply, reply_len) < 0)
 		warn("unable to send status message");
 
+	free(partial);
 	free(reply);
 	selfcheck_freespace(sb);
 }
 
+static void add_stats_entry(struct stats_reply *reply, char const *name, struct histogram const *histogram, u64 count)
+{
+	struct stats_entry *entry = reply->entry + reply->entries++;
+
+	*entry = (struct stats_entry){ .count = count };
+	snprintf(entry->name, sizeof(entry->name), "%s", name);
+	if (histogram) {
+		entry->buckets = STATS_BUCKETS;
+		entry->count = histogram->count;
+		entry->sum = histogram->sum;
+		memcpy(entry->bucket, histogram->bucket, sizeof(entry->bucket));
+	}
+}
+
+/*
+ * Report the metrics: the histograms, the buffer cache counts, then how
+ * many of each message have come in, leaving out those that have not.
+ */
+static void get_stats(unsigned sock, u32 flags)
+{
+	struct { char const *name; struct histogram *histogram; } histograms[] = {
+		{ "origin_write_us", &metrics.origin_write },
+		{ "snapshot_write_us", &metrics.snapshot_write },
+		{ "snapshot_read_us", &metrics.snapshot_read },
+		{ "copyout_us", &metrics.copyout },
+		{ "copyout_bytes", &metrics.copyout_bytes },
+		{ "commit_us", &metrics.commit },
+		{ "commit_blocks", &metrics.commit_blocks },
+		{ "alloc_scan_bytes", &metrics.alloc_scan },
+		{ "lock_wait_us", &metrics.lock_wait },
+	};
+	unsigned histogram_count = sizeof(histograms) / sizeof(*histograms), i;
+	size_t reply_len = sizeof(struct stats_reply) + (histogram_count + 3 + CODES) * sizeof(struct stats_entry);
+	struct stats_reply *reply = calloc(reply_len, 1);
+	char name[STATS_NAME];
+
+	if (!reply) {
+		outerror(sock, ENOMEM, "no memory for stats");
+		return;
+	}
+	reply->since = metrics.since;
+	for (i = 0; i < histogram_count; i++)
+		add_stats_entry(reply, histograms[i].name, histograms[i].histogram, 0);
+	add_stats_entry(reply, "buffer_hits", NULL, buffer_stats.hits);
+	add_stats_entry(reply, "buffer_misses", NULL, buffer_stats.misses);
+	add_stats_entry(reply, "buffer_evictions", NULL, buffer_stats.evictions);
+	for (i = 0; i < CODES; i++)
+		if (metrics.requests[i]) {
+			snprintf(name, sizeof(name), "requests.%s", code_names[i]);
+			add_stats_entry(reply, name, NULL, metrics.requests[i]);
+		}
+	reply_len = sizeof(struct stats_reply) + reply->entries * sizeof(struct stats_entry);
+	if (outhead(sock, STATS_OK, reply_len) < 0 || writepipe(sock, reply, reply_len) < 0)
+		warn("unable to send stats message");
+	free(reply);
+	if (flags & STATS_RESET) {
+		metrics = (struct metrics){ .since = time(NULL) };
+		buffer_stats = (struct buffer_stats){ };
+	}
+}
+
+/* Send the trace ring oldest first, straight from the ring in at most two pieces */
+static void trace_dump(unsigned sock, u32 flags)
+{
+	unsigned records = trace_count - trace_cleared < TRACE_RECORDS ? trace_count - trace_cleared : TRACE_RECORDS;
+	unsigned oldest = (trace_count - records) % TRACE_RECORDS, wrap = TRACE_RECORDS - oldest;
+	struct trace_dump_ok reply = { .phases = TRACE_PHASES, .records = records };
+
+	if (wrap > records)
+		wrap = records;
+	if (outhead(sock, TRACE_DUMP_OK, sizeof(reply) + records * sizeof(struct trace_record)) < 0 ||
+		writepipe(sock, &reply, sizeof(reply)) < 0 ||
+		writepipe(sock, trace_ring + oldest, wrap * sizeof(struct trace_record)) < 0 ||
+		writepipe(sock, trace_ring, (records - wrap) * sizeof(struct trace_record)) < 0)
+		warn("unable to send trace dump");
+	if (flags & TRACE_CLEAR)
+		trace_cleared = trace_count;
+}
+
 /*
  * Responses to IO requests take two quite different paths through the
  * machinery:
@@ -3548,6 +5815,7 @@ static int incoming(struct superblock *sb, struct client *client)
 	unsigned sock = client->sock;
 	char *why = "";
 	int i, j, err;
+	u64 start;
 
 	if ((err = readpipe(sock, &message.head, sizeof(message.head))))
 		goto pipe_error;
@@ -3556,6 +5824,9 @@ static int incoming(struct superblock *sb, struct client *client)
 		goto message_too_long;
 	if ((err = readpipe(sock, &message.body, message.head.length)))
 		goto pipe_error;
+	if (message.head.code - PROTOCOL_ERROR < CODES)
+		metrics.requests[message.head.code - PROTOCOL_ERROR]++;
+	start = usecs();
 
 	switch (message.head.code) {
 	case QUERY_WRITE:
@@ -3569,6 +5840,7 @@ static int incoming(struct superblock *sb, struct client *client)
 				goto message_too_short;
 
 			trace(warn("origin write query, %u ranges", body->count););
+			trace_request(TRACE_ORIGIN_WRITE, body);
 			message.head.code = ORIGIN_WRITE_OK;
 			for (i = 0; i < body->count; i++, p++)
 				for (j = 0, chunk = p->chunk; j < p->chunks; j++, chunk++) {
@@ -3594,7 +5866,10 @@ static int incoming(struct superblock *sb, struct client *client)
 			 * structure with our client ID and fill in the
 			 * message to be sent when the lock is released.
 			 */
+			histogram_time(&metrics.origin_write, start);
+			u64 traced = trace_finish();
 			if (pending) {
+				pending->traced = traced;
 				pending->client = client;
 				memcpy(&pending->message, &message, message.head.length + sizeof(struct head));
 				pending->holdcount--;
@@ -3608,6 +5883,7 @@ static int incoming(struct superblock *sb, struct client *client)
 		if (message.head.length < sizeof(*body))
 			goto message_too_short;
 		trace(printf("snapshot write request, %u ranges\n", body->count););
+		trace_request(TRACE_SNAPSHOT_WRITE, body);
 		struct addto snap = { .nextchunk = -1 };
 		u32 ret_msgcode = SNAPSHOT_WRITE_OK;
 		struct snapshot *snapshot = client_snap(sb, client);
@@ -3620,7 +5896,7 @@ static int incoming(struct superblock *sb, struct client *client)
 					warn("trying to write squashed snapshot, id = %u", body->id);
 					exception =  -1;
 				} else
-					exception = make_unique(sb, chunk, snapshot->bit);
+					exception = make_unique(sb, chunk, snap_bit(snapshot));
 				if (exception == -1) {
 					warn("ERROR: unable to perform copyout during snapshot write.");
 					ret_msgcode = SNAPSHOT_WRITE_ERROR;
@@ -3633,6 +5909,8 @@ static int incoming(struct superblock *sb, struct client *client)
 		finish_copyout(sb);
 		commit_transaction(sb, 0);
 		finish_reply(client->sock, &snap, ret_msgcode, body->id);
+		histogram_time(&metrics.snapshot_write, start);
+		trace_finish();
 		break;
 	case QUERY_SNAPSHOT_READ:
 	{
@@ -3640,6 +5918,7 @@ static int incoming(struct superblock *sb, struct client *client)
 		if (message.head.length < sizeof(*body))
 			goto message_too_short;
 		trace(printf("snapshot read request, %u ranges\n", body->count););
+		trace_request(TRACE_SNAPSHOT_READ, body);
 		struct addto snap = { .nextchunk = -1 }, org = { .nextchunk = -1 };
 		struct snapshot *snapshot = client_snap(sb, client);
 
@@ -3653,6 +5932,7 @@ static int incoming(struct superblock *sb, struct client *client)
 					*(snap.top)++ = 0;
 				}
 			finish_reply(client->sock, &snap, SNAPSHOT_READ_ERROR, body->id);
+			trace_finish();
 			break;
 		}
 
@@ -3660,7 +5940,7 @@ static int incoming(struct superblock *sb, struct client *client)
 			for (j = 0; j < body->ranges[i].chunks; j++) {
 				chunk_t chunk = body->ranges[i].chunk + j, exception = 0;
 				trace(warn("read %Lx", chunk););
-				test_unique(sb, chunk, snapshot->bit, &exception);
+				test_unique(sb, chunk, snap_bit(snapshot), &exception);
 				/*
 				 * If this chunk is only in a snapshot, we
 				 * want to read only from the snapshot; if it's
@@ -3699,6 +5979,8 @@ static int incoming(struct superblock *sb, struct client *client)
 		 */
 		finish_reply(client->sock, &org, SNAPSHOT_READ_ORIGIN_OK, body->id);
 		finish_reply(client->sock, &snap, SNAPSHOT_READ_OK, body->id);
+		histogram_time(&metrics.snapshot_read, start);
+		trace_finish();
 		break;
 	}
 	case FINISH_SNAPSHOT_READ:
@@ -3754,7 +6036,7 @@ static int incoming(struct superblock *sb, struct client *client)
 				goto identify_error;
 			}
 			client->flags |= SNAPCLIENT_BIT;
-			sb->usecount[snapshot->bit]++; // update the transient usecount only
+			sb->usecount[snap_bit(snapshot)]++; // update the transient usecount only
 			sectors = snapshot->sectors;
 		} else
 			sectors = sb->image.orgsectors;
@@ -3823,6 +6105,24 @@ static int incoming(struct superblock *sb, struct client *client)
 			warn("unable to reply to delete snapshot message"); // !!! return message
 		break;
 	}
+	case DELETE_SNAPSHOTS:
+	{
+		struct delete_snapshots *body = (void *)message.body;
+		u32 tags[maxbody / sizeof(u32)], count;
+		if (message.head.length < sizeof(*body))
+			goto message_too_short;
+		count = body->count;
+		if (message.head.length < sizeof(*body) + count * sizeof(tags[0]))
+			goto message_too_short;
+		/* the tags in the message may be unaligned */
+		memcpy(tags, body->snaps, count * sizeof(tags[0]));
+		if ((err = delete_snaps(sb, tags, count, &why)))
+			goto eek;
+		save_sb_check(sb);
+		if (outbead(sock, DELETE_SNAPSHOT_OK, struct { }) < 0)
+			warn("unable to reply to delete snapshots message");
+		break;
+	}
 	case INITIALIZE_SNAPSTORE: // this is a stupid feature
 	{
 		break;
@@ -3840,8 +6140,9 @@ static int incoming(struct superblock *sb, struct client *client)
 			error("Unable to read superblock: %s", strerror(errno));
 		assert(valid_sb(sb));
 		setup_sb(sb);
+		forget_finger(sb);
 		sb->snapmask = calc_snapmask(sb);
-		trace(printf("Active snapshot mask: %016llx\n", sb->snapmask););
+		trace(printf("Active snapshot mask: %016llx\n", sb->snapmask.word[0]););
 		if (sb_get_device_sizes(sb))
 			error("FIXME!!! don't exit from load_sb, return -1 instead");
 #if 0
@@ -3855,16 +6156,20 @@ static int incoming(struct superblock *sb, struct client *client)
 			warn("Server was not shut down properly");
 			//jtrace(show_journal(sb););
 			replay_journal(sb); // !!! handle error
+			start_recount(sb); /* saved at shutdown, so stale */
 		} else {
 			sb->image.flags |= SB_BUSY;
+			if (!(sb->image.flags & SB_COUNTED))
+				start_recount(sb);
 			set_sb_dirty(sb);
 			save_sb(sb);
 		}
+		finish_compaction(sb);
 		break;
 	}
 	case LIST_SNAPSHOTS:
 	{
-		struct snapshot *snapshot = sb->image.snaplist;
+		struct snapshot *snapshot = sb->snaplist;
 		unsigned int n = sb->image.snapshots;
 
 		outhead(sock, SNAPSHOT_LIST, sizeof(int) + n * sizeof(struct snapinfo));
@@ -3987,9 +6292,12 @@ static int incoming(struct superblock *sb, struct client *client)
 		trace_on(printf("generating changelist from snapshot tags %u and %u\n", tag1, tag2););
 		why = "unable to generate changelist";
 		struct gen_changelist gcl = {
-			.cl = init_change_list(sb->snapdata.asi->allocsize_bits, tag1, tag2),
-			.mask1 = against_origin ? ~0ULL : 1ULL << snapshot1->bit,
-			.mask2 = 1ULL << snapshot2->bit };
+			.cl = init_change_list(sb->snapdata.asi->allocsize_bits, tag1, tag2) };
+		if (against_origin)
+			memset(gcl.mask1.word, 0xff, sb->share_words * sizeof(u64));
+		else
+			mask_set(gcl.mask1.word, snap_bit(snapshot1));
+		mask_set(gcl.mask2.word, snap_bit(snapshot2));
 
 		if (!gcl.cl)
 			goto eek;
@@ -4009,13 +6317,18 @@ static int incoming(struct superblock *sb, struct client *client)
 	}
 	case STATUS:
 	{
-		if (message.head.length > sizeof(struct status_request)) { //maybe we should allow messages to be long and assume zero filled for upward compatibility?
+		struct status_options *options = (void *)message.body;
+		u32 flags = 0;
+
+		if (message.head.length == sizeof(struct status_options))
+			flags = options->flags;
+		else if (message.head.length > sizeof(struct status_request)) { //maybe we should allow messages to be long and assume zero filled for upward compatibility?
 			goto message_too_long;
 		} else if (message.head.length < sizeof(struct status_request)) {
 			goto message_too_short;
 		}
 
-		get_status(sb, sock);
+		get_status(sb, sock, flags);
 		break;
 	}
 	case REQUEST_SNAPSHOT_STATE:
@@ -4028,7 +6341,7 @@ static int incoming(struct superblock *sb, struct client *client)
 		}
 		memcpy(&request, message.body, sizeof(request));
 
-		struct snapshot const *snaplist = sb->image.snaplist;
+		struct snapshot const *snaplist = sb->snaplist;
 		struct state_message reply;
 		unsigned int i;
 
@@ -4047,7 +6360,7 @@ static int incoming(struct superblock *sb, struct client *client)
 	case REQUEST_SNAPSHOT_SECTORS:
 	{
 		u32 snap = ((struct status_request *)message.body)->snap;
-		struct snapshot const *snaplist = sb->image.snaplist;
+		struct snapshot const *snaplist = sb->snaplist;
 		struct snapshot_sectors reply;
 		char err_msg[MAX_ERRMSG_SIZE];
 		int i;
@@ -4086,16 +6399,49 @@ static int incoming(struct superblock *sb, struct client *client)
 			if (!metasize)
 				metasize = snapsize;
 		}
+		if (sb->image.flags & SB_RESIZING) {
+			outerror(sock, EBUSY, "a resize is still in progress");
+			break;
+		}
 		err = change_device_sizes(sb, orgsize, snapsize, metasize);
-		check_freespace(sb);
-		/* return the device sizes after change_device_sizes */
+		selfcheck_freespace(sb);
+		/* a bitmap move is only started once the space for it is reserved */
+		commit_transaction(sb, 0);
+		save_sb(sb);
+		/* return the device sizes after change_device_sizes, or being grown to */
 		orgsize = sb->image.orgsectors << SECTOR_BITS;
-		metasize = sb->image.metadata.chunks << sb->image.metadata.allocsize_bits;
-		snapsize = (sb->metadev == sb->snapdev) ? (sb->image.metadata.chunks << sb->image.metadata.allocsize_bits) : (sb->image.snapdata.chunks << sb->image.snapdata.allocsize_bits);
+		metasize = space_chunks(sb, &sb->metadata) << sb->image.metadata.allocsize_bits;
+		snapsize = (sb->metadev == sb->snapdev) ? metasize : (space_chunks(sb, &sb->snapdata) << sb->image.snapdata.allocsize_bits);
 		if (outbead(sock, RESIZE, struct resize_request, orgsize, snapsize, metasize) < 0)
 			warn("unable to send resize reply");
 		break;
 	}
+	case COMPACT_TREE:
+	{
+		struct compact_tree_ok reply;
+		int err;
+
+		if (message.head.length < sizeof(struct compact_tree))
+			goto message_too_short;
+		if ((err = compact_tree(sb, ((struct compact_tree *)message.body)->fill, &reply)) < 0) {
+			outerror(sock, -err, err == -ENOSPC ? "no run of free metadata chunks big enough for the compacted btree" :
+				err == -EBUSY ? "a resize is still in progress" : "unable to compact the btree");
+			break;
+		}
+		if (outbead(sock, COMPACT_TREE_OK, struct compact_tree_ok, reply.old_levels, reply.old_leaves, reply.levels, reply.leaves, reply.nodes) < 0)
+			warn("unable to reply to compact tree message");
+		break;
+	}
+	case STATS:
+		if (message.head.length < sizeof(struct stats_request))
+			goto message_too_short;
+		get_stats(sock, ((struct stats_request *)message.body)->flags);
+		break;
+	case TRACE_DUMP:
+		if (message.head.length < sizeof(struct trace_dump))
+			goto message_too_short;
+		trace_dump(sock, ((struct trace_dump *)message.body)->flags);
+		break;
 	case SHUTDOWN_SERVER:
 		return -2;
 		
@@ -4164,6 +6510,10 @@ pipe_error:
 	return -1; /* we quietly drop the client if the connect breaks */
 }
 
+/*
+ * A clean shutdown leaves good free and space counts in the superblock, which
+ * the next start trusts instead of counting them again.
+ */
 static int cleanup(struct superblock *sb)
 {
 	commit_deferred_allocs(sb);
@@ -4221,7 +6571,7 @@ int snap_server(struct superblock *sb, int listenfd, int getsigfd, int agentfd,
 	unsigned maxclients = 100, clients = 0, others = 3;
 	struct client *clientvec[maxclients];
 	struct pollfd pollvec[others+maxclients];
-	int err = 0;
+	int err = 0, idle = 0;
 
 	pollvec[0] = (struct pollfd){ .fd = listenfd, .events = POLLIN };
 	pollvec[1] = (struct pollfd){ .fd = getsigfd, .events = POLLIN };
@@ -4231,11 +6581,36 @@ int snap_server(struct superblock *sb, int listenfd, int getsigfd, int agentfd,
 		warn("can not set process to throttle less (error %i, %s)", errno, strerror(errno));
 	if ((err = prctl(PR_SET_MEMALLOC, 0, 0, 0, 0)))
 		warn("failed to enter memalloc mode (may deadlock) (error %i, %s)", errno, strerror(errno));
+	metrics.since = time(NULL);
 
 	while (1) {
+		/*
+		 * A background delete, resize or space count gets a step
+		 * between rounds of requests, once START_SERVER has set up
+		 * the superblock.  The delete and resize go first to make
+		 * space available sooner.
+		 */
+		int background = sb->metadata.asi && (deleting(sb) ||
+			(sb->image.flags & SB_RESIZING) || !(sb->image.flags & SB_COUNTED));
+		if (background) {
+			if (deleting(sb))
+				delete_step(sb, DELETE_STEP_LEAVES);
+			else if ((sb->image.flags & SB_RESIZING))
+				relocate_step(sb);
+			else
+				recount_step(sb, RECOUNT_STEP_LEAVES);
+		}
+
+		/*
+		 * Deferred metadata writes go home once requests stop
+		 * arriving for a while, then a batch per poll until done.
+		 */
+		int writeback = sb->metadata.asi && writeback_pending(sb);
+		int timeout = background || (idle && writeback) ? 0 : writeback ? WRITEBACK_IDLE_MS : -1;
+
 		trace(warn("Waiting for activity"););
 
-		int activity = poll(pollvec, others+clients, -1);
+		int activity = poll(pollvec, others+clients, timeout);
 
 		if (activity < 0) {
 			if (errno != EINTR)
@@ -4244,9 +6619,14 @@ int snap_server(struct superblock *sb, int listenfd, int getsigfd, int agentfd,
 		}
 
 		if (!activity) {
-			printf("waiting...\n");
+			if (writeback && !background) {
+				writeback_step(sb);
+				idle = 1;
+			} else if (!background)
+				printf("waiting...\n");
 			continue;
 		}
+		idle = 0;
 
 		/* New connection? */
 		if (pollvec[0].revents) {
@@ -4321,8 +6701,8 @@ int snap_server(struct superblock *sb, int listenfd, int getsigfd, int agentfd,
 					if ((client->flags & SNAPCLIENT_BIT)) {
 						struct snapshot *snapshot = client_snap(sb, client);
 						if (!is_squashed(snapshot)) {
-							assert(sb->usecount[snapshot->bit] > 0);
-							sb->usecount[snapshot->bit]--;
+							assert(sb->usecount[snap_bit(snapshot)] > 0);
+							sb->usecount[snap_bit(snapshot)]--;
 						}
 						free_client_locks(sb, client);
 					}
@@ -4371,17 +6751,18 @@ int sniff_snapstore(int metadev)
 	return sniff;
 }
 
-int init_snapstore(int orgdev, int snapdev, int metadev, unsigned bs_bits, unsigned cs_bits, unsigned js_bytes)
+int init_snapstore(int orgdev, int snapdev, int metadev, unsigned bs_bits, unsigned cs_bits, unsigned js_bytes, unsigned snapshots)
 {
 	struct superblock *sb = new_sb(metadev, orgdev, snapdev);
 
 	unsigned bufsize = 1 << bs_bits;
 	init_buffers(bufsize, 0); /* do not preallocate buffers */
-	if (init_super(sb, js_bytes, bs_bits, cs_bits) < 0)
+	if (init_super(sb, js_bytes, bs_bits, cs_bits, snapshots) < 0)
 		goto fail;
 	if (init_journal(sb) < 0)
 		goto fail;
 	save_sb_check(sb);
+	free(sb->snaptable);
 	free(sb->copybuf);
 	free(sb->snaplocks);
 	free(sb);
@@ -4391,6 +6772,44 @@ fail:
 	return -1;
 }
 
+/*
+ * Compact the btree of a store whose server is not running.  A store left
+ * busy by a crash needs its journal replayed by the server first.
+ */
+int compact_snapstore(int orgdev, int snapdev, int metadev, unsigned fill)
+{
+	struct superblock *sb = new_sb(metadev, orgdev, snapdev);
+	struct compact_tree_ok result;
+	int err;
+
+	if (diskread(sb->metadev, &sb->image, 4096, SB_SECTOR << SECTOR_BITS) < 0) {
+		warn("Unable to read superblock: %s", strerror(errno));
+		return -errno;
+	}
+	if (!valid_sb(sb)) {
+		warn("Invalid superblock");
+		return -EINVAL;
+	}
+	if (sb->image.flags & SB_BUSY) {
+		warn("Snapshot store is in use or was not shut down properly, start and stop its server first");
+		return -EBUSY;
+	}
+	init_buffers(1 << sb->image.metadata.allocsize_bits, 0); /* do not preallocate buffers */
+	setup_sb(sb);
+	sb->snapmask = calc_snapmask(sb);
+	if ((err = sb_get_device_sizes(sb)) < 0)
+		return err;
+	/* so a crash part way leaves the journal for the server to replay */
+	sb->image.flags |= SB_BUSY;
+	set_sb_dirty(sb);
+	save_sb(sb);
+	if (!(err = compact_tree(sb, fill, &result)))
+		printf("btree compacted from %u levels and %Lu leaves to %u levels, %Lu leaves and %Lu index nodes\n",
+			result.old_levels, (llu_t)result.old_leaves, result.levels, (llu_t)result.leaves, (llu_t)result.nodes);
+	cleanup(sb);
+	return err;
+}
+
 int start_server(
 	int orgdev, int snapdev, int metadev, 
 	char const *agent_sockname, char const *server_sockname, char const *logfile, char const *pidfile,
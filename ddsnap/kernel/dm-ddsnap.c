@@ -16,6 +16,8 @@
 #include <linux/proc_fs.h>
 #include <linux/sysrq.h>
 #include <linux/jiffies.h>
+#include <linux/time.h>
+#include <linux/bitops.h>
 #include <linux/vmalloc.h>
 #include <linux/device-mapper.h>
 #include <linux/dm-ioctl.h>
@@ -171,6 +173,23 @@ static void kick(struct block_device *dev)
 #define NUM_BUCKETS 64
 #define MASK_BUCKETS (NUM_BUCKETS - 1)
 
+/*
+ * Per target statistics for /proc/driver/ddsnap/<dev>.  Times are in
+ * microseconds, and histograms count values below each power of two, as
+ * the server's do for ddsnap stats.
+ */
+struct ddsnap_histogram { u64 count, sum, bucket[STATS_BUCKETS]; };
+struct ddsnap_count { u64 bios, bytes; };
+
+struct ddsnap_stats {
+	struct ddsnap_count origin_read, origin_write, snapshot_write;
+	struct ddsnap_count snapshot_read_origin, snapshot_read_store; // which the server sent the read to
+	u64 failed; // bios failed by the server
+	struct ddsnap_histogram round_trip; // query sent to the server until its reply
+	struct ddsnap_histogram origin_write_delay; // origin write mapped until submitted
+	struct ddsnap_histogram lock_release; // snapshot read from origin done until its release is sent
+};
+
 struct devinfo {
 	u64 id;
 	unsigned long flags;
@@ -201,6 +220,8 @@ struct devinfo {
 	spinlock_t pending_lock;
 	spinlock_t end_io_lock;
 	int dont_switch_lists;
+	spinlock_t stats_lock; // stats are counted from interrupts too
+	struct ddsnap_stats stats;
 };
 
 static inline int is_snapshot(struct devinfo *info)
@@ -233,6 +254,34 @@ static void report_error(struct devinfo *info)
 	info->flags |= RECOVER_FLAG;
 }
 
+static inline u64 usecs(void)
+{
+	struct timeval tv;
+	do_gettimeofday(&tv);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/* microseconds since the start, none if the clock was set back */
+static void ddsnap_histogram_time(struct ddsnap_histogram *histogram, u64 start, u64 now)
+{
+	u64 value = now > start ? now - start : 0;
+	unsigned bucket = fls64(value);
+
+	histogram->count++;
+	histogram->sum += value;
+	histogram->bucket[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+}
+
+static void ddsnap_count(struct devinfo *info, struct ddsnap_count *count, struct bio *bio)
+{
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&info->stats_lock, irqflags);
+	count->bios++;
+	count->bytes += bio->bi_size;
+	spin_unlock_irqrestore(&info->stats_lock, irqflags);
+}
+
 /* Static caches, shared by all ddsnap instances */
 
 static struct kmem_cache *pending_cache;
@@ -247,6 +296,7 @@ struct pending {
 	unsigned chunks;
 	struct bio *bio;
 	typeof(jiffies) timestamp;
+	u64 mapped, sent; // microseconds
 	struct list_head list;
 };
 
@@ -326,6 +376,7 @@ struct hook {
 	void *old_private;
 	typeof(jiffies) timestamp;
 	/* needed after end_io, for release, make it a union */
+	u64 done; // microseconds, when the read completed
 	struct list_head list;
 };
 
@@ -344,6 +395,7 @@ static int snapshot_read_end_io(struct bio *bio, unsigned int done, int error)
 	bio->bi_end_io = hook->old_end_io;
 	bio->bi_private = hook->old_private;
 	hook->old_end_io = NULL;
+	hook->done = usecs();
 	if (!(info->flags & READY_FLAG))
 		kmem_cache_free(end_io_cache, hook);
 	else if (info->dont_switch_lists == 0)
@@ -395,6 +447,7 @@ int replied_rw(struct dm_target *target, struct rw_request *body, unsigned lengt
 	unsigned shift = info->chunksize_bits - SECTOR_SHIFT, mask = (1 << shift) - 1;
 	unsigned long irqflags;
 	int i, j, submitted = 0;
+	u64 now;
 
 	trace(show_pending(info);)
 	if(snap) {
@@ -423,6 +476,14 @@ found:
 		spin_unlock(&info->pending_lock);
 
 		bio = pending->bio;
+		now = usecs();
+		spin_lock_irqsave(&info->stats_lock, irqflags);
+		ddsnap_histogram_time(&info->stats.round_trip, pending->sent, now);
+		if (failed_io)
+			info->stats.failed++;
+		else if (!snap && rw == WRITE)
+			ddsnap_histogram_time(&info->stats.origin_write_delay, pending->mapped, now);
+		spin_unlock_irqrestore(&info->stats_lock, irqflags);
 		trace(warn("Handle pending IO sector %Lx", (long long)bio->bi_sector);)
 
 		if(failed_io) {
@@ -474,6 +535,8 @@ found:
 			spin_unlock_irqrestore(&info->end_io_lock, irqflags);
 		}
 
+		ddsnap_count(info, rw == WRITE ? (snap ? &info->stats.snapshot_write : &info->stats.origin_write) :
+			snap ? &info->stats.snapshot_read_store : &info->stats.snapshot_read_origin, bio);
 		generic_make_request(bio);
 		submitted++;
 		kmem_cache_free(pending_cache, pending);
@@ -827,6 +890,7 @@ restart:
 
 			list_del(entry);
 			list_add(&pending->list, info->pending + hash_pending(id));
+			pending->sent = usecs();
 			spin_unlock(&info->pending_lock);
 			trace(show_pending(info);)
 
@@ -851,6 +915,7 @@ restart:
 			struct list_head *entry = info->releases.prev;
 			struct hook *hook = list_entry(entry, struct hook, list);
 			chunk_t chunk = hook->sector >> info->chunkshift;
+			u64 done = hook->done;
 
 			list_del(entry);
 			spin_unlock_irqrestore(&info->end_io_lock, irqflags);
@@ -862,6 +927,9 @@ restart:
 				.count = 1, .ranges[0].chunk = chunk, .ranges[0].chunks = 1)))
 				goto report;
 			up(&info->server_out_sem);
+			spin_lock_irqsave(&info->stats_lock, irqflags);
+			ddsnap_histogram_time(&info->stats.lock_release, done, usecs());
+			spin_unlock_irqrestore(&info->stats_lock, irqflags);
 			spin_lock_irqsave(&info->end_io_lock, irqflags);
 		}
 		spin_unlock_irqrestore(&info->end_io_lock, irqflags);
@@ -1083,8 +1151,10 @@ static int ddsnap_map(struct dm_target *target, struct bio *bio, union map_info
 	}
 	
 	bio->bi_bdev = info->orgdev->bdev;
-	if (bio_data_dir(bio) == READ && !is_snapshot(info))
+	if (bio_data_dir(bio) == READ && !is_snapshot(info)) {
+		ddsnap_count(info, &info->stats.origin_read, bio);
 		return 1;
+	}
 
 	chunk = bio->bi_sector >> info->chunkshift;
 	trace(warn("map %Lx/%x, chunk %Lx", (long long)bio->bi_sector, bio->bi_size, chunk);)
@@ -1095,7 +1165,7 @@ static int ddsnap_map(struct dm_target *target, struct bio *bio, union map_info
 	spin_lock(&info->pending_lock);
 	id = info->nextid;
 	info->nextid = (id + 1) & ~(-1UL << RW_ID_BITS);
-	*pending = (struct pending){ .id = id, .bio = bio, .chunk = chunk, .chunks = 1, .timestamp = jiffies };
+	*pending = (struct pending){ .id = id, .bio = bio, .chunk = chunk, .chunks = 1, .timestamp = jiffies, .mapped = usecs() };
 	if (!worker_ready(info)) {
 		spin_unlock(&info->pending_lock);
 		kmem_cache_free(pending_cache, pending);
@@ -1181,15 +1251,58 @@ static int ddsnap_locked_queries(struct devinfo *info)
 	return total;
 }
 
+static void ddsnap_seq_count(struct seq_file *seq, char const *name, struct ddsnap_count *count)
+{
+	seq_printf(seq, "%s.bios %Lu\n", name, (unsigned long long)count->bios);
+	seq_printf(seq, "%s.bytes %Lu\n", name, (unsigned long long)count->bytes);
+}
+
+/* as ddsnap stats -m prints the server's */
+static void ddsnap_seq_histogram(struct seq_file *seq, char const *name, struct ddsnap_histogram *histogram)
+{
+	unsigned i;
+
+	seq_printf(seq, "%s.count %Lu\n", name, (unsigned long long)histogram->count);
+	seq_printf(seq, "%s.sum %Lu\n", name, (unsigned long long)histogram->sum);
+	for (i = 0; i < STATS_BUCKETS; i++)
+		if (histogram->bucket[i] && i == STATS_BUCKETS - 1)
+			seq_printf(seq, "%s.lt.inf %Lu\n", name, (unsigned long long)histogram->bucket[i]);
+		else if (histogram->bucket[i])
+			seq_printf(seq, "%s.lt.%Lu %Lu\n", name, 1ULL << i, (unsigned long long)histogram->bucket[i]);
+}
+
+/* One name and value per line, the queue depths now then the counts since the target was created */
 static int ddsnap_seq_show(struct seq_file *seq, void *offset)
 {
 	struct dm_target *target = (struct dm_target *) seq->private;
 	struct devinfo *info;
+	struct ddsnap_stats *stats;
+	unsigned long irqflags;
 
 	BUG_ON(!target);
 	info = (struct devinfo *) target->private;
 	BUG_ON(!info);
-	seq_printf(seq, "ddsnap inflight bio vecs %u, pending requests: %u, query requests %u, release requests %u, locked requests %u\n", dm_inflight_total(target), ddsnap_pending_queries(info), ddsnap_queries_queries(info), ddsnap_releases_queries(info), ddsnap_locked_queries(info));
+	seq_printf(seq, "inflight_bio_vecs %u\n", dm_inflight_total(target));
+	seq_printf(seq, "pending_requests %u\n", ddsnap_pending_queries(info));
+	seq_printf(seq, "query_requests %u\n", ddsnap_queries_queries(info));
+	seq_printf(seq, "release_requests %u\n", ddsnap_releases_queries(info));
+	seq_printf(seq, "locked_requests %u\n", ddsnap_locked_queries(info));
+
+	if (!(stats = kmalloc(sizeof(*stats), GFP_KERNEL)))
+		return -ENOMEM;
+	spin_lock_irqsave(&info->stats_lock, irqflags);
+	*stats = info->stats;
+	spin_unlock_irqrestore(&info->stats_lock, irqflags);
+	ddsnap_seq_count(seq, "origin_read", &stats->origin_read);
+	ddsnap_seq_count(seq, "origin_write", &stats->origin_write);
+	ddsnap_seq_count(seq, "snapshot_write", &stats->snapshot_write);
+	ddsnap_seq_count(seq, "snapshot_read_origin", &stats->snapshot_read_origin);
+	ddsnap_seq_count(seq, "snapshot_read_store", &stats->snapshot_read_store);
+	seq_printf(seq, "failed %Lu\n", (unsigned long long)stats->failed);
+	ddsnap_seq_histogram(seq, "server_round_trip_us", &stats->round_trip);
+	ddsnap_seq_histogram(seq, "origin_write_delay_us", &stats->origin_write_delay);
+	ddsnap_seq_histogram(seq, "lock_release_us", &stats->lock_release);
+	kfree(stats);
 	return 0;
 }
 
@@ -1427,6 +1540,7 @@ static int ddsnap_create(struct dm_target *target, unsigned argc, char **argv)
 	sema_init(&info->identify_sem, 0);
 	spin_lock_init(&info->pending_lock);
 	spin_lock_init(&info->end_io_lock);
+	spin_lock_init(&info->stats_lock);
 	INIT_LIST_HEAD(&info->queries);
 	INIT_LIST_HEAD(&info->releases);
 	INIT_LIST_HEAD(&info->locked);
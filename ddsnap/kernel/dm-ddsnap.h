@@ -5,7 +5,7 @@ typedef uint64_t chunk_t;
 
 struct head { uint32_t code; uint32_t length; } PACKED;
 
-/* FIXME: this enum must match csnap_names[] in ../ddsnap/event.c */
+/* FIXME: this enum must match code_names[] in ../ddsnap/ddsnapd.c */
 enum csnap_codes
 {
 	PROTOCOL_ERROR = 0xbead0000,
@@ -64,6 +64,16 @@ enum csnap_codes
 	REQUEST_SNAPSHOT_SECTORS, // !!! don't dedicate a whole message type to just this, return some other global stats here (and move me out of kernel)
 	SNAPSHOT_SECTORS,
 	RESIZE, /* New in 0.6 */
+	SEND_DELTA_STREAM, /* one of several parallel delta connections */
+	SEND_DELTA_ACK, /* downstream has the delta up to here on disk */
+	SEND_DELTA_RESTART, /* downstream does not match the checkpoint */
+	DELETE_SNAPSHOTS, /* several in one tree walk, answered by DELETE_SNAPSHOT_OK */
+	COMPACT_TREE, /* rebuild the btree densely packed */
+	COMPACT_TREE_OK,
+	STATS, /* server counters and latency histograms */
+	STATS_OK,
+	TRACE_DUMP, /* recent data requests with the time in each phase */
+	TRACE_DUMP_OK,
 };
 
 enum csnap_error_codes
@@ -94,6 +104,7 @@ struct identify_ok { uint32_t chunksize_bits; } PACKED;
 struct identify_error { uint32_t err; char msg[]; } PACKED; // !!! why not use reply_error and include msg
 struct connect_server_error { uint32_t err; char msg[]; } PACKED; // !!! why not use reply_error and include msg
 struct create_snapshot { uint32_t snap; } PACKED;
+struct delete_snapshots { uint32_t count; uint32_t snaps[]; } PACKED;
 struct generate_changelist { uint32_t snap1; uint32_t snap2; } PACKED;
 struct generate_origindiff { uint32_t snap; } PACKED;
 struct snapinfo { uint32_t snap; int8_t prio; uint16_t usecnt; uint64_t ctime; } PACKED;
@@ -105,6 +116,19 @@ struct dump_tree_range { chunk_t start; chunk_t finish; } PACKED;
 /* Status retrieval (!!! move me out of kernel !!!) */
 
 struct status_request { uint32_t snap; } PACKED;
+struct status_options { uint32_t snap; uint32_t flags; } PACKED; /* status_request with flags */
+
+#define STATUS_RECOMPUTE (1 << 0) /* recount sharing with a walk of the btree */
+#define STATUS_SUMMARY (1 << 1) /* only unique and shared chunks per snapshot */
+
+struct status_summary { uint64_t exceptions; } PACKED; /* follows the details of a summary */
+
+/* btree fill as of the last walk of the whole tree, follows the details and any summary, no leaves if none yet */
+struct status_tree {
+	uint32_t levels;
+	uint64_t nodes, node_entries; uint32_t node_capacity; /* index entries per node */
+	uint64_t leaves, leaf_bytes; uint32_t leaf_capacity; /* map and exception bytes per leaf */
+} PACKED;
 
 struct snapshot_details { struct snapinfo snapinfo; uint64_t sharing[]; } PACKED;
 
@@ -132,6 +156,31 @@ static inline size_t snapshot_details_calc_size(unsigned row, unsigned snapshots
 struct state_message {uint32_t snap; uint32_t state; } PACKED;
 struct snapshot_sectors { uint32_t snap; uint64_t count; } PACKED;
 struct resize_request { uint64_t orgsize; uint64_t snapsize; uint64_t metasize; } PACKED;
+struct compact_tree { uint32_t fill; } PACKED; /* percent of each leaf and node to fill, zero for full */
+struct compact_tree_ok { uint32_t old_levels; uint64_t old_leaves; uint32_t levels; uint64_t leaves, nodes; } PACKED;
+
+/*
+ * Server metrics, as a list of named entries: a counter has only a count,
+ * a histogram a count and sum of its values, the names say in what units,
+ * and how many fell in each bucket.  Bucket 0 holds zero, bucket i values
+ * from 2^(i-1) up to 2^i, the last anything larger.
+ */
+#define STATS_BUCKETS 32
+#define STATS_NAME 32
+#define STATS_RESET (1 << 0) /* start counting again once reported */
+
+struct stats_request { uint32_t flags; } PACKED;
+struct stats_entry { char name[STATS_NAME]; uint32_t buckets; /* zero for a counter */ uint64_t count, sum; uint64_t bucket[STATS_BUCKETS]; } PACKED;
+struct stats_reply { uint64_t since; /* counting started, seconds since the epoch */ uint32_t entries; struct stats_entry entry[]; } PACKED;
+
+enum trace_kind { TRACE_ORIGIN_WRITE, TRACE_SNAPSHOT_WRITE, TRACE_SNAPSHOT_READ, TRACE_KINDS };
+enum trace_phase { TRACE_PROBE, TRACE_ALLOC, TRACE_TREE, TRACE_COPY_READ, TRACE_COPY_WRITE, TRACE_COMMIT, TRACE_LOCK, TRACE_PHASES };
+#define TRACE_CLEAR (1 << 0) /* forget the records once reported */
+
+/* microseconds; total counts from the request arriving to its reply, so includes time in no phase */
+struct trace_record { uint64_t start; /* microseconds since the epoch */ uint32_t kind, id, chunks, total; uint32_t phase[TRACE_PHASES]; } PACKED;
+struct trace_dump { uint32_t flags; } PACKED;
+struct trace_dump_ok { uint32_t phases; /* TRACE_PHASES of the server */ uint32_t records; /* oldest first */ struct trace_record record[]; } PACKED;
 
 typedef uint16_t shortcount; /* !!! what is this all about */
 
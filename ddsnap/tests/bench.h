@@ -0,0 +1,66 @@
+/*
+ * What the btree benchmarks have in common.  They include ddsnapd.c itself
+ * to get at its static functions, and build their snapshot stores on sparse
+ * files that go away with the process.
+ */
+#include "ddsnapd.c"
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <limits.h>
+
+/* ddsnapd.c builds changelists with these from ddsnap.c, not used here */
+struct change_list *init_change_list(u32 chunksize_bits, u32 src_snap, u32 tgt_snap) { return NULL; }
+int append_change_list(struct change_list *cl, u64 chunkaddr) { return -ENOMEM; }
+void free_change_list(struct change_list *cl) { }
+
+static unsigned seed = 1;
+
+/* below n, taking a second step for more bits than one gives */
+static u64 rnd(u64 n)
+{
+	u64 r;
+
+	seed = seed * 1103515245 + 12345;
+	r = seed >> 8;
+	if (n > 1 << 24) {
+		seed = seed * 1103515245 + 12345;
+		r = r << 24 | seed >> 8;
+	}
+	return r % n;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* a sparse file of the given size in dir, named for the benchmark and unlinked */
+static int open_store(char const *dir, char const *name, off_t size)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s.%u.%s", dir, program_invocation_short_name, getpid(), name);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+		error("unable to create %s: %s", path, strerror(errno));
+	unlink(path);
+	if (ftruncate(fd, size) < 0)
+		error("unable to size %s: %s", path, strerror(errno));
+	return fd;
+}
+
+/* bring up the superblock of an initialized store, as at server startup */
+static struct superblock *load_sb(int metadev, int orgdev, int snapdev)
+{
+	struct superblock *sb = new_sb(metadev, orgdev, snapdev);
+
+	if (diskread(sb->metadev, &sb->image, 4096, SB_SECTOR << SECTOR_BITS) < 0)
+		error("unable to read superblock: %s", strerror(errno));
+	setup_sb(sb);
+	sb->snapmask = calc_snapmask(sb);
+	if (sb_get_device_sizes(sb))
+		error("unable to get device sizes");
+	return sb;
+}
@@ -0,0 +1,152 @@
+/*
+ * Compare the delta compression codecs on real snapshot data.
+ *
+ * usage: codecbench <snapshot device> [<changelist> [<level>]]
+ *
+ * With a changelist only the changed chunks are read, grouped into extents
+ * the same way ddsnap transmit groups them, otherwise the whole device is
+ * read in 1MB extents.  Each extent is compressed and decompressed with every
+ * codec built in, and the round trip is checked.
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "compress.h"
+
+#define error(string, args...) do { printf(string "\n", ##args); exit(1); } while (0)
+
+#define MAX_EXTENT (1 << 20)
+#define CHANGELIST_MAGIC_ID "rln"
+
+struct cl_header
+{
+	char magic[8];
+	unsigned chunksize_bits;
+	unsigned src_snap;
+	unsigned tgt_snap;
+};
+
+struct trial
+{
+	char const *name;
+	unsigned codec, flags;
+	unsigned long long in, out, comp_usecs, uncomp_usecs;
+};
+
+static unsigned long long usec_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static void run_trial(struct trial *trial, int level, char *extent, char *comp, char *check, unsigned long size)
+{
+	unsigned long comp_size = size, check_size = size;
+	unsigned long long start = usec_now();
+	int err = codec_compress(trial->codec, level, trial->flags, comp, &comp_size, extent, size);
+
+	trial->comp_usecs += usec_now() - start;
+	trial->in += size;
+	if (err == -ENOSPC) {
+		trial->out += size; /* sent uncompressed */
+		return;
+	}
+	if (err < 0)
+		error("%s compress failed: %s", trial->name, strerror(-err));
+	trial->out += comp_size;
+
+	start = usec_now();
+	if ((err = codec_uncompress(trial->codec, check, &check_size, comp, comp_size)) < 0)
+		error("%s uncompress failed: %s", trial->name, strerror(-err));
+	trial->uncomp_usecs += usec_now() - start;
+	if (check_size != size || memcmp(check, extent, size))
+		error("%s round trip mismatch", trial->name);
+}
+
+static double rate(unsigned long long bytes, unsigned long long usecs)
+{
+	return usecs ? (double)bytes / usecs : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct trial trials[] = {
+		{ "zlib", CODEC_ZLIB },
+		{ "zstd", CODEC_ZSTD },
+		{ "zstd-long", CODEC_ZSTD, CODEC_LONG },
+		{ "lz4", CODEC_LZ4 },
+	};
+	int ntrials = sizeof(trials) / sizeof(trials[0]), i, dev, level = 1;
+	unsigned long long *chunks = NULL, count = 0, pos, extents = 0;
+	unsigned chunksize_bits = 20;
+
+	if (argc < 2 || argc > 4)
+		error("usage: %s <snapshot device> [<changelist> [<level>]]", argv[0]);
+	if ((dev = open(argv[1], O_RDONLY)) == -1)
+		error("Can't open %s, %s", argv[1], strerror(errno));
+	if (argc > 3)
+		level = atoi(argv[3]);
+
+	if (argc > 2) {
+		struct cl_header clh;
+		unsigned long long chunk, length = 0;
+		FILE *file = fopen(argv[2], "r");
+
+		if (!file || fread(&clh, sizeof(clh), 1, file) != 1 || strncmp(clh.magic, CHANGELIST_MAGIC_ID, sizeof(clh.magic)))
+			error("%s is not a changelist", argv[2]);
+		chunksize_bits = clh.chunksize_bits;
+		while (fread(&chunk, sizeof(chunk), 1, file) == 1 && chunk != -1ULL) {
+			if (count == length && !(chunks = realloc(chunks, (length = length * 2 + 1024) * sizeof(*chunks))))
+				error("out of memory");
+			chunks[count++] = chunk;
+		}
+		fclose(file);
+	} else
+		count = (lseek(dev, 0, SEEK_END) + MAX_EXTENT - 1) >> chunksize_bits;
+
+	char *extent = malloc(MAX_EXTENT), *comp = malloc(MAX_EXTENT), *check = malloc(MAX_EXTENT);
+	unsigned chunksize = 1 << chunksize_bits;
+
+	if (!extent || !comp || !check)
+		error("out of memory");
+
+	for (pos = 0; pos < count;) {
+		unsigned long long addr = chunks ? chunks[pos] : pos, n = 1;
+
+		while (chunks && pos + n < count && chunks[pos + n] == addr + n && (n + 1) * chunksize <= MAX_EXTENT)
+			n++;
+
+		ssize_t size = pread(dev, extent, n * chunksize, addr << chunksize_bits);
+		if (size < 0)
+			error("read error at chunk %Lu: %s", addr, strerror(errno));
+		if (size > 0) {
+			for (i = 0; i < ntrials; i++)
+				if (codec_available(trials[i].codec))
+					run_trial(&trials[i], level, extent, comp, check, size);
+			extents++;
+		}
+		pos += n;
+	}
+
+	printf("%Lu extents, level %i\n", extents, level);
+	printf("%-10s %12s %12s %7s %12s %12s\n", "codec", "in", "out", "ratio", "comp MB/s", "uncomp MB/s");
+	for (i = 0; i < ntrials; i++) {
+		struct trial *trial = &trials[i];
+
+		if (!codec_available(trial->codec)) {
+			printf("%-10s not built in\n", trial->name);
+			continue;
+		}
+		printf("%-10s %12Lu %12Lu %7.3f %12.1f %12.1f\n", trial->name, trial->in, trial->out,
+			trial->out ? (double)trial->in / trial->out : 0,
+			rate(trial->in, trial->comp_usecs), rate(trial->in, trial->uncomp_usecs));
+	}
+	return 0;
+}
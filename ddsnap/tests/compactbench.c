@@ -0,0 +1,106 @@
+/*
+ * Measure the btree before and after compaction.
+ *
+ * usage: compactbench [<chunks per snapshot> [<fill percent> [<directory>]]]
+ *
+ * A snapshot store is built on sparse files in the directory, default /tmp.
+ * Before each of 16 snapshots is taken the given number of chunks, scattered
+ * over the origin, are written, then every other snapshot is deleted, which
+ * leaves the leaves part full and scattered over the metadata store.  The
+ * tree is measured, compacted to the given fill, default full, and measured
+ * again: its levels and blocks, how full its leaves are, how many times a
+ * walk of the leaves in key order has to seek, and the time for a walk with
+ * the buffer cache empty.
+ */
+#include "bench.h"
+
+#define ORIGIN_CHUNKS (1 << 20)
+#define SNAPSHOTS 16
+
+struct result {
+	u64 leaves, bytes, seeks;
+	sector_t last;
+};
+
+static void visit_leaf(struct superblock *sb, struct eleaf *leaf, void *data)
+{
+	struct result *result = data;
+
+	result->leaves++;
+	result->bytes += leaf_payload(leaf);
+}
+
+/* the leaf sectors in key order, found from the index nodes */
+static void count_seeks(struct superblock *sb, sector_t sector, unsigned level, struct result *result)
+{
+	struct buffer *buffer = read_node(sb, sector);
+	struct enode *node = buffer2node(buffer);
+
+	for (unsigned i = 0; i < node->count; i++) {
+		sector_t child = node_sectors(sb, node)[i];
+		if (level + 1 < sb->image.etree_levels)
+			count_seeks(sb, child, level + 1, result);
+		else {
+			if (child != result->last + (1 << sb->metadata.chunk_sectors_bits))
+				result->seeks++;
+			result->last = child;
+		}
+	}
+	brelse(buffer);
+}
+
+static void measure(struct superblock *sb, char const *what)
+{
+	struct result result = { };
+	double start;
+
+	commit_deferred_allocs(sb);
+	count_seeks(sb, sb->image.etree_root, 0, &result);
+	evict_buffers();
+	start = now();
+	traverse_tree_range(sb, 0, -1, visit_leaf, &result);
+	printf("%-10s %6u %8Lu %7.1f%% %8Lu %8.2fms\n", what, sb->image.etree_levels, (llu_t)result.leaves,
+		100.0 * result.bytes / result.leaves / leaf_capacity(sb), (llu_t)result.seeks, (now() - start) * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned chunks = argc > 1 ? atoi(argv[1]) : 20000;
+	unsigned fill = argc > 2 ? atoi(argv[2]) : 0;
+	char const *dir = argc > 3 ? argv[3] : "/tmp";
+	int orgdev = open_store(dir, "origin", (off_t)ORIGIN_CHUNKS << 12);
+	int snapdev = open_store(dir, "snap", ((off_t)SNAPSHOTS * chunks + 1024) << 12);
+	int metadev = open_store(dir, "meta", 1 << 30);
+	struct compact_tree_ok reply;
+	unsigned i, j;
+
+	if (!chunks || chunks > ORIGIN_CHUNKS)
+		error("from 1 to %u chunks", ORIGIN_CHUNKS);
+	if (init_snapstore(orgdev, snapdev, metadev, 12, 12, 1 << 20, 0) < 0)
+		error("unable to initialize snapshot store");
+	init_buffers(1 << 12, 64 << 20);
+
+	struct superblock *sb = load_sb(metadev, orgdev, snapdev);
+
+	for (i = 0; i < SNAPSHOTS; i++) {
+		for (j = 0; j < chunks; j++) {
+			if (make_unique(sb, rnd(ORIGIN_CHUNKS), -1) == -1)
+				error("unable to write origin chunk");
+			dirty_buffer_count_check(sb);
+		}
+		if (create_snapshot(sb, i) < 0)
+			error("unable to create snapshot");
+	}
+	for (i = 0; i < SNAPSHOTS; i += 2)
+		if (delete_snap(sb, find_snap(sb, i)) < 0)
+			error("unable to delete snapshot");
+	while (delete_step(sb, 0) > 0)
+		;
+
+	printf("%-10s %6s %8s %8s %8s %10s\n", "", "levels", "leaves", "fill", "seeks", "cold walk");
+	measure(sb, "before");
+	if (compact_tree(sb, fill, &reply) < 0)
+		error("unable to compact the btree");
+	measure(sb, "compacted");
+	return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Time deleting snapshots from the btree, one tree walk per snapshot against
+ * one walk for all of them.
+ *
+ * usage: deletebench [<max snapshots> [<chunks per snapshot> [<directory>]]]
+ *
+ * A snapshot store is built on sparse files in the directory, default /tmp.
+ * Before each snapshot is taken the given number of chunks, scattered over
+ * the origin, are written, so every snapshot has exceptions of its own and
+ * shares others with its neighbours.  Then all the snapshots are deleted,
+ * either one at a time with the walk finished before the next, or together
+ * in one walk.  The store is rebuilt for each run, for 1, 2, 4... snapshots.
+ */
+#include "bench.h"
+
+#define ORIGIN_CHUNKS (1 << 16)
+
+static struct superblock *build_store(char const *dir, unsigned snapshots, unsigned chunks)
+{
+	int orgdev = open_store(dir, "origin", (off_t)ORIGIN_CHUNKS << 12);
+	int snapdev = open_store(dir, "snap", ((off_t)snapshots * chunks + 1024) << 12);
+	int metadev = open_store(dir, "meta", 64 << 20);
+	unsigned snap, i;
+
+	if (init_snapstore(orgdev, snapdev, metadev, 12, 12, 1 << 20, 0) < 0)
+		error("unable to initialize snapshot store");
+	init_buffers(1 << 12, 64 << 20);
+
+	struct superblock *sb = load_sb(metadev, orgdev, snapdev);
+
+	for (snap = 0; snap < snapshots; snap++) {
+		if (create_snapshot(sb, snap) < 0)
+			error("unable to create snapshot %u", snap);
+		for (i = 0; i < chunks; i++) {
+			if (make_unique(sb, rnd(ORIGIN_CHUNKS), -1) == -1)
+				error("unable to write origin chunk");
+			dirty_buffer_count_check(sb);
+		}
+	}
+	commit_transaction(sb, 0);
+	evict_buffers(); /* the walks read the tree back from the store */
+	return sb;
+}
+
+/*
+ * Build the store and time the delete in a child, so each run starts with
+ * clean buffers and its files go away with it.
+ */
+static double run(char const *dir, unsigned snapshots, unsigned chunks, int together)
+{
+	double elapsed = -1;
+	int pipefd[2];
+	pid_t pid;
+
+	fflush(stdout);
+	if (pipe(pipefd) < 0 || (pid = fork()) < 0)
+		error("unable to start run: %s", strerror(errno));
+	if (!pid) {
+		struct superblock *sb = build_store(dir, snapshots, chunks);
+		u32 tags[SB_SNAPSHOTS];
+		char *why;
+		unsigned i;
+		double start = now();
+
+		if (together) {
+			for (i = 0; i < snapshots; i++)
+				tags[i] = i;
+			if (delete_snaps(sb, tags, snapshots, &why) < 0)
+				error("%s", why);
+			delete_step(sb, 0);
+		} else
+			for (i = 0; i < snapshots; i++) {
+				delete_snap(sb, find_snap(sb, i));
+				delete_step(sb, 0);
+			}
+		elapsed = now() - start;
+		if (write(pipefd[1], &elapsed, sizeof(elapsed)) < 0)
+			exit(1);
+		exit(0);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &elapsed, sizeof(elapsed)) != sizeof(elapsed))
+		error("run of %u snapshots failed", snapshots);
+	close(pipefd[0]);
+	waitpid(pid, NULL, 0);
+	return elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned max = argc > 1 ? atoi(argv[1]) : 32;
+	unsigned chunks = argc > 2 ? atoi(argv[2]) : 1024;
+	char const *dir = argc > 3 ? argv[3] : "/tmp";
+	unsigned snapshots;
+
+	if (!max || max > SB_SNAPSHOTS)
+		error("from 1 to %u snapshots", SB_SNAPSHOTS);
+	printf("%10s %12s %12s\n", "snapshots", "one by one", "together");
+	for (snapshots = 1; snapshots <= max; snapshots *= 2) {
+		double apart = run(dir, snapshots, chunks, 0);
+		double together = run(dir, snapshots, chunks, 1);
+		printf("%10u %11.3fs %11.3fs\n", snapshots, apart, together);
+		fflush(stdout);
+	}
+	return 0;
+}
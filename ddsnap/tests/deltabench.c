@@ -0,0 +1,323 @@
+/*
+ * Aggregate throughput of a delta listener with concurrent sessions.
+ *
+ * usage: deltabench [-s] [-d <ms>] <host>[:<port>] <sessions> <megabytes> [<volume prefix>]
+ *
+ * Each session streams a full volume delta of raw 1MB extents, the way
+ * ddsnap transmit sends an initial replication, so the targets must be at
+ * least that big.  With a volume prefix, session i targets volume
+ * <prefix><i> of a listener started on a directory.
+ *
+ * With -s the sessions are instead the parallel streams of one transfer,
+ * like ddsnap transmit --streams, each sending its share of the megabytes
+ * to the one target (the volume prefix is then the whole volume name).
+ *
+ * With -d each connection goes through a relay that adds the given round
+ * trip time and, like a TCP sender, keeps no more than a window of data in
+ * flight, which is what limits one stream on a long fat link.  Latency is
+ * injected this way so the benchmark runs without root or netem.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "ddsnap.h"
+#include "dm-ddsnap.h"
+#include "sock.h"
+#include "trace.h"
+
+struct delta_header
+{
+	char magic[8];
+	u64 chunk_num;
+	u32 chunk_size;
+	u32 src_snap;
+	u32 tgt_snap;
+} PACKED;
+
+struct delta_stream
+{
+	u32 stream;
+	u32 streams;
+	u64 start_addr;
+	u64 end_addr;
+} PACKED;
+
+struct delta_extent_header
+{
+	u32 magic_num;
+	u32 mode;
+	u32 gzip_on;
+	u64 extent_addr;
+	u64 num_of_chunks;
+	u64 extents_delta_length;
+	u64 ext1_chksum;
+	u64 ext2_chksum;
+} PACKED;
+
+#define DELTA_MAGIC_ID "jc"
+#define MAGIC_NUM 0xbead0023
+#define RAW 2
+#define CHUNK_SIZE 4096
+#define EXTENT_SIZE (1 << 20)
+#define RELAY_WINDOW (4 << 20)
+#define RELAY_PACKET (64 << 10)
+#define RELAY_QUEUE 1024
+
+static unsigned long long rtt;
+
+static unsigned long long usec_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static int expect_reply(int sock, unsigned code, char const *what)
+{
+	struct head head;
+	char reason[maxbody];
+	int err;
+
+	if ((err = readpipe(sock, &head, sizeof(head))) < 0)
+		error("no %s reply: %s", what, strerror(-err));
+	if (head.code == code)
+		return 0;
+	if (head.length >= sizeof(reason))
+		head.length = sizeof(reason) - 1;
+	reason[0] = 0;
+	if (readpipe(sock, reason, head.length) == 0)
+		reason[head.length] = 0;
+	warn("%s refused: %s", what, reason);
+	return -1;
+}
+
+/*
+ * One direction of a relay.  Data read at time t is written out at t + rtt/2
+ * and keeps its place in the window until t + rtt, when its ack would have
+ * come back.  Queue positions run acked <= sent <= queued.
+ */
+struct relay_pipe
+{
+	int from, to, eof;
+	unsigned long window;
+	unsigned acked, sent, queued;
+	struct { unsigned long long time; unsigned len; char *data; } queue[RELAY_QUEUE];
+};
+
+static int relay_step(struct relay_pipe *pipe, unsigned long long now, unsigned long long *next)
+{
+	while (pipe->sent < pipe->queued) {
+		typeof(pipe->queue[0]) *packet = &pipe->queue[pipe->sent % RELAY_QUEUE];
+
+		if (packet->time + rtt / 2 > now) {
+			if (packet->time + rtt / 2 < *next)
+				*next = packet->time + rtt / 2;
+			break;
+		}
+		if (writepipe(pipe->to, packet->data, packet->len) < 0)
+			return -1;
+		free(packet->data);
+		pipe->sent++;
+	}
+	while (pipe->acked < pipe->sent) {
+		typeof(pipe->queue[0]) *packet = &pipe->queue[pipe->acked % RELAY_QUEUE];
+
+		if (packet->time + rtt > now) {
+			if (packet->time + rtt < *next)
+				*next = packet->time + rtt;
+			break;
+		}
+		pipe->window -= packet->len;
+		pipe->acked++;
+	}
+	if (pipe->eof && pipe->sent == pipe->queued && pipe->eof++ == 1)
+		shutdown(pipe->to, SHUT_WR);
+	return 0;
+}
+
+static void relay(int client, int server)
+{
+	struct relay_pipe pipes[2] = { { .from = client, .to = server }, { .from = server, .to = client } };
+	struct pollfd pollvec[2];
+	int i, n;
+
+	while (!pipes[0].eof || !pipes[1].eof || pipes[0].sent < pipes[0].queued || pipes[1].sent < pipes[1].queued) {
+		unsigned long long now = usec_now(), next = -1ULL;
+
+		for (i = 0, n = 0; i < 2; i++) {
+			struct relay_pipe *pipe = &pipes[i];
+
+			if (relay_step(pipe, now, &next) < 0)
+				exit(1);
+			if (!pipe->eof && pipe->window < RELAY_WINDOW && pipe->queued - pipe->acked < RELAY_QUEUE)
+				pollvec[n++] = (struct pollfd){ .fd = pipe->from, .events = POLLIN };
+		}
+		if (poll(pollvec, n, next == -1ULL ? -1 : (next - now + 999) / 1000) < 0)
+			continue;
+		now = usec_now();
+		for (i = 0; i < n; i++) {
+			struct relay_pipe *pipe = &pipes[pollvec[i].fd == server];
+			typeof(pipe->queue[0]) *packet = &pipe->queue[pipe->queued % RELAY_QUEUE];
+			int len;
+
+			if (!pollvec[i].revents)
+				continue;
+			if (!(packet->data = malloc(RELAY_PACKET)))
+				error("out of memory");
+			if ((len = read(pipe->from, packet->data, RELAY_PACKET)) <= 0) {
+				free(packet->data);
+				pipe->eof = 1;
+				continue;
+			}
+			packet->time = now;
+			packet->len = len;
+			pipe->window += len;
+			pipe->queued++;
+		}
+	}
+}
+
+/* connect to the listener through a relay process that adds latency */
+static int relay_socket(char const *host, unsigned port)
+{
+	int pair[2], server;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+		error("unable to create socket pair: %s", strerror(errno));
+	switch (fork()) {
+	case -1:
+		error("unable to fork relay: %s", strerror(errno));
+	case 0:
+		close(pair[0]);
+		if ((server = open_socket(host, port)) < 0)
+			error("unable to connect to %s:%u: %s", host, port, strerror(-server));
+		relay(pair[1], server);
+		exit(0);
+	}
+	close(pair[1]);
+	return pair[0];
+}
+
+static int session(char const *host, unsigned port, u64 start, u64 bytes, struct delta_stream *stream, char const *volume)
+{
+	struct { struct head head; struct delta_header body; char tail[sizeof(struct delta_stream) + 256]; } PACKED request = {
+		.head = { SEND_DELTA, sizeof(struct delta_header) },
+		.body = { DELTA_MAGIC_ID, bytes / CHUNK_SIZE, CHUNK_SIZE, -1, 1 } };
+	char *tail = request.tail;
+	struct delta_extent_header deh = { .magic_num = MAGIC_NUM, .mode = RAW, .num_of_chunks = EXTENT_SIZE / CHUNK_SIZE, .extents_delta_length = EXTENT_SIZE };
+	unsigned char *extent = malloc(EXTENT_SIZE);
+	int sock, err, i;
+	u64 addr;
+
+	if (!extent)
+		error("out of memory");
+	for (i = 0; i < EXTENT_SIZE; i++)
+		extent[i] = rand();
+	for (i = 0; i < EXTENT_SIZE; i++)
+		deh.ext2_chksum += extent[i];
+
+	if (stream) {
+		request.head.code = SEND_DELTA_STREAM;
+		memcpy(tail, stream, sizeof(*stream));
+		request.head.length += sizeof(*stream);
+		tail += sizeof(*stream);
+	}
+	if (volume) {
+		strncpy(tail, volume, 255);
+		request.head.length += strlen(tail) + 1;
+	}
+
+	if ((sock = rtt ? relay_socket(host, port) : open_socket(host, port)) < 0)
+		error("unable to connect to %s:%u: %s", host, port, strerror(-sock));
+	if ((err = writepipe(sock, &request, sizeof(request.head) + request.head.length)) < 0)
+		error("unable to send delta request: %s", strerror(-err));
+	if (expect_reply(sock, SEND_DELTA_PROCEED, "delta request"))
+		return 1;
+	for (addr = start; addr < start + bytes; addr += EXTENT_SIZE) {
+		deh.extent_addr = addr;
+		if ((err = writepipe(sock, &deh, sizeof(deh))) < 0 || (err = writepipe(sock, extent, EXTENT_SIZE)) < 0)
+			error("unable to send delta: %s", strerror(-err));
+	}
+	if (expect_reply(sock, SEND_DELTA_DONE, "delta"))
+		return 1;
+	close(sock);
+	free(extent);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char const *usage = "usage: deltabench [-s] [-d <ms>] <host>[:<port>] <sessions> <megabytes> [<volume prefix>]";
+	int streams = 0, opt;
+
+	while ((opt = getopt(argc, argv, "sd:")) != -1)
+		switch (opt) {
+		case 's':
+			streams = 1;
+			break;
+		case 'd':
+			rtt = strtoull(optarg, NULL, 10) * 1000;
+			break;
+		default:
+			error("%s", usage);
+		}
+	argc -= optind - 1;
+	argv += optind - 1;
+	if (argc != 4 && argc != 5)
+		error("%s", usage);
+
+	char *host = strdup(argv[1]);
+	unsigned port = 4321, len = strlen(host);
+	int sessions = atoi(argv[2]), i, failed = 0, status;
+	u64 bytes = strtoull(argv[3], NULL, 10) << 20;
+	char volume[256];
+
+	if (strchr(host, ':')) {
+		port = parse_port(host, &len);
+		host[len] = 0;
+	}
+
+	unsigned long long start = usec_now();
+
+	for (i = 0; i < sessions; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			error("unable to fork: %s", strerror(errno));
+		if (pid == 0) {
+			srand(i);
+			if (streams) {
+				/* split on extent boundaries, the last stream takes the rest */
+				u64 share = bytes / sessions & ~(u64)(EXTENT_SIZE - 1), from = share * i;
+				struct delta_stream stream = { i, sessions, from, i == sessions - 1 ? ~0ULL : from + share };
+
+				exit(session(host, port, from, i == sessions - 1 ? bytes - from : share, &stream, argc == 5 ? argv[4] : NULL));
+			}
+			if (argc == 5)
+				snprintf(volume, sizeof(volume), "%s%i", argv[4], i);
+			exit(session(host, port, 0, bytes, NULL, argc == 5 ? volume : NULL));
+		}
+	}
+	while (wait(&status) > 0)
+		failed += !WIFEXITED(status) || WEXITSTATUS(status);
+
+	unsigned long long usecs = usec_now() - start;
+	if (streams) {
+		printf("%i streams, %i failed, %Lu bytes in %.3f seconds, %.1f MB/s\n",
+			sessions, failed, bytes, usecs / 1e6, usecs && !failed ? (double)bytes / usecs : 0);
+		return !!failed;
+	}
+	printf("%i sessions, %i failed, %Lu bytes in %.3f seconds, %.1f MB/s aggregate\n",
+		sessions, failed, bytes * (sessions - failed), usecs / 1e6,
+		usecs ? (double)bytes * (sessions - failed) / usecs : 0);
+	return !!failed;
+}
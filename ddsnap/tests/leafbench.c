@@ -0,0 +1,110 @@
+/*
+ * Measure btree leaf fan-out and full tree walks as origin writes grow from
+ * scattered chunks to long sequential extents.
+ *
+ * usage: leafbench [<chunks written> [<directory>]]
+ *
+ * A snapshot store is built on sparse files in the directory, default /tmp,
+ * and one snapshot is taken.  The given number of origin chunks are written
+ * in extents of 1, 4, 16... chunks, each at a random place in the origin, so
+ * every copyout lands next to the previous one in the snapshot store and the
+ * leaves can keep each extent as one run.  For each extent length the leaves
+ * in the tree, the chunks they map on average, and the time to walk the whole
+ * tree from the store with a cold cache are reported.
+ */
+#include "bench.h"
+
+#define ORIGIN_CHUNKS (1 << 22)
+
+struct result {
+	unsigned leaves;
+	u64 chunks;
+	double walk;
+};
+
+static struct superblock *build_store(char const *dir, unsigned chunks, unsigned extent)
+{
+	int orgdev = open_store(dir, "origin", (off_t)ORIGIN_CHUNKS << 12);
+	int snapdev = open_store(dir, "snap", ((off_t)chunks + 1024) << 12);
+	int metadev = open_store(dir, "meta", 256 << 20);
+	unsigned i, j;
+
+	if (init_snapstore(orgdev, snapdev, metadev, 12, 12, 1 << 20, 0) < 0)
+		error("unable to initialize snapshot store");
+	init_buffers(1 << 12, 64 << 20);
+
+	struct superblock *sb = load_sb(metadev, orgdev, snapdev);
+
+	if (create_snapshot(sb, 0) < 0)
+		error("unable to create snapshot");
+	for (i = 0; i < chunks; i += extent) {
+		chunk_t start = rnd(ORIGIN_CHUNKS / extent) * extent;
+		for (j = 0; j < extent; j++) {
+			if (make_unique(sb, start + j, -1) == -1)
+				error("unable to write origin chunk");
+			dirty_buffer_count_check(sb);
+		}
+	}
+	commit_transaction(sb, 0);
+	return sb;
+}
+
+static void count_leaf(struct superblock *sb, struct eleaf *leaf, void *data)
+{
+	struct result *result = data;
+
+	result->leaves++;
+	for (unsigned i = 0; i < leaf->count; i++)
+		result->chunks += map_run(&leaf->map[i]);
+}
+
+/*
+ * Build the store and walk it in a child, so each run starts with clean
+ * buffers and its files go away with it.
+ */
+static void run(char const *dir, unsigned chunks, unsigned extent, struct result *result)
+{
+	int pipefd[2];
+	pid_t pid;
+
+	fflush(stdout);
+	if (pipe(pipefd) < 0 || (pid = fork()) < 0)
+		error("unable to start run: %s", strerror(errno));
+	if (!pid) {
+		struct superblock *sb = build_store(dir, chunks, extent);
+		double start;
+
+		*result = (struct result){ };
+		evict_buffers();
+		posix_fadvise(sb->metadev, 0, 0, POSIX_FADV_DONTNEED);
+		start = now();
+		traverse_tree_range(sb, 0, -1, count_leaf, result);
+		result->walk = now() - start;
+		if (write(pipefd[1], result, sizeof(*result)) < 0)
+			exit(1);
+		exit(0);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], result, sizeof(*result)) != sizeof(*result))
+		error("run with %u chunk extents failed", extent);
+	close(pipefd[0]);
+	waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned chunks = argc > 1 ? atoi(argv[1]) : 1 << 18;
+	char const *dir = argc > 2 ? argv[2] : "/tmp";
+	unsigned extent;
+
+	if (!chunks || chunks > ORIGIN_CHUNKS / 2)
+		error("from 1 to %u chunks", ORIGIN_CHUNKS / 2);
+	printf("%8s %8s %12s %10s\n", "extent", "leaves", "chunks/leaf", "walk");
+	for (extent = 1; extent <= MAX_LEAF_RUN; extent *= 4) {
+		struct result result;
+		run(dir, chunks, extent, &result);
+		printf("%8u %8u %12.1f %9.3fs\n", extent, result.leaves, (double)result.chunks / result.leaves, result.walk);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,609 @@
+/*
+ * Play a workload against a snapshot server and report its throughput and
+ * latency percentiles.
+ *
+ * usage: loadbench [<options>] [<trace>]
+ *
+ *   -n <requests>   data requests to generate (default 20000)
+ *   -p seq|random   where generated requests go on the origin (default random)
+ *   -R <percent>    of generated requests that are snapshot reads (default 0)
+ *   -C <chunks>     chunks per generated request (default 1, at most 16)
+ *   -r <rate>       generated requests per second, 0 for as fast as the
+ *                   queue allows (default 0)
+ *   -s <requests>   take a snapshot every so many generated requests
+ *                   (default 0, only one at the start)
+ *   -k <snapshots>  then delete the oldest past this many (default 0, keep all)
+ *   -e <seed>       for generated requests (default 1)
+ *   -q <depth>      requests in flight at most (default 16)
+ *   -o <megabytes>  origin size (default 1024)
+ *   -c <bytes>      chunk size (default 16384)
+ *   -d <directory>  for the devices, sockets and server log (default /tmp)
+ *   -x <ddsnap>     the ddsnap to run (default ./ddsnap)
+ *   -g              print the generated trace instead of playing it
+ *
+ * A snapshot store is made of sparse files in the directory, the origin
+ * and a snapshot store twice its size, and ddsnap agent and server are
+ * started on it.  Requests go to the server as the kernel sends them: the
+ * origin writes on a connection of their own and the snapshot reads on one
+ * per snapshot, with origin chunks released as soon as their reply comes
+ * back, as if the reads took no time.  Creates and deletes wait for the
+ * requests before them to finish and are timed on their own.
+ *
+ * A trace is one request per line, at a time in microseconds from the
+ * start, with chunks in units of the chunk size:
+ *
+ *   <time> write <chunk> <chunks>
+ *   <time> read <snapshot> <chunk> <chunks>
+ *   <time> create <snapshot>
+ *   <time> delete <snapshot>
+ *
+ * Blank lines and lines starting with # are skipped.  If every time is zero
+ * requests are sent as fast as the queue allows and timed from when they
+ * are sent, otherwise each is sent at its time and timed from then, so the
+ * time spent waiting for room in the queue counts against it.  With -g the
+ * requests the options would generate are printed in this form, to edit or
+ * play again later; a trace recorded elsewhere can be played the same way.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "ddsnap.h"
+#include "dm-ddsnap.h"
+#include "trace.h"
+
+#define MAX_CHUNKS 16 /* a read reply for scattered chunks has to fit in maxbody */
+#define MAX_DEPTH 256
+
+enum { OP_WRITE, OP_READ, OP_CREATE, OP_DELETE, OP_KINDS };
+static char const *const op_names[OP_KINDS] = { "origin write", "snapshot read", "create", "delete" };
+
+struct op { unsigned long long time; unsigned kind; u32 snap; u64 chunk; unsigned chunks; };
+
+struct workload { unsigned requests, random, reads, chunks, rate, every, keep; u64 origin_chunks; };
+
+struct reader { u32 snap; int sock; };
+struct request { u32 id; unsigned kind, chunks, left, failed; unsigned long long start; };
+
+static unsigned long long seed = 1;
+static char const *sockname;
+static u64 sectors;
+static int origin = -1, control = -1;
+static struct reader *readers;
+static unsigned reader_count;
+static struct request inflight[MAX_DEPTH];
+static unsigned busy;
+static u32 nextid;
+static u32 *latency[OP_KINDS];
+static unsigned done[OP_KINDS], failed;
+static u64 chunks_done[OP_KINDS];
+
+/* for cleaning up on the way out, error() included */
+static pid_t agent, server;
+static char *paths[5]; /* origin, snapshot store, agent and server sockets, log */
+
+static unsigned long long usec_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static u64 rnd(u64 n)
+{
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (seed >> 16) % n;
+}
+
+static void add_op(struct op **ops, unsigned *count, unsigned *size, struct op op)
+{
+	if (*count == *size && !(*ops = realloc(*ops, (*size = 2 * *size + 64) * sizeof(**ops))))
+		error("no memory for %u requests", *size);
+	(*ops)[(*count)++] = op;
+}
+
+/* one snapshot to start, then one every so many requests, deleting the oldest past the limit */
+static struct op *generate(struct workload *w, unsigned *count)
+{
+	unsigned size = 0, next = 1, oldest = 1;
+	u64 cursor[2] = { };
+	struct op *ops = NULL;
+
+	*count = 0;
+	add_op(&ops, count, &size, (struct op){ .kind = OP_CREATE, .snap = next++ });
+	for (unsigned i = 0; i < w->requests; i++) {
+		unsigned long long time = w->rate ? i * 1000000ULL / w->rate : 0;
+		int reading = rnd(100) < w->reads;
+		u64 chunk;
+
+		if (w->every && i && i % w->every == 0) {
+			add_op(&ops, count, &size, (struct op){ .time = time, .kind = OP_CREATE, .snap = next++ });
+			if (w->keep && next - oldest > w->keep)
+				add_op(&ops, count, &size, (struct op){ .time = time, .kind = OP_DELETE, .snap = oldest++ });
+		}
+		if (w->random)
+			chunk = rnd(w->origin_chunks - w->chunks + 1);
+		else {
+			if (cursor[reading] + w->chunks > w->origin_chunks)
+				cursor[reading] = 0;
+			chunk = cursor[reading];
+			cursor[reading] += w->chunks;
+		}
+		add_op(&ops, count, &size, (struct op){ .time = time, .kind = reading ? OP_READ : OP_WRITE,
+			.snap = reading ? oldest + rnd(next - oldest) : 0, .chunk = chunk, .chunks = w->chunks });
+	}
+	return ops;
+}
+
+static struct op *load_trace(char const *name, unsigned *count)
+{
+	FILE *file = fopen(name, "r");
+	unsigned size = 0, line_number = 0;
+	struct op *ops = NULL;
+	char line[256], kind[16];
+
+	if (!file)
+		error("unable to open %s: %s", name, strerror(errno));
+	*count = 0;
+	while (fgets(line, sizeof(line), file)) {
+		struct op op = { .chunks = 1 };
+		unsigned long long chunk = 0;
+		int ok;
+
+		line_number++;
+		if (sscanf(line, " %15s", kind) < 1 || kind[0] == '#')
+			continue;
+		if (sscanf(line, "%llu %15s", &op.time, kind) != 2)
+			ok = 0;
+		else if (!strcmp(kind, "write")) {
+			op.kind = OP_WRITE;
+			ok = sscanf(line, "%*s %*s %llu %u", &chunk, &op.chunks) >= 1;
+		} else if (!strcmp(kind, "read")) {
+			op.kind = OP_READ;
+			ok = sscanf(line, "%*s %*s %u %llu %u", &op.snap, &chunk, &op.chunks) >= 2;
+		} else if (!strcmp(kind, "create") || !strcmp(kind, "delete")) {
+			op.kind = kind[0] == 'c' ? OP_CREATE : OP_DELETE;
+			ok = sscanf(line, "%*s %*s %u", &op.snap) == 1;
+		} else
+			ok = 0;
+		if (!ok || !op.chunks || op.chunks > MAX_CHUNKS)
+			error("%s line %u: not a request of 1 to %u chunks", name, line_number, MAX_CHUNKS);
+		op.chunk = chunk;
+		add_op(&ops, count, &size, op);
+	}
+	fclose(file);
+	return ops;
+}
+
+static void print_trace(struct op *ops, unsigned count)
+{
+	for (unsigned i = 0; i < count; i++) {
+		struct op *op = ops + i;
+
+		if (op->kind == OP_WRITE)
+			printf("%llu write %llu %u\n", op->time, op->chunk, op->chunks);
+		else if (op->kind == OP_READ)
+			printf("%llu read %u %llu %u\n", op->time, op->snap, op->chunk, op->chunks);
+		else
+			printf("%llu %s %u\n", op->time, op->kind == OP_CREATE ? "create" : "delete", op->snap);
+	}
+}
+
+static void cleanup(void)
+{
+	if (server > 0) {
+		kill(server, SIGTERM);
+		waitpid(server, NULL, 0);
+	}
+	if (agent > 0) {
+		kill(agent, SIGTERM);
+		waitpid(agent, NULL, 0);
+	}
+	for (unsigned i = 0; i < sizeof(paths) / sizeof(*paths); i++)
+		if (paths[i])
+			unlink(paths[i]);
+}
+
+static char *store_path(char const *dir, char const *name)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/loadbench.%u.%s", dir, getpid(), name) < 0)
+		error("no memory for path");
+	return path;
+}
+
+/* run a ddsnap command with its output in the log, waiting for it to finish if asked */
+static pid_t run(char const *log, char *const argv[], int wait)
+{
+	pid_t pid = fork();
+	int status;
+
+	if (pid < 0)
+		error("unable to fork: %s", strerror(errno));
+	if (!pid) {
+		int fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+		if (fd >= 0) {
+			dup2(fd, 1);
+			dup2(fd, 2);
+		}
+		execvp(argv[0], argv);
+		fprintf(stderr, "unable to run %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	if (wait) {
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			error("%s %s failed, see %s", argv[0], argv[1], log);
+	}
+	return pid;
+}
+
+/* keep trying while the server starts */
+static int connect_server(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock;
+
+	strncpy(addr.sun_path, sockname, sizeof(addr.sun_path) - 1);
+	for (unsigned tries = 0; tries < 1000; tries++) {
+		if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			error("unable to get socket: %s", strerror(errno));
+		if (!connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+			return sock;
+		close(sock);
+		if (waitpid(server, NULL, WNOHANG) == server) {
+			server = 0;
+			error("server exited, see %s", paths[4]);
+		}
+		usleep(10000);
+	}
+	error("unable to connect to %s: %s", sockname, strerror(errno));
+}
+
+static void read_message(int sock, struct messagebuf *message)
+{
+	int err;
+
+	if ((err = readpipe(sock, &message->head, sizeof(message->head))) < 0)
+		error("lost the server: %s", strerror(-err));
+	if (message->head.length >= maxbody)
+		error("message %x too long (%u bytes)", message->head.code, message->head.length);
+	if ((err = readpipe(sock, message->body, message->head.length)) < 0)
+		error("lost the server: %s", strerror(-err));
+	message->body[message->head.length] = 0;
+}
+
+/* the text of an error reply, both kinds have it after a code */
+static char const *error_text(struct messagebuf *message)
+{
+	return message->head.length > sizeof(struct generic_error) ? message->body + sizeof(struct generic_error) : "no reason";
+}
+
+/* connect as a device, the origin if the snapshot is -1 */
+static int identify(u32 snap, unsigned *chunk_bits)
+{
+	struct messagebuf message;
+	int sock = connect_server();
+
+	if (outbead(sock, IDENTIFY, struct identify, .id = (u64)getpid() << 32 | snap, .snap = snap, .off = 0, .len = sectors) < 0)
+		error("unable to send identify: %s", strerror(errno));
+	read_message(sock, &message);
+	if (message.head.code != IDENTIFY_OK)
+		error("unable to identify as snapshot %d: %s", (int)snap, error_text(&message));
+	if (chunk_bits)
+		*chunk_bits = ((struct identify_ok *)message.body)->chunksize_bits;
+	return sock;
+}
+
+static struct reader *find_reader(u32 snap)
+{
+	for (unsigned i = 0; i < reader_count; i++)
+		if (readers[i].snap == snap)
+			return readers + i;
+	return NULL;
+}
+
+static int reader_socket(u32 snap)
+{
+	struct reader *reader = find_reader(snap);
+
+	if (reader)
+		return reader->sock;
+	if (!(readers = realloc(readers, (reader_count + 1) * sizeof(*readers))))
+		error("no memory for reader");
+	readers[reader_count] = (struct reader){ .snap = snap, .sock = identify(snap, NULL) };
+	return readers[reader_count++].sock;
+}
+
+static void record(unsigned kind, unsigned long long start, unsigned chunks)
+{
+	unsigned long long now = usec_now();
+
+	latency[kind][done[kind]++] = now > start ? now - start : 0;
+	chunks_done[kind] += chunks;
+}
+
+static void send_request(struct op *op, unsigned long long start)
+{
+	int sock = op->kind == OP_WRITE ? origin : reader_socket(op->snap);
+	struct request *request = inflight + busy++;
+
+	*request = (struct request){ .id = nextid++, .kind = op->kind, .chunks = op->chunks, .left = op->chunks, .start = start };
+	if (outbead(sock, op->kind == OP_WRITE ? QUERY_WRITE : QUERY_SNAPSHOT_READ, struct rw_request1,
+		.id = request->id, .count = 1, .ranges[0].chunk = op->chunk, .ranges[0].chunks = op->chunks) < 0)
+		error("unable to send request: %s", strerror(errno));
+}
+
+static void complete(u32 id, unsigned chunks, int fail)
+{
+	for (unsigned i = 0; i < busy; i++) {
+		struct request *request = inflight + i;
+
+		if (request->id != id)
+			continue;
+		request->left -= chunks < request->left ? chunks : request->left;
+		request->failed |= fail;
+		if (!request->left) {
+			record(request->kind, request->start, request->chunks);
+			failed += request->failed;
+			*request = inflight[--busy];
+		}
+		return;
+	}
+	error("reply for unknown request %u", id);
+}
+
+/* chunks in a reply, each range followed by its exceptions for the snapshot store replies */
+static unsigned reply_chunks(struct messagebuf *message, int exceptions)
+{
+	struct rw_request *body = (struct rw_request *)message->body;
+	char *p = (char *)body->ranges, *end = message->body + message->head.length;
+	unsigned chunks = 0;
+
+	if (message->head.length < sizeof(*body))
+		error("reply %x too short", message->head.code);
+	for (unsigned i = 0; i < body->count; i++) {
+		struct chunk_range *range = (struct chunk_range *)p;
+
+		if (p + sizeof(*range) > end)
+			error("reply %x ranges overrun", message->head.code);
+		chunks += range->chunks;
+		p += sizeof(*range) + (exceptions ? range->chunks * sizeof(chunk_t) : 0);
+	}
+	return chunks;
+}
+
+static void incoming(int sock)
+{
+	struct messagebuf message;
+
+	read_message(sock, &message);
+	u32 id = ((struct rw_request *)message.body)->id;
+	switch (message.head.code) {
+	case ORIGIN_WRITE_OK:
+	case ORIGIN_WRITE_ERROR:
+		complete(id, reply_chunks(&message, 0), message.head.code == ORIGIN_WRITE_ERROR);
+		break;
+	case SNAPSHOT_READ_ORIGIN_OK:
+		/* the kernel would read the origin now, then release the chunks */
+		if (outhead(sock, FINISH_SNAPSHOT_READ, message.head.length) < 0 ||
+			writepipe(sock, message.body, message.head.length) < 0)
+			error("unable to release snapshot read: %s", strerror(errno));
+		complete(id, reply_chunks(&message, 0), 0);
+		break;
+	case SNAPSHOT_READ_ORIGIN_ERROR:
+		complete(id, reply_chunks(&message, 0), 1);
+		break;
+	case SNAPSHOT_READ_OK:
+	case SNAPSHOT_READ_ERROR:
+		complete(id, reply_chunks(&message, 1), message.head.code == SNAPSHOT_READ_ERROR);
+		break;
+	default:
+		error("unexpected message %x: %s", message.head.code, error_text(&message));
+	}
+}
+
+static void create_or_delete(struct op *op)
+{
+	struct messagebuf message;
+	unsigned long long start;
+	struct reader *reader;
+
+	if (op->kind == OP_CREATE) {
+		start = usec_now();
+		if (outbead(control, CREATE_SNAPSHOT, struct create_snapshot, op->snap) < 0)
+			error("unable to send create: %s", strerror(errno));
+		read_message(control, &message);
+		if (message.head.code != CREATE_SNAPSHOT_OK)
+			error("unable to create snapshot %u: %s", op->snap, error_text(&message));
+		record(OP_CREATE, start, 0);
+		return;
+	}
+	if ((reader = find_reader(op->snap))) {
+		close(reader->sock);
+		*reader = readers[--reader_count];
+	}
+	/* the server may not have seen the reader hang up yet, its snapshot is still in use till then */
+	for (unsigned tries = 0; ; tries++) {
+		start = usec_now();
+		if (outbead(control, DELETE_SNAPSHOT, struct create_snapshot, op->snap) < 0)
+			error("unable to send delete: %s", strerror(errno));
+		read_message(control, &message);
+		if (message.head.code == DELETE_SNAPSHOT_OK)
+			break;
+		if (tries == 1000)
+			error("unable to delete snapshot %u: %s", op->snap, error_text(&message));
+		usleep(1000);
+	}
+	record(OP_DELETE, start, 0);
+}
+
+static void play(struct op *ops, unsigned count, unsigned depth)
+{
+	struct pollfd pollfds[MAX_DEPTH + 1];
+	unsigned long long start = usec_now(), now;
+	unsigned i = 0, timed = 0, j;
+
+	for (j = 0; j < count; j++)
+		timed |= ops[j].time != 0;
+	while (i < count || busy) {
+		struct op *op = i < count ? ops + i : NULL;
+		int timeout = -1, polls = 0;
+
+		now = usec_now() - start;
+		if (op && (op->kind == OP_CREATE || op->kind == OP_DELETE)) {
+			if (!busy && (!timed || op->time <= now)) {
+				create_or_delete(op);
+				i++;
+				continue;
+			}
+			if (!busy)
+				timeout = (op->time - now + 999) / 1000;
+		} else if (op && busy < depth) {
+			if (!timed || op->time <= now) {
+				send_request(op, timed ? start + op->time : usec_now());
+				i++;
+				continue;
+			}
+			timeout = (op->time - now + 999) / 1000;
+		}
+
+		struct pollfd *fds = reader_count < MAX_DEPTH ? pollfds : malloc((reader_count + 1) * sizeof(*fds));
+		if (!fds)
+			error("no memory for poll");
+		fds[polls++] = (struct pollfd){ .fd = origin, .events = POLLIN };
+		for (j = 0; j < reader_count; j++)
+			fds[polls++] = (struct pollfd){ .fd = readers[j].sock, .events = POLLIN };
+		if (poll(fds, polls, timeout) < 0 && errno != EINTR)
+			error("poll failed: %s", strerror(errno));
+		for (j = 0; j < polls; j++)
+			if (fds[j].revents)
+				incoming(fds[j].fd);
+		if (fds != pollfds)
+			free(fds);
+	}
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	u32 x = *(u32 *)a, y = *(u32 *)b;
+	return x < y ? -1 : x > y;
+}
+
+static u32 percentile(unsigned kind, double fraction)
+{
+	unsigned i = fraction * done[kind];
+	return latency[kind][i < done[kind] ? i : done[kind] - 1];
+}
+
+int main(int argc, char *argv[])
+{
+	char const *usage = "usage: loadbench [-n <requests>] [-p seq|random] [-R <read percent>] [-C <chunks>] [-r <rate>] "
+		"[-s <requests>] [-k <snapshots>] [-e <seed>] [-q <depth>] [-o <megabytes>] [-c <bytes>] [-d <directory>] "
+		"[-x <ddsnap>] [-g] [<trace>]";
+	struct workload workload = { .requests = 20000, .random = 1, .chunks = 1 };
+	char const *dir = "/tmp", *ddsnap = "./ddsnap";
+	unsigned depth = 16, chunk_size = 16384, megabytes = 1024, count, chunk_bits, i;
+	int print = 0, opt;
+	struct op *ops;
+
+	while ((opt = getopt(argc, argv, "n:p:R:C:r:s:k:e:q:o:c:d:x:g")) != -1)
+		switch (opt) {
+		case 'n': workload.requests = atoi(optarg); break;
+		case 'p':
+			if (strcmp(optarg, "seq") && strcmp(optarg, "random"))
+				error("%s", usage);
+			workload.random = !strcmp(optarg, "random");
+			break;
+		case 'R': workload.reads = atoi(optarg); break;
+		case 'C': workload.chunks = atoi(optarg); break;
+		case 'r': workload.rate = atoi(optarg); break;
+		case 's': workload.every = atoi(optarg); break;
+		case 'k': workload.keep = atoi(optarg); break;
+		case 'e': seed = strtoull(optarg, NULL, 10); break;
+		case 'q': depth = atoi(optarg); break;
+		case 'o': megabytes = atoi(optarg); break;
+		case 'c': chunk_size = atoi(optarg); break;
+		case 'd': dir = optarg; break;
+		case 'x': ddsnap = optarg; break;
+		case 'g': print = 1; break;
+		default: error("%s", usage);
+		}
+	if (argc - optind > 1)
+		error("%s", usage);
+	if (!depth || depth > MAX_DEPTH)
+		error("queue depth from 1 to %u", MAX_DEPTH);
+	if (!megabytes || chunk_size < 512 || chunk_size & (chunk_size - 1))
+		error("need an origin and a power of two chunk size");
+	workload.origin_chunks = ((u64)megabytes << 20) / chunk_size;
+	if (!workload.chunks || workload.chunks > MAX_CHUNKS || workload.chunks > workload.origin_chunks)
+		error("from 1 to %u chunks per request", MAX_CHUNKS);
+
+	ops = optind < argc ? load_trace(argv[optind], &count) : generate(&workload, &count);
+	if (print) {
+		print_trace(ops, count);
+		return 0;
+	}
+	for (i = 0; i < OP_KINDS; i++)
+		if (!(latency[i] = malloc((count + 1) * sizeof(u32))))
+			error("no memory for %u latencies", count);
+
+	char *names[] = { "origin", "snap", "agent", "server", "log" }, size[32];
+	for (i = 0; i < sizeof(paths) / sizeof(*paths); i++)
+		paths[i] = store_path(dir, names[i]);
+	if (strlen(paths[3]) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+		error("directory name too long for a socket");
+	atexit(cleanup);
+	signal(SIGPIPE, SIG_IGN);
+	for (i = 0; i < 2; i++) {
+		int fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || ftruncate(fd, (off_t)megabytes << (20 + i)) < 0)
+			error("unable to create %s: %s", paths[i], strerror(errno));
+		close(fd);
+	}
+	sockname = paths[3];
+	sectors = (u64)megabytes << 11;
+	snprintf(size, sizeof(size), "%u", chunk_size);
+	run(paths[4], (char *[]){ (char *)ddsnap, "initialize", "-y", "-c", size, paths[1], paths[0], NULL }, 1);
+	agent = run(paths[4], (char *[]){ (char *)ddsnap, "agent", "-f", paths[2], NULL }, 0);
+	for (i = 0; access(paths[2], F_OK) && i < 1000; i++)
+		usleep(10000);
+	server = run(paths[4], (char *[]){ (char *)ddsnap, "server", "-f", paths[1], paths[0], paths[2], paths[3], NULL }, 0);
+	control = connect_server();
+	origin = identify(-1, &chunk_bits);
+	if (1 << chunk_bits != chunk_size)
+		error("server has %u byte chunks, not %u", 1 << chunk_bits, chunk_size);
+	for (i = 0; i < count; i++)
+		if ((ops[i].kind == OP_WRITE || ops[i].kind == OP_READ) && ops[i].chunk + ops[i].chunks > workload.origin_chunks)
+			error("request %u for chunk %llu is past the origin", i, ops[i].chunk);
+
+	unsigned long long start = usec_now();
+	play(ops, count, depth);
+	double elapsed = (usec_now() - start) / 1e6;
+
+	printf("%-14s %9s %9s %10s %8s %8s %8s %8s %8s\n", "", "requests", "chunks", "per second", "MB/s",
+		"p50 us", "p90 us", "p99 us", "max us");
+	for (i = 0; i < OP_KINDS; i++) {
+		if (!done[i])
+			continue;
+		qsort(latency[i], done[i], sizeof(u32), compare_latency);
+		printf("%-14s %9u %9llu %10.1f %8.2f %8u %8u %8u %8u\n", op_names[i], done[i], chunks_done[i],
+			done[i] / elapsed, (chunks_done[i] << chunk_bits) / elapsed / 1e6,
+			percentile(i, 0.5), percentile(i, 0.9), percentile(i, 0.99), latency[i][done[i] - 1]);
+	}
+	printf("%.2f seconds, %u requests failed\n", elapsed, failed);
+	return 0;
+}
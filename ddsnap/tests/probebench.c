@@ -0,0 +1,278 @@
+/*
+ * Time btree probes with the index nodes and leaves searched by a binary
+ * search, against the linear scans they replaced, and runs of probes for
+ * ascending chunks with the last path kept as a finger, against from the root.
+ *
+ * usage: probebench [<exceptions> [<directory>]]
+ *
+ * A snapshot store is built on sparse files in the directory, default /tmp,
+ * for each metadata block size, with the given number of exceptions for
+ * chunks scattered over the origin, then compacted so its nodes and leaves
+ * are full.  The buffer cache holds the whole tree, so random chunks are
+ * looked up in memory: first the path down the index nodes to the leaf,
+ * then the child for a chunk in the node above a leaf, alone, with the node
+ * laid out as before version 1, each key beside its sector, and as now, the
+ * keys apart, each scanned and bisected, then the map entry for the chunk in
+ * the leaf.  Last, runs of 64 ascending chunks from random starts are
+ * probed, first forgetting the finger before each probe, then keeping it.
+ */
+#include "bench.h"
+
+#define ORIGIN_CHUNKS (1 << 28)
+#define PROBES 200000
+
+struct result {
+	unsigned levels, per_node;
+	u64 leaves;
+	double probe_scan, probe_search, pair_scan, pair_search, key_scan, key_search;
+	double leaf_scan, leaf_search, run_root, run_finger;
+};
+
+/* an index entry of a node before version 1 */
+struct pair { u64 key; sector_t sector; };
+
+/* the first child from 1 with a key past the chunk, or the count, as find_child() */
+static unsigned key_scan(struct enode *node, struct pair *pairs, u64 chunk)
+{
+	unsigned i = 1;
+
+	while (i < node->count && node_keys(node)[i] <= chunk)
+		i++;
+	return i;
+}
+
+static unsigned key_search(struct enode *node, struct pair *pairs, u64 chunk)
+{
+	return find_child(node, chunk);
+}
+
+/* as probe() was before find_child() */
+static unsigned pair_scan(struct enode *node, struct pair *pairs, u64 chunk)
+{
+	unsigned i = 1;
+
+	while (i < node->count && pairs[i].key <= chunk)
+		i++;
+	return i;
+}
+
+/* as find_child() was before version 1 */
+static unsigned pair_search(struct enode *node, struct pair *pairs, u64 chunk)
+{
+	unsigned lo = 1, hi = node->count;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (pairs[mid].key > chunk)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/* as probe() was, scanning each node from the front */
+static struct buffer *probe_scan(struct superblock *sb, u64 chunk, struct etree_path *path)
+{
+	unsigned i, levels = sb->image.etree_levels;
+	struct buffer *nodebuf = read_node(sb, sb->image.etree_root);
+
+	for (i = 0; i < levels; i++) {
+		struct enode *node = buffer2node(nodebuf);
+		unsigned next = key_scan(node, NULL, chunk);
+		sector_t child = node_sectors(sb, node)[next - 1];
+
+		path[i] = (struct etree_path){ nodebuf, next };
+		nodebuf = i + 1 < levels ? read_node(sb, child) : snapread(sb, child);
+	}
+	return nodebuf;
+}
+
+/* as find_run() was */
+static unsigned find_run_scan(struct eleaf *leaf, u64 target)
+{
+	unsigned i;
+
+	for (i = 0; i < leaf->count; i++)
+		if ((u64)leaf->map[i].rchunk + map_run(&leaf->map[i]) > target)
+			break;
+	return i;
+}
+
+static double time_probes(struct superblock *sb, struct buffer *(*probe)(struct superblock *, u64, struct etree_path *))
+{
+	struct etree_path path[sb->image.etree_levels];
+	double start = now();
+
+	seed = 1;
+	for (unsigned i = 0; i < PROBES; i++) {
+		struct buffer *leafbuf = probe(sb, rnd(ORIGIN_CHUNKS), path);
+		brelse(leafbuf);
+		brelse_path(path, sb->image.etree_levels);
+	}
+	return (now() - start) / PROBES;
+}
+
+/* over random chunks in the range of the node above a leaf, held in cache */
+static double time_nodes(struct superblock *sb, unsigned (*find)(struct enode *, struct pair *, u64))
+{
+	unsigned levels = sb->image.etree_levels, found = 0;
+	struct etree_path path[levels];
+	struct pair pairs[sb->metadata.alloc_per_node];
+	u64 chunks[100];
+	double time = 0;
+
+	seed = 5;
+	for (unsigned i = 0; i < PROBES / 100; i++) {
+		struct buffer *leafbuf = probe(sb, rnd(ORIGIN_CHUNKS), path);
+		struct enode *node = path_node(path, levels - 1);
+		u64 *keys = node_keys(node), first = node->count > 1 ? keys[1] : 0;
+		u64 span = node->count > 1 ? keys[node->count - 1] - first + 1 : 1;
+
+		for (unsigned j = 0; j < node->count; j++)
+			pairs[j] = (struct pair){ j ? keys[j] : 0, node_sectors(sb, node)[j] };
+		for (unsigned j = 0; j < 100; j++)
+			chunks[j] = first + rnd(span);
+		double start = now();
+
+		for (unsigned j = 0; j < 100; j++)
+			found += find(node, pairs, chunks[j]);
+		time += now() - start;
+		brelse(leafbuf);
+		brelse_path(path, levels);
+	}
+	if (!found)
+		printf("\n");
+	return time / PROBES;
+}
+
+static double time_leaves(struct superblock *sb, unsigned (*find)(struct eleaf *, u64))
+{
+	struct etree_path path[sb->image.etree_levels];
+	unsigned found = 0;
+	double time = 0;
+
+	seed = 2;
+	for (unsigned i = 0; i < PROBES / 100; i++) {
+		u64 chunk = rnd(ORIGIN_CHUNKS);
+		struct buffer *leafbuf = probe(sb, chunk, path);
+		struct eleaf *leaf = buffer2leaf(leafbuf);
+		double start = now();
+
+		/* one lookup is too quick to time alone */
+		for (unsigned j = 0; j < 100; j++)
+			found += find(leaf, chunk + j - leaf->base_chunk);
+		time += now() - start;
+		brelse(leafbuf);
+		brelse_path(path, sb->image.etree_levels);
+	}
+	if (!found)
+		printf("\n");
+	return time / PROBES;
+}
+
+static double time_runs(struct superblock *sb, int finger)
+{
+	struct etree_path path[sb->image.etree_levels];
+	double start = now();
+
+	seed = 4;
+	for (unsigned i = 0; i < PROBES / 64; i++) {
+		u64 chunk = rnd(ORIGIN_CHUNKS);
+
+		for (unsigned j = 0; j < 64; j++) {
+			if (!finger)
+				forget_finger(sb);
+			struct buffer *leafbuf = probe(sb, chunk + j, path);
+			brelse(leafbuf);
+			brelse_path(path, sb->image.etree_levels);
+		}
+	}
+	return (now() - start) / (PROBES / 64 * 64);
+}
+
+static void count_leaf(struct superblock *sb, struct eleaf *leaf, void *data)
+{
+	((struct result *)data)->leaves++;
+}
+
+/*
+ * Build the store and time it in a child, so each block size gets its own
+ * buffer cache and its files go away with it.
+ */
+static void run(char const *dir, unsigned bs_bits, unsigned exceptions, struct result *result)
+{
+	int pipefd[2];
+	pid_t pid;
+
+	fflush(stdout);
+	if (pipe(pipefd) < 0 || (pid = fork()) < 0)
+		error("unable to start run: %s", strerror(errno));
+	if (!pid) {
+		int orgdev = open_store(dir, "origin", (off_t)ORIGIN_CHUNKS << 12);
+		int snapdev = open_store(dir, "snap", ((off_t)exceptions + 1024) << 12);
+		int metadev = open_store(dir, "meta", 1 << 30);
+		struct compact_tree_ok reply;
+
+		if (init_snapstore(orgdev, snapdev, metadev, bs_bits, 12, 1 << 20, 0) < 0)
+			error("unable to initialize snapshot store");
+		init_buffers(1 << bs_bits, 512 << 20);
+
+		struct superblock *sb = load_sb(metadev, orgdev, snapdev);
+		if (create_snapshot(sb, 0) < 0)
+			error("unable to create snapshot");
+		seed = 3;
+		for (unsigned i = 0; i < exceptions; i++) {
+			if (make_unique(sb, rnd(ORIGIN_CHUNKS), -1) == -1)
+				error("unable to write origin chunk");
+			dirty_buffer_count_check(sb);
+		}
+		if (compact_tree(sb, 0, &reply) < 0)
+			error("unable to compact the btree");
+
+		*result = (struct result){ .levels = sb->image.etree_levels, .per_node = sb->metadata.alloc_per_node };
+		traverse_tree_range(sb, 0, -1, count_leaf, result);
+		time_probes(sb, probe); /* warm the cache */
+		result->probe_scan = time_probes(sb, probe_scan);
+		result->probe_search = time_probes(sb, probe);
+		result->pair_scan = time_nodes(sb, pair_scan);
+		result->pair_search = time_nodes(sb, pair_search);
+		result->key_scan = time_nodes(sb, key_scan);
+		result->key_search = time_nodes(sb, key_search);
+		result->leaf_scan = time_leaves(sb, find_run_scan);
+		result->leaf_search = time_leaves(sb, find_run);
+		result->run_root = time_runs(sb, 0);
+		result->run_finger = time_runs(sb, 1);
+		if (write(pipefd[1], result, sizeof(*result)) < 0)
+			exit(1);
+		exit(0);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], result, sizeof(*result)) != sizeof(*result))
+		error("run with %u byte blocks failed", 1 << bs_bits);
+	close(pipefd[0]);
+	waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned exceptions = argc > 1 ? atoi(argv[1]) : 1000000;
+	char const *dir = argc > 2 ? argv[2] : "/tmp";
+	unsigned sizes[] = { 12, 14, 16 };
+
+	if (!exceptions)
+		error("need some exceptions");
+	printf("%10s %6s %8s %8s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "blocksize", "levels", "leaves", "fanout",
+		"probe scan", "search", "pair scan", "search", "key scan", "search", "leaf scan", "search", "run root", "finger");
+	for (unsigned i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		struct result result;
+		run(dir, sizes[i], exceptions, &result);
+		printf("%10u %6u %8Lu %8u %8.3fus %8.3fus %8.3fus %8.3fus %8.3fus %8.3fus %8.3fus %8.3fus %8.3fus %8.3fus\n",
+			1 << sizes[i], result.levels, (llu_t)result.leaves, result.per_node,
+			result.probe_scan * 1e6, result.probe_search * 1e6, result.pair_scan * 1e6, result.pair_search * 1e6,
+			result.key_scan * 1e6, result.key_search * 1e6, result.leaf_scan * 1e6, result.leaf_search * 1e6,
+			result.run_root * 1e6, result.run_finger * 1e6);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Time journal replay after a crash.
+ *
+ * usage: replaybench [<max journal megabytes> [<directory>]]
+ *
+ * A snapshot store is built on sparse files in the directory, default /tmp,
+ * with deferred metadata writes so that committed btree and bitmap blocks
+ * stay in the journal instead of going home.  Origin chunks scattered over
+ * the volume are written, in transactions of a few chunks, until half the
+ * journal is in use, then the server "crashes": the superblock is read back
+ * from disk as at startup and the journal is replayed, first on one thread,
+ * then on as many as replay uses by default.  Journal sizes 1, 2, 4...
+ * megabytes are timed, each in a fresh store.
+ */
+#include "bench.h"
+
+#define ORIGIN_CHUNKS (1 << 20)
+#define TRANSACTION_CHUNKS 8
+
+/*
+ * Fill half the journal with deferred transactions, stopping short of the
+ * point where commit would flush them home, and leave it there.
+ */
+static void build_journal(char const *dir, unsigned megabytes, int *orgdev, int *snapdev, int *metadev)
+{
+	unsigned jblocks = (megabytes << 20) >> 12;
+
+	*orgdev = open_store(dir, "origin", (off_t)ORIGIN_CHUNKS << 12);
+	*snapdev = open_store(dir, "snap", ((off_t)jblocks * TRANSACTION_CHUNKS + 1024) << 12);
+	*metadev = open_store(dir, "meta", ((off_t)megabytes + 64) << 20);
+	if (init_snapstore(*orgdev, *snapdev, *metadev, 12, 12, megabytes << 20, 0) < 0)
+		error("unable to initialize snapshot store");
+	init_buffers(1 << 12, 256 << 20);
+
+	struct superblock *sb = load_sb(*metadev, *orgdev, *snapdev);
+	sb->runflags |= RUN_DEFER;
+	if (create_snapshot(sb, 0) < 0)
+		error("unable to create snapshot");
+	for (int barrier = 1; sb->image.journal_next + 4 * TRANSACTION_CHUNKS < jblocks / 2; barrier = 0) {
+		for (int i = 0; i < TRANSACTION_CHUNKS; i++) {
+			if (make_unique(sb, rnd(ORIGIN_CHUNKS), -1) == -1)
+				error("unable to write origin chunk");
+		}
+		commit_transaction(sb, barrier); /* replay starts after the barrier */
+	}
+	if (fsync(*metadev) < 0)
+		error("unable to sync metadata: %s", strerror(errno));
+}
+
+/*
+ * Replay the same journal on a superblock fresh from disk, so each timing
+ * starts as the server would after a crash.  Replay only writes blocks home,
+ * never the journal, so it may be repeated.
+ */
+static double replay(int orgdev, int snapdev, int metadev, unsigned threads)
+{
+	struct superblock *sb = load_sb(metadev, orgdev, snapdev);
+	double start;
+
+	posix_fadvise(metadev, 0, 0, POSIX_FADV_DONTNEED);
+	replay_threads = threads;
+	start = now();
+	if (replay_journal(sb) < 0)
+		error("replay failed");
+	return now() - start;
+}
+
+/*
+ * Build the store and time replay in a child, so each run starts with clean
+ * buffers and its files go away with it.
+ */
+static void run(char const *dir, unsigned megabytes, double elapsed[2])
+{
+	int pipefd[2];
+	pid_t pid;
+
+	fflush(stdout);
+	if (pipe(pipefd) < 0 || (pid = fork()) < 0)
+		error("unable to start run: %s", strerror(errno));
+	if (!pid) {
+		int orgdev, snapdev, metadev;
+
+		build_journal(dir, megabytes, &orgdev, &snapdev, &metadev);
+		elapsed[0] = replay(orgdev, snapdev, metadev, 1);
+		elapsed[1] = replay(orgdev, snapdev, metadev, 0);
+		if (write(pipefd[1], elapsed, 2 * sizeof(*elapsed)) < 0)
+			exit(1);
+		exit(0);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], elapsed, 2 * sizeof(*elapsed)) != 2 * sizeof(*elapsed))
+		error("run with %u megabyte journal failed", megabytes);
+	close(pipefd[0]);
+	waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned max = argc > 1 ? atoi(argv[1]) : 64;
+	char const *dir = argc > 2 ? argv[2] : "/tmp";
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned megabytes;
+
+	if (!max || max > 1024)
+		error("journal from 1 to 1024 megabytes");
+	printf("%10s %12s %9s %2li\n", "journal", "one thread", "threads", online < MAX_REPLAY_THREADS ? online : MAX_REPLAY_THREADS);
+	for (megabytes = 1; megabytes <= max; megabytes *= 2) {
+		double elapsed[2];
+		run(dir, megabytes, elapsed);
+		printf("%8uMB %11.3fs %11.3fs\n", megabytes, elapsed[0], elapsed[1]);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Measure btree lookups and inserts as the number of snapshots grows past
+ * what fits in a one word share mask.
+ *
+ * usage: snapbench [<chunks per snapshot> [<directory>]]
+ *
+ * A snapshot store is built on sparse files in the directory, default /tmp,
+ * for 64, 256 and 1023 snapshots, the last two with wide share masks and the
+ * smallest block size their leaves allow.  The most is 1023, not 1024, as
+ * bit SNAPSHOT_SQUASHED is never given to a live snapshot.  Before each
+ * snapshot is taken the given number of chunks, scattered over the origin,
+ * are written, so every snapshot has exceptions of its own and shares others
+ * with its neighbours.  Then random chunks of random snapshots are looked up,
+ * and once one more snapshot is taken, deleting the oldest if the store is
+ * full, random origin chunks are written, each adding an exception.  The
+ * time per lookup and per insert is reported.
+ */
+#include "bench.h"
+
+#define ORIGIN_CHUNKS (1 << 16)
+#define LOOKUPS 200000
+#define INSERTS 20000
+
+struct result {
+	unsigned bs_bits, leaves;
+	double lookup, insert;
+};
+
+/* the smallest block size that holds an exception of every snapshot for a chunk */
+static unsigned leaf_bits(unsigned snapshots)
+{
+	unsigned words = snapshots > SB_SNAPSHOTS ? DIVROUND(snapshots + 1, 64) : 1, bits = 12;
+
+	while (words > 1 && offsetof(struct eleaf, map[2]) + (64 * words - 1) * ex_size(words) > 1 << bits)
+		bits++;
+	return bits;
+}
+
+static struct superblock *build_store(char const *dir, unsigned snapshots, unsigned chunks, unsigned bs_bits)
+{
+	int orgdev = open_store(dir, "origin", (off_t)ORIGIN_CHUNKS << 12);
+	int snapdev = open_store(dir, "snap", ((off_t)snapshots * chunks + INSERTS + 1024) << 12);
+	int metadev = open_store(dir, "meta", 1 << 30);
+	unsigned i, j;
+
+	if (init_snapstore(orgdev, snapdev, metadev, bs_bits, 12, 1 << 20, snapshots) < 0)
+		error("unable to initialize snapshot store");
+	init_buffers(1 << bs_bits, 64 << 20);
+
+	struct superblock *sb = load_sb(metadev, orgdev, snapdev);
+
+	for (i = 0; i < snapshots; i++) {
+		for (j = 0; j < chunks; j++) {
+			if (make_unique(sb, rnd(ORIGIN_CHUNKS), -1) == -1)
+				error("unable to write origin chunk");
+			dirty_buffer_count_check(sb);
+		}
+		if (create_snapshot(sb, i) < 0)
+			error("unable to create snapshot");
+	}
+	commit_transaction(sb, 0);
+	return sb;
+}
+
+static void count_leaf(struct superblock *sb, struct eleaf *leaf, void *data)
+{
+	((struct result *)data)->leaves++;
+}
+
+/*
+ * Build the store and time it in a child, so each run starts with clean
+ * buffers and its files go away with it.
+ */
+static void run(char const *dir, unsigned snapshots, unsigned chunks, struct result *result)
+{
+	int pipefd[2];
+	pid_t pid;
+
+	fflush(stdout);
+	if (pipe(pipefd) < 0 || (pid = fork()) < 0)
+		error("unable to start run: %s", strerror(errno));
+	if (!pid) {
+		unsigned bs_bits = leaf_bits(snapshots), i;
+		struct superblock *sb = build_store(dir, snapshots, chunks, bs_bits);
+		chunk_t exception;
+		double start;
+
+		*result = (struct result){ .bs_bits = bs_bits };
+		traverse_tree_range(sb, 0, -1, count_leaf, result);
+		start = now();
+		for (i = 0; i < LOOKUPS; i++)
+			test_unique(sb, rnd(ORIGIN_CHUNKS), snap_bit(&sb->snaplist[rnd(snapshots)]), &exception);
+		result->lookup = (now() - start) / LOOKUPS;
+
+		if (sb->image.snapshots == max_snapshots(sb))
+			delete_snap(sb, sb->snaplist);
+		if (create_snapshot(sb, snapshots) < 0)
+			error("unable to create snapshot");
+		start = now();
+		for (i = 0; i < INSERTS; i++) {
+			if (make_unique(sb, rnd(ORIGIN_CHUNKS), -1) == -1)
+				error("unable to write origin chunk");
+			dirty_buffer_count_check(sb);
+		}
+		commit_transaction(sb, 0);
+		result->insert = (now() - start) / INSERTS;
+		if (write(pipefd[1], result, sizeof(*result)) < 0)
+			exit(1);
+		exit(0);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], result, sizeof(*result)) != sizeof(*result))
+		error("run of %u snapshots failed", snapshots);
+	close(pipefd[0]);
+	waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned chunks = argc > 1 ? atoi(argv[1]) : 64;
+	char const *dir = argc > 2 ? argv[2] : "/tmp";
+	unsigned counts[] = { 64, 256, MAX_SNAPSHOTS - 1 };
+
+	if (!chunks || chunks > ORIGIN_CHUNKS)
+		error("from 1 to %u chunks", ORIGIN_CHUNKS);
+	printf("%10s %10s %8s %10s %10s\n", "snapshots", "blocksize", "leaves", "lookup", "insert");
+	for (unsigned i = 0; i < sizeof(counts) / sizeof(*counts); i++) {
+		struct result result;
+		run(dir, counts[i], chunks, &result);
+		printf("%10u %10u %8u %8.2fus %8.2fus\n", counts[i], 1 << result.bs_bits, result.leaves, result.lookup * 1e6, result.insert * 1e6);
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -45,9 +45,191 @@ void test_help(void)
 	}
 }
 
+/*
+ * Send bytes through the rate limiter on a simulated clock, in the writes
+ * ratelimit_write would make, and return the seconds they took.
+ */
+static double simulated_send(struct ratelimit *rl, u64 *clock, u64 bytes)
+{
+	u64 start = *clock;
+
+	for (u64 len; bytes; bytes -= len) {
+		len = bytes < RATELIMIT_CHUNK ? bytes : RATELIMIT_CHUNK;
+		*clock += ratelimit_delay(rl, *clock, len);
+	}
+	return (*clock - start) / 1e6;
+}
+
+static int near(double actual, double expected)
+{
+	return actual > expected * 0.99 && actual < expected * 1.01;
+}
+
+void test_ratelimit(void)
+{
+	struct ratelimit rl = { };
+	int fd = open("/dev/null", O_WRONLY);
+	u64 clock = 1000000000, start;
+
+	ASSERT_TRUE(fd >= 0);
+
+	/* after the first burst, the achieved rate is the target rate */
+	ratelimit_set(&rl, 8 << 20, 1);
+	ASSERT_TRUE(rl.depth == (8 << 20) / 10);
+	ASSERT_TRUE(near(simulated_send(&rl, &clock, (4 << 20) + rl.depth), 0.5));
+
+	/* a stall earns one burst of catch up, not the whole idle time */
+	clock += 500000;
+	ASSERT_TRUE(near(simulated_send(&rl, &clock, (2 << 20) + rl.depth), 0.25));
+
+	/* the limit is split between parallel streams */
+	ratelimit_set(&rl, 8 << 20, 4);
+	ASSERT_TRUE(rl.rate == 2 << 20);
+	clock += 200000; /* refill the bucket */
+	ASSERT_TRUE(near(simulated_send(&rl, &clock, (1 << 20) + rl.depth), 0.5));
+
+	/* writes really wait, at least */
+	static char extent[1 << 20];
+	ratelimit_set(&rl, 8 << 20, 1);
+	rl.last = 0;
+	start = usec_now();
+	ASSERT_TRUE(ratelimit_write(&rl, fd, extent, rl.depth) == 0);
+	ASSERT_TRUE(ratelimit_write(&rl, fd, extent, sizeof(extent)) == 0);
+	ASSERT_TRUE(usec_now() - start >= 125000 * 9 / 10);
+
+	close(fd);
+}
+
+void test_ratelimit_reread(void)
+{
+	char name[] = "/tmp/ratelimitXXXXXX";
+	struct ratelimit rl = { .file = name };
+	int file = mkstemp(name);
+	u64 clock = usec_now();
+	struct timespec later[2] = { { .tv_nsec = UTIME_OMIT }, { time(NULL) + 10 } };
+
+	ASSERT_TRUE(file >= 0);
+	ASSERT_TRUE(write(file, "4M\n", 3) == 3);
+	ratelimit_set(&rl, 0, 1);
+
+	/* SIGHUP rereads the file at once */
+	ratelimit_sighup(SIGHUP);
+	ratelimit_check(&rl, clock);
+	ASSERT_TRUE(rl.limit == 4 << 20);
+	ASSERT_TRUE(near(simulated_send(&rl, &clock, (2 << 20) + rl.depth), 0.5));
+
+	/* otherwise a change to the file is picked up within a second */
+	ASSERT_TRUE(pwrite(file, "16M\n", 4, 0) == 4);
+	ASSERT_TRUE(futimens(file, later) == 0);
+	simulated_send(&rl, &clock, 5 << 20);
+	ASSERT_TRUE(rl.limit == 16 << 20);
+
+	close(file);
+	unlink(name);
+}
+
+void test_checkpoint(void)
+{
+	char name[] = "/tmp/checkpointXXXXXX";
+	struct change_list *cl = init_change_list(12, 3, 5), *loaded = NULL;
+	struct checkpoint_slot slots[MAX_DELTA_STREAMS] = { { 2 }, { 6, 40960, 4096, 1234 } };
+	int fd = mkstemp(name), streams = 0, i;
+	char *clname = checkpoint_name(name, ".changelist");
+
+	ASSERT_TRUE(cl && fd >= 0 && clname);
+	close(fd);
+	for (i = 0; i < 10; i++)
+		ASSERT_TRUE(append_change_list(cl, i * 3) == 0);
+	ASSERT_TRUE(checkpoint_create(name, cl, 2, slots) == 0);
+
+	memset(slots, 0, sizeof(slots));
+	ASSERT_TRUE(checkpoint_load(name, 3, 5, &loaded, slots, &streams) == 1);
+	ASSERT_TRUE(streams == 2 && loaded->count == 10 && loaded->chunksize_bits == 12);
+	ASSERT_TRUE(!memcmp(loaded->chunks, cl->chunks, 10 * sizeof(u64)));
+	ASSERT_TRUE(slots[0].next_chunk == 2 && slots[1].next_chunk == 6 && slots[1].checksum == 1234);
+	free_change_list(loaded);
+
+	/* a checkpoint of other snapshots, or with its changelist cut short, is not used */
+	loaded = NULL;
+	ASSERT_TRUE(checkpoint_load(name, 3, 6, &loaded, slots, &streams) == 0 && !loaded);
+	ASSERT_TRUE(truncate(clname, sizeof(struct cl_header) + 5 * sizeof(u64)) == 0);
+	ASSERT_TRUE(checkpoint_load(name, 3, 5, &loaded, slots, &streams) == 0 && !loaded);
+
+	checkpoint_remove(name);
+	ASSERT_TRUE(access(name, F_OK) < 0 && access(clname, F_OK) < 0);
+	ASSERT_TRUE(checkpoint_load(name, 3, 5, &loaded, slots, &streams) == 0);
+	free_change_list(cl);
+	free(clname);
+}
+
+/*
+ * Start a delta session on the target in a child and return its pid once
+ * it answers, with the upstream end of its socket in *sock.
+ */
+static pid_t start_session(char const *target, struct delta_options *options, int *sock, struct head *reply)
+{
+	struct { struct head head; struct delta_header body; char volume; struct delta_options options; } PACKED request = {
+		.head = { SEND_DELTA, sizeof(request) - sizeof(struct head) },
+		.body = { DELTA_MAGIC_ID, 1, 4096, ~0U, 1 },
+		.options = *options };
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return -1;
+	if (!(pid = fork())) {
+		close(sv[0]);
+		_exit(delta_session(sv[1], target, 0, NULL));
+	}
+	close(sv[1]);
+	*sock = sv[0];
+	if (writepipe(*sock, &request, sizeof(request)) < 0 || readpipe(*sock, reply, sizeof(*reply)) < 0)
+		reply->code = 0;
+	return pid;
+}
+
+void test_resume_lock(void)
+{
+	char name[] = "/tmp/resumelockXXXXXX";
+	static unsigned char data[8192];
+	struct delta_options options = { .flags = DELTA_CHECK, .check_addr = 4096, .check_size = 4096 };
+	int fd = mkstemp(name), sock1, sock2, status;
+	struct head reply;
+	char err_msg[MAX_ERRMSG_SIZE];
+	pid_t pid1, pid2;
+
+	ASSERT_TRUE(fd >= 0);
+	memset(data, 0x5a, sizeof(data));
+	ASSERT_TRUE(write(fd, data, sizeof(data)) == sizeof(data));
+	close(fd);
+	options.check_sum = checksum(data + 4096, 4096);
+
+	/* a resumed session checks its extent and keeps the target locked */
+	pid1 = start_session(name, &options, &sock1, &reply);
+	ASSERT_TRUE(pid1 > 0 && reply.code == SEND_DELTA_PROCEED);
+
+	/* so a second session on the same range is turned away */
+	options.flags = 0;
+	pid2 = start_session(name, &options, &sock2, &reply);
+	ASSERT_TRUE(pid2 > 0 && reply.code == SEND_DELTA_ERROR);
+	ASSERT_TRUE(reply.length <= sizeof(err_msg) && readpipe(sock2, err_msg, reply.length) == 0);
+	ASSERT_TRUE(strstr(err_msg, "already in progress") != NULL);
+	ASSERT_TRUE(waitpid(pid2, &status, 0) == pid2);
+
+	kill(pid1, SIGKILL);
+	ASSERT_TRUE(waitpid(pid1, &status, 0) == pid1);
+	close(sock1);
+	close(sock2);
+	unlink(name);
+}
+
 test_suite get_suite(void)
 {
 	return MAKE_SIMPLE_SUITE("testddsnap",
 							 SIMPLE_TEST(test_noargs),
-							 SIMPLE_TEST(test_help));
+							 SIMPLE_TEST(test_help),
+							 SIMPLE_TEST(test_ratelimit),
+							 SIMPLE_TEST(test_ratelimit_reread),
+							 SIMPLE_TEST(test_checkpoint),
+							 SIMPLE_TEST(test_resume_lock));
 }